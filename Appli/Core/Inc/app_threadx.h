@@ -35,8 +35,19 @@
 
 /* Exported types ------------------------------------------------------------*/
 /* USER CODE BEGIN ET */
- extern char sqlite_heap[65536 * 2];
- extern char sqlite_pcache[65536 * 6];
+ /* Memory plan of the SQLite buffers, shared by MPLIB_STORAGE.cpp and sqlite3_azure.c.
+    Both check it at compile time, MPLIB_STORAGE::init() checks it against SQLite and the linker sections at boot */
+#define PLAN_PSRAM_BYTES      (32 * 1024 * 1024)  /* PSRAM region of STM32N657XX_LRUN.ld */
+#define PLAN_SRAM_HOT_BYTES   (1024 * 1024)       /* SRAM_HOT region: page cache tier and size classes */
+#define PLAN_PAGE_SIZE        4096                /* PRAGMA page_size of every database */
+#define PLAN_PCACHE_HEADER    256                 /* SQLite's extra (MemPage, PgHdr) and the VFS page header */
+#define PLAN_PCACHE_SLOT      (PLAN_PAGE_SIZE + PLAN_PCACHE_HEADER)
+#define PLAN_PCACHE_BYTES     (4 * 1024 * 1024)   /* sqlite_pcache, .psram_cache */
+#define PLAN_HEAP_BYTES       (1024 * 1024)       /* sqlite_heap, .psram_data (memsys5) */
+#define PLAN_VFS_PSRAM_BYTES  (4 * 1024 * 1024)   /* sqlite3_azure.c pools in .psram_buffers */
+
+ extern char sqlite_heap[PLAN_HEAP_BYTES];
+ extern char sqlite_pcache[PLAN_PCACHE_BYTES];
 /* USER CODE END ET */
 
 /* Exported constants --------------------------------------------------------*/
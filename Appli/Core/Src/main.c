@@ -1452,7 +1452,7 @@ void MPU_Config(void)
   */
   MPU_InitStruct.Number = MPU_REGION_NUMBER1;
   MPU_InitStruct.BaseAddress = 0x34146000;
-  MPU_InitStruct.LimitAddress = 0x3441FFFF;
+  MPU_InitStruct.LimitAddress = 0x3431FFFF;
   MPU_InitStruct.AttributesIndex = MPU_ATTRIBUTES_NUMBER2;
 
   HAL_MPU_ConfigRegion(&MPU_InitStruct);
@@ -1508,6 +1508,17 @@ void MPU_Config(void)
 
   HAL_MPU_ConfigRegion(&MPU_InitStruct);
 
+  /** Initializes and configures the Region 7 and the memory to be protected
+  */
+  MPU_InitStruct.Number = MPU_REGION_NUMBER7;
+  MPU_InitStruct.BaseAddress = 0x34320000;
+  MPU_InitStruct.LimitAddress = 0x3441FFFF;
+  MPU_InitStruct.AttributesIndex = MPU_ATTRIBUTES_NUMBER1;
+  MPU_InitStruct.DisableExec = MPU_INSTRUCTION_ACCESS_DISABLE;
+  MPU_InitStruct.IsShareable = MPU_ACCESS_NOT_SHAREABLE;
+
+  HAL_MPU_ConfigRegion(&MPU_InitStruct);
+
   /** Initializes and configures the Attribute 0 and the memory to be protected
   */
   MPU_AttributesInit.Number = MPU_ATTRIBUTES_NUMBER0;
@@ -176,7 +176,12 @@ UINT MX_FileX_Init(VOID *memory_ptr)
 /* USER CODE BEGIN fx_app_thread_entry 0*/
   UINT tx_status = TX_SUCCESS;
 
-  _Alignas(32) static uint64_t fx_sd_media_memory[1024]; // redefine here as it is generated not in a user section
+#if (FX_SD_MEDIA_CACHE_BYTES / FX_STM32_SD_DEFAULT_SECTOR_SIZE) > FX_MAX_SECTOR_CACHE
+#warning "FileX uses only FX_MAX_SECTOR_CACHE sectors of FX_SD_MEDIA_CACHE_BYTES, raise it in fx_user.h"
+#endif
+  // redefine here as it is generated not in a user section, size and placement from FX_SD_MEDIA_CACHE_*
+  static uint64_t fx_sd_media_memory[FX_SD_MEDIA_CACHE_BYTES / sizeof(uint64_t)]
+      __attribute__((section(FX_SD_MEDIA_CACHE_SECTION), aligned(32)));
 
 
 //  MPLIB_STORAGE_PTR storage_handle = Get_Storage_Instance();
@@ -197,6 +202,8 @@ UINT MX_FileX_Init(VOID *memory_ptr)
   if (sd_status == FX_SUCCESS)
   {
 	  printf("\nOK Fx media successfully opened.\n");
+	  printf("\nOK Fx media cache: %lu KB, %lu sectors%s\n", (ULONG)(sizeof(fx_sd_media_memory) / 1024),
+			 sdio_disk.fx_media_sector_cache_size, sdio_disk.fx_media_sector_cache_hashed ? " (hashed)" : "");
 
 	//  fx_media_space_available(&sdio_disk, &free_bytes);
 
@@ -42,6 +42,12 @@ extern "C" {
 /* Exported constants --------------------------------------------------------*/
 /* USER CODE BEGIN EC */
 
+/* FileX media cache handed to fx_media_open(): FAT, directory and data sectors.
+   FileX uses at most FX_MAX_SECTOR_CACHE sectors of it (fx_user.h), and looks them up through
+   a hash only when the sector count is a power of two */
+#define FX_SD_MEDIA_CACHE_BYTES             (1024 * 1024)
+#define FX_SD_MEDIA_CACHE_SECTION           ".psram_buffers"
+
 /* USER CODE END EC */
 
 /* Exported macro ------------------------------------------------------------*/
@@ -127,7 +127,7 @@
 
 /* Defines the number of entries in the FAT cache.  */
 
-/* #define FX_MAX_FAT_CACHE         16 */
+#define FX_MAX_FAT_CACHE         256
 
 /* Defines the maximum size of long file names supported by FileX.
    The minimum value is 13 and the maximum value is 256.  */
@@ -139,7 +139,7 @@
 /* Defines the maximum number of logical sectors that can be cached by FileX. The cache memory
    supplied to FileX at fx_media_open determines how many sectors can actually be cached.  */
 
-/* #define FX_MAX_SECTOR_CACHE         256 */
+#define FX_MAX_SECTOR_CACHE         2048
 
 /* Defined, the file search cache optimization is disabled.  */
 
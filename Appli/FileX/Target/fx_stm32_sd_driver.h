@@ -28,6 +28,17 @@ extern "C" {
 /* Exported types ------------------------------------------------------------*/
 /* USER CODE BEGIN ET */
 
+/* Transfer path counters, see fx_stm32_sd_driver_stats() */
+typedef struct
+{
+  ULONG direct_reads;      /* Transfers straight into the FileX buffer */
+  ULONG direct_writes;
+  ULONG bounce_reads;      /* Requests that went through the bounce buffer */
+  ULONG bounce_writes;
+  ULONG bounce_transfers;  /* SD transfers those took (one per bounce buffer fill) */
+  ULONG bounce_sectors;
+} FX_STM32_SD_STATS;
+
 /* USER CODE END ET */
 
 extern TX_SEMAPHORE sd_tx_semaphore;
@@ -36,6 +47,11 @@ extern TX_SEMAPHORE sd_rx_semaphore;
 /* Exported constants --------------------------------------------------------*/
 /* USER CODE BEGIN EC */
 
+/* Bounce buffer for DMA transfers from/to FileX buffers the DMA cannot use directly, in sectors.
+ * Such requests go out as multi-block transfers of up to this many sectors instead of one
+ * single-block transfer per sector. It is cache-line aligned and sits in AXI SRAM (.bss) */
+#define FX_STM32_SD_BOUNCE_SECTORS                            64
+
 /* USER CODE END EC */
 /* Default timeout used to wait for fx operations */
 #define FX_STM32_SD_DEFAULT_TIMEOUT                           (10 * TX_TIMER_TICKS_PER_SECOND)
@@ -195,6 +211,9 @@ VOID fx_stm32_sd_driver(FX_MEDIA *media_ptr);
 
 /* USER CODE BEGIN EFP */
 
+/* Copies the transfer path counters, and clears them if reset is not 0 */
+VOID fx_stm32_sd_driver_stats(FX_STM32_SD_STATS *stats, UINT reset);
+
 /* USER CODE END EFP */
 
 /* Private defines -----------------------------------------------------------*/
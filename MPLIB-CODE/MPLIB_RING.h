@@ -0,0 +1,152 @@
+/*
+ * MPLIB_RING.h
+ *
+ *  Staging ring protocol shared by MPLIB_STORAGE (target) and test/ring_stress.cpp (host).
+ *  Many producers reserve byte ranges with an atomic fetch-add, fill them and set the commit
+ *  word of the record start; one consumer takes the committed prefix and releases it. All
+ *  positions are free-running 32-bit byte counts, capacity is a power of two.
+ *
+ *  Only the atomic shim below differs between the two builds: LDREX/STREX and DMB/DSB on the
+ *  Cortex-M55, GCC __atomic builtins when MPLIB_RING_HOST is defined. Waiting for space stays
+ *  with the caller (ThreadX event flags on target, a yield on the host).
+ */
+#ifndef MPLIB_RING_H_
+#define MPLIB_RING_H_
+
+#include "stdint.h"
+
+#ifndef MPLIB_RING_HOST
+#include "stm32n6xx.h"
+#endif
+
+// Compact staging record (PSRAM ring): 32-byte header, then category[cat_len] and
+// message[msg_len] back to back (no NUL, no padding), record start 32-byte aligned.
+// DS_LOG_STRUCT stays the producer-side and raw-file format: captureLog() packs it.
+#define LOG_REC_ALIGN       32
+#define LOG_REC_FLAG_PAD    0x01	// Filler record (ring end / wasted part of a wrapped reservation)
+
+typedef struct __attribute__((packed, aligned(4))) {
+    uint16_t size;                  // Whole record in bytes, multiple of LOG_REC_ALIGN
+    uint8_t  flags;
+    uint8_t  cat_len;
+    uint16_t msg_len;
+    uint16_t cat_id;                // ds_categories id, filled in by the ingestor before insert (0 = unresolved)
+    uint32_t log_index;
+    uint32_t token;
+    uint32_t local_log_index;
+    uint32_t timestamp_at_store;
+    uint32_t timestamp_at_log;
+    uint32_t severity;
+    char     data[];                // category, then message
+} DS_LOG_REC;
+
+#define LOG_REC_HEADER_SIZE 32
+
+//=======================================================================================
+// Atomic shim
+//=======================================================================================
+#ifdef MPLIB_RING_HOST
+
+static inline uint32_t ringFetchAdd(volatile uint32_t* p, uint32_t v) {
+    return __atomic_fetch_add(p, v, __ATOMIC_ACQ_REL);
+}
+
+static inline uint32_t ringLoadAcquire(const volatile uint32_t* p) {
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void ringStoreRelease(volatile uint32_t* p, uint32_t v) {
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+#else
+
+// A context switch between LDREX and STREX clears the exclusive monitor, so STREX fails and we retry
+static inline uint32_t ringFetchAdd(volatile uint32_t* p, uint32_t v) {
+    uint32_t old;
+    do {
+        old = __LDREXW(p);
+    } while (__STREXW(old + v, p) != 0U);
+    __DMB();
+    return old;
+}
+
+static inline uint32_t ringLoadAcquire(const volatile uint32_t* p) {
+    uint32_t v = *p;
+    __DMB();
+    return v;
+}
+
+// DSB rather than DMB: the record lives in PSRAM behind the XSPI, its writes must be done
+static inline void ringStoreRelease(volatile uint32_t* p, uint32_t v) {
+    __DSB();
+    *p = v;
+}
+
+#endif
+
+//=======================================================================================
+// Producer side
+//=======================================================================================
+static inline uint32_t ringRecordSize(uint32_t cat_len, uint32_t msg_len) {
+    return (LOG_REC_HEADER_SIZE + cat_len + msg_len + LOG_REC_ALIGN - 1) & ~(LOG_REC_ALIGN - 1);
+}
+
+// The reserved bytes have been released by the consumer (one lap ago)
+static inline bool ringHasSpace(const volatile uint32_t* tail, uint32_t pos, uint32_t size, uint32_t capacity) {
+    return pos + size - ringLoadAcquire(tail) <= capacity;
+}
+
+// Records never wrap: a reservation straddling the ring end is committed as two pads and
+// false is returned, the caller reserves again
+static inline bool ringPlace(volatile uint8_t* ring, volatile uint32_t* commit, uint32_t capacity,
+                             uint32_t pos, uint32_t size) {
+    uint32_t room = capacity - (pos % capacity);
+    if (size <= room) return true;
+
+    uint32_t pad_pos[2]  = { pos, pos + room };
+    uint32_t pad_size[2] = { room, size - room };
+    for (int k = 0; k < 2; k++) {
+        volatile DS_LOG_REC* pad = (volatile DS_LOG_REC*)&ring[pad_pos[k] % capacity];
+        pad->size = (uint16_t)pad_size[k];
+        pad->flags = LOG_REC_FLAG_PAD;
+        ringStoreRelease(&commit[(pad_pos[k] % capacity) / LOG_REC_ALIGN], pad_pos[k] + 1);
+    }
+    return false;
+}
+
+// Record writes must be visible before the commit word
+static inline void ringCommit(volatile uint32_t* commit, uint32_t capacity, uint32_t pos) {
+    ringStoreRelease(&commit[(pos % capacity) / LOG_REC_ALIGN], pos + 1);
+}
+
+//=======================================================================================
+// Consumer side
+//=======================================================================================
+
+// Committed prefix of [from, from + avail), up to max_logs real records: returns the records,
+// *bytes gets the prefix length (pads included). Stops at the first record not committed yet
+static inline uint32_t ringDrainable(const volatile uint8_t* ring, const volatile uint32_t* commit, uint32_t capacity,
+                                     uint32_t from, uint32_t avail, uint32_t max_logs, uint32_t* bytes) {
+    uint32_t off = 0;
+    uint32_t logs = 0;
+
+    while (off < avail && logs < max_logs) {
+        uint32_t pos = from + off;
+        if (ringLoadAcquire(&commit[(pos % capacity) / LOG_REC_ALIGN]) != pos + 1) break;
+
+        const volatile DS_LOG_REC* rec = (const volatile DS_LOG_REC*)&ring[pos % capacity];
+        if (!(rec->flags & LOG_REC_FLAG_PAD)) logs++;
+        off += rec->size;
+    }
+
+    *bytes = off;
+    return logs;
+}
+
+// Hands [old tail, pos) back to the producers once the consumer is done reading it
+static inline void ringRelease(volatile uint32_t* tail, uint32_t pos) {
+    ringStoreRelease(tail, pos);
+}
+
+#endif /* MPLIB_RING_H_ */
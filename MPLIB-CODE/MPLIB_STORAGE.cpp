@@ -20,8 +20,10 @@ extern "C" {
 	#include "sqlite3.h"
 	#include "sqlite3_azure.h"
 	#include "app_filex.h"
+	#include "fx_stm32_sd_driver.h"
 	#include "tx_api.h"
 	#include "main.h"
+	#include "app_threadx.h"
 }
 
 //=======================================================================================
@@ -45,6 +47,7 @@ static MPLIB_STORAGE* storage_instance_for_dma = nullptr;
 TX_THREAD storage_thread;
 TX_THREAD ingestion_thread;
 TX_THREAD simulator_thread;
+TX_THREAD query_thread;
 
 TX_MUTEX sd_io_mutex;
 TX_MUTEX db_mutex;
@@ -53,6 +56,10 @@ TX_MUTEX db_mutex;
 //TX_EVENT_FLAGS_GROUP sd_events;
 TX_EVENT_FLAGS_GROUP staging_events;
 
+// Query service: QUERY_REQUEST pointers, one ULONG each
+TX_QUEUE query_queue;
+static ULONG query_queue_storage[QUERY_QUEUE_DEPTH];
+
 // For interrupt-driven version (optional)
 TX_SEMAPHORE dma_complete_sem;
 
@@ -74,6 +81,7 @@ extern DMA_HandleTypeDef handle_GPDMA1_Channel0;
 extern "C" {
     extern uint8_t __psram_pcache_start, __psram_pcache_end;
     extern uint8_t __psram_heap_start, __psram_heap_end;
+    extern uint8_t __psram_buffers_start, __psram_buffers_end;
     extern uint32_t __psram_logs_start;
     extern uint32_t __psram_logs_end;
 }
@@ -87,25 +95,49 @@ __attribute__((section(".SqlPoolSection"),aligned(32))) uint8_t simulator_stack[
 
 __attribute__((section(".SqlPoolSection"),aligned(32))) uint8_t ingestion_stack[INGESTION_STACK_SIZE];
 
+__attribute__((section(".SqlPoolSection"),aligned(32))) uint8_t query_stack[QUERY_STACK_SIZE];
+
 __attribute__((section(".SqlPoolSection"), aligned(32))) static uint8_t sram_landing_zone[SRAM_LANDING_SIZE];
 
 // SUPERPOWER: 1 MB heap (was 512 KB) — headroom for memsys5 fragmentation at scale
-__attribute__((section(".psram_data"), aligned(32))) char sqlite_heap[1024 * 1024];
+// Sizes come from the memory plan in app_threadx.h; rebalanceMemory() lends what the heap leaves idle
+__attribute__((section(".psram_data"), aligned(32))) char sqlite_heap[PLAN_HEAP_BYTES];
 
 // SUPERPOWER: 4 MB page cache (was 393 KB / 96 slots)
 // At 4M rows the B-tree has 5-6 levels; all interior pages must stay hot.
-// Slot size = page_size(4096) + pcache header(~256) = 4352 bytes per slot
-// 4 MB / 4352 = ~965 slots — enough to hold one full buffer's B-tree pages in RAM
-__attribute__((section(".psram_cache"), aligned(32))) char sqlite_pcache[4 * 1024 * 1024];
+// Slot size = PLAN_PCACHE_SLOT: page_size(4096) + pcache header(256) = 4352 bytes per slot
+// 4 MB / 4352 = ~963 slots — enough to hold one full buffer's B-tree pages in RAM
+__attribute__((section(".psram_cache"), aligned(32))) char sqlite_pcache[PLAN_PCACHE_BYTES];
 
-__attribute__((section(".psram_logs"), aligned(32))) static DS_LOG_STRUCT psram_buffer_A[LOGS_PER_BUFFER];
+// Staging ring: RING_CAPACITY_BYTES of variable-length DS_LOG_REC records
+__attribute__((section(".psram_logs"), aligned(32))) static uint8_t psram_ring[RING_CAPACITY_BYTES];
 
-__attribute__((section(".psram_logs"), aligned(32))) static DS_LOG_STRUCT psram_buffer_B[LOGS_PER_BUFFER];
+// Commit words, one per LOG_REC_ALIGN unit of psram_ring: pos + 1 of the record that starts there.
+// Kept out of the record so stale bytes of an older, longer record can never look committed.
+__attribute__((section(".psram_logs"), aligned(32))) static volatile uint32_t psram_ring_commit[RING_CAPACITY_BYTES / LOG_REC_ALIGN];
 
 //=======================================================================================
 //
 //=======================================================================================
-const char* DB_NAME = "logs.db";
+#define PSRAM_BATCH_PTR_TYPE "LOG_SPAN"
+
+// Schema-qualified (%s): main, or the active L0 run
+static const char* INSERT_SQL_HEAD = "INSERT INTO %s.ds_logs (log_index, message, category_id, token, local_log_index, timestamp_at_store, timestamp_at_log, severity) VALUES ";
+
+// ds_logs column list, shared by the segment table and the L0 runs
+#define DS_LOGS_COLUMNS_DDL \
+    "(log_index INTEGER PRIMARY KEY, " \
+    "message TEXT NOT NULL, " \
+    "category_id INTEGER, " \
+    "token INTEGER, " \
+    "local_log_index INTEGER, " \
+    "timestamp_at_store INTEGER, " \
+    "timestamp_at_log INTEGER, " \
+    "severity INTEGER)"
+
+// PSRAM hot tier: one database image per L0 run (sqlite3_deserialize, fixed size, never freed)
+static const char* const l0_run_names[2] = { "l0_0", "l0_1" };
+__attribute__((section(".psram_buffers"), aligned(32))) static uint8_t l0_images[2][L0_TIER_ENABLE ? L0_RUN_BYTES : 1];
 
 //=======================================================================================
 // THREADS CREATION
@@ -153,6 +185,25 @@ void StartStorageServices(ULONG thread_input) {
         printf("\nOK INGESTOR STARTED\n");
     }
 
+    // QUERY: Priority 12 (below the ingestor and storage worker — readers only get the idle time)
+    tx_status = tx_thread_create(
+        &query_thread,
+        (CHAR*)"SQLite Query",
+        query_thread_entry,
+        0,
+        query_stack, QUERY_STACK_SIZE,
+        QUERY_PRIORITY, QUERY_PRIORITY, 0, 0
+    );
+
+    if (tx_status != TX_SUCCESS)
+    {
+        printf("ERROR TO START QUERY THREAD: %d\n", tx_status);
+    }
+    else {
+        tx_thread_resume(&query_thread);
+        printf("\nOK QUERY SERVICE STARTED\n");
+    }
+
     printf("\nOK DB STORAGE STARTING SERVICES\n");
 
     // STORAGE/WORK: Priority 8 (set in main service loop)
@@ -178,6 +229,23 @@ extern "C" void ingestion_direct_thread_entry(unsigned long thread_input) {
     STORAGE->ingestor_direct(0);
 }
 
+extern "C" void query_thread_entry(unsigned long thread_input) {
+    STORAGE->queryService(0);
+}
+
+extern "C" int StorageQuery(QUERY_REQUEST* req) {
+    return STORAGE->query(req);
+}
+
+extern "C" void StorageCaptureLog(DS_LOG_STRUCT* log) {
+    STORAGE->captureLog(*log);
+}
+
+extern "C" uint32_t StorageCaptureRecord(uint32_t token, uint32_t timestamp_at_log, uint32_t severity,
+                                         const char* category, uint32_t cat_len, const char* message, uint32_t msg_len) {
+    return STORAGE->captureRecord(token, timestamp_at_log, severity, category, cat_len, message, msg_len);
+}
+
 //=======================================================================================
 // INGESTION STRATEGY WITH LANDING ZONE AND RAW FILES ONLY
 //=======================================================================================
@@ -204,6 +272,81 @@ int sqlite3_os_end(void)
   return SQLITE_OK;
 }
 
+//=======================================================================================
+// DEFERRED INDEX TABLE (builder and views below, see createDeferredIndexes)
+//=======================================================================================
+#define INDEX_MAX_KEYS 2
+
+// One index entry of a batch, sorted by (key, log_index) before it is merged into the index
+typedef struct {
+    uint32_t key[INDEX_MAX_KEYS];
+    uint32_t log_index;
+    uint32_t reserved;
+} INDEX_ENTRY;
+
+typedef struct {
+    const char* name;           // Index table
+    const char* keys;           // Key columns, in index order
+    const char* key_decl;       // Key column declarations
+    const char* view;           // Read view
+    uint32_t nkeys;
+    void (*extract)(const DS_LOG_REC* rec, INDEX_ENTRY* e);    // Key columns of a staged record
+} DEFERRED_INDEX;
+
+static void indexKeyCategory(const DS_LOG_REC* rec, INDEX_ENTRY* e) {
+    e->key[0] = rec->cat_id;
+    e->key[1] = 0;
+}
+
+static void indexKeySeverityTime(const DS_LOG_REC* rec, INDEX_ENTRY* e) {
+    e->key[0] = rec->severity;
+    e->key[1] = rec->timestamp_at_log;
+}
+
+static const DEFERRED_INDEX deferred_indexes[] = {
+    { "idx_logs_category",      "category_id",                "category_id INTEGER",                         "ds_logs_by_category", 1, indexKeyCategory },
+    { "idx_logs_severity_time", "severity, timestamp_at_log", "severity INTEGER, timestamp_at_log INTEGER",  "ds_logs_by_severity", 2, indexKeySeverityTime },
+};
+
+#define DEFERRED_INDEX_COUNT (sizeof(deferred_indexes) / sizeof(deferred_indexes[0]))
+
+static const char* const ds_logs_columns[INSERT_COLUMNS] = {
+    "log_index", "message", "category_id", "token", "local_log_index", "timestamp_at_store", "timestamp_at_log", "severity"
+};
+
+typedef struct {
+    sqlite3_stmt* fill_stmt;    // INSERT OR IGNORE INTO <name> SELECT ... WHERE log_index > ?1 AND log_index <= ?2
+    sqlite3_stmt* entry_stmt;   // INSERT OR IGNORE INTO <name> VALUES (key..., log_index)
+    sqlite3_int64 high_water;
+} DEFERRED_INDEX_STATE;
+
+static DEFERRED_INDEX_STATE index_state[DEFERRED_INDEX_COUNT];
+static sqlite3_stmt* index_hw_stmt = nullptr;  // UPDATE ds_index_state SET high_water = ?2 WHERE name = ?1
+
+// Sort buffer for the live (INDEX_MAINTAIN_SORTED) path, reused by each index in turn
+__attribute__((section(".psram_buffers"), aligned(32))) static INDEX_ENTRY index_sort_buf[RING_DRAIN_MAX_LOGS];
+
+// Memory plan (app_threadx.h): every PSRAM buffer against the PSRAM region. The VFS checks its own
+// pools against PLAN_VFS_PSRAM_BYTES, checkMemoryPlan() the linked sections at boot
+#define PLAN_PSRAM_BUFFERS_BYTES (sizeof(l0_images) + sizeof(index_sort_buf) + FX_SD_MEDIA_CACHE_BYTES + PLAN_VFS_PSRAM_BYTES)
+#define PLAN_PSRAM_LOGS_BYTES    (sizeof(psram_ring) + sizeof(psram_ring_commit))
+
+static_assert(PLAN_PCACHE_BYTES + PLAN_HEAP_BYTES + PLAN_PSRAM_LOGS_BYTES + PLAN_PSRAM_BUFFERS_BYTES <= PLAN_PSRAM_BYTES,
+              "PSRAM buffers exceed PLAN_PSRAM_BYTES");
+static_assert(PLAN_PAGE_SIZE == 4096, "PRAGMA page_size statements assume PLAN_PAGE_SIZE 4096");
+
+// WAL frames are one page each: 8192 frames at 4 KB pages
+#define CKPT_HARD_FRAMES (CKPT_HARD_WAL_BYTES / PLAN_PAGE_SIZE)
+static_assert(PLAN_PCACHE_BYTES / PLAN_PCACHE_SLOT >= 2 * (QUERY_CACHE_KB * 1024 / PLAN_PAGE_SIZE),
+              "Page cache pool too small for the query connection's share");
+static_assert(REBALANCE_CHUNK / PLAN_PCACHE_SLOT >= 1 && REBALANCE_MAX_LOANS <= 64,
+              "REBALANCE_CHUNK must hold a page cache slot, the page cache takes at most 64 loans");
+
+// Stats: slices built in the window, rows indexed in total (builder / live at commit)
+static uint32_t index_slices = 0;
+static uint32_t index_rows = 0;
+static uint32_t index_live_rows = 0;
+
 //=======================================================================================
 // GLOBAL PERFORMANCE COUNTERS (add to top of .cpp file)
 //=======================================================================================
@@ -211,7 +354,10 @@ int sqlite3_os_end(void)
 // Simulator stats (already exists, enhance it)
 static uint32_t sim_total_logs = 0;
 static uint32_t sim_last_count = 0;
-static uint32_t sim_last_time = 0;
+
+// Stats block window (statsWindow(), ingestor thread)
+#define STATS_WINDOW_MS 5000
+static uint32_t stats_last_time = 0;
 
 // Storage stats
 static uint32_t stor_total_logs = 0;
@@ -223,6 +369,212 @@ static uint32_t ing_total_logs = 0;
 static uint32_t ing_last_count = 0;
 static uint32_t ing_last_time = 0;
 static uint32_t ing_total_skipped = 0;
+static uint32_t ing_quarantined = 0;       // Records of drains that failed INGEST_RETRY_MAX times
+static uint32_t ing_dropped = 0;           // Of those, records whose quarantine file failed too
+
+// Insert path stats, indexed by INSERT_PATH (rows and ticks spent BEGIN..COMMIT)
+static uint32_t ins_rows[INSERT_PATH_COUNT] = {0};
+static uint32_t ins_ticks[INSERT_PATH_COUNT] = {0};
+static const char* const ins_path_names[INSERT_PATH_COUNT] = { "single", "batch", "vtab" };
+
+// DWT cycles spent in insertBuffer() and the rows it inserted (5 s window): the per-insert CPU
+// cost that the page cache tiers change, compare with SQLITE3_AZURE_CONFIG_PCACHE_SRAM_SIZE 0
+static uint64_t ins_cycles = 0;
+static uint32_t ins_cycle_rows = 0;
+
+// Batch sizing stats (5 s window, reset by the stats block)
+static uint32_t batch_target = INGEST_MIN_BATCH_LOGS;
+static uint32_t batch_txns = 0;
+static uint32_t batch_logs = 0;
+static uint32_t batch_max = 0;
+static uint32_t batch_deadline_flushes = 0;
+
+// Category dictionary: names cached, window map hits / ds_categories lookups
+static uint32_t cat_dict_entries = 0;
+static uint32_t cat_hits = 0;
+static uint32_t cat_misses = 0;
+
+// Segments: rollovers and retention drops since boot
+static uint32_t seg_rollovers = 0;
+static uint32_t seg_dropped = 0;
+static uint32_t seg_delete_retries = 0;
+
+// Query service: requests served, cursors closed for idling, snapshot lag seen at OPEN
+static uint32_t query_opens = 0;
+static uint32_t query_pages = 0;
+static uint32_t query_rows = 0;
+static uint32_t query_busy = 0;
+static uint32_t query_errors = 0;
+static uint32_t query_expired = 0;
+static sqlite3_int64 query_lag_max = 0;  // Window maximum, swapped out by the stats block
+static uint32_t query_last_opens = 0;       // Values at the previous stats block
+static uint32_t query_last_pages = 0;
+static uint32_t query_last_rows = 0;
+
+// PSRAM hot tier: run freezes (forced = the other run had to be merged first), merge work since boot
+static uint32_t l0_freezes = 0;
+static uint32_t l0_forced = 0;
+static uint32_t l0_slices = 0;
+static uint32_t l0_merged_rows = 0;
+static uint32_t l0_quarantined = 0;         // Rows of slices that failed INGEST_RETRY_MAX merges
+static uint32_t l0_stalls = 0;              // Drains held in the ring: the active run was full and could not be frozen
+
+// FileX media cache: counter values at the previous stats block (FX_MEDIA keeps totals since mount)
+static ULONG fx_last_sector_hits = 0;
+static ULONG fx_last_sector_misses = 0;
+static ULONG fx_last_fat_hits = 0;
+static ULONG fx_last_fat_misses = 0;
+static ULONG fx_last_driver_reads = 0;
+static ULONG fx_last_driver_writes = 0;
+static uint32_t fx_last_rows = 0;
+
+// WAL checkpoint scheduler: frame counts from the WAL hook, per-frame cost learned from checkpoints
+static uint32_t wal_frames = 0;             // WAL size in frames after the last commit
+static uint32_t wal_backfilled = 0;         // Frames of it already copied into the database
+static uint32_t ckpt_us_per_frame = 250;    // EWMA, starts at a typical SD page write
+static uint32_t ckpt_runs = 0;
+static uint32_t ckpt_forced = 0;
+static uint32_t ckpt_deferred = 0;
+static uint32_t ckpt_over_budget = 0;
+static uint32_t ckpt_frames = 0;
+
+// Memory rebalancer: chunks lent to the page cache (newest last), window counters
+static struct {
+    void* memory;
+    bool heap;                              // From the SQLite heap, else the temporary file pool
+} rebalance_loans[REBALANCE_MAX_LOANS];
+static uint32_t rebalance_count = 0;
+static uint32_t rebalance_heap = 0;         // Of them, from the SQLite heap
+static uint32_t rebalance_lent = 0;
+static uint32_t rebalance_returned = 0;
+static uint32_t rebalance_busy = 0;         // Returns put off by a pinned page
+static sqlite3_int64 rebalance_heap_peak = 0;
+static unsigned rebalance_slot_size = PLAN_PCACHE_SLOT;    // As configured by init()
+
+static int walFramesHook(void*, sqlite3*, const char* schema, int nFrame) {
+    if (strcmp(schema, "main") != 0) return SQLITE_OK;
+    if ((uint32_t)nFrame < wal_backfilled) wal_backfilled = 0;     // WAL restarted from frame 1
+    wal_frames = (uint32_t)nFrame;
+    return SQLITE_OK;
+}
+
+static void segmentName(uint32_t seq, char* name, size_t size) {
+    snprintf(name, size, SEGMENT_PREFIX "%lu.db", seq);
+}
+
+//=======================================================================================
+// LATENCY CLOCK - DWT cycle counter extended in software, read as ticks of 2^LATENCY_CLOCK_SHIFT cycles
+//
+// Records are stamped in ticks (timestamp_at_store, 32 bits: 0.32 us at 800 MHz, wraps every
+// ~23 min, only differences are used). CYCCNT wraps every ~5 s at 800 MHz, so it is extended in
+// software; every reader refreshes the extension and the ingestor never sleeps longer than
+// LATENCY_CLOCK_REFRESH_TICKS. The stamp is a shift and an OR: conversion to microseconds
+// (a divide) is left to the stats block and the few per-transaction readers.
+//=======================================================================================
+#define LATENCY_CLOCK_REFRESH_TICKS 1000
+#define LATENCY_CLOCK_SHIFT         8
+
+static uint32_t dwt_cycles_per_us = 1;
+static uint32_t dwt_last = 0;
+static uint32_t dwt_wraps = 0;
+
+static void latencyClockInit() {
+    DCB->DEMCR |= DCB_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+    dwt_cycles_per_us = SystemCoreClock / 1000000U;
+    if (dwt_cycles_per_us == 0) dwt_cycles_per_us = 1;
+}
+
+static uint32_t latencyClock() {
+    // Few-instruction critical section (no RTOS object): callable from any producer thread
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+
+    uint32_t now = DWT->CYCCNT;
+    if (now < dwt_last) dwt_wraps++;
+    dwt_last = now;
+    uint32_t wraps = dwt_wraps;
+
+    __set_PRIMASK(primask);
+    return (wraps << (32 - LATENCY_CLOCK_SHIFT)) | (now >> LATENCY_CLOCK_SHIFT);
+}
+
+static uint32_t latencyTicksToUs(uint32_t ticks) {
+    return (uint32_t)(((uint64_t)ticks << LATENCY_CLOCK_SHIFT) / dwt_cycles_per_us);
+}
+
+//=======================================================================================
+// LATENCY HISTOGRAM - HDR-style log-linear buckets, microseconds
+//
+//   v < 16          : one bucket per value (exact)
+//   v >= 16         : 8 linear sub-buckets per power of two (<= 12.5% relative error)
+// Recording is a clz + shift + increment, so per-record cost stays negligible. Pipeline
+// stages are recorded in latency clock ticks and converted when printed.
+//=======================================================================================
+#define LAT_HIST_SUB_BITS   3
+#define LAT_HIST_SUB        (1U << LAT_HIST_SUB_BITS)
+#define LAT_HIST_LINEAR     (2U * LAT_HIST_SUB)
+#define LAT_HIST_BUCKETS    (LAT_HIST_LINEAR + (32U - (LAT_HIST_SUB_BITS + 1U)) * LAT_HIST_SUB)
+
+typedef struct {
+    uint32_t bucket[LAT_HIST_BUCKETS];
+    uint32_t count;
+    uint32_t max;
+} LAT_HIST;
+
+// Pipeline stages, one histogram each (5 s window, reset by the stats block)
+typedef enum {
+    LAT_STAGE_QUEUE = 0,    // capture -> ingest start (time spent staged in PSRAM)
+    LAT_STAGE_COMMIT,       // ingest start -> COMMIT done (transaction time seen by the record)
+    LAT_STAGE_TOTAL,        // capture -> COMMIT done
+    LAT_STAGE_COUNT
+} LAT_STAGE;
+
+static LAT_HIST lat_hist[LAT_STAGE_COUNT];
+static const char* const lat_stage_names[LAT_STAGE_COUNT] = { "queue", "commit", "total" };
+
+// Checkpoint durations (one sample per checkpoint, same window)
+static LAT_HIST ckpt_hist;
+
+static inline uint32_t latHistIndex(uint32_t v) {
+    if (v < LAT_HIST_LINEAR) return v;
+    uint32_t e = 31U - (uint32_t)__builtin_clz(v);                  // e >= LAT_HIST_SUB_BITS + 1
+    uint32_t sub = (v >> (e - LAT_HIST_SUB_BITS)) & (LAT_HIST_SUB - 1U);
+    return LAT_HIST_LINEAR + (e - (LAT_HIST_SUB_BITS + 1U)) * LAT_HIST_SUB + sub;
+}
+
+// Largest value that maps to bucket 'i'
+static uint32_t latHistUpper(uint32_t i) {
+    if (i < LAT_HIST_LINEAR) return i;
+    uint32_t e = (i - LAT_HIST_LINEAR) / LAT_HIST_SUB + (LAT_HIST_SUB_BITS + 1U);
+    uint32_t sub = (i - LAT_HIST_LINEAR) % LAT_HIST_SUB;
+    uint64_t lo = ((uint64_t)(LAT_HIST_SUB + sub)) << (e - LAT_HIST_SUB_BITS);
+    uint64_t hi = lo + (1ULL << (e - LAT_HIST_SUB_BITS)) - 1U;
+    return (hi > 0xFFFFFFFFULL) ? 0xFFFFFFFFU : (uint32_t)hi;
+}
+
+static inline void latHistAdd(LAT_HIST* h, uint32_t v, uint32_t n) {
+    h->bucket[latHistIndex(v)] += n;
+    h->count += n;
+    if (v > h->max) h->max = v;
+}
+
+// Upper bound of the bucket holding the percentile (per-100k: 50000 = p50, 99900 = p999)
+static uint32_t latHistPercentile(const LAT_HIST* h, uint32_t per100k) {
+    if (h->count == 0) return 0;
+    uint32_t rank = (uint32_t)(((uint64_t)h->count * per100k + 99999U) / 100000U);
+    uint32_t seen = 0;
+    for (uint32_t i = 0; i < LAT_HIST_BUCKETS; i++) {
+        seen += h->bucket[i];
+        if (seen >= rank) {
+            uint32_t upper = latHistUpper(i);
+            return (upper < h->max) ? upper : h->max;
+        }
+    }
+    return h->max;
+}
 
 //=======================================================================================
 //
@@ -243,47 +595,26 @@ void MPLIB_STORAGE::init_psram()
 	// CRITICAL: Manual zero-fill with barriers for PSRAM
 	// ================================================================
 
-	// Zero buffer A
-	for (uint32_t i = 0; i < LOGS_PER_BUFFER; i++) {
-		volatile DS_LOG_STRUCT* log = &psram_buffer_A[i];
-		log->log_index = 0;
-		log->token = 0;
-		log->local_log_index = 0;
-		log->timestamp_at_store = 0;
-		log->timestamp_at_log = 0;
-		log->severity = 0;
-		memset((void*)log->category, 0, sizeof(log->category));
-		memset((void*)log->message, 0, sizeof(log->message));
-		memset((void*)log->reserved, 0, sizeof(log->reserved));
+	// Zero the whole ring and its commit words
+	volatile uint32_t* words = (volatile uint32_t*)psram_ring;
+	for (uint32_t i = 0; i < RING_CAPACITY_BYTES / sizeof(uint32_t); i++) {
+		words[i] = 0;
 	}
-
-	__DSB();  // Ensure all writes are complete
-	__ISB();  // Instruction barrier
-
-	// Zero buffer B
-	for (uint32_t i = 0; i < LOGS_PER_BUFFER; i++) {
-		volatile DS_LOG_STRUCT* log = &psram_buffer_B[i];
-		log->log_index = 0;
-		log->token = 0;
-		log->local_log_index = 0;
-		log->timestamp_at_store = 0;
-		log->timestamp_at_log = 0;
-		log->severity = 0;
-		memset((void*)log->category, 0, sizeof(log->category));
-		memset((void*)log->message, 0, sizeof(log->message));
-		memset((void*)log->reserved, 0, sizeof(log->reserved));
+	for (uint32_t i = 0; i < RING_CAPACITY_BYTES / LOG_REC_ALIGN; i++) {
+		psram_ring_commit[i] = 0;   // Nothing committed yet (pos + 1 is never 0 on the first lap)
 	}
 
 	__DSB();  // Ensure all writes are complete
 	__ISB();  // Instruction barrier
 
-	printf("\nOK [INIT] PSRAM buffers manually zeroed (%lu logs each)\n", LOGS_PER_BUFFER);
+	printf("\nOK [INIT] PSRAM ring manually zeroed (%u segments x %u KB)\n", RING_SEGMENTS, RING_SEGMENT_BYTES / 1024);
 
-	// Verify zeroing worked
-	if (psram_buffer_A[0].log_index != 0 || psram_buffer_B[0].log_index != 0) {
+	// Verify zeroing worked (first and last segment)
+	if (words[0] != 0 || words[(RING_CAPACITY_BYTES - RING_SEGMENT_BYTES) / sizeof(uint32_t)] != 0) {
 		printf("\nERROR [INIT] PSRAM zero verification FAILED!\n");
-		printf("  Buffer A[0].log_index = 0x%08lX (expected 0)\n", psram_buffer_A[0].log_index);
-		printf("  Buffer B[0].log_index = 0x%08lX (expected 0)\n", psram_buffer_B[0].log_index);
+		printf("  Segment 0[0]  = 0x%08lX (expected 0)\n", words[0]);
+		printf("  Segment %u[0] = 0x%08lX (expected 0)\n", RING_SEGMENTS - 1,
+		       words[(RING_CAPACITY_BYTES - RING_SEGMENT_BYTES) / sizeof(uint32_t)]);
 	} else {
 		printf("\nOK [INIT] PSRAM zero verification PASSED\n");
 	}
@@ -304,14 +635,24 @@ bool MPLIB_STORAGE::init() {
     // CONFIG 1: Use PSRAM for the Page Cache
     // CRITICAL: slot size MUST be page_size + header overhead (~256 bytes).
     // Old value of 4096 was too small — SQLite silently fell back to the heap for every page!
-    #define PCACHE_SLOT_SIZE (4096 + 256)
-    rc = sqlite3_config(SQLITE_CONFIG_PAGECACHE, sqlite_pcache, PCACHE_SLOT_SIZE, (int)(sizeof(sqlite_pcache) / PCACHE_SLOT_SIZE));
+    // The VFS page cache replaces pcache1: it keeps B-tree interior pages and recycles the
+    // append-only leaves first, so inserts stay flat as the table grows past what the cache holds
+    // Slots follow the memory plan, unless SQLite's page header turns out larger than planned
+    checkMemoryPlan();
+    if (rebalance_slot_size < sqlite3_azure_pcache_slot_size(PLAN_PAGE_SIZE))
+        rebalance_slot_size = sqlite3_azure_pcache_slot_size(PLAN_PAGE_SIZE);
+    rc = sqlite3_azure_pcache_config(sqlite_pcache, sizeof(sqlite_pcache), rebalance_slot_size);
     if (rc != SQLITE_OK) printf("\nWARN [INIT] PageCache Config Failed: %d", rc);
 
     // CONFIG 2: Use PSRAM for the Heap (memsys5)
     rc = sqlite3_config(SQLITE_CONFIG_HEAP, sqlite_heap, (int)sizeof(sqlite_heap), 64);
     if (rc != SQLITE_OK) printf("\nWARN [INIT] Heap Config Failed: %d", rc);
 
+    // CONFIG 2b: Size classes in on-chip SRAM in front of memsys5, plus the transaction arena
+    // the ingestor opens around each BEGIN..COMMIT (SQLITE3_AZURE_CONFIG_SIZE_CLASSES 0 for memsys5 alone)
+    rc = sqlite3_azure_mem_config();
+    if (rc != SQLITE_OK) printf("\nWARN [INIT] Size Class Config Failed: %d", rc);
+
     // CONFIG 3: Enable status tracking for your terminal stats
     sqlite3_config(SQLITE_CONFIG_MEMSTATUS, 1);
 
@@ -330,26 +671,37 @@ bool MPLIB_STORAGE::init() {
     tx_status = tx_semaphore_create(&dma_complete_sem, "DMA Complete", 0);
     if (tx_status != TX_SUCCESS) return false;
 
+    latencyClockInit();
+
     init_psram();
-    buffer_A = psram_buffer_A;
-    buffer_B = psram_buffer_B;
-    active_fill_buffer = buffer_A;
+    ring = psram_ring;
+    ring_commit = psram_ring_commit;
+    ring_reserve = 0;
+    ring_tail = 0;
+    ring_log_index = 0;     // Every segment is purged below, keys start over
 
     tx_status = tx_event_flags_create(&staging_events, "Staging Events");
     if (tx_status != TX_SUCCESS) return false;
 
-    tx_event_flags_set(&staging_events, 0, TX_AND);  // Clear all bits
-    tx_event_flags_set(&staging_events, FLAG_BUF_A_FREE | FLAG_BUF_B_FREE, TX_OR);  // Both buffers start free
+    tx_event_flags_set(&staging_events, 0, TX_AND);  // Clear all bits (ring starts empty)
 
     tx_status = tx_mutex_create(&sd_io_mutex, "SD I/O Mutex", TX_NO_INHERIT);
     tx_status = tx_mutex_create(&db_mutex, "DB Mutex", TX_NO_INHERIT);
+    tx_status = tx_queue_create(&query_queue, (CHAR*)"Query Queue", TX_1_ULONG,
+                                query_queue_storage, sizeof(query_queue_storage));
+    if (tx_status != TX_SUCCESS) return false;
     tx_status = tx_semaphore_create(&sem_raw_files, "Raw Files Semaphore", 0);
 
-    delete_database_files();
-    printf("\nOK [INIT] Starting database: %s\n", DB_NAME);
+    purgeSegments();
+    seg_first = seg_seq = 0;
+    seg_rows = 0;
+    seg_opened = seg_size_checked = tx_time_get();
+    seg_size = 0;
+    segmentName(seg_seq, db_name, sizeof(db_name));
+    printf("\nOK [INIT] Starting database: %s\n", db_name);
 
     // OPEN & TUNE
-    rc = sqlite3_open(DB_NAME, &db);
+    rc = sqlite3_open(db_name, &db);
     if (rc != SQLITE_OK) {
         printf("\nERROR [INIT] Failed to open DB: %s\n", sqlite3_errmsg(db));
         return false;
@@ -363,7 +715,7 @@ bool MPLIB_STORAGE::init() {
     }
 
     // Finalize and Close so Ingestor thread can take over
-    if (insert_stmt) { sqlite3_finalize(insert_stmt); insert_stmt = nullptr; }
+    finalizeInsertStatements();
     if (db) {
         sqlite3_close(db);
         db = nullptr;
@@ -379,70 +731,221 @@ bool MPLIB_STORAGE::init() {
 //
 //=======================================================================================
 void MPLIB_STORAGE::simulator() {
-    DS_LOG_STRUCT test_log;
+    char message[LOG_LENGTH];
     uint32_t counter = 0;
     const char *sim_name = "SIMULATOR";
-    int cur, hi;
-
-    sim_last_time = tx_time_get();
-    sim_last_count = 0; // Ensure reset
-    ing_last_count = 0; // Ensure reset
+    const uint32_t sim_name_len = strlen(sim_name);
 
     printf("\nOK [SIMULATOR] Simulator Online - OPTIMIZED MODE\n");
 
     while(1) {
-        // ... [Log filling logic remains the same] ...
-        test_log.log_index = counter;
-        snprintf(test_log.message, LOG_LENGTH, "Burst #%lu", counter);
-        snprintf(test_log.category, CAT_LENGTH, "%s", sim_name);
-        test_log.token = 13131;
-        test_log.local_log_index = 0;
-        test_log.timestamp_at_store = 0;
-        test_log.timestamp_at_log = tx_time_get();
-        test_log.severity = 1;
+        // Length-aware capture: only the formatted bytes reach the ring (no NUL padding)
+        int msg_len = snprintf(message, LOG_LENGTH, "Burst #%lu", counter);
+        if (msg_len < 0) msg_len = 0;
+
+        this->captureRecord(13131, tx_time_get(), 1,
+                            sim_name, sim_name_len, message, (uint32_t)msg_len);
 
         counter++;
         sim_total_logs++;
 
-        this->captureLog(test_log);
+        // Keep your timing logic
+        if (counter % 20 == 0) {
+            tx_thread_sleep(1);
+        }
+//        tx_thread_sleep(1);
+    }
+}
 
-        uint32_t current_time = tx_time_get();
+//=======================================================================================
+// Stats block - one STATS_WINDOW_MS window, run by the ingestor between transactions
+//   Most counters are the ingestor's own, so they are printed and reset on the thread that
+//   updates them; the memory rebalancer runs here for the same reason. Producer and query
+//   thread counters are only read (the query lag maximum is swapped with interrupts off)
+//=======================================================================================
+void MPLIB_STORAGE::statsWindow() {
+    int cur, hi;
+    uint32_t now = tx_time_get();
+    uint32_t secs = (now - stats_last_time + 500) / 1000;
+    if (secs == 0) secs = 1;
 
-        // Stats loop runs every 5 seconds (5000 ticks)
-        if (current_time - sim_last_time >= 5000) {
-            // FIX: Divide by 5 to get per-second average over the 5s window
-            uint32_t sim_logs_this_sec = (sim_total_logs - sim_last_count) / 5;
-            uint32_t ing_logs_this_sec = (ing_total_logs - ing_last_count) / 5;
+    // Per-second average over the window
+    uint32_t sim_logs_this_sec = (sim_total_logs - sim_last_count) / secs;
+    uint32_t ing_logs_this_sec = (ing_total_logs - ing_last_count) / secs;
 
-            printf("\n--- STATS BLOCK ---------------------------------------------------------------------------");
-            printf("\n[STATS] SIMULATOR : %5lu logs/sec | Total: %7lu",
-                   sim_logs_this_sec, sim_total_logs);
-            printf("\n[STATS] INGESTION : %5lu logs/sec | Total: %7lu (Skipped: %lu)",
-                   ing_logs_this_sec, ing_total_logs, ing_total_skipped);
-
-            // FIX: Use ing_total_logs to show what is actually waiting in PSRAM
-            uint32_t pending_in_psram = 0;
-            if (sim_total_logs > ing_total_logs) {
-                pending_in_psram = sim_total_logs - ing_total_logs;
-            }
+    printf("\n--- STATS BLOCK ---------------------------------------------------------------------------");
+    printf("\n[STATS] SIMULATOR : %5lu logs/sec | Total: %7lu",
+           sim_logs_this_sec, sim_total_logs);
+    printf("\n[STATS] INGESTION : %5lu logs/sec | Total: %7lu (Skipped: %lu, Quarantined: %lu, Dropped: %lu)",
+           ing_logs_this_sec, ing_total_logs, ing_total_skipped, ing_quarantined, ing_dropped);
+
+    // FIX: Use ing_total_logs to show what is actually waiting in PSRAM
+    uint32_t pending_in_psram = 0;
+    if (sim_total_logs > ing_total_logs + ing_quarantined) {
+        pending_in_psram = sim_total_logs - ing_total_logs - ing_quarantined;
+    }
 
-            printf("\n[STATS] PSRAM     : %lu logs pending write", pending_in_psram);
+    printf("\n[STATS] PSRAM     : %lu logs pending write | Ring: %lu/%u KB used",
+           pending_in_psram, (uint32_t)(ring_reserve - ring_tail) / 1024, RING_CAPACITY_BYTES / 1024);
 
-            sqlite3_status(SQLITE_STATUS_MEMORY_USED, &cur, &hi, 0);
-            printf("\n[STATS] SQLite Mem: %d / %d bytes", cur, (int)sizeof(sqlite_heap));
-            printf("\n--- STATS BLOCK ---------------------------------------------------------------------------\n");
+    printf("\n[STATS] INSERT    :");
+    for (int p = 0; p < INSERT_PATH_COUNT; p++) {
+        uint32_t rate = ins_ticks[p] > 0 ? (uint32_t)((uint64_t)ins_rows[p] * 1000 / ins_ticks[p]) : 0;
+        printf(" %s %5lu rows/sec%s", ins_path_names[p], rate, (p + 1 < INSERT_PATH_COUNT) ? " |" : "");
+    }
 
-            sim_last_time = current_time;
-            sim_last_count = sim_total_logs;
-            ing_last_count = ing_total_logs;
+    printf("\n[STATS] BATCH     : target %lu | avg %lu | max %lu logs | %lu txns (%lu deadline flushes)",
+           batch_target, batch_txns > 0 ? batch_logs / batch_txns : 0, batch_max,
+           batch_txns, batch_deadline_flushes);
+    for (int st = 0; st < LAT_STAGE_COUNT; st++) {
+        const LAT_HIST* h = &lat_hist[st];
+        printf("\n[STATS] LAT %-6s: p50 %7lu us | p99 %7lu us | p999 %7lu us | max %7lu us (%lu recs)",
+               lat_stage_names[st],
+               latencyTicksToUs(latHistPercentile(h, 50000)), latencyTicksToUs(latHistPercentile(h, 99000)),
+               latencyTicksToUs(latHistPercentile(h, 99900)), latencyTicksToUs(h->max), h->count);
+    }
+    printf("\n[STATS] CKPT      : %lu runs (%lu forced, %lu deferred, %lu over %u ms) | %lu frames | WAL %lu/%lu | p50 %lu us | p99 %lu us | max %lu us | %lu us/frame",
+           ckpt_runs, ckpt_forced, ckpt_deferred, ckpt_over_budget, CKPT_BUDGET_MS, ckpt_frames,
+           wal_frames - wal_backfilled, wal_frames,
+           latHistPercentile(&ckpt_hist, 50000), latHistPercentile(&ckpt_hist, 99000), ckpt_hist.max,
+           ckpt_us_per_frame);
+    ckpt_runs = ckpt_forced = ckpt_deferred = ckpt_over_budget = ckpt_frames = 0;
+    memset(&ckpt_hist, 0, sizeof(ckpt_hist));
+    sqlite3_azure_wb_stats wb;
+    sqlite3_azure_write_behind_stats(&wb, 1);
+    printf("\n[STATS] WBEHIND   : %lu writes -> %lu runs (%lu KB, max %lu merged) | %lu read hits | %lu drains, %lu stalls | queue %lu KB (max %lu KB)",
+           wb.staged, wb.runs, (uint32_t)(wb.bytes / 1024), wb.max_run_writes, wb.read_hits,
+           wb.drains, wb.stalls, wb.queued / 1024, wb.queued_max / 1024);
+    sqlite3_azure_ext_stats ext;
+    sqlite3_azure_extent_stats(&ext, 1);
+    printf("\n[STATS] EXTENTS   : %lu mapped seeks, %lu fallbacks | %lu FAT reads | max %lu extents | prealloc %lu contiguous, %lu best effort (%lu MB, %lu MB released)",
+           ext.seeks, ext.fallbacks, ext.fat_reads, ext.max_extents, ext.contiguous, ext.best_effort,
+           (uint32_t)(ext.preallocated / (1024 * 1024)), (uint32_t)(ext.released / (1024 * 1024)));
+    rebalanceMemory();    // Before the counters below start a new window
+    sqlite3_azure_tmp_stats tmp;
+    sqlite3_azure_temp_stats(&tmp, 1);
+    printf("\n[STATS] TEMPFS    : %lu files (%lu open) | %lu KB written, %lu KB read | pool %lu/%lu KB (max %lu KB) | %lu spills (%lu KB to card)",
+           tmp.files, tmp.open, (uint32_t)(tmp.written / 1024), (uint32_t)(tmp.read / 1024),
+           tmp.in_use / 1024, tmp.pool / 1024, tmp.in_use_max / 1024, tmp.spills, (uint32_t)(tmp.spilled / 1024));
+    sqlite3_azure_pc_stats pcs;
+    sqlite3_azure_pcache_stats(&pcs, 1);
+    {
+        uint32_t int_total = pcs.hits[SQLITE3_AZURE_PAGE_INTERIOR] + pcs.misses[SQLITE3_AZURE_PAGE_INTERIOR];
+        uint32_t leaf_total = pcs.hits[SQLITE3_AZURE_PAGE_LEAF] + pcs.misses[SQLITE3_AZURE_PAGE_LEAF];
+        printf("\n[STATS] PCACHE    : interior %lu%% hit (%lu miss, %lu evicted) | leaf %lu%% hit (%lu miss, %lu evicted) | other %lu/%lu | cached %lu/%lu/%lu of %lu slots (%lu free, %lu heap) | %lu full",
+               int_total > 0 ? (uint32_t)((uint64_t)pcs.hits[SQLITE3_AZURE_PAGE_INTERIOR] * 100 / int_total) : 0,
+               pcs.misses[SQLITE3_AZURE_PAGE_INTERIOR], pcs.evictions[SQLITE3_AZURE_PAGE_INTERIOR],
+               leaf_total > 0 ? (uint32_t)((uint64_t)pcs.hits[SQLITE3_AZURE_PAGE_LEAF] * 100 / leaf_total) : 0,
+               pcs.misses[SQLITE3_AZURE_PAGE_LEAF], pcs.evictions[SQLITE3_AZURE_PAGE_LEAF],
+               pcs.hits[SQLITE3_AZURE_PAGE_OTHER], pcs.misses[SQLITE3_AZURE_PAGE_OTHER],
+               pcs.cached[SQLITE3_AZURE_PAGE_INTERIOR], pcs.cached[SQLITE3_AZURE_PAGE_LEAF],
+               pcs.cached[SQLITE3_AZURE_PAGE_OTHER], pcs.slots, pcs.free_slots, pcs.heap_pages, pcs.no_slot);
+        uint32_t tier_total = pcs.tier_hits[0] + pcs.tier_hits[1];
+        printf("\n[STATS] PCTIER    : SRAM %lu/%lu pages | %lu%% of hits | %lu promoted, %lu demoted | insert %lu cycles/row",
+               pcs.sram_pages, pcs.sram_slots,
+               tier_total > 0 ? (uint32_t)((uint64_t)pcs.tier_hits[1] * 100 / tier_total) : 0,
+               pcs.promotions, pcs.demotions,
+               ins_cycle_rows > 0 ? (uint32_t)(ins_cycles / ins_cycle_rows) : 0);
+        ins_cycles = 0;
+        ins_cycle_rows = 0;
+    }
+#ifndef FX_MEDIA_STATISTICS_DISABLE
+    {
+        ULONG hits = sdio_disk.fx_media_logical_sector_cache_read_hits - fx_last_sector_hits;
+        ULONG misses = sdio_disk.fx_media_logical_sector_cache_read_misses - fx_last_sector_misses;
+        ULONG reads = sdio_disk.fx_media_driver_read_requests - fx_last_driver_reads;
+        uint32_t rows = ing_total_logs - fx_last_rows;
+        printf("\n[STATS] FXCACHE   : %lu KB | sectors %lu hits, %lu misses (%lu%%) | FAT %lu hits, %lu misses | %lu dirty | driver %lu reads, %lu writes | %lu reads / 1k rows",
+               (sdio_disk.fx_media_sector_cache_size * sdio_disk.fx_media_bytes_per_sector) / 1024,
+               hits, misses, (hits + misses) > 0 ? (uint32_t)((uint64_t)hits * 100 / (hits + misses)) : 0,
+               sdio_disk.fx_media_fat_entry_cache_read_hits - fx_last_fat_hits,
+               sdio_disk.fx_media_fat_entry_cache_read_misses - fx_last_fat_misses,
+               sdio_disk.fx_media_sector_cache_dirty_count,
+               reads, sdio_disk.fx_media_driver_write_requests - fx_last_driver_writes,
+               rows > 0 ? (uint32_t)((uint64_t)reads * 1000 / rows) : 0);
+        fx_last_sector_hits = sdio_disk.fx_media_logical_sector_cache_read_hits;
+        fx_last_sector_misses = sdio_disk.fx_media_logical_sector_cache_read_misses;
+        fx_last_fat_hits = sdio_disk.fx_media_fat_entry_cache_read_hits;
+        fx_last_fat_misses = sdio_disk.fx_media_fat_entry_cache_read_misses;
+        fx_last_driver_reads = sdio_disk.fx_media_driver_read_requests;
+        fx_last_driver_writes = sdio_disk.fx_media_driver_write_requests;
+        fx_last_rows = ing_total_logs;
+    }
+#endif
+    FX_STM32_SD_STATS sd;
+    fx_stm32_sd_driver_stats(&sd, 1);
+    printf("\n[STATS] SD        : direct %lu reads, %lu writes | bounce %lu reads, %lu writes -> %lu transfers (%lu sectors)",
+           sd.direct_reads, sd.direct_writes, sd.bounce_reads, sd.bounce_writes,
+           sd.bounce_transfers, sd.bounce_sectors);
+    printf("\n[STATS] CATDICT   : %lu names | %lu hits | %lu misses",
+           cat_dict_entries, cat_hits, cat_misses);
+    batch_txns = batch_logs = batch_max = batch_deadline_flushes = 0;
+    cat_hits = cat_misses = 0;
+    if (INDEX_BUILD_DEFERRED) {
+        printf("\n[STATS] INDEX     :");
+        for (uint32_t i = 0; i < DEFERRED_INDEX_COUNT; i++) {
+            printf(" %s lag %lld |", deferred_indexes[i].name, max_rowid - index_state[i].high_water);
         }
+        printf(" %lu slices, %lu rows built, %lu rows at commit", index_slices, index_rows, index_live_rows);
+        index_slices = 0;
+    }
+    memset(lat_hist, 0, sizeof(lat_hist));
+
+    printf("\n[STATS] SEGMENT   : %s | %lu rows | %lu on card (%lu..%lu) | %lu rollovers, %lu dropped, %lu delete retries",
+           db_name, seg_rows, seg_seq - seg_first + 1, seg_first, seg_seq, seg_rollovers, seg_dropped,
+           seg_delete_retries);
+
+    if (l0_on) {
+        printf("\n[STATS] L0        : active %s %lu rows, %lu KB | frozen %lu rows (merged to %lld) | %lu freezes (%lu forced) | %lu slices, %lu rows merged | %lu quarantined, %lu stalls",
+               l0_run_names[l0_active], l0_rows[l0_active], (uint32_t)(l0_bytes / 1024),
+               l0_rows[l0_active ^ 1], l0_merged, l0_freezes, l0_forced, l0_slices, l0_merged_rows,
+               l0_quarantined, l0_stalls);
+        l0_slices = l0_merged_rows = 0;
+    }
 
-        // Keep your timing logic
-        if (counter % 20 == 0) {
-            tx_thread_sleep(1);
+    // Written by the query thread: only read here, the window is the difference to the last block
+    uint32_t opens = query_opens, pages = query_pages, rows = query_rows;
+    UINT interrupts = tx_interrupt_control(TX_INT_DISABLE);
+    sqlite3_int64 lag_max = query_lag_max;
+    query_lag_max = 0;
+    tx_interrupt_control(interrupts);
+    printf("\n[STATS] QUERY     : %lu opens | %lu pages | %lu rows | %lu busy, %lu errors, %lu expired | snapshot %lld, lag %lld (max %lld), %lu rows in L0",
+           opens - query_last_opens, pages - query_last_pages, rows - query_last_rows, query_busy, query_errors, query_expired,
+           query_snapshot, query_lag, lag_max, l0_on ? l0_rows[0] + l0_rows[1] : 0);
+    query_last_opens = opens;
+    query_last_pages = pages;
+    query_last_rows = rows;
+
+    sqlite3_status(SQLITE_STATUS_MEMORY_USED, &cur, &hi, 0);
+    printf("\n[STATS] SQLite Mem: %d / %d bytes", cur, (int)sizeof(sqlite_heap));
+    {
+        sqlite3_azure_sc_stats sc;
+        sqlite3_azure_size_class_stats(&sc, 1);
+        uint32_t allocs = 0, carved_bytes = 0, used_bytes = 0;
+        printf("\n[STATS] MEMCLS    :");
+        for (int c = 0; c < SQLITE3_AZURE_MEM_CLASSES; c++) {
+            allocs += sc.allocs[c];
+            carved_bytes += sc.carved[c] * sc.size[c];
+            used_bytes += sc.in_use[c] * sc.size[c];
+            if (sc.carved[c] > 0) printf(" %u:%lu/%lu", sc.size[c], sc.in_use[c], sc.carved[c]);
         }
-//        tx_thread_sleep(1);
+        printf(" | %lu allocs | chunks %lu/%lu, %lu%% free in carved | arena %lu allocs, %lu resets, %lu pinned, %lu/%lu busy, high %lu B | memsys5 %lu allocs",
+               allocs, sc.chunks_used, sc.chunks,
+               carved_bytes > 0 ? (uint32_t)((uint64_t)(carved_bytes - used_bytes) * 100 / carved_bytes) : 0,
+               sc.arena_allocs, sc.arena_resets, sc.arena_pinned, sc.arena_busy, sc.arena_blocks,
+               sc.arena_high, sc.fallback_allocs);
     }
+    printf("\n[STATS] MEMPLAN   : heap peak %lu/%u KB | temp peak %lu/%lu KB | lent to pcache %lu KB (%lu heap, %lu temp chunks, %lu slots) | %lu lent, %lu returned, %lu busy",
+           (uint32_t)(rebalance_heap_peak / 1024), PLAN_HEAP_BYTES / 1024,
+           tmp.in_use_max / 1024, (tmp.pool - tmp.lent) / 1024,
+           rebalance_count * (REBALANCE_CHUNK / 1024), rebalance_heap, rebalance_count - rebalance_heap,
+           pcs.lent_slots, rebalance_lent, rebalance_returned, rebalance_busy);
+    rebalance_lent = rebalance_returned = rebalance_busy = 0;
+    printf("\n--- STATS BLOCK ---------------------------------------------------------------------------\n");
+
+    stats_last_time = now;
+    sim_last_count = sim_total_logs;
+    ing_last_count = ing_total_logs;
 }
 
 //=======================================================================================
@@ -457,11 +960,14 @@ void MPLIB_STORAGE::work() {
     printf("\nOK [STORAGE] service work thread loop started\n");  // ADD THIS
 
     while(1) {
-//    	printf("\nDEBUG [STORAGE] Waiting for buffer flags...\n");
-
-        tx_event_flags_get(&staging_events, 0x03, TX_OR_CLEAR, &actual_flags, TX_WAIT_FOREVER);
-
-        printf("\nDEBUG [STORAGE] Woke up! actual_flags=0x%02lX\n", actual_flags);
+        // One raw file per drain of at least INGEST_MIN_BATCH_LOGS records (fixed DS_LOG_STRUCT format)
+        LOG_SPAN span;
+        uint32_t logs = drainableRecords(RING_DRAIN_MAX_LOGS, &span);
+        if (logs < INGEST_MIN_BATCH_LOGS && span.bytes < RING_CAPACITY_BYTES / 2) {
+            ULONG wait = (ring_reserve != ring_tail) ? 1 : TX_WAIT_FOREVER;
+            tx_event_flags_get(&staging_events, FLAG_RING_DATA, TX_OR_CLEAR, &actual_flags, wait);
+            continue;
+        }
 
         if (produce_idx - consume_idx >= MAX_RAW_FILES) {
             printf("\nCRITICAL [STORAGE] Queue Full! Stalling Simulator...\n");
@@ -469,21 +975,14 @@ void MPLIB_STORAGE::work() {
             printf("\nOK [STORAGE] Simulator suspended\n");
         }
 
-//        DS_LOG_STRUCT* src = (actual_flags & 0x01) ? psram_buffer_A : psram_buffer_B;
-//        snprintf(raw_filename, sizeof(raw_filename), "batch_%lu.raw", produce_idx % MAX_RAW_FILES);
-        DS_LOG_STRUCT* src = (actual_flags & 0x01) ? psram_buffer_A : psram_buffer_B;
-        uint32_t actual_count = (actual_flags & 0x01) ? buffer_A_count : buffer_B_count;
-
-        if (actual_count == 0) actual_count = LOGS_PER_BUFFER;  // Safety
-
         snprintf(raw_filename, sizeof(raw_filename), "batch_%lu.raw", produce_idx % MAX_RAW_FILES);
 
         uint32_t start_time = tx_time_get();
 
-        if (this->writeRawFile(raw_filename, src, actual_count) == FX_SUCCESS) {
+        if (this->writeRawRecords(raw_filename, &span) == FX_SUCCESS) {
             uint32_t write_time = tx_time_get() - start_time;
 
-            stor_total_logs += LOGS_PER_BUFFER;
+            stor_total_logs += logs;
 
             produce_idx++;
             tx_semaphore_put(&sem_raw_files);
@@ -491,9 +990,11 @@ void MPLIB_STORAGE::work() {
             printf("\nOK [STORAGE] batch_%lu.raw written (%lu ms, %lu logs/sec instantaneous)\n",
                    produce_idx - 1,
                    write_time,
-                   write_time > 0 ? (LOGS_PER_BUFFER * 1000 / write_time) : 0);
+                   write_time > 0 ? (logs * 1000 / write_time) : 0);
         }
 
+        releaseSpan(&span);
+
         tx_thread_relinquish();
     }
 }
@@ -509,11 +1010,11 @@ void MPLIB_STORAGE::tuneDbConfig() {
         "PRAGMA page_size = 4096;",            // MUST match config sz (4096)
         "PRAGMA journal_mode = WAL;",
         "PRAGMA synchronous = OFF;",           // No fsyncs — max throughput (data loss on power-fail OK)
-        "PRAGMA cache_size = -4096;",          // 4 MiB — keep ALL B-tree interior pages hot in PSRAM
-        "PRAGMA locking_mode = EXCLUSIVE;",
+        "PRAGMA cache_size = -4096;",          // 4 MiB — interior pages stay hot in PSRAM (VFS page cache)
+        "PRAGMA locking_mode = NORMAL;",       // wal-index lives in PSRAM (VFS xShm*): readers on other connections never block the writer
         "PRAGMA temp_store = MEMORY;",
         "PRAGMA journal_size_limit = 4194304;",
-        "PRAGMA wal_autocheckpoint = 0;",      // Disable auto-checkpoint; we do manual PASSIVE every 5 buffers
+        "PRAGMA wal_autocheckpoint = 0;",      // Disable auto-checkpoint; scheduleCheckpoint() decides
         "PRAGMA auto_vacuum = NONE;"
     };
 
@@ -526,158 +1027,878 @@ void MPLIB_STORAGE::tuneDbConfig() {
             if (zErrMsg) { sqlite3_free(zErrMsg); zErrMsg = nullptr; }
         }
     }
+    // WAL size after each commit feeds the checkpoint scheduler (replaces the auto-checkpoint hook)
+    sqlite3_wal_hook(db, walFramesHook, nullptr);
+    wal_frames = wal_backfilled = 0;
+
     printf("\nOK [DB_CONFIG] Storage-optimized configuration active\n");
 }
 
 //=======================================================================================
+// PSRAM_BATCH - eponymous read-only virtual table over a DS_LOG_STRUCT staging buffer
 //
+//   SELECT ... FROM psram_batch(buf, start, count)
+//
+//   buf   : LOG_SPAN pointer bound with sqlite3_bind_pointer(..., PSRAM_BATCH_PTR_TYPE, ...)
+//   start : records of the span to skip (default 0)
+//   count : number of records (default: rest of the span)
+//
+// Columns are served straight from the PSRAM records with SQLITE_STATIC and their real lengths:
+// no copy, no parsing, no NUL padding. Pad records are skipped. category_id is the dictionary id
+// resolveCategories() stored in the record header.
 //=======================================================================================
-void MPLIB_STORAGE::ingestor(ULONG thread_input) {
-    char raw_filename[32];
-    UINT state;
-
-    printf("\nOK [INGESTION] SQLite Ingestor Thread Online (OPTIMIZED)\n");
-
-    // ================================================================
-    // CRITICAL: Open database in THIS thread (ingestion thread)
-    // ================================================================
-    printf("\nOK [INGESTION] Opening database in ingestion thread...\n");
+enum {
+    PSRAM_BATCH_COL_LOG_INDEX = 0,
+    PSRAM_BATCH_COL_MESSAGE,
+    PSRAM_BATCH_COL_CATEGORY_ID,
+    PSRAM_BATCH_COL_TOKEN,
+    PSRAM_BATCH_COL_LOCAL_LOG_INDEX,
+    PSRAM_BATCH_COL_TIMESTAMP_AT_STORE,
+    PSRAM_BATCH_COL_TIMESTAMP_AT_LOG,
+    PSRAM_BATCH_COL_SEVERITY,
+    PSRAM_BATCH_COL_BUF,      // HIDDEN
+    PSRAM_BATCH_COL_START,    // HIDDEN
+    PSRAM_BATCH_COL_COUNT     // HIDDEN
+};
+
+// idxNum bits: which hidden arguments were supplied
+#define PSRAM_BATCH_IDX_BUF    0x01
+#define PSRAM_BATCH_IDX_START  0x02
+#define PSRAM_BATCH_IDX_COUNT  0x04
+
+typedef struct {
+    sqlite3_vtab_cursor base;
+    const LOG_SPAN* span;
+    const DS_LOG_REC* rec;      // Current record
+    uint32_t off;               // Span offset just past 'rec'
+    uint32_t start;
+    uint32_t count;
+    uint32_t i;
+} psram_batch_cursor;
 
-    int rc = sqlite3_open(DB_NAME, &db);
-    if (rc != SQLITE_OK) {
-        printf("\nERROR [INGESTION] Failed to open DB: %s\n", sqlite3_errmsg(db));
-        printf("\nFATAL [INGESTION] Cannot proceed without database!\n");
-        return;
+//=======================================================================================
+// Next real record of a span at offset *off (pads skipped), nullptr past the end
+//=======================================================================================
+static inline const DS_LOG_REC* logSpanNext(const LOG_SPAN* span, uint32_t* off) {
+    while (*off < span->bytes) {
+        const DS_LOG_REC* rec = (const DS_LOG_REC*)(span->base + ((span->from + *off) % RING_CAPACITY_BYTES));
+        *off += rec->size;
+        if (!(rec->flags & LOG_REC_FLAG_PAD)) return rec;
     }
+    return nullptr;
+}
 
-    // Apply database configuration
-    tuneDbConfig();
-    printf("\nOK [INGESTION] Database configuration applied\n");
+static int psramBatchConnect(sqlite3* db, void*, int, const char* const*, sqlite3_vtab** ppVtab, char**) {
+    int rc = sqlite3_declare_vtab(db,
+        "CREATE TABLE x(log_index INTEGER, message TEXT, category_id INTEGER, token INTEGER, "
+        "local_log_index INTEGER, timestamp_at_store INTEGER, timestamp_at_log INTEGER, severity INTEGER, "
+        "buf HIDDEN, start HIDDEN, count HIDDEN)");
+    if (rc != SQLITE_OK) return rc;
 
-    // Prepare INSERT statement in THIS thread
-    const char *sql = "INSERT INTO ds_logs (log_index, message, category, token, local_log_index, timestamp_at_store, timestamp_at_log, severity) VALUES (?, ?, ?, ?, ?, ?, ?, ?);";
-    rc = sqlite3_prepare_v2(db, sql, -1, &insert_stmt, nullptr);
-    if (rc != SQLITE_OK) {
-        printf("\nERROR [INGESTION] Statement Prep Fail: %s\n", sqlite3_errmsg(db));
-        printf("\nFATAL [INGESTION] Cannot proceed without prepared statement!\n");
-        sqlite3_close_v2(db);
-        db = nullptr;
-        return;
-    }
-    printf("\nOK [INGESTION] Prepared statement configured\n");
+    sqlite3_vtab* vtab = (sqlite3_vtab*)sqlite3_malloc(sizeof(sqlite3_vtab));
+    if (vtab == nullptr) return SQLITE_NOMEM;
+    memset(vtab, 0, sizeof(sqlite3_vtab));
 
-    // Initialize stats timer
-    ing_last_time = tx_time_get();
+    *ppVtab = vtab;
+    return SQLITE_OK;
+}
 
-    // ================================================================
-    // Main Ingestion Loop
-    // ================================================================
-    while(1) {
-        // Wait for a file to be ready
-    	printf("\nOK [INGESTION] Waiting for a file to be ready\n");
-        tx_semaphore_get(&sem_raw_files, TX_WAIT_FOREVER);
+static int psramBatchDisconnect(sqlite3_vtab* vtab) {
+    sqlite3_free(vtab);
+    return SQLITE_OK;
+}
 
-        // ============================================================
-        // CHECK IF DATABASE NEEDS REOPENING (after recovery)
-        // ============================================================
-        if (db == nullptr) {
-            printf("\n--- STATS BLOCK ---------------------------------------------------------------------------");
-            printf("\n[INGESTION] Database handle is null - reopening after recovery...");
-            printf("\n--- STATS BLOCK ---------------------------------------------------------------------------\n");
+static int psramBatchBestIndex(sqlite3_vtab*, sqlite3_index_info* info) {
+    int arg_constraint[3] = { -1, -1, -1 };   // buf, start, count
 
-            rc = sqlite3_open(DB_NAME, &db);
-            if (rc != SQLITE_OK) {
-                printf("\nERROR [INGESTION] Failed to reopen DB: %s !!!\n", sqlite3_errmsg(db));
-                printf("\nINFO [INGESTION] Retrying in 1 second...\n");
-                tx_semaphore_put(&sem_raw_files);
-                tx_thread_sleep(1000);
-                continue;
-            }
+    for (int i = 0; i < info->nConstraint; i++) {
+        const struct sqlite3_index_info::sqlite3_index_constraint* c = &info->aConstraint[i];
+        if (c->iColumn < PSRAM_BATCH_COL_BUF) continue;
+        if (c->op != SQLITE_INDEX_CONSTRAINT_EQ) continue;
+        if (!c->usable) return SQLITE_CONSTRAINT;   // Table-valued function arguments must be usable
+        arg_constraint[c->iColumn - PSRAM_BATCH_COL_BUF] = i;
+    }
 
-            tuneDbConfig();
-            printf("\n[INGESTION] Database configuration reapplied\n");
+    if (arg_constraint[0] < 0) {
+        // No buffer pointer: plan is valid but returns nothing
+        info->estimatedCost = 2147483647.0;
+        info->estimatedRows = 0;
+        info->idxNum = 0;
+        return SQLITE_OK;
+    }
 
-            rc = sqlite3_prepare_v2(db, sql, -1, &insert_stmt, nullptr);
-            if (rc != SQLITE_OK) {
-                printf("\nERROR [INGESTION] Failed to recreate statement: %s !!!\n", sqlite3_errmsg(db));
-                sqlite3_close_v2(db);
-                db = nullptr;
-                tx_semaphore_put(&sem_raw_files);
-                tx_thread_sleep(1000);
-                continue;
-            }
+    int argv_index = 1;
+    info->idxNum = 0;
+    for (int a = 0; a < 3; a++) {
+        if (arg_constraint[a] < 0) continue;
+        info->aConstraintUsage[arg_constraint[a]].argvIndex = argv_index++;
+        info->aConstraintUsage[arg_constraint[a]].omit = 1;
+        info->idxNum |= (1 << a);
+    }
 
-            printf("\n--- STATS BLOCK ---------------------------------------------------------------------------");
-            printf("\n[INGESTION] Database reopened and ready!");
-            printf("\n--- STATS BLOCK ---------------------------------------------------------------------------\n");
-        }
+    info->estimatedCost = (double)INGEST_MIN_BATCH_LOGS;
+    info->estimatedRows = INGEST_MIN_BATCH_LOGS;
+    return SQLITE_OK;
+}
 
-        // ============================================================
-        // Process Next File
-        // ============================================================
-        snprintf(raw_filename, sizeof(raw_filename), "batch_%lu.raw", consume_idx % MAX_RAW_FILES);
+static int psramBatchOpen(sqlite3_vtab*, sqlite3_vtab_cursor** ppCursor) {
+    psram_batch_cursor* cur = (psram_batch_cursor*)sqlite3_malloc(sizeof(psram_batch_cursor));
+    if (cur == nullptr) return SQLITE_NOMEM;
+    memset(cur, 0, sizeof(psram_batch_cursor));
 
-        // Calculate queue status BEFORE processing
-        uint32_t files_in_queue = produce_idx - consume_idx;
+    *ppCursor = &cur->base;
+    return SQLITE_OK;
+}
 
-        printf("\nOK [INGESTION] Processing batch_%lu.raw (Queue: %lu waiting / %lu total processed)\n",
-               consume_idx, files_in_queue, consume_idx);
+static int psramBatchClose(sqlite3_vtab_cursor* cursor) {
+    sqlite3_free(cursor);
+    return SQLITE_OK;
+}
 
-        uint32_t start_time = tx_time_get();
+static int psramBatchFilter(sqlite3_vtab_cursor* cursor, int idxNum, const char*, int argc, sqlite3_value** argv) {
+    psram_batch_cursor* cur = (psram_batch_cursor*)cursor;
+    int a = 0;
 
-        // Track counts before processing
-        uint32_t logs_before = ing_total_logs;
-        uint32_t skipped_before = ing_total_skipped;
+    cur->span = nullptr;
+    cur->rec = nullptr;
+    cur->off = 0;
+    cur->start = 0;
+    cur->count = 0;
+    cur->i = 0;
 
-        if (this->ingestRawToSQLite(raw_filename, &state)) {
-            // ========================================================
-            // SUCCESS - Calculate actual counts
-            // ========================================================
-            uint32_t ingest_time = tx_time_get() - start_time;
+    if (idxNum & PSRAM_BATCH_IDX_BUF)   cur->span = (const LOG_SPAN*)sqlite3_value_pointer(argv[a++], PSRAM_BATCH_PTR_TYPE);
+    if (idxNum & PSRAM_BATCH_IDX_START) cur->start = (uint32_t)sqlite3_value_int64(argv[a++]);
 
-            uint32_t actual_ingested = ing_total_logs - logs_before;
-            uint32_t actual_skipped = ing_total_skipped - skipped_before;
+    if (cur->span == nullptr || cur->start >= cur->span->logs) return SQLITE_OK;
 
-            consume_idx++;
+    cur->count = cur->span->logs - cur->start;
+    if (idxNum & PSRAM_BATCH_IDX_COUNT) {
+        sqlite3_int64 n = sqlite3_value_int64(argv[a++]);
+        if (n < 0) n = 0;
+        if ((uint64_t)n < cur->count) cur->count = (uint32_t)n;
+    }
 
-            // Calculate queue status AFTER processing
-            uint32_t files_remaining = produce_idx - consume_idx;
+    for (uint32_t k = 0; k <= cur->start; k++) {
+        cur->rec = logSpanNext(cur->span, &cur->off);
+    }
+    if (cur->rec == nullptr) cur->count = 0;
 
-            printf("\n--- STATS BLOCK ---------------------------------------------------------------------------");
-            printf("\nOK [INGESTION] batch_%lu completed:", consume_idx - 1);
-            printf("\n  Time: %lu ms", ingest_time);
-            printf("\n  Rate: %lu logs/sec",
-                   ingest_time > 0 ? (actual_ingested * 1000 / ingest_time) : 0);
-            printf("\n  Ingested: %lu logs", actual_ingested);
-            printf("\n  Skipped: %lu logs", actual_skipped);
-            printf("\n  Queue: %lu files remaining / %lu total processed", files_remaining, consume_idx);
-            printf("\n--- STATS BLOCK ---------------------------------------------------------------------------\n");
+    (void)argc;
+    return SQLITE_OK;
+}
 
-            // Check if simulator was suspended due to queue full
-            if (produce_idx - consume_idx < MAX_RAW_FILES) {
-                UINT thread_state;
-                tx_thread_info_get(&simulator_thread, 0, &thread_state, 0, 0, 0, 0, 0, 0);
-                if (thread_state == TX_SUSPENDED) {
-                    tx_thread_resume(&simulator_thread);
-                    printf("\nOK [INGESTION] Queue space available (%lu/%lu). Simulator Resumed.\n",
-                           (produce_idx - consume_idx), MAX_RAW_FILES);
-                }
-            }
-        }
-        else {
-            // ========================================================
-            // FAILURE - Log error and skip file
-            // ========================================================
-            consume_idx++;
+static int psramBatchNext(sqlite3_vtab_cursor* cursor) {
+    psram_batch_cursor* cur = (psram_batch_cursor*)cursor;
+    cur->i++;
+    if (cur->i < cur->count) {
+        cur->rec = logSpanNext(cur->span, &cur->off);
+        if (cur->rec == nullptr) cur->count = cur->i;
+    }
+    return SQLITE_OK;
+}
 
-            uint32_t files_remaining = produce_idx - consume_idx;
+static int psramBatchEof(sqlite3_vtab_cursor* cursor) {
+    psram_batch_cursor* cur = (psram_batch_cursor*)cursor;
+    return cur->i >= cur->count;
+}
 
-            printf("\nERROR [INGESTION] Status: %d, batch_%lu.raw skipped (Queue: %lu remaining / %lu total processed)\n",
-                   state, consume_idx - 1, files_remaining, consume_idx);
+static int psramBatchColumn(sqlite3_vtab_cursor* cursor, sqlite3_context* ctx, int col) {
+    psram_batch_cursor* cur = (psram_batch_cursor*)cursor;
+    const DS_LOG_REC* log = cur->rec;
+
+    switch (col) {
+        case PSRAM_BATCH_COL_LOG_INDEX:          sqlite3_result_int64(ctx, log->log_index); break;
+        case PSRAM_BATCH_COL_MESSAGE:            sqlite3_result_text(ctx, log->data + log->cat_len, log->msg_len, SQLITE_STATIC); break;
+        case PSRAM_BATCH_COL_CATEGORY_ID:        sqlite3_result_int(ctx, log->cat_id); break;
+        case PSRAM_BATCH_COL_TOKEN:              sqlite3_result_int64(ctx, log->token); break;
+        case PSRAM_BATCH_COL_LOCAL_LOG_INDEX:    sqlite3_result_int64(ctx, log->local_log_index); break;
+        case PSRAM_BATCH_COL_TIMESTAMP_AT_STORE: sqlite3_result_int64(ctx, log->timestamp_at_store); break;
+        case PSRAM_BATCH_COL_TIMESTAMP_AT_LOG:   sqlite3_result_int64(ctx, log->timestamp_at_log); break;
+        case PSRAM_BATCH_COL_SEVERITY:           sqlite3_result_int64(ctx, log->severity); break;
+        case PSRAM_BATCH_COL_START:              sqlite3_result_int64(ctx, cur->start); break;
+        case PSRAM_BATCH_COL_COUNT:              sqlite3_result_int64(ctx, cur->count); break;
+        default:                                 sqlite3_result_null(ctx); break;
+    }
+    return SQLITE_OK;
+}
 
-            if (db == nullptr) {
-                printf("\n[INGESTION] Database closed due to recovery, will reopen next iteration\n");
-            }
+static int psramBatchRowid(sqlite3_vtab_cursor* cursor, sqlite3_int64* pRowid) {
+    psram_batch_cursor* cur = (psram_batch_cursor*)cursor;
+    *pRowid = cur->start + cur->i;
+    return SQLITE_OK;
+}
+
+static sqlite3_module psram_batch_module = {
+    0,                      // iVersion
+    nullptr,                // xCreate: NULL makes it eponymous-only
+    psramBatchConnect,      // xConnect
+    psramBatchBestIndex,    // xBestIndex
+    psramBatchDisconnect,   // xDisconnect
+    nullptr,                // xDestroy
+    psramBatchOpen,         // xOpen
+    psramBatchClose,        // xClose
+    psramBatchFilter,       // xFilter
+    psramBatchNext,         // xNext
+    psramBatchEof,          // xEof
+    psramBatchColumn,       // xColumn
+    psramBatchRowid,        // xRowid
+    nullptr,                // xUpdate: read-only
+    nullptr,                // xBegin
+    nullptr,                // xSync
+    nullptr,                // xCommit
+    nullptr,                // xRollback
+    nullptr,                // xFindFunction
+    nullptr,                // xRename
+    nullptr,                // xSavepoint
+    nullptr,                // xRelease
+    nullptr,                // xRollbackTo
+    nullptr,                // xShadowName
+    nullptr                 // xIntegrity
+};
+
+//=======================================================================================
+// Prepares the single-row INSERT, the psram_batch INSERT ... SELECT and the INSERT_BATCH_ROWS-row INSERT
+//=======================================================================================
+bool MPLIB_STORAGE::prepareInsertStatements() {
+    const char* schema = l0_on ? l0_run_names[l0_active] : "main";
+    char head[192];
+    char sql[256];
+    snprintf(head, sizeof(head), INSERT_SQL_HEAD, schema);
+    snprintf(sql, sizeof(sql), "%s(?, ?, ?, ?, ?, ?, ?, ?);", head);
+
+    int rc = sqlite3_prepare_v2(db, sql, -1, &insert_stmt, nullptr);
+    if (rc != SQLITE_OK) {
+        printf("\nERROR [INGEST] Prepare failed: %s\n", sqlite3_errmsg(db));
+        return false;
+    }
+
+    if (INSERT_PSRAM_VTAB) {
+        rc = sqlite3_create_module(db, "psram_batch", &psram_batch_module, nullptr);
+        if (rc == SQLITE_OK) {
+            char* vtab_sql = sqlite3_mprintf(
+                "INSERT INTO %s.ds_logs (log_index, message, category_id, token, local_log_index, timestamp_at_store, timestamp_at_log, severity) "
+                "SELECT log_index, message, category_id, token, local_log_index, timestamp_at_store, timestamp_at_log, severity "
+                "FROM psram_batch(?1, ?2, ?3);", schema);
+            rc = (vtab_sql != nullptr) ? sqlite3_prepare_v2(db, vtab_sql, -1, &vtab_stmt, nullptr) : SQLITE_NOMEM;
+            sqlite3_free(vtab_sql);
+        }
+        if (rc != SQLITE_OK) {
+            printf("\nWARN [INGEST] psram_batch unavailable: %s\n", sqlite3_errmsg(db));
+            vtab_stmt = nullptr;
+        }
+    }
+
+    if (INSERT_BATCH_ROWS <= 1) return true;
+
+    // "INSERT ... VALUES (?,?,?,?,?,?,?,?),(?,?,?,?,?,?,?,?),..."
+    sqlite3_str* batch_sql = sqlite3_str_new(db);
+    sqlite3_str_appendall(batch_sql, head);
+    for (int r = 0; r < INSERT_BATCH_ROWS; r++) {
+        sqlite3_str_appendall(batch_sql, (r == 0) ? "(?,?,?,?,?,?,?,?)" : ",(?,?,?,?,?,?,?,?)");
+    }
+    sqlite3_str_appendchar(batch_sql, 1, ';');
+
+    char* zSql = sqlite3_str_finish(batch_sql);
+    if (zSql == nullptr) {
+        printf("\nWARN [INGEST] Out of memory building batch INSERT, single-row path only\n");
+        return true;
+    }
+
+    rc = sqlite3_prepare_v2(db, zSql, -1, &batch_stmt, nullptr);
+    sqlite3_free(zSql);
+
+    if (rc != SQLITE_OK) {
+        printf("\nWARN [INGEST] Batch prepare failed: %s, single-row path only\n", sqlite3_errmsg(db));
+        batch_stmt = nullptr;
+    }
+
+    return true;
+}
+
+//=======================================================================================
+//
+//=======================================================================================
+void MPLIB_STORAGE::finalizeInsertStatements() {
+    if (vtab_stmt)   { sqlite3_finalize(vtab_stmt);   vtab_stmt = nullptr; }
+    if (batch_stmt)  { sqlite3_finalize(batch_stmt);  batch_stmt = nullptr; }
+    if (insert_stmt) { sqlite3_finalize(insert_stmt); insert_stmt = nullptr; }
+    finalizeCategoryStatements();
+    finalizeIndexStatements();
+}
+
+//=======================================================================================
+// Current right edge of ds_logs (rowid max is a single root-to-leaf descent)
+//=======================================================================================
+void MPLIB_STORAGE::loadMaxRowid() {
+    sqlite3_stmt* stmt = nullptr;
+
+    max_rowid = -1;
+    if (sqlite3_prepare_v2(db, "SELECT max(log_index) FROM ds_logs;", -1, &stmt, nullptr) != SQLITE_OK) return;
+
+    if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+        max_rowid = sqlite3_column_int64(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    main_rowid = max_rowid;
+
+    printf("\nOK [INGEST] Right edge of ds_logs: log_index %lld\n", max_rowid);
+}
+
+//=======================================================================================
+// CATEGORY DICTIONARY - name -> ds_categories.id, open addressing with linear probing
+//   Only the ingesting thread touches it. Entries added inside a transaction that rolls back
+//   are dropped by reloading from ds_categories (loadCategories), so the map never holds an
+//   id the database does not have.
+//=======================================================================================
+typedef struct {
+    uint16_t id;                // 0 = empty slot
+    uint8_t  len;
+    char     name[CAT_LENGTH];
+} CAT_DICT_ENTRY;
+
+static CAT_DICT_ENTRY cat_dict[CAT_DICT_SLOTS];
+static const CAT_DICT_ENTRY* cat_dict_last = nullptr;   // Consecutive records mostly share a category
+
+static inline uint32_t catDictHash(const char* name, uint32_t len) {
+    uint32_t h = 2166136261u;                   // FNV-1a
+    for (uint32_t i = 0; i < len; i++) {
+        h = (h ^ (uint8_t)name[i]) * 16777619u;
+    }
+    return h;
+}
+
+static inline bool catDictMatch(const CAT_DICT_ENTRY* e, const char* name, uint32_t len) {
+    return e->len == len && memcmp(e->name, name, len) == 0;
+}
+
+static CAT_DICT_ENTRY* catDictSlot(const char* name, uint32_t len) {
+    uint32_t i = catDictHash(name, len) & (CAT_DICT_SLOTS - 1);
+    while (cat_dict[i].id != 0 && !catDictMatch(&cat_dict[i], name, len)) {
+        i = (i + 1) & (CAT_DICT_SLOTS - 1);
+    }
+    return &cat_dict[i];                        // Match, or the empty slot where it belongs
+}
+
+static void catDictPut(const char* name, uint32_t len, uint16_t id) {
+    if (cat_dict_entries >= CAT_DICT_MAX_ENTRIES || len > CAT_LENGTH) return;
+
+    CAT_DICT_ENTRY* e = catDictSlot(name, len);
+    if (e->id == 0) cat_dict_entries++;
+    e->id = id;
+    e->len = (uint8_t)len;
+    memcpy(e->name, name, len);
+}
+
+//=======================================================================================
+//
+//=======================================================================================
+void MPLIB_STORAGE::finalizeCategoryStatements() {
+    if (cat_find_stmt)   { sqlite3_finalize(cat_find_stmt);   cat_find_stmt = nullptr; }
+    if (cat_insert_stmt) { sqlite3_finalize(cat_insert_stmt); cat_insert_stmt = nullptr; }
+}
+
+//=======================================================================================
+// Prepares the dictionary statements and refills the map with the committed categories
+//=======================================================================================
+bool MPLIB_STORAGE::loadCategories() {
+    sqlite3_stmt* stmt = nullptr;
+
+    memset(cat_dict, 0, sizeof(cat_dict));
+    cat_dict_entries = 0;
+    cat_dict_last = nullptr;
+
+    if (cat_find_stmt == nullptr &&
+        sqlite3_prepare_v2(db, "SELECT id FROM ds_categories WHERE name = ?;", -1, &cat_find_stmt, nullptr) != SQLITE_OK) {
+        printf("\nERROR [CATDICT] Prepare failed: %s\n", sqlite3_errmsg(db));
+        return false;
+    }
+    if (cat_insert_stmt == nullptr &&
+        sqlite3_prepare_v2(db, "INSERT INTO ds_categories (name) VALUES (?);", -1, &cat_insert_stmt, nullptr) != SQLITE_OK) {
+        printf("\nERROR [CATDICT] Prepare failed: %s\n", sqlite3_errmsg(db));
+        return false;
+    }
+
+    if (sqlite3_prepare_v2(db, "SELECT id, name FROM ds_categories;", -1, &stmt, nullptr) != SQLITE_OK) return false;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        catDictPut((const char*)sqlite3_column_text(stmt, 1), (uint32_t)sqlite3_column_bytes(stmt, 1),
+                   (uint16_t)sqlite3_column_int(stmt, 0));
+    }
+    sqlite3_finalize(stmt);
+
+    printf("\nOK [CATDICT] %lu categories loaded\n", cat_dict_entries);
+    return true;
+}
+
+//=======================================================================================
+// Category name -> id. Map hit in the common case; a miss looks the name up in
+// ds_categories and inserts it there when new (inside the caller's transaction).
+// Returns 0 when the name could not be resolved (the row then shows a NULL category).
+//=======================================================================================
+uint16_t MPLIB_STORAGE::categoryId(const char* name, uint32_t len) {
+    if (cat_dict_last != nullptr && catDictMatch(cat_dict_last, name, len)) {
+        cat_hits++;
+        return cat_dict_last->id;
+    }
+
+    const CAT_DICT_ENTRY* e = catDictSlot(name, len);
+    if (e->id != 0) {
+        cat_dict_last = e;
+        cat_hits++;
+        return e->id;
+    }
+
+    cat_misses++;
+    if (cat_find_stmt == nullptr || cat_insert_stmt == nullptr) return 0;
+
+    sqlite3_int64 id = 0;
+    sqlite3_bind_text(cat_find_stmt, 1, name, (int)len, SQLITE_STATIC);
+    if (sqlite3_step(cat_find_stmt) == SQLITE_ROW) id = sqlite3_column_int64(cat_find_stmt, 0);
+    sqlite3_reset(cat_find_stmt);
+
+    if (id == 0) {
+        sqlite3_bind_text(cat_insert_stmt, 1, name, (int)len, SQLITE_STATIC);
+        int rc = sqlite3_step(cat_insert_stmt);
+        sqlite3_reset(cat_insert_stmt);
+        if (rc != SQLITE_DONE) {
+            printf("\nERROR [CATDICT] Insert failed: %d (%s)\n", rc, sqlite3_errmsg(db));
+            return 0;
+        }
+        id = sqlite3_last_insert_rowid(db);
+    }
+
+    if (id <= 0 || id > 0xFFFF) return 0;
+
+    catDictPut(name, len, (uint16_t)id);
+    return (uint16_t)id;
+}
+
+//=======================================================================================
+// Stamps the dictionary id into every record header of a span before the insert paths
+// bind it (the span belongs to the ingestor until releaseSpan)
+//=======================================================================================
+bool MPLIB_STORAGE::resolveCategories(const LOG_SPAN* span) {
+    uint32_t off = 0;
+    bool ok = true;
+
+    for (const DS_LOG_REC* rec = logSpanNext(span, &off); rec != nullptr; rec = logSpanNext(span, &off)) {
+        uint16_t id = categoryId(rec->data, rec->cat_len);
+        if (id == 0) ok = false;
+        ((DS_LOG_REC*)rec)->cat_id = id;
+    }
+    return ok;
+}
+
+//=======================================================================================
+// DEFERRED INDEXES - secondary indexes built behind ingest from a persisted high-water mark
+//
+//   <name>            WITHOUT ROWID table (key..., log_index), PRIMARY KEY (key..., log_index)
+//   ds_index_state    name -> high_water: every ds_logs row with log_index <= high_water is indexed
+//   <view>            ds_logs columns; index seek for log_index <= high_water (key columns come from
+//                     the index so a WHERE on them is pushed into its PRIMARY KEY), rowid range scan
+//                     of ds_logs above it. Query with e.g. SELECT * FROM ds_logs_by_category WHERE category_id = ?
+//=======================================================================================
+
+// True when 'column' is one of the comma-separated key columns
+static bool indexHasKey(const DEFERRED_INDEX* ix, const char* column) {
+    size_t n = strlen(column);
+    for (const char* k = ix->keys; *k != '\0'; ) {
+        while (*k == ' ' || *k == ',') k++;
+        const char* end = k;
+        while (*end != '\0' && *end != ',') end++;
+        if ((size_t)(end - k) == n && memcmp(k, column, n) == 0) return true;
+        k = end;
+    }
+    return false;
+}
+
+// Persists a high-water mark in the current transaction
+static bool indexSetHighWater(uint32_t i, sqlite3_int64 high_water) {
+    sqlite3_bind_text(index_hw_stmt, 1, deferred_indexes[i].name, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(index_hw_stmt, 2, high_water);
+    int rc = sqlite3_step(index_hw_stmt);
+    sqlite3_reset(index_hw_stmt);
+    return rc == SQLITE_DONE;
+}
+
+// Batch entry order: key columns, then log_index
+static int indexEntryCompare(const void* a, const void* b) {
+    const INDEX_ENTRY* x = (const INDEX_ENTRY*)a;
+    const INDEX_ENTRY* y = (const INDEX_ENTRY*)b;
+    for (int k = 0; k < INDEX_MAX_KEYS; k++) {
+        if (x->key[k] != y->key[k]) return (x->key[k] < y->key[k]) ? -1 : 1;
+    }
+    return (x->log_index > y->log_index) - (x->log_index < y->log_index);
+}
+
+//=======================================================================================
+// Index tables, state rows and read views (called from createTable)
+//=======================================================================================
+bool MPLIB_STORAGE::createDeferredIndexes() {
+    char *zErrMsg = 0;
+    int status = sqlite3_exec(db,
+        "CREATE TABLE IF NOT EXISTS ds_index_state ("
+        "name TEXT PRIMARY KEY, "
+        "high_water INTEGER NOT NULL"
+        ") WITHOUT ROWID;", NULL, NULL, &zErrMsg);
+
+    for (uint32_t i = 0; status == SQLITE_OK && i < DEFERRED_INDEX_COUNT; i++) {
+        const DEFERRED_INDEX* ix = &deferred_indexes[i];
+
+        sqlite3_str* sql = sqlite3_str_new(db);
+        sqlite3_str_appendf(sql,
+            "CREATE TABLE IF NOT EXISTS %s (%s, log_index INTEGER, PRIMARY KEY (%s, log_index)) WITHOUT ROWID;"
+            "INSERT OR IGNORE INTO ds_index_state (name, high_water) VALUES ('%s', -1);"
+            "CREATE VIEW IF NOT EXISTS %s AS SELECT ",
+            ix->name, ix->key_decl, ix->keys, ix->name, ix->view);
+        for (int c = 0; c < INSERT_COLUMNS; c++) {
+            sqlite3_str_appendf(sql, "%s%s.%s", (c == 0) ? "" : ", ",
+                                indexHasKey(ix, ds_logs_columns[c]) ? "x" : "l", ds_logs_columns[c]);
+        }
+        sqlite3_str_appendf(sql,
+            " FROM %s x JOIN ds_logs l ON l.log_index = x.log_index"
+            " WHERE x.log_index <= (SELECT high_water FROM ds_index_state WHERE name = '%s')"
+            " UNION ALL SELECT * FROM ds_logs"
+            " WHERE log_index > (SELECT high_water FROM ds_index_state WHERE name = '%s');",
+            ix->name, ix->name, ix->name);
+
+        char* zSql = sqlite3_str_finish(sql);
+        if (zSql == nullptr) return false;
+        status = sqlite3_exec(db, zSql, NULL, NULL, &zErrMsg);
+        sqlite3_free(zSql);
+    }
+
+    if (status != SQLITE_OK) {
+        printf("\nERROR TO CREATE DEFERRED INDEXES: %d, message: %s !!!\n", status, zErrMsg);
+        sqlite3_free(zErrMsg);
+        return false;
+    }
+    return true;
+}
+
+//=======================================================================================
+//
+//=======================================================================================
+void MPLIB_STORAGE::finalizeIndexStatements() {
+    for (uint32_t i = 0; i < DEFERRED_INDEX_COUNT; i++) {
+        if (index_state[i].fill_stmt)  { sqlite3_finalize(index_state[i].fill_stmt);  index_state[i].fill_stmt = nullptr; }
+        if (index_state[i].entry_stmt) { sqlite3_finalize(index_state[i].entry_stmt); index_state[i].entry_stmt = nullptr; }
+    }
+    if (index_hw_stmt) { sqlite3_finalize(index_hw_stmt); index_hw_stmt = nullptr; }
+}
+
+//=======================================================================================
+// Prepares the slice statements and reads back the persisted high-water marks
+//=======================================================================================
+bool MPLIB_STORAGE::loadIndexState() {
+    sqlite3_stmt* stmt = nullptr;
+    int rc;
+
+    if (!INDEX_BUILD_DEFERRED) return true;
+
+    finalizeIndexStatements();
+
+    rc = sqlite3_prepare_v2(db, "UPDATE ds_index_state SET high_water = ?2 WHERE name = ?1;", -1, &index_hw_stmt, nullptr);
+    if (rc == SQLITE_OK) rc = sqlite3_prepare_v2(db, "SELECT high_water FROM ds_index_state WHERE name = ?;", -1, &stmt, nullptr);
+
+    for (uint32_t i = 0; rc == SQLITE_OK && i < DEFERRED_INDEX_COUNT; i++) {
+        const DEFERRED_INDEX* ix = &deferred_indexes[i];
+
+        index_state[i].high_water = -1;
+        sqlite3_bind_text(stmt, 1, ix->name, -1, SQLITE_STATIC);
+        if (sqlite3_step(stmt) == SQLITE_ROW) index_state[i].high_water = sqlite3_column_int64(stmt, 0);
+        sqlite3_reset(stmt);
+
+        char* zSql = sqlite3_mprintf(
+            "INSERT OR IGNORE INTO %s (%s, log_index) SELECT %s, log_index FROM ds_logs "
+            "WHERE log_index > ?1 AND log_index <= ?2;", ix->name, ix->keys, ix->keys);
+        if (zSql == nullptr) { rc = SQLITE_NOMEM; break; }
+        rc = sqlite3_prepare_v2(db, zSql, -1, &index_state[i].fill_stmt, nullptr);
+        sqlite3_free(zSql);
+
+        if (rc != SQLITE_OK || !INDEX_MAINTAIN_SORTED) continue;
+        zSql = sqlite3_mprintf("INSERT OR IGNORE INTO %s (%s, log_index) VALUES (%s?);",
+                               ix->name, ix->keys, (ix->nkeys == 2) ? "?, ?, " : "?, ");
+        if (zSql == nullptr) { rc = SQLITE_NOMEM; break; }
+        rc = sqlite3_prepare_v2(db, zSql, -1, &index_state[i].entry_stmt, nullptr);
+        sqlite3_free(zSql);
+    }
+    sqlite3_finalize(stmt);
+
+    if (rc != SQLITE_OK) {
+        printf("\nERROR [INDEX] Prepare failed: %s\n", sqlite3_errmsg(db));
+        finalizeIndexStatements();
+        return false;
+    }
+    return true;
+}
+
+//=======================================================================================
+// One bounded catch-up step: the index furthest behind the ds_logs edge gets up to
+// INDEX_BUILD_SLICE_ROWS more rows, in its own transaction. False when all are current.
+//=======================================================================================
+bool MPLIB_STORAGE::buildIndexSlice() {
+    DEFERRED_INDEX_STATE* st = nullptr;
+
+    if (!INDEX_BUILD_DEFERRED || db == nullptr || index_hw_stmt == nullptr) return false;
+
+    // Only rows already in main.ds_logs can be indexed (L0 rows arrive through mergeL0Slice)
+    sqlite3_int64 edge = l0_on ? main_rowid : max_rowid;
+
+    for (uint32_t i = 0; i < DEFERRED_INDEX_COUNT; i++) {
+        if (index_state[i].fill_stmt == nullptr || index_state[i].high_water >= edge) continue;
+        if (st == nullptr || index_state[i].high_water < st->high_water) st = &index_state[i];
+    }
+    if (st == nullptr) return false;
+
+    // log_index is unique, so a key range of SLICE_ROWS holds at most SLICE_ROWS rows
+    sqlite3_int64 from = st->high_water;
+    sqlite3_int64 to = from + INDEX_BUILD_SLICE_ROWS;
+    if (to > edge) to = edge;
+
+    if (sqlite3_exec(db, "BEGIN TRANSACTION;", NULL, NULL, NULL) != SQLITE_OK) return false;
+
+    sqlite3_bind_int64(st->fill_stmt, 1, from);
+    sqlite3_bind_int64(st->fill_stmt, 2, to);
+    int rc = sqlite3_step(st->fill_stmt);
+    sqlite3_reset(st->fill_stmt);
+    uint32_t rows = (uint32_t)sqlite3_changes(db);
+
+    if (rc == SQLITE_DONE && !indexSetHighWater(st - index_state, to)) rc = SQLITE_ERROR;
+
+    if (rc != SQLITE_DONE || sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK) {
+        printf("\nERROR [INDEX] Slice of %s failed: %s\n", deferred_indexes[st - index_state].name, sqlite3_errmsg(db));
+        sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+        return false;
+    }
+
+    st->high_water = to;
+    index_slices++;
+    index_rows += rows;
+    return true;
+}
+
+//=======================================================================================
+// Index work of one ingest transaction, before its COMMIT
+//   Current index (mark at the right edge), INDEX_MAINTAIN_SORTED: the batch's entries are
+//   extracted into PSRAM, sorted by key and inserted in key order, so every index leaf is
+//   visited once per batch instead of once per row; the mark moves to the new right edge.
+//   Otherwise, keys at or below the mark (non-monotonic buffer) move the mark back so readers
+//   never lose those rows and the builder covers them again (INSERT OR IGNORE skips the rest).
+// In-memory marks may run ahead of a rolled-back transaction: reload with loadIndexState().
+// With the L0 tier the batch lands in a PSRAM run, not ds_logs, and the same work is done when
+// the run is merged (mergeIndexEntries()), so ingest commits still write nothing to the segment.
+//=======================================================================================
+bool MPLIB_STORAGE::maintainIndexes(const LOG_SPAN* span, bool append_ok, sqlite3_int64 max_key) {
+    sqlite3_int64 min_key = max_key;
+    uint32_t off = 0;
+
+    if (!INDEX_BUILD_DEFERRED || index_hw_stmt == nullptr || l0_on) return true;
+
+    if (!append_ok) {
+        for (const DS_LOG_REC* rec = logSpanNext(span, &off); rec != nullptr; rec = logSpanNext(span, &off)) {
+            if ((sqlite3_int64)rec->log_index < min_key) min_key = rec->log_index;
+        }
+    }
+
+    for (uint32_t i = 0; i < DEFERRED_INDEX_COUNT; i++) {
+        const DEFERRED_INDEX* ix = &deferred_indexes[i];
+        DEFERRED_INDEX_STATE* st = &index_state[i];
+
+        if (st->entry_stmt == nullptr || st->high_water < max_rowid) {
+            if (st->high_water >= min_key && indexSetHighWater(i, min_key - 1)) st->high_water = min_key - 1;
+            continue;
+        }
+
+        uint32_t n = 0;
+        off = 0;
+        for (const DS_LOG_REC* rec = logSpanNext(span, &off); rec != nullptr && n < RING_DRAIN_MAX_LOGS; rec = logSpanNext(span, &off)) {
+            ix->extract(rec, &index_sort_buf[n]);
+            index_sort_buf[n].log_index = rec->log_index;
+            n++;
+        }
+        qsort(index_sort_buf, n, sizeof(INDEX_ENTRY), indexEntryCompare);
+
+        for (uint32_t e = 0; e < n; e++) {
+            for (uint32_t k = 0; k < ix->nkeys; k++) {
+                sqlite3_bind_int64(st->entry_stmt, 1 + k, index_sort_buf[e].key[k]);
+            }
+            sqlite3_bind_int64(st->entry_stmt, 1 + ix->nkeys, index_sort_buf[e].log_index);
+
+            int rc = sqlite3_step(st->entry_stmt);
+            sqlite3_reset(st->entry_stmt);
+            if (rc != SQLITE_DONE) {
+                printf("\nERROR [INDEX] %s entry failed: %d (%s)\n", ix->name, rc, sqlite3_errmsg(db));
+                return false;
+            }
+        }
+
+        if (max_key > st->high_water) {
+            if (!indexSetHighWater(i, max_key)) return false;
+            st->high_water = max_key;
+        }
+        index_live_rows += n;
+    }
+    return true;
+}
+
+//=======================================================================================
+//
+//=======================================================================================
+void MPLIB_STORAGE::ingestor(ULONG thread_input) {
+    char raw_filename[32];
+    UINT state;
+
+    printf("\nOK [INGESTION] SQLite Ingestor Thread Online (OPTIMIZED)\n");
+
+    // ================================================================
+    // CRITICAL: Open database in THIS thread (ingestion thread)
+    // ================================================================
+    printf("\nOK [INGESTION] Opening database in ingestion thread...\n");
+
+    int rc = sqlite3_open(db_name, &db);
+    if (rc != SQLITE_OK) {
+        printf("\nERROR [INGESTION] Failed to open DB: %s\n", sqlite3_errmsg(db));
+        printf("\nFATAL [INGESTION] Cannot proceed without database!\n");
+        return;
+    }
+
+    // Apply database configuration
+    tuneDbConfig();
+    printf("\nOK [INGESTION] Database configuration applied\n");
+
+    // Prepare INSERT statement in THIS thread
+    const char *sql = "INSERT INTO ds_logs (log_index, message, category_id, token, local_log_index, timestamp_at_store, timestamp_at_log, severity) VALUES (?, ?, ?, ?, ?, ?, ?, ?);";
+    rc = sqlite3_prepare_v2(db, sql, -1, &insert_stmt, nullptr);
+    if (rc != SQLITE_OK) {
+        printf("\nERROR [INGESTION] Statement Prep Fail: %s\n", sqlite3_errmsg(db));
+        printf("\nFATAL [INGESTION] Cannot proceed without prepared statement!\n");
+        sqlite3_close_v2(db);
+        db = nullptr;
+        return;
+    }
+    printf("\nOK [INGESTION] Prepared statement configured\n");
+
+    if (!loadCategories()) {
+        printf("\nFATAL [INGESTION] Cannot proceed without category dictionary!\n");
+        finalizeInsertStatements();
+        sqlite3_close_v2(db);
+        db = nullptr;
+        return;
+    }
+
+    // Initialize stats timer
+    ing_last_time = tx_time_get();
+
+    // ================================================================
+    // Main Ingestion Loop
+    // ================================================================
+    while(1) {
+        // Wait for a file to be ready
+    	printf("\nOK [INGESTION] Waiting for a file to be ready\n");
+        tx_semaphore_get(&sem_raw_files, TX_WAIT_FOREVER);
+
+        // ============================================================
+        // CHECK IF DATABASE NEEDS REOPENING (after recovery)
+        // ============================================================
+        if (db == nullptr) {
+            printf("\n--- STATS BLOCK ---------------------------------------------------------------------------");
+            printf("\n[INGESTION] Database handle is null - reopening after recovery...");
+            printf("\n--- STATS BLOCK ---------------------------------------------------------------------------\n");
+
+            rc = sqlite3_open(db_name, &db);
+            if (rc != SQLITE_OK) {
+                printf("\nERROR [INGESTION] Failed to reopen DB: %s !!!\n", sqlite3_errmsg(db));
+                printf("\nINFO [INGESTION] Retrying in 1 second...\n");
+                tx_semaphore_put(&sem_raw_files);
+                tx_thread_sleep(1000);
+                continue;
+            }
+
+            tuneDbConfig();
+            printf("\n[INGESTION] Database configuration reapplied\n");
+
+            rc = sqlite3_prepare_v2(db, sql, -1, &insert_stmt, nullptr);
+            if (rc != SQLITE_OK || !loadCategories()) {
+                printf("\nERROR [INGESTION] Failed to recreate statement: %s !!!\n", sqlite3_errmsg(db));
+                finalizeInsertStatements();
+                sqlite3_close_v2(db);
+                db = nullptr;
+                tx_semaphore_put(&sem_raw_files);
+                tx_thread_sleep(1000);
+                continue;
+            }
+
+            printf("\n--- STATS BLOCK ---------------------------------------------------------------------------");
+            printf("\n[INGESTION] Database reopened and ready!");
+            printf("\n--- STATS BLOCK ---------------------------------------------------------------------------\n");
+        }
+
+        // ============================================================
+        // Process Next File
+        // ============================================================
+        snprintf(raw_filename, sizeof(raw_filename), "batch_%lu.raw", consume_idx % MAX_RAW_FILES);
+
+        // Calculate queue status BEFORE processing
+        uint32_t files_in_queue = produce_idx - consume_idx;
+
+        printf("\nOK [INGESTION] Processing batch_%lu.raw (Queue: %lu waiting / %lu total processed)\n",
+               consume_idx, files_in_queue, consume_idx);
+
+        uint32_t start_time = tx_time_get();
+
+        // Track counts before processing
+        uint32_t logs_before = ing_total_logs;
+        uint32_t skipped_before = ing_total_skipped;
+
+        if (this->ingestRawToSQLite(raw_filename, &state)) {
+            // ========================================================
+            // SUCCESS - Calculate actual counts
+            // ========================================================
+            uint32_t ingest_time = tx_time_get() - start_time;
+
+            uint32_t actual_ingested = ing_total_logs - logs_before;
+            uint32_t actual_skipped = ing_total_skipped - skipped_before;
+
+            consume_idx++;
+
+            // Calculate queue status AFTER processing
+            uint32_t files_remaining = produce_idx - consume_idx;
+
+            printf("\n--- STATS BLOCK ---------------------------------------------------------------------------");
+            printf("\nOK [INGESTION] batch_%lu completed:", consume_idx - 1);
+            printf("\n  Time: %lu ms", ingest_time);
+            printf("\n  Rate: %lu logs/sec",
+                   ingest_time > 0 ? (actual_ingested * 1000 / ingest_time) : 0);
+            printf("\n  Ingested: %lu logs", actual_ingested);
+            printf("\n  Skipped: %lu logs", actual_skipped);
+            printf("\n  Queue: %lu files remaining / %lu total processed", files_remaining, consume_idx);
+            printf("\n--- STATS BLOCK ---------------------------------------------------------------------------\n");
+
+            // Check if simulator was suspended due to queue full
+            if (produce_idx - consume_idx < MAX_RAW_FILES) {
+                UINT thread_state;
+                tx_thread_info_get(&simulator_thread, 0, &thread_state, 0, 0, 0, 0, 0, 0);
+                if (thread_state == TX_SUSPENDED) {
+                    tx_thread_resume(&simulator_thread);
+                    printf("\nOK [INGESTION] Queue space available (%lu/%lu). Simulator Resumed.\n",
+                           (produce_idx - consume_idx), MAX_RAW_FILES);
+                }
+            }
+        }
+        else {
+            // ========================================================
+            // FAILURE - Log error and skip file
+            // ========================================================
+            consume_idx++;
+
+            uint32_t files_remaining = produce_idx - consume_idx;
+
+            printf("\nERROR [INGESTION] Status: %d, batch_%lu.raw skipped (Queue: %lu remaining / %lu total processed)\n",
+                   state, consume_idx - 1, files_remaining, consume_idx);
+
+            if (db == nullptr) {
+                printf("\n[INGESTION] Database closed due to recovery, will reopen next iteration\n");
+            }
 
             tx_thread_sleep(100);
         }
@@ -686,66 +1907,312 @@ void MPLIB_STORAGE::ingestor(ULONG thread_input) {
     }
 }
 
+//=======================================================================================
+//
+//=======================================================================================
+
+// Binds one log to the INSERT_COLUMNS parameters starting at 'first' (1-based)
+static inline void bindLogAt(sqlite3_stmt* stmt, int first, const DS_LOG_STRUCT& log, uint16_t cat_id) {
+    sqlite3_bind_int(stmt, first + 0, log.log_index);
+
+    // Real string lengths (bounded by the field size) and SQLITE_STATIC: no NUL padding stored, no copies
+    sqlite3_bind_text(stmt, first + 1, log.message, (int)strnlen(log.message, LOG_LENGTH), SQLITE_STATIC);
+    sqlite3_bind_int(stmt, first + 2, cat_id);
+
+    sqlite3_bind_int(stmt, first + 3, log.token);
+    sqlite3_bind_int(stmt, first + 4, log.local_log_index);
+    sqlite3_bind_int(stmt, first + 5, log.timestamp_at_store);
+    sqlite3_bind_int(stmt, first + 6, log.timestamp_at_log);
+    sqlite3_bind_int(stmt, first + 7, log.severity);
+}
+
+// Same for a compact staging record: lengths and the resolved category id come from the header
+static inline void bindRecAt(sqlite3_stmt* stmt, int first, const DS_LOG_REC* rec) {
+    sqlite3_bind_int(stmt, first + 0, rec->log_index);
+
+    sqlite3_bind_text(stmt, first + 1, rec->data + rec->cat_len, rec->msg_len, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, first + 2, rec->cat_id);
+
+    sqlite3_bind_int(stmt, first + 3, rec->token);
+    sqlite3_bind_int(stmt, first + 4, rec->local_log_index);
+    sqlite3_bind_int(stmt, first + 5, rec->timestamp_at_store);
+    sqlite3_bind_int(stmt, first + 6, rec->timestamp_at_log);
+    sqlite3_bind_int(stmt, first + 7, rec->severity);
+}
+
 //=======================================================================================
 //
 //=======================================================================================
 UINT MPLIB_STORAGE::bindAndStep(const DS_LOG_STRUCT& log) {
     if (insert_stmt == nullptr) return SQLITE_ERROR;
 
-    sqlite3_bind_int(insert_stmt, 1, log.log_index);
+    bindLogAt(insert_stmt, 1, log, categoryId(log.category, strnlen(log.category, CAT_LENGTH)));
+
+    int status = sqlite3_step(insert_stmt);
+
+    sqlite3_reset(insert_stmt);
+//    sqlite3_clear_bindings(insert_stmt);
+
+    return status;
+}
 
-    // Use fixed lengths and SQLITE_STATIC to skip strlen() and internal copies
-    sqlite3_bind_text(insert_stmt, 2, log.message, LOG_LENGTH, SQLITE_STATIC);
-    sqlite3_bind_text(insert_stmt, 3, log.category, CAT_LENGTH, SQLITE_STATIC);
+//=======================================================================================
+//
+//=======================================================================================
+UINT MPLIB_STORAGE::bindAndStepRec(const DS_LOG_REC* rec) {
+    if (insert_stmt == nullptr) return SQLITE_ERROR;
 
-    sqlite3_bind_int(insert_stmt, 4, log.token);
-    sqlite3_bind_int(insert_stmt, 5, log.local_log_index);
-    sqlite3_bind_int(insert_stmt, 6, log.timestamp_at_store);
-    sqlite3_bind_int(insert_stmt, 7, log.timestamp_at_log);
-    sqlite3_bind_int(insert_stmt, 8, log.severity);
+    bindRecAt(insert_stmt, 1, rec);
 
     int status = sqlite3_step(insert_stmt);
 
     sqlite3_reset(insert_stmt);
-//    sqlite3_clear_bindings(insert_stmt);
 
     return status;
 }
 
+//=======================================================================================
+// Multi-row insert: INSERT_BATCH_ROWS logs in a single VDBE run (one step + one reset)
+//=======================================================================================
+UINT MPLIB_STORAGE::bindAndStepBatch(const DS_LOG_REC* const* recs) {
+    if (batch_stmt == nullptr) return SQLITE_ERROR;
+
+    for (int r = 0; r < INSERT_BATCH_ROWS; r++) {
+        bindRecAt(batch_stmt, 1 + r * INSERT_COLUMNS, recs[r]);
+    }
+
+    int status = sqlite3_step(batch_stmt);
+
+    sqlite3_reset(batch_stmt);
+
+    return status;
+}
+
+//=======================================================================================
+// True when every key is strictly increasing and above the committed right edge, which lets
+// maintainIndexes() skip its own scan for the lowest key.
+// Also returns the highest key of the span so max_rowid can follow the inserts.
+//=======================================================================================
+bool MPLIB_STORAGE::isAppendOnly(const LOG_SPAN* span, sqlite3_int64 edge, sqlite3_int64* max_key) {
+    bool append_ok = true;
+    sqlite3_int64 prev = edge;
+    sqlite3_int64 highest = edge;
+    uint32_t off = 0;
+
+    for (const DS_LOG_REC* rec = logSpanNext(span, &off); rec != nullptr; rec = logSpanNext(span, &off)) {
+        sqlite3_int64 key = rec->log_index;
+        if (key <= prev) append_ok = false;
+        if (key > highest) highest = key;
+        prev = key;
+    }
+
+    *max_key = highest;
+    return append_ok;
+}
+
+//=======================================================================================
+// Picks the fastest prepared insert path (bench baseline buffers always use single-row)
+//=======================================================================================
+INSERT_PATH MPLIB_STORAGE::selectInsertPath(bool baseline) {
+    if (baseline)                return INSERT_PATH_SINGLE;
+    if (vtab_stmt != nullptr)    return INSERT_PATH_VTAB;
+    if (batch_stmt != nullptr)   return INSERT_PATH_BATCH;
+    return INSERT_PATH_SINGLE;
+}
+
+//=======================================================================================
+// Inserts the records of a span through the selected path
+//   VTAB: one statement, psram_batch() walks the span in place
+//   BATCH: full groups through batch_stmt, the tail group row by row
+//=======================================================================================
+UINT MPLIB_STORAGE::insertBuffer(const LOG_SPAN* span, INSERT_PATH path) {
+    uint32_t i = 0;
+    uint32_t off = 0;
+
+    if (path == INSERT_PATH_VTAB && vtab_stmt != nullptr) {
+        sqlite3_bind_pointer(vtab_stmt, 1, (void*)span, PSRAM_BATCH_PTR_TYPE, nullptr);
+        sqlite3_bind_int(vtab_stmt, 2, 0);
+        sqlite3_bind_int(vtab_stmt, 3, span->logs);
+
+        int step_rc = sqlite3_step(vtab_stmt);
+        sqlite3_reset(vtab_stmt);
+
+        if (step_rc != SQLITE_DONE) {
+            printf("\nERROR [INGEST] psram_batch insert failed: %d (%s)\n", step_rc, sqlite3_errmsg(db));
+        }
+        return step_rc;
+    }
+
+    if (path == INSERT_PATH_BATCH && batch_stmt != nullptr) {
+        const DS_LOG_REC* group[INSERT_BATCH_ROWS];
+
+        for (; i + INSERT_BATCH_ROWS <= span->logs; i += INSERT_BATCH_ROWS) {
+            for (int r = 0; r < INSERT_BATCH_ROWS; r++) {
+                group[r] = logSpanNext(span, &off);
+            }
+
+            int step_rc = this->bindAndStepBatch(group);
+            if (step_rc != SQLITE_DONE) {
+                printf("\nERROR [INGEST] Batch insert at %lu failed: %d (%s)\n",
+                       i, step_rc, sqlite3_errmsg(db));
+                return step_rc;
+            }
+        }
+    }
+
+    // Tail group (count not a multiple of INSERT_BATCH_ROWS) or single-row mode
+    for (const DS_LOG_REC* rec = logSpanNext(span, &off); rec != nullptr; rec = logSpanNext(span, &off), i++) {
+        int step_rc = this->bindAndStepRec(rec);
+        if (step_rc != SQLITE_DONE) {
+            printf("\nERROR [INGEST] Insert %lu failed: %d (%s)\n",
+                   i, step_rc, sqlite3_errmsg(db));
+            return step_rc;
+        }
+    }
+
+    return SQLITE_DONE;
+}
+
 //=======================================================================================
 //
 //=======================================================================================
 void MPLIB_STORAGE::captureLog(DS_LOG_STRUCT& log) {
-    if (current_index >= LOGS_PER_BUFFER) {
-        ULONG ready_flag = (active_fill_buffer == psram_buffer_A) ? FLAG_BUF_A_READY : FLAG_BUF_B_READY;
-        ULONG next_free  = (ready_flag == FLAG_BUF_A_READY) ? FLAG_BUF_B_FREE : FLAG_BUF_A_FREE;
+    // Fixed-size producers: only the used part of each text field reaches the ring
+    log.log_index = captureRecord(log.token, log.timestamp_at_log, log.severity,
+                                  log.category, strnlen(log.category, CAT_LENGTH),
+                                  log.message, strnlen(log.message, LOG_LENGTH));
+}
 
-        // 1. SYNC: Finalize PSRAM writes before signaling
-        __DSB();
+//=======================================================================================
+// RING - producer side: reserve, fill and commit one compact record, returns its log_index
+//=======================================================================================
+uint32_t MPLIB_STORAGE::captureRecord(uint32_t token, uint32_t timestamp_at_log, uint32_t severity,
+                                      const char* category, uint32_t cat_len, const char* message, uint32_t msg_len) {
+    if (cat_len > CAT_LENGTH) cat_len = CAT_LENGTH;
+    if (msg_len > LOG_LENGTH) msg_len = LOG_LENGTH;
+
+    uint32_t size = ringRecordSize(cat_len, msg_len);
+    uint32_t pos;
+
+    do {
+        // 1. RESERVE: atomic fetch-add on the byte position, no mutex (LDREX/STREX)
+        pos = ringFetchAdd(&ring_reserve, size);
+
+        // 2. BACKPRESSURE: the bytes must have been released by the ingestor (one lap ago).
+        //    Several producers can wait here: TX_OR_CLEAR hands the space token to one of them,
+        //    the 1-tick timeout lets the others re-check instead of missing the wakeup.
+        while (!ringHasSpace(&ring_tail, pos, size, RING_CAPACITY_BYTES)) {
+            ULONG actual_f;
+            tx_event_flags_get(&staging_events, FLAG_RING_SPACE, TX_OR_CLEAR, &actual_f, 1);
+        }
 
-        // 2. SIGNAL: Tell ingestor this buffer is full
-        tx_event_flags_set(&staging_events, ready_flag, TX_OR);
+        // A reservation straddling the ring end is committed as two pads, then we reserve again
+    } while (!ringPlace(ring, ring_commit, RING_CAPACITY_BYTES, pos, size));
+
+    // The key comes from one counter for all producers, taken once the space is ours: unique, so a
+    // drain never fails on a duplicate INTEGER PRIMARY KEY (keys of concurrent producers may reach
+    // the ring slightly out of order, which the insert paths and maintainIndexes() handle)
+    uint32_t log_index = ringFetchAdd(&ring_log_index, 1);
+
+    // 3. WRITE: the bytes are exclusively ours until the commit word is set
+    //    timestamp_at_store = capture time in latency clock ticks (DWT), used for the ingest deadline and latency stats
+    uint32_t offset = pos % RING_CAPACITY_BYTES;
+    volatile DS_LOG_REC* rec = (volatile DS_LOG_REC*)&ring[offset];
+
+    rec->size = (uint16_t)size;
+    rec->flags = 0;
+    rec->cat_len = (uint8_t)cat_len;
+    rec->msg_len = (uint16_t)msg_len;
+    rec->cat_id = 0;
+    rec->log_index = log_index;
+    rec->token = token;
+    rec->local_log_index = offset / LOG_REC_ALIGN;
+    rec->timestamp_at_store = latencyClock();
+    rec->timestamp_at_log = timestamp_at_log;
+    rec->severity = severity;
+    memcpy((void*)rec->data, category, cat_len);
+    memcpy((void*)(rec->data + cat_len), message, msg_len);
+
+    // 4. COMMIT: record writes must be visible before the commit word
+    ringCommit(ring_commit, RING_CAPACITY_BYTES, pos);
+
+    // Crossing a segment boundary wakes the ingestor (earlier records may still be in flight,
+    // the ingestor only takes the committed prefix)
+    if ((pos / RING_SEGMENT_BYTES) != ((pos + size) / RING_SEGMENT_BYTES)) {
+        tx_event_flags_set(&staging_events, FLAG_RING_DATA, TX_OR);
+    }
+    return log_index;
+}
 
-        // 3. BACKPRESSURE: Block until the OTHER buffer is free
-        //    The ingestor sets the FREE flag after COMMIT + flag clear.
-        //    TX_AND_CLEAR consumes the free token so it's one-shot.
-        ULONG actual_f;
-        UINT status = tx_event_flags_get(&staging_events, next_free,
-                                         TX_AND_CLEAR, &actual_f, TX_WAIT_FOREVER);
+//=======================================================================================
+// RING - consumer side: committed prefix starting at ring_tail, up to max_logs real records
+//=======================================================================================
+uint32_t MPLIB_STORAGE::drainableRecords(uint32_t max_logs, LOG_SPAN* span) {
+    uint32_t from = ring_tail;
+    uint32_t avail = ringLoadAcquire(&ring_reserve) - from;
+
+    // Stop at the first record whose producer has not committed yet
+    span->base = (const uint8_t*)ring;
+    span->from = from;
+    span->logs = ringDrainable(ring, ring_commit, RING_CAPACITY_BYTES, from, avail, max_logs, &span->bytes);
+    return span->logs;
+}
 
-        if (status != TX_SUCCESS) {
-            // Should never happen with TX_WAIT_FOREVER, but guard anyway
-            printf("\nERROR [SIMULATOR] Backpressure wait failed (%u)\n", status);
-        }
+//=======================================================================================
+// RING - drops stale cache lines over a span (two ranges when it wraps the ring)
+//=======================================================================================
+void MPLIB_STORAGE::invalidateSpan(const LOG_SPAN* span) {
+    uint32_t offset = span->from % RING_CAPACITY_BYTES;
+    uint32_t first = RING_CAPACITY_BYTES - offset;
 
-        // 4. SWAP: Switch to the now-free standby buffer
-        active_fill_buffer = (active_fill_buffer == psram_buffer_A) ? psram_buffer_B : psram_buffer_A;
-        current_index = 0;
+    if (span->bytes <= first) {
+        SCB_InvalidateDCache_by_Addr((uint32_t*)&ring[offset], span->bytes);
+    } else {
+        SCB_InvalidateDCache_by_Addr((uint32_t*)&ring[offset], first);
+        SCB_InvalidateDCache_by_Addr((uint32_t*)&ring[0], span->bytes - first);
+    }
+}
+
+//=======================================================================================
+// RING - consumer side: give a drained span back to the producers
+//=======================================================================================
+void MPLIB_STORAGE::releaseSpan(const LOG_SPAN* span) {
+    ringRelease(&ring_tail, span->from + span->bytes);
+
+    tx_event_flags_set(&staging_events, FLAG_RING_SPACE, TX_OR);
+}
+
+//=======================================================================================
+// RING - consumer side: a drain whose transaction was rolled back
+//   The span stays in the ring (producers wait on the space) and is drained again after
+//   INGEST_RETRY_MS. The INGEST_RETRY_MAX-th failure writes its records to quarantine_<n>.raw
+//   and releases them. Returns true once the span is released
+//=======================================================================================
+bool MPLIB_STORAGE::failedSpan(const LOG_SPAN* span) {
+    if (++span_failures < INGEST_RETRY_MAX) {
+        printf("\nWARN [INGEST] %lu logs not stored, retry %lu of %u\n",
+               span->logs, span_failures, INGEST_RETRY_MAX - 1);
+        tx_thread_sleep(INGEST_RETRY_MS);
+        return false;
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "quarantine_%lu.raw", quarantine_seq++);
+    fx_file_delete(&sdio_disk, (CHAR*)name);   // Left over from an earlier boot
+
+    UINT status = writeRawRecords(name, span);
+    if (status == FX_SUCCESS) {
+        printf("\nERROR [INGEST] %lu logs failed %u times, quarantined in %s\n", span->logs, INGEST_RETRY_MAX, name);
+    } else {
+        printf("\nERROR [INGEST] %lu logs failed %u times and could not be quarantined (0x%02X), dropped\n",
+               span->logs, INGEST_RETRY_MAX, status);
+        ing_dropped += span->logs;
     }
+    ing_quarantined += span->logs;
 
-    log.local_log_index = current_index;
-    memcpy((void*)&active_fill_buffer[current_index], &log, sizeof(DS_LOG_STRUCT));
-    current_index++;
+    span_failures = 0;
+    releaseSpan(span);
+    return true;
 }
 
 //=======================================================================================
@@ -774,7 +2241,7 @@ bool MPLIB_STORAGE::ingestRawToSQLite(const char* filename, UINT *status) {
     // ================================================================
     // Process file in chunks, one transaction per chunk
     // ================================================================
-    while (total_logs_ingested < LOGS_PER_BUFFER) {
+    while (total_logs_ingested < RING_DRAIN_MAX_LOGS) {
         // Invalidate cache for DMA safety
         SCB_InvalidateDCache_by_Addr((uint32_t *)sram_landing_zone, SRAM_LANDING_SIZE);
 
@@ -862,6 +2329,7 @@ bool MPLIB_STORAGE::ingestRawToSQLite(const char* filename, UINT *status) {
 
             // Rollback this chunk
             sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+            loadCategories();
 
             // Check for critical errors
             if (err == SQLITE_CORRUPT || err == SQLITE_NOTADB) {
@@ -870,21 +2338,6 @@ bool MPLIB_STORAGE::ingestRawToSQLite(const char* filename, UINT *status) {
                 return false;
             }
 
-            // ============================================================
-            // CHECKPOINT WAL (Flush to main database)
-            // ============================================================
-            if (chunk_count % 2 == 0) {
-				int wal_log = 0, wal_ckpt = 0;
-//				*status = sqlite3_wal_checkpoint_v2(db, NULL, SQLITE_CHECKPOINT_PASSIVE, &wal_log, &wal_ckpt);
-				*status = sqlite3_wal_checkpoint_v2(db, NULL, SQLITE_CHECKPOINT_TRUNCATE, &wal_log, &wal_ckpt);
-				if (*status == SQLITE_OK) {
-					printf("\nOK [INGESTION] WAL checkpoint: %d frames, %d checkpointed\n",
-						   wal_log, wal_ckpt);
-				} else {
-					printf("\nWARN [INGESTION] WAL checkpoint returned: %d\n", *status);
-				}
-            }
-
             // Non-critical commit failure - continue to next chunk
             printf("\nWARN [INGESTION] Chunk %lu rolled back, continuing...\n", chunk_count);
         } else {
@@ -892,6 +2345,9 @@ bool MPLIB_STORAGE::ingestRawToSQLite(const char* filename, UINT *status) {
         	// Release page cache after every commit
 			sqlite3_db_release_memory(db);
             successful_chunks++;
+
+            // Scheduler instead of an inline TRUNCATE checkpoint
+            scheduleCheckpoint(false);
 //            printf("\nOK [INGESTION] Chunk %lu committed (%lu logs, %lu skipped)\n", chunk_count, num_logs - chunk_skipped, chunk_skipped);
         }
 
@@ -948,6 +2404,60 @@ bool MPLIB_STORAGE::ingestRawToSQLite(const char* filename, UINT *status) {
     }
 }
 
+//=======================================================================================
+// Raw files keep the fixed DS_LOG_STRUCT layout: compact records are expanded
+// WRITE_CHUNK_SIZE at a time into the SRAM landing zone, then written to SD
+//=======================================================================================
+UINT MPLIB_STORAGE::writeRawRecords(const char* filename, const LOG_SPAN* span) {
+    FX_FILE raw_file;
+    UINT status;
+
+    status = fx_file_create(&sdio_disk, (CHAR*)filename);
+    if (status != FX_SUCCESS && status != FX_ALREADY_CREATED) {
+        printf("ERROR [STORAGE] Create Fail: 0x%02X\n", status);
+        return status;
+    }
+
+    status = fx_file_open(&sdio_disk, &raw_file, (CHAR*)filename, FX_OPEN_FOR_WRITE);
+    if (status != FX_SUCCESS) {
+        printf("ERROR [STORAGE] Open Fail: 0x%02X\n", status);
+        return status;
+    }
+
+    DS_LOG_STRUCT* chunk = (DS_LOG_STRUCT*)sram_landing_zone;
+    uint32_t off = 0;
+    const DS_LOG_REC* rec = logSpanNext(span, &off);
+
+    while (rec != nullptr && status == FX_SUCCESS) {
+        uint32_t n = 0;
+        for (; rec != nullptr && n < WRITE_CHUNK_SIZE; rec = logSpanNext(span, &off), n++) {
+            DS_LOG_STRUCT* log = &chunk[n];
+            memset(log, 0, sizeof(DS_LOG_STRUCT));
+            log->log_index = rec->log_index;
+            log->token = rec->token;
+            log->local_log_index = rec->local_log_index;
+            log->timestamp_at_store = rec->timestamp_at_store;
+            log->timestamp_at_log = rec->timestamp_at_log;
+            log->severity = rec->severity;
+            memcpy(log->category, rec->data, rec->cat_len);
+            memcpy(log->message, rec->data + rec->cat_len, rec->msg_len);
+        }
+
+        tx_mutex_get(&sd_io_mutex, TX_WAIT_FOREVER);
+        status = fx_file_write(&raw_file, chunk, n * sizeof(DS_LOG_STRUCT));
+        tx_mutex_put(&sd_io_mutex);
+
+        if (status != FX_SUCCESS) {
+            printf("\nERROR [STORAGE] Write Fail: 0x%02X\n", status);
+        }
+    }
+
+    fx_media_flush(&sdio_disk);
+    fx_file_close(&raw_file);
+
+    return status;
+}
+
 //=======================================================================================
 //
 //=======================================================================================
@@ -969,78 +2479,308 @@ UINT MPLIB_STORAGE::writeRawFile(const char* filename, volatile DS_LOG_STRUCT* b
         return status;
     }
 
-    uint32_t logs_rem = LOGS_PER_BUFFER;
+    uint32_t logs_rem = actual_count;
+
+    uint32_t offset = 0;
+    uint32_t dma_start_time = tx_time_get();
+
+    // Single memory barrier before all DMA operations
+    __DSB();
+
+    while (logs_rem > 0) {
+        uint32_t count = (logs_rem >= CHUNK_SIZE) ? CHUNK_SIZE : logs_rem;
+        uint32_t sz = count * sizeof(DS_LOG_STRUCT);
+
+        // ============================================================
+        // DMA TRANSFER: PSRAM â†’ AXI SRAM (Hardware accelerated!)
+        // ============================================================
+
+        HAL_StatusTypeDef dma_status = HAL_DMA_Start(
+            &hdma_mem2mem,
+            (uint32_t)&buffer_in_psram[offset],  // Source: PSRAM address
+            (uint32_t)sram_landing_zone,         // Dest: Landing zone
+            sz                                   // Size in BYTES
+        );
+
+        if (dma_status != HAL_OK) {
+            printf("\nERROR [STORAGE] DMA Start failed: %d\n", dma_status);
+            // Fallback to memcpy
+            memcpy(sram_landing_zone, (const void*)&buffer_in_psram[offset], sz);
+        } else {
+            // Wait for DMA to complete (polling)
+            dma_status = HAL_DMA_PollForTransfer(
+                &hdma_mem2mem,
+                HAL_DMA_FULL_TRANSFER,  // Wait for complete transfer
+                1000                     // Timeout: 1000ms
+            );
+
+            if (dma_status != HAL_OK) {
+                printf("\nERROR [STORAGE] DMA Poll timeout: %d\n", dma_status);
+                // Fallback to memcpy for remaining data
+                memcpy(sram_landing_zone, (const void*)&buffer_in_psram[offset], sz);
+            }
+        }
+
+        // Ensure DMA transfer is visible before SD write
+        __DSB();
+
+        // Write to SD card (FileX with IDMA handles this)
+        tx_mutex_get(&sd_io_mutex, TX_WAIT_FOREVER);
+
+        status = fx_file_write(&raw_file, sram_landing_zone, sz);
+        if (status != FX_SUCCESS) {
+            printf("\nERROR [STORAGE] Write Fail: 0x%02X at offset %lu\n", status, offset);
+            tx_mutex_put(&sd_io_mutex);
+            break;
+        }
+
+        tx_mutex_put(&sd_io_mutex);
+
+        logs_rem -= count;
+        offset += count;
+    }
+
+    uint32_t dma_total_time = tx_time_get() - dma_start_time;
+
+    // Single flush at end
+    fx_media_flush(&sdio_disk);
+    fx_file_close(&raw_file);
+
+    printf("\nOK [STORAGE] DMA write complete: %s (%lu ms total, %lu logs/sec)\n",
+           filename, dma_total_time,
+           dma_total_time > 0 ? (actual_count * 1000 / dma_total_time) : 0);
+
+    return status;
+}
+
+//=======================================================================================
+// SEGMENTS - logs_<seq>.db files, see SEGMENT_* in MPLIB_STORAGE.h
+//=======================================================================================
+// Size of the main database file in bytes
+static uint64_t segmentBytes(sqlite3* db) {
+    sqlite3_stmt* stmt = nullptr;
+    uint64_t bytes = 0;
+
+    if (sqlite3_prepare_v2(db, "SELECT page_count * page_size FROM pragma_page_count(), pragma_page_size();",
+                           -1, &stmt, nullptr) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW) bytes = (uint64_t)sqlite3_column_int64(stmt, 0);
+        sqlite3_finalize(stmt);
+    }
+    return bytes;
+}
+
+//=======================================================================================
+// Fresh start: every segment (and the pre-segment logs.db) left on the card is deleted
+//=======================================================================================
+void MPLIB_STORAGE::purgeSegments() {
+    CHAR entry[FX_MAX_LONG_NAME_LEN];
+    uint32_t purged = 0;
+
+    fx_file_delete(&sdio_disk, (CHAR*)"logs.db");
+    fx_file_delete(&sdio_disk, (CHAR*)"logs.db-journal");
+
+    // Restart the directory walk after each delete: the entry list changes under it
+    bool found = true;
+    while (found) {
+        found = false;
+        UINT status = fx_directory_first_entry_find(&sdio_disk, entry);
+        while (status == FX_SUCCESS) {
+            if (strncmp(entry, SEGMENT_PREFIX, sizeof(SEGMENT_PREFIX) - 1) == 0 &&
+                fx_file_delete(&sdio_disk, entry) == FX_SUCCESS) {
+                purged++;
+                found = true;
+                break;
+            }
+            status = fx_directory_next_entry_find(&sdio_disk, entry);
+        }
+    }
+
+    fx_media_flush(&sdio_disk);
+    printf("\nOK [SEGMENT] %lu old segment files deleted\n", purged);
+}
+
+//=======================================================================================
+// Opens db_name as the write segment: schema, per-segment state, recent segments attached
+//=======================================================================================
+bool MPLIB_STORAGE::openSegment() {
+    if (sqlite3_open(db_name, &db) != SQLITE_OK) {
+        printf("\nERROR [SEGMENT] Failed to open %s: %s\n", db_name, sqlite3_errmsg(db));
+        sqlite3_close_v2(db);
+        db = nullptr;
+        return false;
+    }
+
+    tuneDbConfig();
+    if (createTable()) {
+        loadMaxRowid();
+        if (L0_TIER_ENABLE && !attachL0()) {
+            printf("\nWARN [L0] PSRAM tier unavailable, ingesting straight into %s\n", db_name);
+        }
+        if (prepareInsertStatements() && loadCategories() && loadIndexState()) {
+            uint32_t attached = attachSegments(db, seg_seq, l0_on);
+            printf("\nOK [SEGMENT] Writing %s, %lu older segments attached\n", db_name, attached);
+            return true;
+        }
+    }
+
+    finalizeInsertStatements();
+    sqlite3_close_v2(db);
+    db = nullptr;
+    l0_on = false;
+    return false;
+}
+
+//=======================================================================================
+// True once the write segment reached one of its rollover limits
+//   The size is measured every SEGMENT_SIZE_CHECK_MS, not on every COMMIT: at ingest rates the
+//   segment overshoots SEGMENT_MAX_BYTES by a few seconds of rows at most
+//=======================================================================================
+bool MPLIB_STORAGE::segmentFull() {
+    uint32_t now = tx_time_get();
+
+    if (SEGMENT_MAX_ROWS > 0 && seg_rows >= SEGMENT_MAX_ROWS) return true;
+    if (SEGMENT_WINDOW_MS > 0 && now - seg_opened >= SEGMENT_WINDOW_MS && seg_rows > 0) return true;
+    if (SEGMENT_MAX_BYTES == 0) return false;
+
+    if (now - seg_size_checked >= SEGMENT_SIZE_CHECK_MS) {
+        seg_size = segmentBytes(db);
+        seg_size_checked = now;
+    }
+    return seg_size >= SEGMENT_MAX_BYTES;
+}
+
+//=======================================================================================
+// Closes the write segment and starts logs_<seq + 1>.db (between transactions only)
+//=======================================================================================
+bool MPLIB_STORAGE::rollSegment() {
+    // The runs belong to this connection: everything still in PSRAM goes into the closing segment
+    if (l0_on && !flushL0()) return false;
 
-    uint32_t offset = 0;
-    uint32_t dma_start_time = tx_time_get();
+    uint64_t bytes = segmentBytes(db);
+    seg_bytes[seg_seq % SEGMENT_RETAIN_SLOTS] = bytes;
 
-    // Single memory barrier before all DMA operations
-    __DSB();
+    finalizeInsertStatements();
+    sqlite3_close_v2(db);
+    db = nullptr;
+    l0_on = false;
 
-    while (logs_rem > 0) {
-        uint32_t count = (logs_rem >= CHUNK_SIZE) ? CHUNK_SIZE : logs_rem;
-        uint32_t sz = count * sizeof(DS_LOG_STRUCT);
+    printf("\nOK [SEGMENT] %s closed: %lu rows, %lu KB\n", db_name, seg_rows, (uint32_t)(bytes / 1024));
 
-        // ============================================================
-        // DMA TRANSFER: PSRAM â†’ AXI SRAM (Hardware accelerated!)
-        // ============================================================
+    seg_seq++;
+    seg_rows = 0;
+    seg_opened = seg_size_checked = tx_time_get();
+    seg_size = 0;
+    seg_rollovers++;
+    segmentName(seg_seq, db_name, sizeof(db_name));
 
-        HAL_StatusTypeDef dma_status = HAL_DMA_Start(
-            &hdma_mem2mem,
-            (uint32_t)&buffer_in_psram[offset],  // Source: PSRAM address
-            (uint32_t)sram_landing_zone,         // Dest: Landing zone
-            sz                                   // Size in BYTES
-        );
+    enforceRetention();
 
-        if (dma_status != HAL_OK) {
-            printf("\nERROR [STORAGE] DMA Start failed: %d\n", dma_status);
-            // Fallback to memcpy
-            memcpy(sram_landing_zone, (const void*)&buffer_in_psram[offset], sz);
-        } else {
-            // Wait for DMA to complete (polling)
-            dma_status = HAL_DMA_PollForTransfer(
-                &hdma_mem2mem,
-                HAL_DMA_FULL_TRANSFER,  // Wait for complete transfer
-                1000                     // Timeout: 1000ms
-            );
+    return openSegment();
+}
 
-            if (dma_status != HAL_OK) {
-                printf("\nERROR [STORAGE] DMA Poll timeout: %d\n", dma_status);
-                // Fallback to memcpy for remaining data
-                memcpy(sram_landing_zone, (const void*)&buffer_in_psram[offset], sz);
+//=======================================================================================
+// Drops the oldest closed segments while the card holds too many or too many bytes of them
+//=======================================================================================
+void MPLIB_STORAGE::enforceRetention() {
+    char name[24];
+    char side[32];
+
+    for (;;) {
+        uint32_t count = seg_seq - seg_first + 1;
+        uint64_t bytes = 0;
+        for (uint32_t seq = seg_first; seq < seg_seq; seq++) bytes += seg_bytes[seq % SEGMENT_RETAIN_SLOTS];
+
+        if (seg_first >= seg_seq) return;
+        if (count <= SEGMENT_RETAIN_MAX && bytes <= SEGMENT_RETAIN_BYTES) return;
+
+        // The segment file first: FileX refuses to delete an open file, so a reader still on this
+        // segment keeps it, and its -wal and -shm, until the next rollover tries again
+        segmentName(seg_first, name, sizeof(name));
+        UINT status = fx_file_delete(&sdio_disk, name);
+        if (status != FX_SUCCESS && status != FX_NOT_FOUND) {
+            printf("\nWARN [SEGMENT] Delete of %s failed: 0x%02X, retrying at the next rollover\n", name, status);
+            seg_delete_retries++;
+            if (count >= SEGMENT_RETAIN_SLOTS) {
+                printf("\nERROR [SEGMENT] %lu segments on the card, sizes of the oldest no longer tracked\n", count);
             }
+            return;
         }
 
-        // Ensure DMA transfer is visible before SD write
-        __DSB();
+        // Side files if a crash left any
+        snprintf(side, sizeof(side), "%s-journal", name); fx_file_delete(&sdio_disk, side);
+        snprintf(side, sizeof(side), "%s-wal", name);     fx_file_delete(&sdio_disk, side);
+        snprintf(side, sizeof(side), "%s-shm", name);     fx_file_delete(&sdio_disk, side);
 
-        // Write to SD card (FileX with IDMA handles this)
-        tx_mutex_get(&sd_io_mutex, TX_WAIT_FOREVER);
+        seg_bytes[seg_first % SEGMENT_RETAIN_SLOTS] = 0;
+        seg_first++;
+        seg_dropped++;
+        fx_media_flush(&sdio_disk);
+        printf("\nOK [SEGMENT] Retention: %s dropped\n", name);
+    }
+}
 
-        status = fx_file_write(&raw_file, sram_landing_zone, sz);
-        if (status != FX_SUCCESS) {
-            printf("\nERROR [STORAGE] Write Fail: 0x%02X at offset %lu\n", status, offset);
-            tx_mutex_put(&sd_io_mutex);
-            break;
+//=======================================================================================
+// ATTACHes the most recent segments before 'seq' (the write segment, main of 'conn') and
+// rebuilds the cross-segment TEMP views:
+//   ds_logs_all                  UNION ALL of every attached ds_logs_v, main.ds_logs_v and the L0 runs
+//   <deferred index view>_all    same over ds_logs_by_* (index seek per segment, L0 runs scanned)
+// The L0 runs are only unioned on the ingest connection, they are not visible to any other one.
+// Returns the number of segments attached.
+//=======================================================================================
+uint32_t MPLIB_STORAGE::attachSegments(sqlite3* conn, uint32_t seq_main, bool with_l0) {
+    char name[24];
+    uint32_t from = seg_first;
+    if (from > seq_main) from = seq_main;
+    if (seq_main - from > SEGMENT_ATTACH_MAX) from = seq_main - SEGMENT_ATTACH_MAX;
+
+    for (uint32_t seq = from; seq < seq_main; seq++) {
+        segmentName(seq, name, sizeof(name));
+        char* zSql = sqlite3_mprintf("ATTACH DATABASE '%s' AS seg_%lu;", name, seq);
+        int rc = (zSql != nullptr) ? sqlite3_exec(conn, zSql, NULL, NULL, NULL) : SQLITE_NOMEM;
+        sqlite3_free(zSql);
+        if (rc != SQLITE_OK) {
+            printf("\nWARN [SEGMENT] ATTACH %s failed: %s\n", name, sqlite3_errmsg(conn));
+            from = seq + 1;     // Views only span a contiguous run of attached segments
         }
-
-        tx_mutex_put(&sd_io_mutex);
-
-        logs_rem -= count;
-        offset += count;
     }
 
-    uint32_t dma_total_time = tx_time_get() - dma_start_time;
+    const char* views[1 + DEFERRED_INDEX_COUNT];
+    views[0] = "ds_logs_v";
+    for (uint32_t i = 0; i < DEFERRED_INDEX_COUNT; i++) views[1 + i] = deferred_indexes[i].view;
 
-    // Single flush at end
-    fx_media_flush(&sdio_disk);
-    fx_file_close(&raw_file);
+    for (uint32_t v = 0; v < 1 + DEFERRED_INDEX_COUNT; v++) {
+        if (v > 0 && !INDEX_BUILD_DEFERRED) break;
 
-    printf("\nOK [STORAGE] DMA write complete: %s (%lu ms total, %lu logs/sec)\n",
-           filename, dma_total_time,
-           dma_total_time > 0 ? (LOGS_PER_BUFFER * 1000 / dma_total_time) : 0);
+        sqlite3_str* sql = sqlite3_str_new(conn);
+        sqlite3_str_appendf(sql, "DROP VIEW IF EXISTS temp.%s_all; CREATE TEMP VIEW %s_all AS ",
+                            (v == 0) ? "ds_logs" : views[v], (v == 0) ? "ds_logs" : views[v]);
+        for (uint32_t seq = from; seq < seq_main; seq++) {
+            sqlite3_str_appendf(sql, "SELECT * FROM seg_%lu.%s UNION ALL ", seq, views[v]);
+        }
+        sqlite3_str_appendf(sql, "SELECT * FROM main.%s", views[v]);
+        // L0 rows not merged yet (a frozen run's merged prefix is already in main)
+        for (uint32_t r = 0; with_l0 && r < 2; r++) {
+            if (v == 0) {
+                sqlite3_str_appendf(sql,
+                    " UNION ALL SELECT l.log_index, l.message, c.name AS category, l.token, l.local_log_index, "
+                    "l.timestamp_at_store, l.timestamp_at_log, l.severity "
+                    "FROM %s.ds_logs l LEFT JOIN main.ds_categories c ON c.id = l.category_id "
+                    "WHERE l.log_index > (SELECT merged FROM %s.ds_l0_state)", l0_run_names[r], l0_run_names[r]);
+            } else {
+                sqlite3_str_appendf(sql, " UNION ALL SELECT * FROM %s.ds_logs WHERE log_index > (SELECT merged FROM %s.ds_l0_state)",
+                                    l0_run_names[r], l0_run_names[r]);
+            }
+        }
+        sqlite3_str_appendchar(sql, 1, ';');
 
-    return status;
+        char* zSql = sqlite3_str_finish(sql);
+        if (zSql == nullptr || sqlite3_exec(conn, zSql, NULL, NULL, NULL) != SQLITE_OK) {
+            printf("\nWARN [SEGMENT] Cross-segment view %s failed: %s\n", views[v], sqlite3_errmsg(conn));
+        }
+        sqlite3_free(zSql);
+    }
+
+    return seq_main - from;
 }
 
 //=======================================================================================
@@ -1048,17 +2788,7 @@ UINT MPLIB_STORAGE::writeRawFile(const char* filename, volatile DS_LOG_STRUCT* b
 //=======================================================================================
 bool MPLIB_STORAGE::createTable() {
     char *zErrMsg = 0;
-    const char* sql_create =
-    "CREATE TABLE IF NOT EXISTS ds_logs ("
-    "log_index INTEGER PRIMARY KEY, "
-    "message TEXT NOT NULL, "
-    "category TEXT, "
-    "token INTEGER, "
-    "local_log_index INTEGER, "
-    "timestamp_at_store INTEGER, "
-    "timestamp_at_log INTEGER, "
-    "severity INTEGER"
-    ");";
+    const char* sql_create = "CREATE TABLE IF NOT EXISTS ds_logs " DS_LOGS_COLUMNS_DDL ";";
 
     int status = sqlite3_exec(db, sql_create, NULL, NULL, &zErrMsg);
     if (status == SQLITE_OK) {
@@ -1071,8 +2801,27 @@ bool MPLIB_STORAGE::createTable() {
         return false;
     }
 
-    // INDEX DEFERRED: idx_logs_category removed during bulk ingestion for throughput.
-    // Create it post-load with: CREATE INDEX idx_logs_category ON ds_logs(category);
+    // Category dictionary + read view with the names joined back (same columns as the old ds_logs)
+    const char* sql_categories =
+    "CREATE TABLE IF NOT EXISTS ds_categories ("
+    "id INTEGER PRIMARY KEY, "
+    "name TEXT NOT NULL UNIQUE"
+    ");"
+    "CREATE VIEW IF NOT EXISTS ds_logs_v AS "
+    "SELECT l.log_index, l.message, c.name AS category, l.token, l.local_log_index, "
+    "l.timestamp_at_store, l.timestamp_at_log, l.severity "
+    "FROM ds_logs l LEFT JOIN ds_categories c ON c.id = l.category_id;";
+
+    status = sqlite3_exec(db, sql_categories, NULL, NULL, &zErrMsg);
+    if (status != SQLITE_OK) {
+        printf("\nERROR TO CREATE CATEGORIES: %d, message: %s !!!\n", status, zErrMsg);
+        sqlite3_free(zErrMsg);
+        return false;
+    }
+
+    // INDEX DEFERRED: no live secondary index on ds_logs during bulk ingestion (throughput).
+    // idx_logs_category & co. are built behind ingest by buildIndexSlice()
+    if (INDEX_BUILD_DEFERRED && !createDeferredIndexes()) return false;
 
     return true;
 }
@@ -1101,6 +2850,17 @@ void MPLIB_STORAGE::recoverDatabase() {
         printf("\n[RECOVERY] No statement to finalize (already null).");
     }
 
+    if (batch_stmt != nullptr) {
+        sqlite3_finalize(batch_stmt);
+        batch_stmt = nullptr;
+    }
+    if (vtab_stmt != nullptr) {
+        sqlite3_finalize(vtab_stmt);
+        vtab_stmt = nullptr;
+    }
+    finalizeCategoryStatements();
+    finalizeIndexStatements();
+
     // ================================================================
     // STEP 2: Close database handle
     // ================================================================
@@ -1153,9 +2913,6 @@ void MPLIB_STORAGE::recoverDatabase() {
         printf("\n[RECOVERY] Database file deletion returned: 0x%02X", status);
     }
 
-    // Also delete WAL and SHM files if they exist
-    fx_file_delete(&sdio_disk, "logs.db-wal");
-    fx_file_delete(&sdio_disk, "logs.db-shm");
     printf("\n[RECOVERY] WAL/SHM files cleaned up.");
 
     // ================================================================
@@ -1164,7 +2921,7 @@ void MPLIB_STORAGE::recoverDatabase() {
     printf("\n[RECOVERY] Recreating database structure...");
 
     // Temporarily open database to recreate structure
-    int rc = sqlite3_open(DB_NAME, &db);
+    int rc = sqlite3_open(db_name, &db);
     if (rc != SQLITE_OK) {
         printf("\nERROR [RECOVERY] Failed to reopen DB: %s", sqlite3_errmsg(db));
         printf("\nFAIL [RECOVERY] System could not be restored!");
@@ -1202,8 +2959,11 @@ void MPLIB_STORAGE::recoverDatabase() {
     // STEP 7: Reset counters and state
     // ================================================================
     // Don't reset produce_idx/consume_idx - let the pipeline continue
-    // Just reset the statement pointer
+    // Just reset the statement pointers
     insert_stmt = nullptr;
+    batch_stmt = nullptr;
+    vtab_stmt = nullptr;
+    max_rowid = -1;
 
     printf("\n--- STATS BLOCK ---------------------------------------------------------------------------");
     printf("\n[RECOVERY] Recovery complete!");
@@ -1227,7 +2987,7 @@ void print_log( DS_LOG_STRUCT* log) {
 //=======================================================================================
 bool MPLIB_STORAGE::verifyLayout() {
     uint32_t logs_space = (uint32_t)&__psram_logs_end - (uint32_t)&__psram_logs_start;
-    uint32_t required = sizeof(psram_buffer_A) + sizeof(psram_buffer_B);
+    uint32_t required = sizeof(psram_ring) + sizeof(psram_ring_commit);
 
     if (required > logs_space) {
         printf("ERROR [STORAGE] PSRAM Logging Section too small!\n");
@@ -1262,7 +3022,10 @@ UINT MPLIB_STORAGE::delete_database_files()
 //	status = fx_file_delete(&sdio_disk, "batch_4.raw");
 //	status = fx_file_delete(&sdio_disk, "batch_4.raw");
 
-    status = fx_file_delete(&sdio_disk, (CHAR*)DB_NAME);
+    char side[32];
+
+    // Only the write segment: closed segments are left to enforceRetention()
+    status = fx_file_delete(&sdio_disk, (CHAR*)db_name);
     if (status == FX_SUCCESS) {
         printf("\nOK [STORAGE] Old database deleted for fresh start\n");
     } else if (status != FX_NOT_FOUND) {
@@ -1273,218 +3036,1118 @@ UINT MPLIB_STORAGE::delete_database_files()
 		printf("\nERROR [STORAGE] database log file is write protected, cannot delete automagically\n");
 	}
 
-	status = fx_file_delete(&sdio_disk, (CHAR*)"logs.db-journal");
+	snprintf(side, sizeof(side), "%s-journal", db_name);
+	status = fx_file_delete(&sdio_disk, (CHAR*)side);
 	if (status == FX_SUCCESS) {
 	    printf("\nOK [STORAGE] journal file deleted\n");
 	} else if (status == FX_NOT_FOUND) {
 	    // This is the normal case if the previous run closed cleanly
 	}
 
+	snprintf(side, sizeof(side), "%s-wal", db_name);
+	fx_file_delete(&sdio_disk, (CHAR*)side);
+	snprintf(side, sizeof(side), "%s-shm", db_name);
+	fx_file_delete(&sdio_disk, (CHAR*)side);
+
 	fx_media_flush(&sdio_disk);
 
-	return status;
+	return status;
+}
+
+//=======================================================================================
+//
+//=======================================================================================
+
+// DMA Transfer Complete Callback (called by interrupt)
+void HAL_DMA_XferCpltCallback(DMA_HandleTypeDef *hdma)
+{
+    if (hdma == &(hdma_mem2mem)) {
+        // Signal completion via semaphore
+        tx_semaphore_put(&(dma_complete_sem));
+        dma_transfer_complete = true;
+    }
+}
+
+//=======================================================================================
+//
+//=======================================================================================
+
+// DMA Error Callback
+void HAL_DMA_XferErrorCallback(DMA_HandleTypeDef *hdma)
+{
+    if (hdma == &(hdma_mem2mem)) {
+        printf("\nERROR [DMA] Transfer error!\n");
+        // Signal error - still release semaphore but set error flag
+        dma_transfer_complete = false;
+        tx_semaphore_put(&(dma_complete_sem));
+    }
+}
+
+//=======================================================================================
+//
+//=======================================================================================
+
+// Interrupt-based writeRawFile
+UINT MPLIB_STORAGE::writeRawFile_interrupt(const char* filename, volatile DS_LOG_STRUCT* buffer_in_psram, uint32_t actual_count) {
+    FX_FILE raw_file;
+    UINT status;
+
+    const uint32_t CHUNK_SIZE = WRITE_CHUNK_SIZE;
+
+    status = fx_file_create(&sdio_disk, (CHAR*)filename);
+    if (status != FX_SUCCESS && status != FX_ALREADY_CREATED) {
+        printf("ERROR [STORAGE] Create Fail: 0x%02X\n", status);
+        return status;
+    }
+
+    status = fx_file_open(&sdio_disk, &raw_file, (CHAR*)filename, FX_OPEN_FOR_WRITE);
+    if (status != FX_SUCCESS) {
+        printf("ERROR [STORAGE] Open Fail: 0x%02X\n", status);
+        return status;
+    }
+
+    uint32_t logs_rem = actual_count;
+
+    uint32_t offset = 0;
+
+    __DSB();
+
+    while (logs_rem > 0) {
+        uint32_t count = (logs_rem >= CHUNK_SIZE) ? CHUNK_SIZE : logs_rem;
+        uint32_t sz = count * sizeof(DS_LOG_STRUCT);
+
+        // ============================================================
+        // DMA TRANSFER WITH INTERRUPT (Non-blocking!)
+        // ============================================================
+
+        dma_transfer_complete = false;
+
+        HAL_StatusTypeDef dma_status = HAL_DMA_Start_IT(
+            &hdma_mem2mem,
+            (uint32_t)&buffer_in_psram[offset],
+            (uint32_t)sram_landing_zone,
+            sz
+        );
+
+        if (dma_status != HAL_OK) {
+            printf("\nERROR [STORAGE] DMA Start_IT failed: %d\n", dma_status);
+            memcpy(sram_landing_zone, (const void*)&buffer_in_psram[offset], sz);
+        } else {
+            // Wait for DMA completion via semaphore (released by interrupt)
+            UINT sem_status = tx_semaphore_get(&dma_complete_sem, 1000); // 1 second timeout
+
+            if (sem_status != TX_SUCCESS || !dma_transfer_complete) {
+                printf("\nERROR [STORAGE] DMA timeout or error\n");
+                HAL_DMA_Abort(&hdma_mem2mem);
+                memcpy(sram_landing_zone, (const void*)&buffer_in_psram[offset], sz);
+            }
+        }
+
+        __DSB();
+
+        // Write to SD (while CPU was waiting, DMA was working!)
+        tx_mutex_get(&sd_io_mutex, TX_WAIT_FOREVER);
+        status = fx_file_write(&raw_file, sram_landing_zone, sz);
+        tx_mutex_put(&sd_io_mutex);
+
+        if (status != FX_SUCCESS) {
+            printf("\nERROR [STORAGE] Write Fail: 0x%02X\n", status);
+            break;
+        }
+
+        logs_rem -= count;
+        offset += count;
+    }
+
+    fx_media_flush(&sdio_disk);
+    fx_file_close(&raw_file);
+
+    return status;
+}
+
+//=======================================================================================
+// L0 TIER - PSRAM runs in front of the segment, see L0_* in MPLIB_STORAGE.h
+//   l0_<n>.ds_logs        same columns as ds_logs, filled by the ingest transactions
+//   l0_<n>.ds_l0_state    merged: rows up to this log_index are already in main.ds_logs
+//=======================================================================================
+bool MPLIB_STORAGE::attachL0() {
+    l0_on = false;
+
+    for (uint32_t r = 0; r < 2; r++) {
+        char* zSql = sqlite3_mprintf("ATTACH DATABASE ':memory:' AS %s;", l0_run_names[r]);
+        int rc = (zSql != nullptr) ? sqlite3_exec(db, zSql, NULL, NULL, NULL) : SQLITE_NOMEM;
+        sqlite3_free(zSql);
+        if (rc != SQLITE_OK || !resetL0Run(r)) return false;
+    }
+
+    l0_active = 0;
+    l0_merged = -1;
+    l0_bytes = 0;
+    l0_started = tx_time_get();
+    l0_on = true;
+
+    printf("\nOK [L0] Two %lu KB PSRAM runs attached (%s, %s)\n",
+           (uint32_t)(L0_RUN_BYTES / 1024), l0_run_names[0], l0_run_names[1]);
+    return true;
+}
+
+//=======================================================================================
+// Empties a run in one call: the image is deserialized again at size 0 (no DELETE, no journal)
+//=======================================================================================
+bool MPLIB_STORAGE::resetL0Run(uint32_t run) {
+    const char* name = l0_run_names[run];
+
+    int rc = sqlite3_deserialize(db, name, l0_images[run], 0, L0_RUN_BYTES, 0);
+    if (rc == SQLITE_OK) {
+        // Rollback journal in the heap: a run must never open a file on the card
+        char* zSql = sqlite3_mprintf(
+            "PRAGMA %s.page_size = 4096;"
+            "PRAGMA %s.journal_mode = MEMORY;"
+            "CREATE TABLE %s.ds_logs " DS_LOGS_COLUMNS_DDL ";"
+            "CREATE TABLE %s.ds_l0_state (merged INTEGER NOT NULL);"
+            "INSERT INTO %s.ds_l0_state (merged) VALUES (-1);",
+            name, name, name, name, name);
+        rc = (zSql != nullptr) ? sqlite3_exec(db, zSql, NULL, NULL, NULL) : SQLITE_NOMEM;
+        sqlite3_free(zSql);
+    }
+
+    if (rc != SQLITE_OK) {
+        printf("\nERROR [L0] Reset of %s failed: %d (%s)\n", name, rc, sqlite3_errmsg(db));
+        return false;
+    }
+
+    l0_rows[run] = 0;
+    return true;
+}
+
+//=======================================================================================
+// Before an ingest transaction: freezes the active run if it may not take 'bytes' of ring
+// records, or if its oldest rows passed L0_MAX_AGE_MS. False when the batch does not fit and
+// the run could not be frozen: the drain must stay in the ring (producers wait on the space)
+//=======================================================================================
+bool MPLIB_STORAGE::reserveL0(uint32_t bytes) {
+    sqlite3_int64 used = 0;
+    sqlite3_serialize(db, l0_run_names[l0_active], &used, SQLITE_SERIALIZE_NOCOPY);    // Size only, no copy
+    l0_bytes = used;
+
+    if (l0_rows[l0_active] == 0) return true;
+
+    // A row is smaller than its ring record; a quarter on top covers page fill and interior pages
+    bool fits = (used + bytes + bytes / 4 <= (sqlite3_int64)L0_RUN_BYTES);
+    bool aged = (tx_time_get() - l0_started >= L0_MAX_AGE_MS);
+    if (fits && !aged) return true;
+
+    if (freezeL0(true)) return true;
+    if (fits) return true;      // Only aged: the run still takes this batch
+
+    printf("\nWARN [L0] Freeze of %s failed, batch held in the ring\n", l0_run_names[l0_active]);
+    l0_stalls++;
+    return false;
+}
+
+//=======================================================================================
+// Swaps the runs: the active one is frozen for merging, the empty one takes the ingest.
+// If the other run is still being merged, force finishes it first (the ingest outran the merge)
+//=======================================================================================
+bool MPLIB_STORAGE::freezeL0(bool force) {
+    uint32_t other = l0_active ^ 1;
+
+    if (l0_rows[other] > 0) {
+        if (!force) return false;
+        l0_forced++;
+        while (l0_rows[other] > 0) {
+            if (mergeL0Slice()) continue;
+            if (l0_slice_failures == 0) return false;
+            tx_thread_sleep(INGEST_RETRY_MS);   // Retried until merged or quarantined
+        }
+    }
+
+    printf("\nOK [L0] %s frozen with %lu rows, ingest moves to %s\n",
+           l0_run_names[l0_active], l0_rows[l0_active], l0_run_names[other]);
+
+    if (vtab_stmt)   { sqlite3_finalize(vtab_stmt);   vtab_stmt = nullptr; }
+    if (batch_stmt)  { sqlite3_finalize(batch_stmt);  batch_stmt = nullptr; }
+    if (insert_stmt) { sqlite3_finalize(insert_stmt); insert_stmt = nullptr; }
+
+    l0_active = other;
+    l0_merged = -1;
+    l0_bytes = 0;
+    l0_started = tx_time_get();
+    l0_freezes++;
+
+    return prepareInsertStatements();
+}
+
+//=======================================================================================
+// Slack work: merges the next L0_MERGE_SLICE_ROWS rows of the frozen run into main.ds_logs
+// in one transaction, or resets the run once it is fully merged. With no frozen run, a
+// quiet active run is frozen by age. False when there is nothing to do, or when the slice
+// failed (l0_slice_failures counts it, failedL0Slice() quarantines it in the end).
+//=======================================================================================
+bool MPLIB_STORAGE::mergeL0Slice() {
+    if (!l0_on || db == nullptr) return false;
+
+    uint32_t frozen = l0_active ^ 1;
+    if (l0_rows[frozen] == 0) {
+        if (l0_rows[l0_active] == 0 || tx_time_get() - l0_started < L0_MAX_AGE_MS) return false;
+        if (!freezeL0(false)) return false;
+        frozen = l0_active ^ 1;
+    }
+    const char* run = l0_run_names[frozen];
+
+    // Bounds of the next slice in log_index order, so the copy is a single rowid range
+    sqlite3_stmt* stmt = nullptr;
+    sqlite3_int64 lo = 0, hi = 0;
+    uint32_t rows = 0;
+    char* zSql = sqlite3_mprintf(
+        "SELECT min(log_index), max(log_index), count(*) FROM "
+        "(SELECT log_index FROM %s.ds_logs WHERE log_index > ?1 ORDER BY log_index LIMIT ?2);", run);
+    int rc = (zSql != nullptr) ? sqlite3_prepare_v2(db, zSql, -1, &stmt, nullptr) : SQLITE_NOMEM;
+    sqlite3_free(zSql);
+    if (rc == SQLITE_OK) {
+        sqlite3_bind_int64(stmt, 1, l0_merged);
+        sqlite3_bind_int(stmt, 2, L0_MERGE_SLICE_ROWS);
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            lo = sqlite3_column_int64(stmt, 0);
+            hi = sqlite3_column_int64(stmt, 1);
+            rows = (uint32_t)sqlite3_column_int(stmt, 2);
+        }
+    }
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_OK) {
+        printf("\nERROR [L0] Merge scan of %s failed: %s\n", run, sqlite3_errmsg(db));
+        return failedL0Slice(frozen, l0_merged + 1, INT64_MAX, l0_rows[frozen]);     // Bounds unknown: the rest of the run
+    }
+
+    if (rows == 0) {
+        if (!resetL0Run(frozen)) return false;
+        l0_merged = -1;
+        return true;
+    }
+
+    if (sqlite3_exec(db, "BEGIN TRANSACTION;", NULL, NULL, NULL) != SQLITE_OK) {
+        printf("\nERROR [L0] Merge of %s failed: %s\n", run, sqlite3_errmsg(db));
+        return failedL0Slice(frozen, lo, hi, rows);
+    }
+
+    // Sorted run -> right edge of ds_logs; the run's merged mark moves in the same transaction
+    // so ds_logs_all never shows a row twice or not at all. A log_index already in ds_logs is a
+    // constraint error: the slice is rolled back, stays in the run and is retried, then quarantined
+    zSql = sqlite3_mprintf(
+        "INSERT INTO main.ds_logs SELECT * FROM %s.ds_logs WHERE log_index BETWEEN %lld AND %lld;"
+        "UPDATE %s.ds_l0_state SET merged = %lld;", run, lo, hi, run, hi);
+    rc = (zSql != nullptr) ? sqlite3_exec(db, zSql, NULL, NULL, NULL) : SQLITE_NOMEM;
+    sqlite3_free(zSql);
+
+    if (rc == SQLITE_OK && !mergeIndexEntries(run, lo, hi)) rc = SQLITE_ERROR;
+
+    if (rc == SQLITE_OK) rc = sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) {
+        printf("\nERROR [L0] Merge of %s failed: %s\n", run, sqlite3_errmsg(db));
+        sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+        loadIndexState();
+        return failedL0Slice(frozen, lo, hi, rows);
+    }
+
+    l0_slice_failures = 0;
+    if (hi > main_rowid) main_rowid = hi;
+    l0_slices++;
+    l0_merged_rows += rows;
+    return releaseL0Slice(frozen, hi, rows);
 }
 
 //=======================================================================================
-//
+// Moves the frozen run past a slice that is in main (or quarantined). Every committed row of
+// the run is counted, so the last slice empties it right away
 //=======================================================================================
-
-// DMA Transfer Complete Callback (called by interrupt)
-void HAL_DMA_XferCpltCallback(DMA_HandleTypeDef *hdma)
-{
-    if (hdma == &(hdma_mem2mem)) {
-        // Signal completion via semaphore
-        tx_semaphore_put(&(dma_complete_sem));
-        dma_transfer_complete = true;
+bool MPLIB_STORAGE::releaseL0Slice(uint32_t frozen, sqlite3_int64 hi, uint32_t rows) {
+    l0_merged = hi;
+    l0_rows[frozen] = (l0_rows[frozen] > rows) ? l0_rows[frozen] - rows : 0;
+    if (l0_rows[frozen] == 0) {
+        if (!resetL0Run(frozen)) return false;
+        l0_merged = -1;
     }
+    return true;
 }
 
 //=======================================================================================
-//
+// A merge slice that was rolled back: it stays in the frozen run and is merged again at the
+// next call. The INGEST_RETRY_MAX-th failure writes rows lo..hi to quarantine_<n>.raw and moves
+// the run past them, so the run can still be emptied and frozen again. True once released
 //=======================================================================================
+bool MPLIB_STORAGE::failedL0Slice(uint32_t frozen, sqlite3_int64 lo, sqlite3_int64 hi, uint32_t rows) {
+    const char* run = l0_run_names[frozen];
 
-// DMA Error Callback
-void HAL_DMA_XferErrorCallback(DMA_HandleTypeDef *hdma)
-{
-    if (hdma == &(hdma_mem2mem)) {
-        printf("\nERROR [DMA] Transfer error!\n");
-        // Signal error - still release semaphore but set error flag
-        dma_transfer_complete = false;
-        tx_semaphore_put(&(dma_complete_sem));
+    if (++l0_slice_failures < INGEST_RETRY_MAX) {
+        printf("\nWARN [L0] Slice of %s not merged, retry %lu of %u\n", run, l0_slice_failures, INGEST_RETRY_MAX - 1);
+        return false;
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "quarantine_%lu.raw", quarantine_seq++);
+    fx_file_delete(&sdio_disk, (CHAR*)name);   // Left over from an earlier boot
+
+    UINT status = writeL0Quarantine(name, run, lo, hi);
+    if (status == FX_SUCCESS) {
+        printf("\nERROR [L0] %lu rows of %s failed %u merges, quarantined in %s\n", rows, run, INGEST_RETRY_MAX, name);
+    } else {
+        printf("\nERROR [L0] %lu rows of %s failed %u merges and could not be quarantined (0x%02X), dropped\n",
+               rows, run, INGEST_RETRY_MAX, status);
+        ing_dropped += rows;
+    }
+    l0_quarantined += rows;
+    l0_slice_failures = 0;
+
+    // Hidden from ds_logs_all like a merged prefix (an unbounded range empties the run)
+    if (hi != INT64_MAX) {
+        char* zSql = sqlite3_mprintf("UPDATE %s.ds_l0_state SET merged = %lld;", run, hi);
+        if (zSql != nullptr) sqlite3_exec(db, zSql, NULL, NULL, NULL);
+        sqlite3_free(zSql);
+    } else {
+        rows = l0_rows[frozen];
     }
+    return releaseL0Slice(frozen, hi, rows);
 }
 
 //=======================================================================================
-//
+// Rows lo..hi of an L0 run in the raw-file format of writeRawRecords(), WRITE_CHUNK_SIZE at
+// a time through the SRAM landing zone
 //=======================================================================================
-
-// Interrupt-based writeRawFile
-UINT MPLIB_STORAGE::writeRawFile_interrupt(const char* filename, volatile DS_LOG_STRUCT* buffer_in_psram, uint32_t actual_count) {
+UINT MPLIB_STORAGE::writeL0Quarantine(const char* filename, const char* run, sqlite3_int64 lo, sqlite3_int64 hi) {
     FX_FILE raw_file;
+    sqlite3_stmt* stmt = nullptr;
     UINT status;
 
-    const uint32_t CHUNK_SIZE = WRITE_CHUNK_SIZE;
+    char* zSql = sqlite3_mprintf(
+        "SELECT l.log_index, l.token, l.local_log_index, l.timestamp_at_store, l.timestamp_at_log, l.severity, "
+        "c.name, l.message FROM %s.ds_logs l LEFT JOIN main.ds_categories c ON c.id = l.category_id "
+        "WHERE l.log_index BETWEEN %lld AND %lld ORDER BY l.log_index;", run, lo, hi);
+    int rc = (zSql != nullptr) ? sqlite3_prepare_v2(db, zSql, -1, &stmt, nullptr) : SQLITE_NOMEM;
+    sqlite3_free(zSql);
+    if (rc != SQLITE_OK) {
+        printf("\nERROR [L0] Quarantine scan of %s failed: %s\n", run, sqlite3_errmsg(db));
+        return FX_IO_ERROR;
+    }
 
     status = fx_file_create(&sdio_disk, (CHAR*)filename);
-    if (status != FX_SUCCESS && status != FX_ALREADY_CREATED) {
-        printf("ERROR [STORAGE] Create Fail: 0x%02X\n", status);
-        return status;
+    if (status == FX_SUCCESS || status == FX_ALREADY_CREATED) {
+        status = fx_file_open(&sdio_disk, &raw_file, (CHAR*)filename, FX_OPEN_FOR_WRITE);
     }
-
-    status = fx_file_open(&sdio_disk, &raw_file, (CHAR*)filename, FX_OPEN_FOR_WRITE);
     if (status != FX_SUCCESS) {
         printf("ERROR [STORAGE] Open Fail: 0x%02X\n", status);
+        sqlite3_finalize(stmt);
         return status;
     }
 
-    uint32_t logs_rem = LOGS_PER_BUFFER;
+    DS_LOG_STRUCT* chunk = (DS_LOG_STRUCT*)sram_landing_zone;
+    rc = SQLITE_ROW;
+
+    while (rc == SQLITE_ROW && status == FX_SUCCESS) {
+        uint32_t n = 0;
+        while (n < WRITE_CHUNK_SIZE && (rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            DS_LOG_STRUCT* log = &chunk[n++];
+            memset(log, 0, sizeof(DS_LOG_STRUCT));
+            log->log_index = (uint32_t)sqlite3_column_int64(stmt, 0);
+            log->token = (uint32_t)sqlite3_column_int64(stmt, 1);
+            log->local_log_index = (uint32_t)sqlite3_column_int64(stmt, 2);
+            log->timestamp_at_store = (uint32_t)sqlite3_column_int64(stmt, 3);
+            log->timestamp_at_log = (uint32_t)sqlite3_column_int64(stmt, 4);
+            log->severity = (uint32_t)sqlite3_column_int64(stmt, 5);
+            const unsigned char* cat = sqlite3_column_text(stmt, 6);
+            const unsigned char* msg = sqlite3_column_text(stmt, 7);
+            if (cat != nullptr) strncpy(log->category, (const char*)cat, sizeof(log->category) - 1);
+            if (msg != nullptr) strncpy(log->message, (const char*)msg, sizeof(log->message) - 1);
+        }
+        if (rc != SQLITE_ROW && rc != SQLITE_DONE) status = FX_IO_ERROR;
+        if (n == 0 || status != FX_SUCCESS) break;
 
-    uint32_t offset = 0;
+        tx_mutex_get(&sd_io_mutex, TX_WAIT_FOREVER);
+        status = fx_file_write(&raw_file, chunk, n * sizeof(DS_LOG_STRUCT));
+        tx_mutex_put(&sd_io_mutex);
 
-    __DSB();
+        if (status != FX_SUCCESS) {
+            printf("\nERROR [STORAGE] Write Fail: 0x%02X\n", status);
+        }
+    }
 
-    while (logs_rem > 0) {
-        uint32_t count = (logs_rem >= CHUNK_SIZE) ? CHUNK_SIZE : logs_rem;
-        uint32_t sz = count * sizeof(DS_LOG_STRUCT);
+    sqlite3_finalize(stmt);
+    fx_media_flush(&sdio_disk);
+    fx_file_close(&raw_file);
 
-        // ============================================================
-        // DMA TRANSFER WITH INTERRUPT (Non-blocking!)
-        // ============================================================
+    return status;
+}
 
-        dma_transfer_complete = false;
+//=======================================================================================
+// Index work of one merge slice, before its COMMIT - maintainIndexes() for rows that reach
+// ds_logs from a PSRAM run instead of the staging ring
+//   Current index, INDEX_MAINTAIN_SORTED: the slice's entries are read back from the run into
+//   the PSRAM sort buffer, sorted by key and inserted in key order; the mark moves to 'hi'.
+//   Otherwise, a mark at or above 'lo' (late keys) moves back to lo - 1 for the builder.
+//=======================================================================================
+bool MPLIB_STORAGE::mergeIndexEntries(const char* run, sqlite3_int64 lo, sqlite3_int64 hi) {
+    sqlite3_stmt* scan = nullptr;
 
-        HAL_StatusTypeDef dma_status = HAL_DMA_Start_IT(
-            &hdma_mem2mem,
-            (uint32_t)&buffer_in_psram[offset],
-            (uint32_t)sram_landing_zone,
-            sz
-        );
+    if (!INDEX_BUILD_DEFERRED || index_hw_stmt == nullptr) return true;
 
-        if (dma_status != HAL_OK) {
-            printf("\nERROR [STORAGE] DMA Start_IT failed: %d\n", dma_status);
-            memcpy(sram_landing_zone, (const void*)&buffer_in_psram[offset], sz);
-        } else {
-            // Wait for DMA completion via semaphore (released by interrupt)
-            UINT sem_status = tx_semaphore_get(&dma_complete_sem, 1000); // 1 second timeout
+    for (uint32_t i = 0; i < DEFERRED_INDEX_COUNT; i++) {
+        const DEFERRED_INDEX* ix = &deferred_indexes[i];
+        DEFERRED_INDEX_STATE* st = &index_state[i];
 
-            if (sem_status != TX_SUCCESS || !dma_transfer_complete) {
-                printf("\nERROR [STORAGE] DMA timeout or error\n");
-                HAL_DMA_Abort(&hdma_mem2mem);
-                memcpy(sram_landing_zone, (const void*)&buffer_in_psram[offset], sz);
+        if (st->entry_stmt == nullptr || st->high_water < main_rowid) {
+            if (st->high_water >= lo) {
+                if (!indexSetHighWater(i, lo - 1)) return false;
+                st->high_water = lo - 1;
             }
+            continue;
         }
 
-        __DSB();
+        if (scan == nullptr) {
+            char* zSql = sqlite3_mprintf("SELECT log_index, category_id, severity, timestamp_at_log FROM %s.ds_logs "
+                                         "WHERE log_index BETWEEN ?1 AND ?2;", run);
+            int rc = (zSql != nullptr) ? sqlite3_prepare_v2(db, zSql, -1, &scan, nullptr) : SQLITE_NOMEM;
+            sqlite3_free(zSql);
+            if (rc != SQLITE_OK) return false;
+            sqlite3_bind_int64(scan, 1, lo);
+            sqlite3_bind_int64(scan, 2, hi);
+        }
 
-        // Write to SD (while CPU was waiting, DMA was working!)
-        tx_mutex_get(&sd_io_mutex, TX_WAIT_FOREVER);
-        status = fx_file_write(&raw_file, sram_landing_zone, sz);
-        tx_mutex_put(&sd_io_mutex);
+        // The key columns of a row, through the same extract() as the staged records
+        DS_LOG_REC rec;
+        memset(&rec, 0, sizeof(rec));
+        uint32_t n = 0;
+        while (n < RING_DRAIN_MAX_LOGS && sqlite3_step(scan) == SQLITE_ROW) {
+            rec.log_index = (uint32_t)sqlite3_column_int64(scan, 0);
+            rec.cat_id = (uint16_t)sqlite3_column_int(scan, 1);
+            rec.severity = (uint32_t)sqlite3_column_int64(scan, 2);
+            rec.timestamp_at_log = (uint32_t)sqlite3_column_int64(scan, 3);
+            ix->extract(&rec, &index_sort_buf[n]);
+            index_sort_buf[n].log_index = rec.log_index;
+            n++;
+        }
+        sqlite3_reset(scan);
+        qsort(index_sort_buf, n, sizeof(INDEX_ENTRY), indexEntryCompare);
 
-        if (status != FX_SUCCESS) {
-            printf("\nERROR [STORAGE] Write Fail: 0x%02X\n", status);
-            break;
+        for (uint32_t e = 0; e < n; e++) {
+            for (uint32_t k = 0; k < ix->nkeys; k++) {
+                sqlite3_bind_int64(st->entry_stmt, 1 + k, index_sort_buf[e].key[k]);
+            }
+            sqlite3_bind_int64(st->entry_stmt, 1 + ix->nkeys, index_sort_buf[e].log_index);
+
+            int rc = sqlite3_step(st->entry_stmt);
+            sqlite3_reset(st->entry_stmt);
+            if (rc != SQLITE_DONE) {
+                printf("\nERROR [INDEX] %s entry failed: %d (%s)\n", ix->name, rc, sqlite3_errmsg(db));
+                sqlite3_finalize(scan);
+                return false;
+            }
         }
 
-        logs_rem -= count;
-        offset += count;
+        if (hi > st->high_water) {
+            if (!indexSetHighWater(i, hi)) { sqlite3_finalize(scan); return false; }
+            st->high_water = hi;
+        }
+        index_live_rows += n;
     }
 
-    fx_media_flush(&sdio_disk);
-    fx_file_close(&raw_file);
+    sqlite3_finalize(scan);
+    return true;
+}
 
-    return status;
+//=======================================================================================
+// Merges both runs completely (segment rollover) - stalls the ingestor for the whole merge
+//=======================================================================================
+bool MPLIB_STORAGE::flushL0() {
+    if (l0_rows[l0_active] > 0 && !freezeL0(true)) return false;
+
+    while (l0_rows[l0_active ^ 1] > 0) {
+        if (mergeL0Slice()) continue;
+        if (l0_slice_failures == 0) return false;
+        tx_thread_sleep(INGEST_RETRY_MS);
+    }
+    return true;
+}
+
+//=======================================================================================
+// WAL checkpoint scheduler - called between transactions, returns true if it checkpointed
+//   idle: nothing committed is waiting in the ring
+//=======================================================================================
+bool MPLIB_STORAGE::scheduleCheckpoint(bool idle) {
+    if (db == nullptr) return false;
+
+    uint32_t pending = wal_frames - wal_backfilled;
+    if (pending == 0) return false;
+
+    uint32_t budget_frames = (CKPT_BUDGET_MS * 1000U) / (ckpt_us_per_frame > 0 ? ckpt_us_per_frame : 1);
+    uint32_t backlog = ring_reserve - ring_tail;
+    bool forced = (pending >= CKPT_HARD_FRAMES);
+
+    if (!forced) {
+        if (backlog > CKPT_BACKLOG_BYTES) {
+            if (pending >= budget_frames) ckpt_deferred++;
+            return false;
+        }
+        // Busy: wait until a checkpoint is worth its budget. Idle: take any meaningful WAL
+        if (!(pending >= budget_frames || (idle && pending >= CKPT_MIN_FRAMES))) return false;
+    }
+
+    int wal_log = 0, wal_ckpt = 0;
+    uint32_t start = latencyClock();
+    int rc = sqlite3_wal_checkpoint_v2(db, NULL, SQLITE_CHECKPOINT_PASSIVE, &wal_log, &wal_ckpt);
+    uint32_t took_us = latencyTicksToUs(latencyClock() - start);
+
+    if (rc != SQLITE_OK) {
+        printf("\nWARN [CKPT] Checkpoint returned: %d (%s)\n", rc, sqlite3_errmsg(db));
+        return false;
+    }
+
+    uint32_t copied = (wal_ckpt > (int)wal_backfilled) ? (uint32_t)wal_ckpt - wal_backfilled : 0;
+    if (wal_ckpt >= wal_log) {
+        wal_frames = wal_backfilled = 0;    // Fully backfilled: the next commit restarts the WAL
+    } else {
+        wal_frames = (uint32_t)wal_log;
+        wal_backfilled = (wal_ckpt > 0) ? (uint32_t)wal_ckpt : 0;
+    }
+
+    // Learn the per-frame cost (EWMA 1/4) from checkpoints that copied enough to be representative
+    if (copied >= 16) ckpt_us_per_frame = (3 * ckpt_us_per_frame + took_us / copied) / 4;
+
+    latHistAdd(&ckpt_hist, took_us, 1);
+    ckpt_runs++;
+    ckpt_frames += copied;
+    if (forced) ckpt_forced++;
+    if (took_us > CKPT_BUDGET_MS * 1000U) ckpt_over_budget++;
+    return copied > 0;      // No progress (frames pinned): let the caller sleep
+}
+
+//=======================================================================================
+// Memory plan - the linked PSRAM sections and SQLite's page header against app_threadx.h
+//   Called before the engine is configured, prints ERROR lines for what does not match
+//=======================================================================================
+void MPLIB_STORAGE::checkMemoryPlan() {
+    struct { const char* name; const uint8_t* start; const uint8_t* end; uint32_t planned; bool budget; } sections[] = {
+        { ".psram_cache",   &__psram_pcache_start,  &__psram_pcache_end,  PLAN_PCACHE_BYTES,        false },
+        { ".psram_buffers", &__psram_buffers_start, &__psram_buffers_end, PLAN_PSRAM_BUFFERS_BYTES, true },
+        { ".psram_logs",    (const uint8_t*)&__psram_logs_start, (const uint8_t*)&__psram_logs_end, PLAN_PSRAM_LOGS_BYTES, false },
+        { ".psram_data",    &__psram_heap_start,    &__psram_heap_end,    PLAN_HEAP_BYTES,          false },
+    };
+    // A planned buffer must be in its section (not less), the pools of .psram_buffers within their budget
+    for (const auto& sec : sections) {
+        uint32_t linked = (uint32_t)(sec.end - sec.start);
+        bool match = sec.budget ? (linked <= sec.planned) : (linked >= sec.planned);
+        printf("\n%s [PLAN] %-14s %6lu KB linked, %6lu KB %s", match ? "OK" : "ERROR", sec.name,
+               linked / 1024, sec.planned / 1024, sec.budget ? "budget" : "planned");
+    }
+
+    // SQLITE_CONFIG_PCACHE_HDRSZ is only known at run time: a slot that is too small sends every page to the heap
+    unsigned slot_need = sqlite3_azure_pcache_slot_size(PLAN_PAGE_SIZE);
+    if (slot_need > PLAN_PCACHE_SLOT) {
+        printf("\nERROR [PLAN] PLAN_PCACHE_SLOT %u B < %u B that a %u B page needs, using %u B slots",
+               PLAN_PCACHE_SLOT, slot_need, PLAN_PAGE_SIZE, slot_need);
+    } else {
+        printf("\nOK [PLAN] Page cache slot %u B, %u B needed | %u slots", PLAN_PCACHE_SLOT, slot_need,
+               PLAN_PCACHE_BYTES / PLAN_PCACHE_SLOT);
+    }
+}
+
+//=======================================================================================
+// Memory rebalancer - called from the stats block (ingestor thread) once per window
+//   Lends idle SQLite heap or temp file pool memory to the page cache, or takes it back
+//=======================================================================================
+void MPLIB_STORAGE::rebalanceMemory() {
+#if REBALANCE_ENABLE
+    sqlite3_azure_pc_stats pcs;
+    sqlite3_azure_tmp_stats tmp;
+    sqlite3_int64 cur, hi;
+
+    sqlite3_azure_pcache_stats(&pcs, 0);
+    sqlite3_azure_temp_stats(&tmp, 0);
+    sqlite3_status64(SQLITE_STATUS_MEMORY_USED, &cur, &hi, 1);
+
+    // The chunks lent from the heap count as heap use, but they are not what the heap needs
+    rebalance_heap_peak = hi - (sqlite3_int64)rebalance_heap * REBALANCE_CHUNK;
+
+    bool temp_short = tmp.spills > 0 || tmp.in_use_max + REBALANCE_TEMP_RESERVE > tmp.pool - tmp.lent;
+    bool cache_short = pcs.free_slots == 0
+                       && pcs.evictions[SQLITE3_AZURE_PAGE_INTERIOR] + pcs.evictions[SQLITE3_AZURE_PAGE_LEAF]
+                          + pcs.evictions[SQLITE3_AZURE_PAGE_OTHER] > 0;
+    bool cache_idle = pcs.free_slots >= 2 * (REBALANCE_CHUNK / rebalance_slot_size);
+
+    // Give back: all an owner needs at once, one chunk per window while the cache leaves slots unused
+    while (rebalance_count > 0) {
+        bool heap_short = rebalance_heap > 0 && rebalance_heap_peak + REBALANCE_HEAP_RESERVE
+                          + (sqlite3_int64)rebalance_heap * REBALANCE_CHUNK > PLAN_HEAP_BYTES;
+        bool temp_back = temp_short && rebalance_count > rebalance_heap;
+        if (!heap_short && !temp_back && !cache_idle) break;
+
+        // Newest loan of the pool that needs it: the temp pool takes its chunks back newest first
+        int i = (int)rebalance_count - 1;
+        if (heap_short || temp_back) {
+            while (rebalance_loans[i].heap != heap_short) i--;
+        }
+        if (sqlite3_azure_pcache_reclaim(rebalance_loans[i].memory) != SQLITE_OK) {
+            rebalance_busy++;       // A page in it is pinned, next window
+            return;
+        }
+        if (rebalance_loans[i].heap) {
+            sqlite3_free(rebalance_loans[i].memory);
+            rebalance_heap--;
+        } else {
+            sqlite3_azure_temp_return(rebalance_loans[i].memory, REBALANCE_CHUNK);
+        }
+        for (uint32_t j = i + 1; j < rebalance_count; j++) rebalance_loans[j - 1] = rebalance_loans[j];
+        rebalance_count--;
+        rebalance_returned++;
+        if (!heap_short && !temp_back) return;
+    }
+
+    if (!cache_short || rebalance_count == REBALANCE_MAX_LOANS) return;
+
+    // Lend: heap first (memsys5 hands out a 64 KB block whole), then the top of the temp pool
+    void* memory = nullptr;
+    bool heap = false;
+    if (rebalance_heap_peak + REBALANCE_HEAP_RESERVE + (sqlite3_int64)(rebalance_heap + 1) * REBALANCE_CHUNK <= PLAN_HEAP_BYTES) {
+        memory = sqlite3_malloc(REBALANCE_CHUNK);
+        heap = (memory != nullptr);
+    }
+    if (memory == nullptr && !temp_short && tmp.in_use_max + REBALANCE_TEMP_RESERVE + REBALANCE_CHUNK <= tmp.pool - tmp.lent) {
+        memory = sqlite3_azure_temp_lend(REBALANCE_CHUNK);
+    }
+    if (memory == nullptr) return;
+
+    if (sqlite3_azure_pcache_lend(memory, REBALANCE_CHUNK) != SQLITE_OK) {
+        if (heap) sqlite3_free(memory);
+        else sqlite3_azure_temp_return(memory, REBALANCE_CHUNK);
+        return;
+    }
+    rebalance_loans[rebalance_count].memory = memory;
+    rebalance_loans[rebalance_count].heap = heap;
+    rebalance_count++;
+    if (heap) rebalance_heap++;
+    rebalance_lent++;
+#endif
 }
 
 //=======================================================================================
 // INGESTOR_DIRECT - Direct PSRAM to SQLite (bypasses raw files)
 //=======================================================================================
 void MPLIB_STORAGE::ingestor_direct(ULONG thread_input) {
-    const char *sql = "INSERT INTO ds_logs (log_index, message, category, token, local_log_index, timestamp_at_store, timestamp_at_log, severity) VALUES (?, ?, ?, ?, ?, ?, ?, ?);";
-    uint32_t buffer_counter = 0;
+    uint32_t txn_counter = 0;
     int rc;
 
+    stats_last_time = tx_time_get();
+
     while(1) {
         ULONG actual_flags;
-        // Wait for either buffer READY flag (0x01 | 0x02)
-        if (tx_event_flags_get(&staging_events, FLAG_BUF_A_READY | FLAG_BUF_B_READY,
-                               TX_OR, &actual_flags, TX_WAIT_FOREVER) != TX_SUCCESS) continue;
+        // Between transactions: the stats window and the rebalancer touch the ingestor's counters
+        if (tx_time_get() - stats_last_time >= STATS_WINDOW_MS) statsWindow();
+
+        // Commit when the adaptive target is reached, or earlier once the oldest committed
+        // record hits the latency deadline (partial flush)
+        // (or when half the ring is committed: large records can fill it before the target)
+        LOG_SPAN span;
+        uint32_t txn_logs = drainableRecords(RING_DRAIN_MAX_LOGS, &span);
+        uint32_t age_us = 0;
+        if (txn_logs > 0) {
+            uint32_t off = 0;
+            age_us = latencyTicksToUs(latencyClock() - logSpanNext(&span, &off)->timestamp_at_store);
+        }
+        bool deadline = (txn_logs > 0 && age_us >= INGEST_MAX_LATENCY_MS * 1000U);
+        bool ring_pressure = (span.bytes >= RING_CAPACITY_BYTES / 2);
+
+        if (txn_logs < batch_target && !deadline && !ring_pressure) {
+            // Slack: checkpoint, merge the frozen L0 run, then catch the deferred indexes up,
+            // one bounded slice at a time; sleep once all are current
+            if (scheduleCheckpoint(txn_logs == 0)) continue;
+            if (mergeL0Slice()) continue;
+            if (buildIndexSlice()) continue;
+
+            ULONG wait = LATENCY_CLOCK_REFRESH_TICKS;
+            if (txn_logs > 0)                     wait = (INGEST_MAX_LATENCY_MS * 1000U - age_us) / 1000U + 1;  // Until the deadline
+            else if (ring_reserve != ring_tail)   wait = 1;     // Reserved but not committed yet
+            tx_event_flags_get(&staging_events, FLAG_RING_DATA, TX_OR_CLEAR, &actual_flags, wait);
+            continue;
+        }
 
         // Reopen handle if needed
-        if (db == nullptr) {
-            if (sqlite3_open(DB_NAME, &db) != SQLITE_OK) {
-                printf("\nERROR [INGEST] Failed to open DB: %s\n", sqlite3_errmsg(db));
-                tx_thread_sleep(1000);
-                continue;
-            }
-            tuneDbConfig();
-            rc = sqlite3_prepare_v2(db, sql, -1, &insert_stmt, nullptr);
-            if (rc != SQLITE_OK) {
-                printf("\nERROR [INGEST] Prepare failed: %s\n", sqlite3_errmsg(db));
-                sqlite3_close_v2(db);
-                db = nullptr;
-                tx_thread_sleep(1000);
-                continue;
-            }
+        if (db == nullptr && !openSegment()) {
+            tx_thread_sleep(1000);
+            continue;
+        }
+
+        // The active L0 run must be able to take the whole drain, otherwise it is frozen first.
+        // If it can be neither, the drain stays in the ring and producers wait on the space
+        if (l0_on && !reserveL0(span.bytes)) {
+            tx_thread_sleep(INGEST_RETRY_MS);
+            continue;
         }
 
-        // Determine which buffer to consume
-        ULONG ready_bit = (actual_flags & FLAG_BUF_A_READY) ? FLAG_BUF_A_READY : FLAG_BUF_B_READY;
-        ULONG free_bit  = (ready_bit == FLAG_BUF_A_READY)   ? FLAG_BUF_A_FREE  : FLAG_BUF_B_FREE;
-        volatile DS_LOG_STRUCT* src_buffer = (ready_bit == FLAG_BUF_A_READY) ? psram_buffer_A : psram_buffer_B;
+        // Every committed record, up to RING_DRAIN_MAX_LOGS, goes into this transaction
+        sqlite3_int64 txn_max_key;
+        invalidateSpan(&span);
+        bool append_ok = isAppendOnly(&span, max_rowid, &txn_max_key);
 
-        SCB_InvalidateDCache_by_Addr((uint32_t*)src_buffer, LOGS_PER_BUFFER * sizeof(DS_LOG_STRUCT));
+        // Bench builds run the first transactions on the single-row path for the before/after comparison
+        INSERT_PATH path = selectInsertPath(INSERT_BENCH_BASELINE && txn_counter < INSERT_BATCH_BASELINE_TXNS);
 
         uint32_t start_time = tx_time_get();
+        uint32_t ingest_start = latencyClock();
 
-        // --- SINGLE TRANSACTION PER BUFFER ---
+        // --- SINGLE TRANSACTION PER DRAIN ---
         rc = sqlite3_exec(db, "BEGIN TRANSACTION;", NULL, NULL, NULL);
         if (rc != SQLITE_OK) {
             printf("\nERROR [INGEST] BEGIN failed: %s\n", sqlite3_errmsg(db));
-            // Release: clear READY, set FREE so simulator isn't stuck forever
-            tx_event_flags_set(&staging_events, ~ready_bit, TX_AND);
-            tx_event_flags_set(&staging_events, free_bit, TX_OR);
+            failedSpan(&span);
             continue;
         }
 
-        bool batch_ok = true;
-        for (uint32_t i = 0; i < LOGS_PER_BUFFER; i++) {
-            int step_rc = this->bindAndStep((const DS_LOG_STRUCT&)src_buffer[i]);
-            if (step_rc != SQLITE_DONE) {
-                printf("\nERROR [INGEST] Insert %lu failed: %d (%s)\n",
-                       i, step_rc, sqlite3_errmsg(db));
-                batch_ok = false;
-                break;
-            }
+        // Category names -> dictionary ids (new names are inserted in this transaction)
+        if (!resolveCategories(&span)) {
+            printf("\nWARN [CATDICT] Unresolved categories in this batch, stored as NULL\n");
         }
 
+        // From the insert steps to COMMIT, transient allocations come from the arena, which starts
+        // over at COMMIT. It opens after the category inserts: the steps' statements are prepared
+        sqlite3_azure_mem_arena(1);
+        uint32_t insert_cycles = DWT->CYCCNT;
+        bool batch_ok = (this->insertBuffer(&span, path) == SQLITE_DONE);
+        insert_cycles = DWT->CYCCNT - insert_cycles;
+        batch_ok = batch_ok && maintainIndexes(&span, append_ok, txn_max_key);
+
         if (batch_ok) {
             rc = sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL);
             if (rc != SQLITE_OK) {
                 printf("\nERROR [INGEST] COMMIT failed: %s\n", sqlite3_errmsg(db));
                 sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+                batch_ok = false;
             }
         } else {
             sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
         }
+        sqlite3_azure_mem_arena(0);
+        if (!batch_ok) {
+            loadCategories();   // Forget ids of rolled-back ds_categories rows
+            loadIndexState();   // and high-water marks of rolled-back index entries
+            failedSpan(&span);  // Neither released nor counted until it is stored or quarantined
+            continue;
+        }
+        span_failures = 0;
 
         // Update stats
         uint32_t elapsed = tx_time_get() - start_time;
-        ing_total_logs += LOGS_PER_BUFFER;
+        ing_total_logs += txn_logs;
         ing_last_time = tx_time_get();
+        ins_rows[path] += txn_logs;
+        ins_ticks[path] += elapsed;
+        ins_cycles += insert_cycles;
+        ins_cycle_rows += txn_logs;
+        max_rowid = txn_max_key;
+        if (l0_on) {
+            if (l0_rows[l0_active] == 0) l0_started = tx_time_get();
+            l0_rows[l0_active] += txn_logs;
+        } else {
+            main_rowid = txn_max_key;
+        }
+
+        // Ingest-start and commit stamps are shared by the whole transaction: COMMIT
+        // is recorded once with weight txn_logs, queue/total once per record
+        uint32_t commit = latencyClock();
+        latHistAdd(&lat_hist[LAT_STAGE_COMMIT], commit - ingest_start, txn_logs);
+        uint32_t off = 0;
+        for (const DS_LOG_REC* rec = logSpanNext(&span, &off); rec != nullptr; rec = logSpanNext(&span, &off)) {
+            uint32_t stored = rec->timestamp_at_store;
+            latHistAdd(&lat_hist[LAT_STAGE_QUEUE], ingest_start - stored, 1);
+            latHistAdd(&lat_hist[LAT_STAGE_TOTAL], commit - stored, 1);
+        }
+
+        batch_txns++;
+        batch_logs += txn_logs;
+        if (txn_logs > batch_max) batch_max = txn_logs;
+        if (deadline && txn_logs < batch_target) batch_deadline_flushes++;
+
+        // Release records: advance the tail, then signal SPACE to unblock producers
+        releaseSpan(&span);
+
+        // ADAPT: still behind after this commit -> bigger transactions amortize COMMIT + WAL
+        // append; drained down to a trickle -> smaller ones keep latency low
+        LOG_SPAN next;
+        uint32_t backlog = drainableRecords(batch_target, &next);
+        if (backlog >= batch_target && batch_target < RING_DRAIN_MAX_LOGS) {
+            batch_target *= 2;
+            if (batch_target > RING_DRAIN_MAX_LOGS) batch_target = RING_DRAIN_MAX_LOGS;
+        } else if (backlog < batch_target / 4 && batch_target > INGEST_MIN_BATCH_LOGS) {
+            batch_target /= 2;
+            if (batch_target < INGEST_MIN_BATCH_LOGS) batch_target = INGEST_MIN_BATCH_LOGS;
+        }
+
+        printf("\n>> [INGEST] %lu logs%s Done | %lu ms | Rate: %lu l/s | Path: %s\n",
+               txn_logs, deadline ? " (deadline)" : "", elapsed,
+               (txn_logs * 1000 / (elapsed > 0 ? elapsed : 1)),
+               ins_path_names[path]);
+
+        // Records are already released: a checkpoint here only delays the next drain, and the
+        // scheduler keeps it within CKPT_BUDGET_MS unless the WAL hits CKPT_HARD_WAL_BYTES
+        txn_counter++;
+        scheduleCheckpoint(false);
+
+        // Segment rollover between transactions: closing the segment also checkpoints it
+        seg_rows += txn_logs;
+        if (segmentFull()) {
+            if (!rollSegment()) {
+                printf("\nERROR [SEGMENT] Rollover to %s failed, retrying on next batch\n", db_name);
+            }
+        }
+    }
+}
+
+//=======================================================================================
+// QUERY SERVICE - read-only cursors for other threads, see QUERY_* in MPLIB_STORAGE.h
+//=======================================================================================
+int MPLIB_STORAGE::query(QUERY_REQUEST* req) {
+    if (req == nullptr) return SQLITE_MISUSE;
+
+    req->status = SQLITE_ERROR;
+    if (tx_semaphore_create(&req->done, (CHAR*)"Query Done", 0) != TX_SUCCESS) return req->status;
+
+    ULONG msg = (ULONG)(uintptr_t)req;
+    if (tx_queue_send(&query_queue, &msg, TX_WAIT_FOREVER) == TX_SUCCESS) {
+        tx_semaphore_get(&req->done, TX_WAIT_FOREVER);
+    }
+
+    tx_semaphore_delete(&req->done);
+    return req->status;
+}
+
+//=======================================================================================
+// Reader connection on the write segment. It is opened read-write without CREATE and kept
+// query_only: when the writer has moved on, this connection is the last one on the old segment,
+// and its close checkpoints that segment's WAL here instead of in the ingestor.
+// The recent closed segments are attached as on the ingest connection, so ds_logs_all and the
+// index _all views exist here too (the TEMP views go in before query_only is set)
+//=======================================================================================
+bool MPLIB_STORAGE::openQueryConnection() {
+    uint32_t seq = seg_seq;
+    if (query_db != nullptr && query_seq == seq) return true;
+
+    closeQueryConnection();
+
+    char name[24];
+    segmentName(seq, name, sizeof(name));
+    if (sqlite3_open_v2(name, &query_db, SQLITE_OPEN_READWRITE, nullptr) != SQLITE_OK) {
+        printf("\nWARN [QUERY] Failed to open %s: %s\n", name, sqlite3_errmsg(query_db));
+        sqlite3_close_v2(query_db);
+        query_db = nullptr;
+        return false;
+    }
+
+    char pragmas[96];
+    snprintf(pragmas, sizeof(pragmas), "PRAGMA cache_size = -%u; PRAGMA temp_store = MEMORY;", QUERY_CACHE_KB);
+    sqlite3_exec(query_db, pragmas, NULL, NULL, NULL);
+    sqlite3_busy_timeout(query_db, QUERY_BUSY_TIMEOUT_MS);
+
+    uint32_t attached = attachSegments(query_db, seq, false);
+    sqlite3_exec(query_db, "PRAGMA query_only = ON;", NULL, NULL, NULL);
+
+    // Snapshot probe: right after a rollover main is still empty, the newest attached segment has the edge
+    char* zSql = (attached > 0)
+        ? sqlite3_mprintf("SELECT coalesce((SELECT max(log_index) FROM main.ds_logs), "
+                          "(SELECT max(log_index) FROM seg_%lu.ds_logs));", seq - 1)
+        : sqlite3_mprintf("SELECT max(log_index) FROM main.ds_logs;");
+    int rc = (zSql != nullptr) ? sqlite3_prepare_v2(query_db, zSql, -1, &query_max_stmt, nullptr) : SQLITE_NOMEM;
+    sqlite3_free(zSql);
+    if (rc != SQLITE_OK) {
+        printf("\nWARN [QUERY] %s has no ds_logs yet: %s\n", name, sqlite3_errmsg(query_db));
+        closeQueryConnection();
+        return false;
+    }
+
+    query_seq = seq;
+    printf("\nOK [QUERY] Reader connection on %s, %lu older segments attached\n", name, attached);
+    return true;
+}
+
+void MPLIB_STORAGE::closeQueryConnection() {
+    closeQueryCursor();
+    if (query_max_stmt) { sqlite3_finalize(query_max_stmt); query_max_stmt = nullptr; }
+    if (query_db) { sqlite3_close_v2(query_db); query_db = nullptr; }
+}
+
+// Ends the cursor and with it the read transaction, so checkpoints can backfill past the snapshot again
+void MPLIB_STORAGE::closeQueryCursor() {
+    if (query_stmt == nullptr) return;
+
+    sqlite3_finalize(query_stmt);
+    query_stmt = nullptr;
+    query_owner = nullptr;
+    query_row_pending = false;
+    sqlite3_exec(query_db, "COMMIT;", NULL, NULL, NULL);
+}
+
+//=======================================================================================
+// Steps the cursor into req->page. A row that no longer fits stays pending for the next page
+//=======================================================================================
+void MPLIB_STORAGE::fillQueryPage(QUERY_REQUEST* req) {
+    uint32_t used = 0;
+    int rc = SQLITE_ROW;
+    const int columns = sqlite3_column_count(query_stmt);
+
+    // Commits since the snapshot was taken (log_index is global, so this holds across a rollover too).
+    // Rows still in the L0 runs are part of it: they only reach this connection once merged, and
+    // are reported separately rather than merged on the query path, which would stall the ingest
+    sqlite3_int64 newest = max_rowid;
+    query_lag = (newest > query_snapshot) ? newest - query_snapshot : 0;
+    UINT interrupts = tx_interrupt_control(TX_INT_DISABLE);
+    if (query_lag > query_lag_max) query_lag_max = query_lag;
+    tx_interrupt_control(interrupts);
+    req->snapshot_index = query_snapshot;
+    req->snapshot_lag = query_lag;
+    req->l0_pending = L0_TIER_ENABLE ? (int64_t)l0_rows[0] + l0_rows[1] : 0;
+
+    if (req->page == nullptr || req->page_bytes < 2) {
+        req->status = SQLITE_MISUSE;
+        return;
+    }
+
+    for (;;) {
+        if (!query_row_pending) {
+            rc = sqlite3_step(query_stmt);
+            if (rc != SQLITE_ROW) break;
+        }
+        query_row_pending = false;
+
+        uint32_t need = 0;
+        for (int c = 0; c < columns; c++) {
+            sqlite3_column_text(query_stmt, c);
+            need += (uint32_t)sqlite3_column_bytes(query_stmt, c) + 1;    // Text + '\t' or '\n'
+        }
 
-        // Release buffer: clear READY bit, then signal FREE to unblock simulator
-        tx_event_flags_set(&staging_events, ~ready_bit, TX_AND);
-        tx_event_flags_set(&staging_events, free_bit, TX_OR);
+        if (used + need >= req->page_bytes && req->rows > 0) {
+            query_row_pending = true;
+            rc = SQLITE_ROW;
+            break;
+        }
+
+        for (int c = 0; c < columns; c++) {
+            const char* text = (const char*)sqlite3_column_text(query_stmt, c);
+            uint32_t len = (uint32_t)sqlite3_column_bytes(query_stmt, c);
+            if (used + len + 1 >= req->page_bytes) len = req->page_bytes - used - 2;  // Row longer than a page
+            if (text) memcpy(req->page + used, text, len);
+            used += len;
+            req->page[used++] = (c + 1 < columns) ? '\t' : '\n';
+            if (used + 1 >= req->page_bytes) break;
+        }
+        req->rows++;
+
+        if (used + 1 >= req->page_bytes) {
+            rc = SQLITE_ROW;
+            break;
+        }
+    }
+    req->page[used] = '\0';
 
-        printf("\n>> [INGEST] Buffer %s Done | %lu ms | Rate: %lu l/s\n",
-               (ready_bit == FLAG_BUF_A_READY ? "A" : "B"), elapsed,
-               (LOGS_PER_BUFFER * 1000 / (elapsed > 0 ? elapsed : 1)));
+    req->status = rc;
+    query_pages++;
+    query_rows += req->rows;
+    query_last_use = tx_time_get();
 
-        buffer_counter++;
-        if (buffer_counter % 5 == 0) {
-            sqlite3_wal_checkpoint_v2(db, NULL, SQLITE_CHECKPOINT_PASSIVE, NULL, NULL);
+    if (rc != SQLITE_ROW) {
+        if (rc != SQLITE_DONE) {
+            printf("\nWARN [QUERY] Step failed: %s\n", sqlite3_errmsg(query_db));
+            query_errors++;
         }
+        closeQueryCursor();
     }
 }
 
+//=======================================================================================
+// QUERY SERVICE thread
+//=======================================================================================
+void MPLIB_STORAGE::queryService(ULONG thread_input) {
+    ULONG msg;
+
+    while (!started) tx_thread_sleep(100);
+    printf("\nOK [QUERY] Query service online (priority %u, cursor timeout %u ms)\n",
+           QUERY_PRIORITY, QUERY_CURSOR_TIMEOUT_MS);
+
+    while (1) {
+        if (tx_queue_receive(&query_queue, &msg, QUERY_CURSOR_TIMEOUT_MS) != TX_SUCCESS) {
+            // Idle: an abandoned cursor must not pin its snapshot, and once the writer
+            // has rolled over the old segment is let go (and checkpointed) here
+            if (query_stmt != nullptr && tx_time_get() - query_last_use >= QUERY_CURSOR_TIMEOUT_MS) {
+                closeQueryCursor();
+                query_expired++;
+            }
+            if (query_stmt == nullptr && query_db != nullptr && query_seq != seg_seq) {
+                closeQueryConnection();
+            }
+            continue;
+        }
+
+        QUERY_REQUEST* req = (QUERY_REQUEST*)(uintptr_t)msg;
+        req->rows = 0;
+        req->snapshot_index = query_snapshot;
+        req->snapshot_lag = query_lag;
+        req->l0_pending = 0;
+
+        switch (req->op) {
+            case QUERY_OP_OPEN: {
+                if (query_stmt != nullptr) {
+                    if (query_owner != req && tx_time_get() - query_last_use < QUERY_CURSOR_TIMEOUT_MS) {
+                        req->status = SQLITE_BUSY;
+                        query_busy++;
+                        break;
+                    }
+                    if (query_owner != req) query_expired++;
+                    closeQueryCursor();
+                }
+                if (!openQueryConnection()) {
+                    req->status = SQLITE_CANTOPEN;
+                    query_errors++;
+                    break;
+                }
+
+                int rc = sqlite3_prepare_v2(query_db, req->sql, -1, &query_stmt, nullptr);
+                if (rc == SQLITE_OK && query_stmt == nullptr) rc = SQLITE_MISUSE;     // Empty SQL
+                if (rc == SQLITE_OK && !sqlite3_stmt_readonly(query_stmt)) rc = SQLITE_READONLY;
+                if (rc != SQLITE_OK) {
+                    printf("\nWARN [QUERY] Rejected (%d): %s\n", rc, sqlite3_errmsg(query_db));
+                    sqlite3_finalize(query_stmt);
+                    query_stmt = nullptr;
+                    req->status = rc;
+                    query_errors++;
+                    break;
+                }
+
+                // One read transaction for the probe and every page: they all see the same snapshot
+                sqlite3_exec(query_db, "BEGIN;", NULL, NULL, NULL);
+                query_snapshot = -1;
+                if (sqlite3_step(query_max_stmt) == SQLITE_ROW &&
+                    sqlite3_column_type(query_max_stmt, 0) != SQLITE_NULL) {
+                    query_snapshot = sqlite3_column_int64(query_max_stmt, 0);
+                }
+                sqlite3_reset(query_max_stmt);
+
+                query_owner = req;
+                query_row_pending = false;
+                query_opens++;
+                fillQueryPage(req);
+                break;
+            }
+            case QUERY_OP_NEXT:
+                if (query_stmt == nullptr || query_owner != req) {
+                    req->status = SQLITE_ABORT;     // Never opened, finished or expired
+                    break;
+                }
+                fillQueryPage(req);
+                break;
+            case QUERY_OP_CLOSE:
+                if (query_owner == req) closeQueryCursor();
+                req->status = SQLITE_DONE;
+                break;
+            default:
+                req->status = SQLITE_MISUSE;
+                break;
+        }
+
+        tx_semaphore_put(&req->done);
+    }
+}
@@ -30,22 +30,183 @@
 #define SIMULATOR_STACK_SIZE		4*1024
 #define INGESTION_STACK_SIZE		80*1024
 #define STORAGE_STACK_SIZE			12*1024
+#define QUERY_STACK_SIZE			24*1024
+
+// Segmented staging ring in PSRAM (replaces the fixed A/B double buffer)
+//   RING_SEGMENTS x RING_SEGMENT_BYTES = PSRAM footprint (how big a burst can be absorbed)
+//   RING_SEGMENT_BYTES                 = hand-off granularity (the ingestor is woken per filled segment)
+//   RING_DRAIN_MAX_LOGS                = max records committed in one transaction
+// The ring holds variable-length DS_LOG_REC records (see below), so its capacity in logs depends
+// on message sizes: ~64 B for a short message vs 224 B for the old fixed slot.
+// Any number of threads may call captureLog()/captureRecord(): space is reserved with an atomic
+// fetch-add (LDREX/STREX) on a free-running byte position and published through a commit word.
+#define RING_SEGMENT_BYTES  (256 * 1024)	// 256KB per segment
+#define RING_SEGMENTS       32			// 32 segments = 8MB of 32MB PSRAM (~131K short logs)
+#define RING_DRAIN_MAX_LOGS 16384		// Up to 16384 logs per COMMIT
+
+#define RING_CAPACITY_BYTES (RING_SEGMENTS * RING_SEGMENT_BYTES)
+
+#if (RING_SEGMENTS & (RING_SEGMENTS - 1)) != 0 || (RING_SEGMENT_BYTES & (RING_SEGMENT_BYTES - 1)) != 0
+#error "RING_SEGMENTS and RING_SEGMENT_BYTES must be powers of two (free-running 32-bit positions)"
+#endif
 
-#define LOGS_PER_BUFFER 16384	// 16384 logs × 224B = ~3.6MB per buffer (×2 = 7.2MB of 32MB PSRAM)
-
-// Event flag bits for double-buffer synchronization
-//   0x01 = Buffer A ready (full, waiting for ingestor)
-//   0x02 = Buffer B ready (full, waiting for ingestor)
-//   0x04 = Buffer A free  (ingestor done, simulator may write)
-//   0x08 = Buffer B free  (ingestor done, simulator may write)
-#define FLAG_BUF_A_READY  0x01
-#define FLAG_BUF_B_READY  0x02
-#define FLAG_BUF_A_FREE   0x04
-#define FLAG_BUF_B_FREE   0x08
+// Latency-targeted adaptive batching (ingestor_direct)
+//   The ingestor commits once INGEST_MIN_BATCH_LOGS..RING_DRAIN_MAX_LOGS records are committed
+//   (adaptive target), or earlier when the oldest record has waited INGEST_MAX_LATENCY_MS ticks
+//   (partial flush). The target doubles while a backlog remains after a commit and halves once idle.
+#define INGEST_MAX_LATENCY_MS   1000
+#define INGEST_MIN_BATCH_LOGS   1024
+
+// A drain whose transaction fails stays in the ring and is tried again after INGEST_RETRY_MS, up to
+// INGEST_RETRY_MAX times; then its records are written to quarantine_<n>.raw (raw-file format) and
+// released, so one bad span can neither stall the producers nor be counted as ingested
+#define INGEST_RETRY_MAX        3
+#define INGEST_RETRY_MS         100
+
+// Event flag bits for ring synchronization
+//   0x01 = A record crossing a segment boundary was committed (producer -> ingestor)
+//   0x02 = Segment released  (ingestor -> producer, ring has space again)
+#define FLAG_RING_DATA    0x01
+#define FLAG_RING_SPACE   0x02
 
 // OPTIMIZATION: Larger chunk size for fewer mutex cycles
 #define WRITE_CHUNK_SIZE 512  // 512 logs × 224B = 114,688 bytes (~112KB)
 
+// OPTIMIZATION: Multi-row INSERT ... VALUES (...),(...) — one sqlite3_step() per group of rows
+// 16/32/64 are sensible (8 binds per row, 64 rows = 512 host parameters). 1 = legacy single-row path
+#define INSERT_BATCH_ROWS 32
+#define INSERT_COLUMNS 8
+
+// OPTIMIZATION: Set-based insert — one INSERT INTO ds_logs SELECT ... FROM psram_batch(?) per buffer
+// psram_batch is an eponymous read-only virtual table whose columns point straight into PSRAM records
+#define INSERT_PSRAM_VTAB 1
+
+// Category dictionary: ds_logs stores an integer category_id, names live once in ds_categories(id, name)
+// and the ds_logs_v view joins them back. The ingestor keeps an open-addressing hash map of known names
+// (CAT_DICT_SLOTS, power of two) so resolving a category is a hash + memcmp, never a query; names past
+// CAT_DICT_MAX_ENTRIES are still stored, they just cost a ds_categories lookup on every miss.
+#define CAT_DICT_SLOTS          256
+#define CAT_DICT_MAX_ENTRIES    192     // 75% load factor
+
+#if (CAT_DICT_SLOTS & (CAT_DICT_SLOTS - 1)) != 0 || CAT_DICT_MAX_ENTRIES >= CAT_DICT_SLOTS
+#error "CAT_DICT_SLOTS must be a power of two larger than CAT_DICT_MAX_ENTRIES"
+#endif
+
+// Deferred secondary indexes (see deferred_indexes[] in MPLIB_STORAGE.cpp)
+// Each index is a WITHOUT ROWID (key..., log_index) table that covers ds_logs up to a high-water
+// log_index persisted in ds_index_state. The ingestor catches it up in slices of at most
+// INDEX_BUILD_SLICE_ROWS rows whenever it would otherwise sleep, so bulk ingest never pays for the
+// index. Its ds_logs_by_* view seeks the index below the high-water mark and scans only the tail above it.
+#define INDEX_BUILD_DEFERRED    1
+#define INDEX_BUILD_SLICE_ROWS  2048
+
+// Live sorted index maintenance: once an index has caught up, each ingest transaction sorts its
+// entries by key (PSRAM buffer) and merges them in key order before COMMIT, so an index leaf is
+// touched once per batch rather than once per row. 0 = indexes are only built by the slices above
+#define INDEX_MAINTAIN_SORTED   1
+
+// Segmented storage: the ingestor writes logs_<seq>.db and rolls over to the next segment when
+// the current one reaches SEGMENT_MAX_ROWS rows, SEGMENT_MAX_BYTES bytes or SEGMENT_WINDOW_MS of
+// wall-clock time (0 disables a criterion). Each segment is a complete database (ds_logs, dictionary,
+// deferred indexes), so its B-tree stays shallow and insert cost stays flat however long the device
+// runs. The SEGMENT_ATTACH_MAX most recent closed segments are ATTACHed read-only behind the TEMP
+// view ds_logs_all (UNION ALL). Beyond SEGMENT_RETAIN_MAX segments or SEGMENT_RETAIN_BYTES on the
+// card, the oldest segment is dropped with a file delete - no DELETE statement, no vacuum. A delete
+// that fails (the query connection lets go of an old segment only once idle) is retried at the next
+// rollover; SEGMENT_RETAIN_SLOTS sizes are tracked so the late segments stay in the byte budget.
+#define SEGMENT_PREFIX          "logs_"
+#define SEGMENT_MAX_ROWS        (4UL * 1024 * 1024)
+#define SEGMENT_MAX_BYTES       (1024ULL * 1024 * 1024)     // 1 GB, well below the FAT32 4 GB file limit
+#define SEGMENT_WINDOW_MS       (60UL * 60 * 1000)          // 1 hour
+#define SEGMENT_SIZE_CHECK_MS   5000                        // Page count re-read at most this often
+#define SEGMENT_ATTACH_MAX      4                           // <= SQLITE_MAX_ATTACHED (10)
+#define SEGMENT_RETAIN_MAX      16                          // Segments on the card, current one included
+#define SEGMENT_RETAIN_BYTES    (8ULL * 1024 * 1024 * 1024)
+#define SEGMENT_RETAIN_SLOTS    (2 * SEGMENT_RETAIN_MAX)    // Sizes kept, retained plus deletes pending
+
+#if SEGMENT_ATTACH_MAX >= SEGMENT_RETAIN_MAX
+#error "SEGMENT_ATTACH_MAX must be smaller than SEGMENT_RETAIN_MAX"
+#endif
+
+// PSRAM hot tier (two-level LSM): ingest transactions commit into an in-memory run, an SQLite
+// database deserialized over a PSRAM image and attached as l0_0 / l0_1, so a COMMIT writes no WAL and
+// touches no SD sector. The run taking the ingest is frozen once the next batch might not fit it, or
+// once it holds rows older than L0_MAX_AGE_MS; the other run takes over and the frozen one is merged
+// into the segment in log_index order (sequential right-edge appends), L0_MERGE_SLICE_ROWS rows per
+// transaction whenever the ingestor would otherwise sleep, then emptied in one call. ds_logs_all and
+// the <index view>_all views include both runs. Rows still in PSRAM are lost on power failure, like
+// anything synchronous = OFF has not written yet: at most two runs, or about 2 x L0_MAX_AGE_MS of logs.
+// A slice that fails INGEST_RETRY_MAX merges is quarantined like a failed drain; while the active run
+// is full and cannot be frozen, drains stay in the ring.
+#define L0_TIER_ENABLE          1
+#define L0_RUN_BYTES            (6UL * 1024 * 1024)         // Per run, two runs
+#define L0_MAX_AGE_MS           10000
+#define L0_MERGE_SLICE_ROWS     8192
+
+// A drain is capped at half the ring (ring_pressure), and an empty run must always take one
+#if L0_TIER_ENABLE && (L0_RUN_BYTES < RING_CAPACITY_BYTES / 2 + RING_CAPACITY_BYTES / 8)
+#error "L0_RUN_BYTES must hold a half-ring drain plus B-tree overhead"
+#endif
+
+// A merge slice goes through the index sort buffer in one piece
+#if L0_TIER_ENABLE && (L0_MERGE_SLICE_ROWS > RING_DRAIN_MAX_LOGS)
+#error "L0_MERGE_SLICE_ROWS must not exceed RING_DRAIN_MAX_LOGS"
+#endif
+
+// WAL checkpoint scheduler (ingestor_direct, between transactions - never inside the drain)
+// A checkpoint cannot be split, so the stall it adds is bounded through its size: the scheduler
+// starts one as soon as the pending frames would take about CKPT_BUDGET_MS to copy (per-frame cost
+// learned from previous checkpoints), defers while more than CKPT_BACKLOG_BYTES wait in the ring,
+// and only overrides the backlog once the WAL holds CKPT_HARD_WAL_BYTES (CKPT_HARD_FRAMES frames
+// of the page size). With the ring empty, any WAL of at least CKPT_MIN_FRAMES is checkpointed in the slack.
+#define CKPT_BUDGET_MS          25
+#define CKPT_MIN_FRAMES         64
+#define CKPT_HARD_WAL_BYTES     (32UL * 1024 * 1024)
+#define CKPT_BACKLOG_BYTES      (RING_CAPACITY_BYTES / 4)
+
+// Read-query service (query thread, QUERY_PRIORITY - always below the ingestor's 5)
+// Clients hand QUERY_REQUESTs to StorageQuery(); the service runs them on its own connection to the
+// write segment, inside one read transaction per cursor, so every page of a result comes from the
+// same WAL snapshot. A WAL reader never holds a lock a COMMIT waits for - an open snapshot only stops
+// checkpoints from backfilling past it - so a cursor left idle for QUERY_CURSOR_TIMEOUT_MS is closed.
+// QUERY_CACHE_KB bounds the reader's share of the page cache so it cannot evict the ingestor's pages.
+// The reader attaches the recent closed segments like the writer (ds_logs_all works there too), but
+// the L0 runs exist on the ingest connection only (a deserialized image is private to its connection,
+// and the ingestor rewrites it in place). A query sees rows once they are merged: every page reports
+// the lag of its snapshot, L0 rows included, and how many committed rows are still in the runs.
+#define QUERY_PRIORITY          12
+#define QUERY_QUEUE_DEPTH       8
+#define QUERY_CACHE_KB          256
+#define QUERY_CURSOR_TIMEOUT_MS 2000
+#define QUERY_BUSY_TIMEOUT_MS   100
+
+// PSRAM memory rebalancer (stats block, every 5 s)
+// The split of PSRAM between the SQLite buffers is the plan in app_threadx.h, checked when building and
+// at boot. While the page cache is recycling pages with no free slot, idle memory of the SQLite heap
+// (memsys5, above its high-water mark plus REBALANCE_HEAP_RESERVE) or of the VFS temporary file pool
+// (above REBALANCE_TEMP_RESERVE) is lent to it, one REBALANCE_CHUNK per window. A chunk goes back once
+// its owner's high-water mark comes within the reserve (or the temp pool spilled), or once the cache
+// leaves two chunks of slots unused for a whole window. The staging ring and the write-behind pool are
+// rings indexed by free-running positions and keep their planned size
+#define REBALANCE_ENABLE        1
+#define REBALANCE_CHUNK         (64 * 1024)                 // A memsys5 block, and 16 temp pool blocks
+#define REBALANCE_MAX_LOANS     32                          // 2 MB on top of the planned page cache
+#define REBALANCE_HEAP_RESERVE  (256 * 1024)
+#define REBALANCE_TEMP_RESERVE  (512 * 1024)
+
+// Bench builds only: the first N ingest transactions go through the single-row path so the stats block
+// can show a before/after rate. Production builds (0) never slow real data down for the comparison
+#define INSERT_BENCH_BASELINE      0
+#define INSERT_BATCH_BASELINE_TXNS 2
+
+// Insert strategy used for one buffer (also indexes the per-path rate counters)
+typedef enum {
+    INSERT_PATH_SINGLE = 0,   // bindAndStep() per log
+    INSERT_PATH_BATCH,        // bindAndStepBatch() per INSERT_BATCH_ROWS logs
+    INSERT_PATH_VTAB,         // INSERT ... SELECT FROM psram_batch() per buffer
+    INSERT_PATH_COUNT
+} INSERT_PATH;
+
 // perfectly aligned 224-byte struct
 typedef struct __attribute__((packed, aligned(32))) {
     uint32_t log_index;
@@ -59,6 +220,42 @@ typedef struct __attribute__((packed, aligned(32))) {
     uint8_t reserved[16];
 } DS_LOG_STRUCT, *DS_LOG_STRUCT_PTR;
 
+// DS_LOG_REC and the ring protocol (reserve, commit word, drain, wrap padding) live in MPLIB_RING.h
+#include "MPLIB_RING.h"
+
+#define LOG_REC_MAX_SIZE    ((LOG_REC_HEADER_SIZE + CAT_LENGTH + LOG_LENGTH + LOG_REC_ALIGN - 1) & ~(LOG_REC_ALIGN - 1))
+
+// Query service request. OPEN prepares sql (one read-only statement), starts the snapshot and fills
+// the first page; NEXT fills the following pages; CLOSE drops the cursor early (it closes by itself
+// after the last page). Pages hold the columns '\t'-separated, every row '\n'-terminated, NUL at the end;
+// a single row longer than the page is truncated.
+typedef enum {
+    QUERY_OP_OPEN = 0,
+    QUERY_OP_NEXT,
+    QUERY_OP_CLOSE
+} QUERY_OP;
+
+typedef struct {
+    QUERY_OP op;
+    const char* sql;                // QUERY_OP_OPEN only
+    char* page;
+    uint32_t page_bytes;
+    uint32_t rows;                  // Rows in this page
+    int status;                     // SQLITE_ROW: more pages, SQLITE_DONE: last page, else the error
+    int64_t snapshot_index;         // Newest log_index visible in the snapshot (-1 = empty segment)
+    int64_t snapshot_lag;           // Committed log_index values newer than the snapshot when the page was filled
+    int64_t l0_pending;             // Of the committed rows, those still in the PSRAM runs (not visible to queries)
+    TX_SEMAPHORE done;              // Used by StorageQuery()
+} QUERY_REQUEST;
+
+// A committed run of the staging ring handed to the insert paths: [from, from + bytes), pads included
+typedef struct {
+    const uint8_t* base;            // Ring start
+    uint32_t from;                  // Ring position of the run (bytes, free-running)
+    uint32_t bytes;
+    uint32_t logs;                  // Real (non-pad) records in the run
+} LOG_SPAN;
+
 
 //=======================================================================================
 // C THREAD ENTRY POINTS
@@ -76,6 +273,22 @@ void ingestion_thread_entry(ULONG thread_input);
 
 void ingestion_direct_thread_entry(ULONG thread_input);
 
+void query_thread_entry(ULONG thread_input);
+
+// Thread-safe, lock-free log capture for any ThreadX thread (blocks only when the ring is full,
+// so never call it from an ISR). StorageCaptureRecord() takes explicit lengths and skips the
+// fixed-size struct; StorageCaptureLog() is kept for existing DS_LOG_STRUCT producers.
+// The log_index (ds_logs key) is assigned at reservation from one counter, so concurrent producers
+// never collide: StorageCaptureRecord() returns it, StorageCaptureLog() stores it in log->log_index.
+void StorageCaptureLog(DS_LOG_STRUCT* log);
+
+uint32_t StorageCaptureRecord(uint32_t token, uint32_t timestamp_at_log, uint32_t severity,
+                              const char* category, uint32_t cat_len, const char* message, uint32_t msg_len);
+
+// Runs one step of a read query on the query service thread and blocks the caller until its page is
+// filled; returns req->status. One cursor is open at a time: OPEN from another client gets SQLITE_BUSY
+int StorageQuery(QUERY_REQUEST* req);
+
 #ifdef __cplusplus
 }
 #endif
@@ -114,40 +327,164 @@ public:
 
 	void setStart(bool value);
 
+    void captureLog(DS_LOG_STRUCT& log);
+
+    uint32_t captureRecord(uint32_t token, uint32_t timestamp_at_log, uint32_t severity,
+                           const char* category, uint32_t cat_len, const char* message, uint32_t msg_len);
+
+    void queryService(ULONG thread_input);
+
+    int query(QUERY_REQUEST* req);
+
 protected:
 	void init_psram();
 
-    void captureLog(DS_LOG_STRUCT& log);
-
     UINT writeRawFile(const char* filename, volatile DS_LOG_STRUCT* buffer, uint32_t actual_count);
 
     UINT writeRawFile_interrupt(const char* filename, volatile DS_LOG_STRUCT* buffer_in_psram, uint32_t actual_count);
 
     bool ingestRawToSQLite(const char* filename, UINT *status);
 
+    UINT writeRawRecords(const char* filename, const LOG_SPAN* span);
+
     UINT bindAndStep(const DS_LOG_STRUCT& log);
 
+    UINT bindAndStepRec(const DS_LOG_REC* rec);
+
+    UINT bindAndStepBatch(const DS_LOG_REC* const* recs);
+
+    UINT insertBuffer(const LOG_SPAN* span, INSERT_PATH path);
+
+    INSERT_PATH selectInsertPath(bool baseline);
+
+    bool isAppendOnly(const LOG_SPAN* span, sqlite3_int64 edge, sqlite3_int64* max_key);
+
+    uint32_t drainableRecords(uint32_t max_logs, LOG_SPAN* span);
+
+    void invalidateSpan(const LOG_SPAN* span);
+
+    void releaseSpan(const LOG_SPAN* span);
+
+    bool failedSpan(const LOG_SPAN* span);
+
+    bool loadCategories();
+
+    uint16_t categoryId(const char* name, uint32_t len);
+
+    bool resolveCategories(const LOG_SPAN* span);
+
+    bool loadIndexState();
+
+    bool buildIndexSlice();
+
+    bool maintainIndexes(const LOG_SPAN* span, bool append_ok, sqlite3_int64 max_key);
+
+    bool scheduleCheckpoint(bool idle);
+
+    void rebalanceMemory();
+
+    void statsWindow();
+
+    void checkMemoryPlan();
+
+    bool attachL0();
+
+    bool resetL0Run(uint32_t run);
+
+    bool reserveL0(uint32_t bytes);
+
+    bool freezeL0(bool force);
+
+    bool mergeL0Slice();
+
+    bool releaseL0Slice(uint32_t frozen, sqlite3_int64 hi, uint32_t rows);
+
+    bool failedL0Slice(uint32_t frozen, sqlite3_int64 lo, sqlite3_int64 hi, uint32_t rows);
+
+    UINT writeL0Quarantine(const char* filename, const char* run, sqlite3_int64 lo, sqlite3_int64 hi);
+
+    bool mergeIndexEntries(const char* run, sqlite3_int64 lo, sqlite3_int64 hi);
+
+    bool flushL0();
+
+    bool openQueryConnection();
+
+    void closeQueryConnection();
+
+    void closeQueryCursor();
+
+    void fillQueryPage(QUERY_REQUEST* req);
+
 private:
     bool started = false;
     sqlite3* db = nullptr;
     sqlite3_stmt* insert_stmt = nullptr;
+    sqlite3_stmt* batch_stmt = nullptr;   // INSERT_BATCH_ROWS-row INSERT, tail rows use insert_stmt
+    sqlite3_stmt* vtab_stmt = nullptr;    // INSERT ... SELECT FROM psram_batch(?1, ?2, ?3)
+    volatile sqlite3_int64 max_rowid = -1;    // Highest committed log_index, -1 = empty table (read by the query thread)
+    volatile sqlite3_int64 main_rowid = -1;   // Highest log_index in main.ds_logs (lower than max_rowid while L0 holds rows)
+    sqlite3_stmt* cat_find_stmt = nullptr;    // SELECT id FROM ds_categories WHERE name = ?
+    sqlite3_stmt* cat_insert_stmt = nullptr;  // INSERT INTO ds_categories (name) VALUES (?)
 
     bool createTable();
     void recoverDatabase();
     void tuneDbConfig();
+    bool prepareInsertStatements();
+    void finalizeInsertStatements();
+    void loadMaxRowid();
+    void finalizeCategoryStatements();
+    void finalizeIndexStatements();
+    bool createDeferredIndexes();
 
     UINT delete_database_files();
+    void purgeSegments();
+    bool openSegment();
+    bool rollSegment();
+    bool segmentFull();
+    uint32_t attachSegments(sqlite3* conn, uint32_t seq_main, bool with_l0);
+    void enforceRetention();
     bool verifyLayout();
 
-    // Pointers to the PSRAM sections defined in your linker script
-    volatile DS_LOG_STRUCT* buffer_A;
-    volatile DS_LOG_STRUCT* buffer_B;
-    volatile DS_LOG_STRUCT* active_fill_buffer;
-
-    uint32_t current_index = 0;
-
-    uint32_t buffer_A_count = 0;
-    uint32_t buffer_B_count = 0;
+    // Staging ring in PSRAM: many producers (captureRecord), single consumer (ingestor)
+    // Both positions count bytes and are free-running: offset = pos % RING_CAPACITY_BYTES
+    volatile uint8_t* ring = nullptr;
+    volatile uint32_t* ring_commit = nullptr;       // Commit word per LOG_REC_ALIGN unit: pos + 1 at a record start
+    volatile uint32_t ring_reserve = 0;             // Next byte position handed to a producer (LDREX/STREX)
+    volatile uint32_t ring_tail = 0;                // First byte position not yet released by the ingestor
+    volatile uint32_t ring_log_index = 0;           // Next log_index handed to a producer (LDREX/STREX)
+    uint32_t span_failures = 0;                     // Failed attempts of the drain at ring_tail
+    uint32_t quarantine_seq = 0;                    // Next quarantine_<n>.raw
+
+    // Segments on the card: seg_first..seg_seq, seg_seq is the one being written (db_name)
+    char db_name[24] = SEGMENT_PREFIX "0.db";
+    uint32_t seg_first = 0;
+    volatile uint32_t seg_seq = 0;                  // Read by the query thread to follow rollovers
+    uint32_t seg_rows = 0;                          // Rows committed to the current segment
+    uint32_t seg_opened = 0;                        // tx_time_get() when the current segment was started
+    uint64_t seg_size = 0;                          // Bytes of the current segment when last measured
+    uint32_t seg_size_checked = 0;                  // tx_time_get() of that measurement
+    uint64_t seg_bytes[SEGMENT_RETAIN_SLOTS] = {0}; // Closed segment sizes, indexed seq % SEGMENT_RETAIN_SLOTS
+
+    // PSRAM hot tier: runs l0_0 / l0_1 on the ingest connection, l0_active takes the inserts and the
+    // other one, when it holds rows, is frozen and being merged up to l0_merged
+    bool l0_on = false;                             // Runs attached (otherwise ingest goes to main)
+    uint32_t l0_active = 0;
+    volatile uint32_t l0_rows[2] = {0, 0};
+    uint32_t l0_started = 0;                        // tx_time_get() of the active run's first commit
+    sqlite3_int64 l0_bytes = 0;                     // Active run image size at the last reserveL0()
+    sqlite3_int64 l0_merged = -1;                   // Frozen run rows up to this log_index are in main
+    uint32_t l0_slice_failures = 0;                 // Failed merges of the frozen run's next slice
+
+    // Query service (query thread only): reader connection on segment query_seq, at most one cursor
+    sqlite3* query_db = nullptr;
+    sqlite3_stmt* query_stmt = nullptr;             // Open cursor, its read transaction holds the snapshot
+    sqlite3_stmt* query_max_stmt = nullptr;         // max(log_index) of main, or of the newest attached segment
+    const QUERY_REQUEST* query_owner = nullptr;     // Request that opened the cursor
+    uint32_t query_seq = 0;
+    uint32_t query_last_use = 0;                    // tx_time_get() of the last page served
+    bool query_row_pending = false;                 // Stepped row that did not fit the previous page
+    sqlite3_int64 query_snapshot = -1;
+    sqlite3_int64 query_lag = 0;
 };
 
 //=======================================================================================
@@ -0,0 +1,164 @@
+/*
+ * ring_stress.cpp
+ *
+ *  Host-side stress test of the staging ring protocol in MPLIB_RING.h: several std::thread
+ *  producers reserve, fill and commit records of random length into a small ring while one
+ *  consumer drains committed prefixes and releases them. The ring wraps thousands of times,
+ *  so reservations straddling the end (wrap padding) and producers waiting for space are
+ *  exercised constantly.
+ *
+ *  The consumer checks that every record arrives exactly once, in per-producer order, with
+ *  its payload intact and at the offset it was reserved at.
+ *
+ *  Build and run: make -C MPLIB-CODE/test check
+ */
+#define MPLIB_RING_HOST
+#include "MPLIB_RING.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#define TEST_CAPACITY       (16 * 1024)     // Small ring: a wrap every ~100 records
+#define TEST_PRODUCERS      6
+#define TEST_RECORDS        200000          // Per producer
+#define TEST_CAT_MAX        24
+#define TEST_MSG_MAX        160
+
+alignas(32) static uint8_t test_ring[TEST_CAPACITY];
+static volatile uint32_t test_commit[TEST_CAPACITY / LOG_REC_ALIGN];
+static volatile uint32_t test_reserve = 0;
+static volatile uint32_t test_tail = 0;
+
+// The first failure ends the run: producers may be waiting for space the consumer will not release
+#define CHECK(cond, ...) do { if (!(cond)) { printf("FAIL: " __VA_ARGS__); printf("\n"); fflush(stdout); std::_Exit(1); } } while (0)
+
+// Same xorshift on both sides: lengths and payload follow from (producer, seq)
+static uint32_t mix(uint32_t x) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return x;
+}
+
+static uint8_t payloadByte(uint32_t producer, uint32_t seq, uint32_t i) {
+    return (uint8_t)(producer * 61 + seq * 7 + i);
+}
+
+//=======================================================================================
+// Producer: mirrors MPLIB_STORAGE::captureRecord()
+//=======================================================================================
+static void producer(uint32_t id) {
+    char cat[TEST_CAT_MAX];
+    char msg[TEST_MSG_MAX];
+
+    for (uint32_t seq = 0; seq < TEST_RECORDS; seq++) {
+        uint32_t r = mix(id * 0x9E3779B9u + seq + 1);
+        uint32_t cat_len = r % (TEST_CAT_MAX + 1);
+        uint32_t msg_len = (r >> 8) % (TEST_MSG_MAX + 1);
+        for (uint32_t i = 0; i < cat_len; i++) cat[i] = (char)payloadByte(id, seq, i);
+        for (uint32_t i = 0; i < msg_len; i++) msg[i] = (char)payloadByte(id, seq, cat_len + i);
+
+        uint32_t size = ringRecordSize(cat_len, msg_len);
+        uint32_t pos;
+        do {
+            pos = ringFetchAdd(&test_reserve, size);
+            while (!ringHasSpace(&test_tail, pos, size, TEST_CAPACITY)) {
+                std::this_thread::yield();
+            }
+        } while (!ringPlace(test_ring, test_commit, TEST_CAPACITY, pos, size));
+
+        uint32_t offset = pos % TEST_CAPACITY;
+        volatile DS_LOG_REC* rec = (volatile DS_LOG_REC*)&test_ring[offset];
+        rec->size = (uint16_t)size;
+        rec->flags = 0;
+        rec->cat_len = (uint8_t)cat_len;
+        rec->msg_len = (uint16_t)msg_len;
+        rec->cat_id = 0;
+        rec->log_index = seq;
+        rec->token = id;
+        rec->local_log_index = offset / LOG_REC_ALIGN;
+        rec->timestamp_at_store = 0;
+        rec->timestamp_at_log = r;
+        rec->severity = 0;
+        memcpy((void*)rec->data, cat, cat_len);
+        memcpy((void*)(rec->data + cat_len), msg, msg_len);
+
+        ringCommit(test_commit, TEST_CAPACITY, pos);
+    }
+}
+
+//=======================================================================================
+// Consumer: mirrors drainableRecords() / releaseSpan() of the ingestor
+//=======================================================================================
+static void consumer() {
+    std::vector<uint32_t> next(TEST_PRODUCERS, 0);
+    uint64_t total = 0;
+    uint64_t pads = 0;
+    uint32_t max_logs = 1;
+
+    while (total < (uint64_t)TEST_PRODUCERS * TEST_RECORDS) {
+        uint32_t from = test_tail;
+        uint32_t avail = ringLoadAcquire(&test_reserve) - from;
+        uint32_t bytes;
+        max_logs = mix(max_logs) % 64 + 1;
+        uint32_t logs = ringDrainable(test_ring, test_commit, TEST_CAPACITY, from, avail, max_logs, &bytes);
+        if (bytes == 0) {
+            std::this_thread::yield();
+            continue;
+        }
+
+        uint32_t seen = 0;
+        for (uint32_t off = 0; off < bytes; ) {
+            uint32_t pos = from + off;
+            const DS_LOG_REC* rec = (const DS_LOG_REC*)&test_ring[pos % TEST_CAPACITY];
+            CHECK(rec->size >= LOG_REC_ALIGN && rec->size % LOG_REC_ALIGN == 0, "bad size %u at %u", rec->size, pos);
+            CHECK(pos % TEST_CAPACITY + rec->size <= TEST_CAPACITY, "record at %u crosses the ring end", pos);
+
+            if (rec->flags & LOG_REC_FLAG_PAD) {
+                pads++;
+            } else {
+                uint32_t id = rec->token;
+                uint32_t seq = rec->log_index;
+                CHECK(id < TEST_PRODUCERS, "bad producer %u at %u", id, pos);
+                CHECK(seq == next[id], "producer %u: got seq %u, expected %u", id, seq, next[id]);
+                next[id] = seq + 1;
+
+                uint32_t r = mix(id * 0x9E3779B9u + seq + 1);
+                CHECK(rec->cat_len == r % (TEST_CAT_MAX + 1) && rec->msg_len == (r >> 8) % (TEST_MSG_MAX + 1),
+                      "producer %u seq %u: bad lengths", id, seq);
+                CHECK(rec->size == ringRecordSize(rec->cat_len, rec->msg_len), "producer %u seq %u: bad size", id, seq);
+                CHECK(rec->local_log_index == (pos % TEST_CAPACITY) / LOG_REC_ALIGN, "producer %u seq %u: bad offset", id, seq);
+                for (uint32_t i = 0; i < (uint32_t)rec->cat_len + rec->msg_len; i++) {
+                    if ((uint8_t)rec->data[i] != payloadByte(id, seq, i)) {
+                        CHECK(false, "producer %u seq %u: payload byte %u", id, seq, i);
+                        break;
+                    }
+                }
+                seen++;
+            }
+            off += rec->size;
+        }
+        CHECK(seen == logs && logs <= max_logs, "drain counted %u records, walked %u (max %u)", logs, seen, max_logs);
+
+        ringRelease(&test_tail, from + bytes);
+        total += seen;
+    }
+
+    printf("ring_stress: %llu records, %llu pads, %u laps\n", (unsigned long long)total,
+           (unsigned long long)pads, test_tail / TEST_CAPACITY);
+}
+
+int main() {
+    std::vector<std::thread> threads;
+    std::thread drain(consumer);
+    for (uint32_t id = 0; id < TEST_PRODUCERS; id++) threads.emplace_back(producer, id);
+    for (auto& t : threads) t.join();
+    drain.join();
+
+    CHECK(test_reserve == test_tail, "reserved %u, released %u", test_reserve, test_tail);
+    printf("ring_stress: OK\n");
+    return 0;
+}
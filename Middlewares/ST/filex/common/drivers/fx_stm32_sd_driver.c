@@ -17,14 +17,24 @@
  * the scratch buffer is required when performing DMA transfers using unaligned addresses
  * When CPU cache is enabled, the scratch buffer should be 32-byte aligned to match a whole cache line
  * otherwise it is 4-byte aligned to match the DMA alignment constraints
+ * It holds FX_STM32_SD_BOUNCE_SECTORS sectors, so an unaligned request is still sent as
+ * multi-block transfers
  */
 
+#ifndef FX_STM32_SD_BOUNCE_SECTORS
+#define FX_STM32_SD_BOUNCE_SECTORS 1
+#endif
+
+#define SCRATCH_SIZE (FX_STM32_SD_DEFAULT_SECTOR_SIZE * FX_STM32_SD_BOUNCE_SECTORS)
+
 #if (FX_STM32_SD_CACHE_MAINTENANCE == 1)
-static UCHAR scratch[FX_STM32_SD_DEFAULT_SECTOR_SIZE] __attribute__ ((aligned (32)));
+static UCHAR scratch[SCRATCH_SIZE] __attribute__ ((aligned (32)));
 #else
-static UCHAR scratch[FX_STM32_SD_DEFAULT_SECTOR_SIZE] __attribute__ ((aligned (4)));
+static UCHAR scratch[SCRATCH_SIZE] __attribute__ ((aligned (4)));
 #endif
 
+static FX_STM32_SD_STATS sd_stats;
+
 UINT  _fx_partition_offset_calculate(void  *partition_sector, UINT partition, ULONG *partition_start, ULONG *partition_size);
 
 static UINT sd_read_data(FX_MEDIA *media_ptr, ULONG sector, UINT num_sectors, UINT use_scratch_buffer);
@@ -78,6 +88,14 @@ VOID  fx_stm32_sd_driver(FX_MEDIA *media_ptr)
 #if (FX_STM32_SD_DMA_API == 1)
   /* the SD DMA requires a 4-byte aligned buffers */
   unaligned_buffer = (UINT)(media_ptr->fx_media_driver_buffer) & 0x3;
+#if (FX_STM32_SD_CACHE_MAINTENANCE == 1)
+  /* invalidating the cache lines of a read buffer that does not start on a line would also
+     drop whatever the CPU wrote next to it, so reads need a 32-byte aligned buffer */
+  if (media_ptr->fx_media_driver_request == FX_DRIVER_READ)
+  {
+    unaligned_buffer = (UINT)(media_ptr->fx_media_driver_buffer) & 0x1F;
+  }
+#endif
 #else
   /* if the DMA is not used there isn't any constraint on buffer alignment */
   unaligned_buffer = 0;
@@ -266,12 +284,21 @@ static UINT sd_read_data(FX_MEDIA *media_ptr, ULONG start_sector, UINT num_secto
 
   if (use_scratch_buffer)
   {
+    UINT chunk;
+
     read_addr = media_ptr->fx_media_driver_buffer;
+    sd_stats.bounce_reads++;
 
-    for (i = 0; i < num_sectors; i++)
+    for (i = 0; i < num_sectors; i += chunk)
     {
+      chunk = num_sectors - i;
+      if (chunk > FX_STM32_SD_BOUNCE_SECTORS)
+      {
+        chunk = FX_STM32_SD_BOUNCE_SECTORS;
+      }
+
       /* Start reading into the scratch buffer */
-      status = fx_stm32_sd_read_blocks(FX_STM32_SD_INSTANCE, (UINT *)scratch, (UINT)start_sector++, 1);
+      status = fx_stm32_sd_read_blocks(FX_STM32_SD_INSTANCE, (UINT *)scratch, (UINT)start_sector, chunk);
 
       if (status != 0)
       {
@@ -284,11 +311,14 @@ static UINT sd_read_data(FX_MEDIA *media_ptr, ULONG start_sector, UINT num_secto
        FX_STM32_SD_READ_CPLT_NOTIFY();
 
 #if (FX_STM32_SD_CACHE_MAINTENANCE == 1)
-      invalidate_cache_by_addr((uint32_t*)scratch, FX_STM32_SD_DEFAULT_SECTOR_SIZE);
+      invalidate_cache_by_addr((uint32_t*)scratch, chunk * FX_STM32_SD_DEFAULT_SECTOR_SIZE);
 #endif
 
-      _fx_utility_memory_copy(scratch, read_addr, FX_STM32_SD_DEFAULT_SECTOR_SIZE);
-      read_addr += FX_STM32_SD_DEFAULT_SECTOR_SIZE;
+      _fx_utility_memory_copy(scratch, read_addr, chunk * FX_STM32_SD_DEFAULT_SECTOR_SIZE);
+      read_addr += chunk * FX_STM32_SD_DEFAULT_SECTOR_SIZE;
+      start_sector += chunk;
+      sd_stats.bounce_transfers++;
+      sd_stats.bounce_sectors += chunk;
     }
 
     /* Check if all sectors were read */
@@ -303,6 +333,7 @@ static UINT sd_read_data(FX_MEDIA *media_ptr, ULONG start_sector, UINT num_secto
   }
   else
   {
+    sd_stats.direct_reads++;
 
     status = fx_stm32_sd_read_blocks(FX_STM32_SD_INSTANCE, (UINT *)media_ptr->fx_media_driver_buffer, (UINT)start_sector, num_sectors);
 
@@ -350,19 +381,31 @@ static UINT sd_write_data(FX_MEDIA *media_ptr, ULONG start_sector, UINT num_sect
 
   if (use_scratch_buffer)
   {
+    UINT chunk;
+
     write_addr = media_ptr->fx_media_driver_buffer;
+    sd_stats.bounce_writes++;
 
-    for (i = 0; i < num_sectors; i++)
+    for (i = 0; i < num_sectors; i += chunk)
     {
-      _fx_utility_memory_copy(write_addr, scratch, FX_STM32_SD_DEFAULT_SECTOR_SIZE);
-      write_addr += FX_STM32_SD_DEFAULT_SECTOR_SIZE;
+      chunk = num_sectors - i;
+      if (chunk > FX_STM32_SD_BOUNCE_SECTORS)
+      {
+        chunk = FX_STM32_SD_BOUNCE_SECTORS;
+      }
+
+      _fx_utility_memory_copy(write_addr, scratch, chunk * FX_STM32_SD_DEFAULT_SECTOR_SIZE);
+      write_addr += chunk * FX_STM32_SD_DEFAULT_SECTOR_SIZE;
 
 #if (FX_STM32_SD_CACHE_MAINTENANCE == 1)
       /* Clean the DCache to make the SD DMA see the actual content of the scratch buffer */
-      clean_cache_by_addr((uint32_t*)scratch, FX_STM32_SD_DEFAULT_SECTOR_SIZE);
+      clean_cache_by_addr((uint32_t*)scratch, chunk * FX_STM32_SD_DEFAULT_SECTOR_SIZE);
 #endif
 
-      status = fx_stm32_sd_write_blocks(FX_STM32_SD_INSTANCE, (UINT *)scratch, (UINT)start_sector++, 1);
+      status = fx_stm32_sd_write_blocks(FX_STM32_SD_INSTANCE, (UINT *)scratch, (UINT)start_sector, chunk);
+      start_sector += chunk;
+      sd_stats.bounce_transfers++;
+      sd_stats.bounce_sectors += chunk;
 
       if (status != 0)
       {
@@ -386,6 +429,8 @@ static UINT sd_write_data(FX_MEDIA *media_ptr, ULONG start_sector, UINT num_sect
   }
   else
   {
+    sd_stats.direct_writes++;
+
 #if (FX_STM32_SD_CACHE_MAINTENANCE == 1)
     clean_cache_by_addr((uint32_t*)media_ptr->fx_media_driver_buffer, num_sectors * FX_STM32_SD_DEFAULT_SECTOR_SIZE);
 #endif
@@ -409,3 +454,19 @@ static UINT sd_write_data(FX_MEDIA *media_ptr, ULONG start_sector, UINT num_sect
 
   return status;
 }
+
+/**
+* @brief Copy the transfer path counters
+* @param FX_STM32_SD_STATS *stats destination
+* @param UINT reset clear the counters after copying when not 0
+* @retval None
+*/
+VOID fx_stm32_sd_driver_stats(FX_STM32_SD_STATS *stats, UINT reset)
+{
+  *stats = sd_stats;
+
+  if (reset)
+  {
+    _fx_utility_memory_set((UCHAR *)&sd_stats, 0, sizeof(sd_stats));
+  }
+}
@@ -43,8 +43,19 @@
 #include <stdio.h>
 #include <assert.h>
 #include <limits.h>
+#include <stdint.h>
 #include <malloc.h>
 
+#include "fx_utility.h" // _fx_utility_FAT_entry_read for the extent maps
+
+// The extent maps reach into FileX internals: they read FAT entries with _fx_utility_FAT_entry_read()
+// and set the FX_FILE current_* position fields the way fx_file_extended_seek() does. All of it sits
+// behind the fx_internal_* helpers in the file system section, written against FileX 6.4.0; check
+// them against the new fx_file_extended_seek.c and fx_api.h before moving to another release
+#if (FILEX_MAJOR_VERSION != 6) || (FILEX_MINOR_VERSION != 4)
+#error "sqlite3_azure.c: the extent maps depend on FileX 6.4 internals (fx_internal_* helpers)"
+#endif
+
 /* ---------------------------- Configuration ---------------------------------------- */
 
 // If defined, signals not to allocate large blocks. Sane for MCU
@@ -74,16 +85,44 @@ static void* const SQLITE3_AZURE_CONFIG_PAGE_POOL = sqlite_pcache;
 // Do not forget to align the buffer subsequently
 #define SQLITE3_AZURE_CONFIG_PAGE_POOL_ALIGNMENT 32
 
-// !!! Very important !!!
-// If you try to work with an existing database that have larger page size
-// the page cache (and the database itself) will very likely be corrupted !!!
-// From the other hand, if you set this value to for example 4096 but will work with
-// 512-byte pages you will waste most of page cache memory
-// For me 512 was the only value that worked with small MCU memory
-static const unsigned SQLITE3_AZURE_CONFIG_MAX_PAGE_SIZE = 512;
-
-// This constant defines starting from what size the VFS will try to pre-allocate file space
-static const ULONG64 PREALLOCATE_MINIMUM = 16536;
+// Page size the page cache pool is cut for, from the memory plan in app_threadx.h.
+// Pages of a larger size still work but come from the SQLite heap; smaller ones waste most of a slot
+static const unsigned SQLITE3_AZURE_CONFIG_MAX_PAGE_SIZE = PLAN_PAGE_SIZE;
+
+// Files with an extent map grow in steps of this many bytes of consecutive clusters, on
+// SQLITE_FCNTL_SIZE_HINT and on writes past the allocated space, so a large database stays a handful
+// of extents. If the card has no free run that long, the largest available one is taken instead
+static const ULONG64 PREALLOCATE_CHUNK = 4 * 1024 * 1024;
+
+// SRAM tier of the page cache (see the page cache section), 0 keeps every page in the PSRAM pool.
+// The section is the NPU/AXICACHE/VENC RAM that main.c powers up for the core, past the frame
+// buffers (SRAM_HOT in STM32N657XX_LRUN.ld, MPU region 7). Slots are as large as the PSRAM pool's
+#define SQLITE3_AZURE_CONFIG_PCACHE_SRAM_SIZE (768 * 1024)
+#define SQLITE3_AZURE_CONFIG_PCACHE_SRAM_SECTION ".sram_pcache"
+#define SQLITE3_AZURE_CONFIG_PCACHE_PROMOTE_HITS 4    // Fetches of a PSRAM interior page before it moves up
+
+// Size-class allocator (sqlite3_azure_mem_config), 0 leaves SQLite on memsys5 alone.
+// Classes of 16 to 2048 bytes share CLASS_POOL_SIZE of on-chip SRAM, next to the page cache tier;
+// the transaction arena is ARENA_BLOCKS blocks of ARENA_SIZE / ARENA_BLOCKS bytes
+#define SQLITE3_AZURE_CONFIG_SIZE_CLASSES 1
+#define SQLITE3_AZURE_CONFIG_CLASS_POOL_SIZE (192 * 1024)
+#define SQLITE3_AZURE_CONFIG_CLASS_POOL_SECTION ".sram_heap"
+#define SQLITE3_AZURE_CONFIG_ARENA_SIZE (64 * 1024)
+#define SQLITE3_AZURE_CONFIG_ARENA_BLOCKS 8
+
+// Extent maps (file offset -> cluster without walking the FAT chain on every seek)
+// One map per open main database or WAL file; each extent is a run of consecutive clusters, so with
+// PREALLOCATE_CHUNK steps 256 extents cover at least 1 GB. Beyond that seeks fall back to FileX
+#define SQLITE3_AZURE_CONFIG_EXTENT_MAPS 16
+#define SQLITE3_AZURE_CONFIG_EXTENT_RUNS 256
+#define SQLITE3_AZURE_CONFIG_EXTENT_SECTION ".psram_buffers"
+
+// Temporary files (opened without a name: sorter runs, statement journals, temp databases, VACUUM)
+// live in PSRAM blocks of TEMP_BLOCK_SIZE bytes taken from one TEMP_POOL_SIZE pool shared by all of them.
+// A write that finds the pool used up moves its file to the card and carries on there. 0 keeps them on the card
+#define SQLITE3_AZURE_CONFIG_TEMP_POOL_SIZE (2 * 1024 * 1024)
+#define SQLITE3_AZURE_CONFIG_TEMP_BLOCK_SIZE 4096
+#define SQLITE3_AZURE_CONFIG_TEMP_POOL_SECTION ".psram_buffers"
 
 // If static pool used has no effect
 // If NULL, sqlite will stay on standard malloc
@@ -92,6 +131,31 @@ static const ULONG64 PREALLOCATE_MINIMUM = 16536;
 //    #define SQLITE3_AZURE_CONFIG_DYNAMIC_POOL (NULL)
 //#endif
 
+// WAL shared-memory index (xShmMap and friends)
+// There is no other process to share it with, so the wal-index never goes to a -shm file:
+// regions are taken from a static pool that should sit in external RAM (PSRAM here).
+// SQLite maps 32K regions; each one indexes about 4096 WAL frames, and every open database
+// in WAL mode (main database plus attached ones) needs its own regions
+#define SQLITE3_AZURE_CONFIG_SHM_REGION_SIZE 32768
+#define SQLITE3_AZURE_CONFIG_SHM_POOL_REGIONS 16
+#define SQLITE3_AZURE_CONFIG_SHM_POOL_SECTION ".psram_buffers"
+
+// Write-behind for the main database and WAL files
+// xWrite copies the data into a staging pool and returns, a dedicated I/O thread writes it to the
+// card in file order, merging writes that continue each other (WAL frame header + page, runs of
+// checkpointed pages) into one multi-sector fx_file_write of up to WB_MAX_RUN bytes.
+// Reads of staged data are served from the pool, xSync/xTruncate/xClose wait for the file's queue.
+// Only for synchronous=OFF style use: a power loss also loses what is still staged.
+// The I/O thread should rank above the SQLite threads: it mostly sleeps on the SD DMA semaphore
+// and the writer keeps the CPU meanwhile
+#define SQLITE3_AZURE_CONFIG_WRITE_BEHIND 1
+#define SQLITE3_AZURE_CONFIG_WB_POOL_SIZE (1024 * 1024)
+#define SQLITE3_AZURE_CONFIG_WB_SLOTS 1024            // Staged writes, power of two
+#define SQLITE3_AZURE_CONFIG_WB_MAX_RUN (128 * 1024)
+#define SQLITE3_AZURE_CONFIG_WB_PRIORITY 4
+#define SQLITE3_AZURE_CONFIG_WB_STACK_SIZE 4096
+#define SQLITE3_AZURE_CONFIG_WB_POOL_SECTION ".psram_buffers"
+
 // Additional scratch RAM region, may be NULL to discard
 static void* const SQLITE3_AZURE_CONFIG_SCRATCH = NULL; // (void*)0x38000000;
 static const unsigned SQLITE3_AZURE_CONFIG_SCRATCH_SIZE = 0x10000;
@@ -110,6 +174,14 @@ static const unsigned SQLITE3_AZURE_CONFIG_SCRATCH_SIZE = 0x10000;
 // 3 - all messages
 #define SQLITE3_AZURE_CONFIG_DEBUG 0
 
+#if SQLITE3_AZURE_CONFIG_WRITE_BEHIND && !SQLITE_THREADSAFE
+#error "Write-behind shares files between the I/O thread and SQLite, it needs SQLITE_THREADSAFE"
+#endif
+
+#if SQLITE3_AZURE_CONFIG_WB_SLOTS & (SQLITE3_AZURE_CONFIG_WB_SLOTS - 1)
+#error "SQLITE3_AZURE_CONFIG_WB_SLOTS must be a power of two"
+#endif
+
 /* ---------------------------- Helper functions ------------------------------------- */
 
 // Function that returns random number
@@ -237,6 +309,13 @@ struct sqlite3_azure_file
     // Azure File management
     // Do not forget to include sqlite3_azure_fx_user.h in fx_user.h
     FX_FILE* fx_file;
+
+    // Per-connection wal-index state, the shared part hangs on fx_file->shm
+    unsigned short shm_shared_mask; // SQLITE_SHM_NLOCK bits held SHARED by this connection
+    unsigned short shm_excl_mask;   // SQLITE_SHM_NLOCK bits held EXCLUSIVE by this connection
+    int shm_mapped;                 // This connection holds a reference on fx_file->shm
+
+    struct temp_file* temp;         // Contents of a temporary file kept in PSRAM, fx_file is NULL meanwhile
 };
 
 const sqlite3_io_methods azure_file_methods;
@@ -244,7 +323,243 @@ sqlite3_vfs azure_vfs;
 
 static TX_MUTEX openclose;
 
-int xOpen(sqlite3_vfs* vfs, sqlite3_filename zName, sqlite3_file* fptr, int flags, int *pOutFlags)
+/*
+ *   FileX internals used by the extent maps (FileX 6.4.0, see the version check at the top).
+ *   Nothing else in this file touches FX_FILE fields that fx_file_extended_seek() owns
+ */
+
+// Leading run of consecutive clusters, as fx_file_open() found it
+static void fx_internal_leading_run(const FX_FILE* file, ULONG* first, ULONG* clusters)
+{
+    *first = file->fx_file_first_physical_cluster;
+    *clusters = file->fx_file_consecutive_cluster;
+}
+
+// Next cluster in the chain, with fx_media_protect held
+static UINT fx_internal_fat_next(FX_MEDIA* media_ptr, ULONG cluster, ULONG* next)
+{
+    return _fx_utility_FAT_entry_read(media_ptr, cluster, next);
+}
+
+// Bytes of clusters the file holds, the file size plus any preallocated tail
+static ULONG64 fx_internal_allocated(const FX_FILE* file)
+{
+    return file->fx_file_current_available_size;
+}
+
+// Same state fx_file_extended_seek() leaves behind for an offset inside the file, 'cluster' being
+// the physical cluster of relative cluster offset / bytes_per_cluster
+static void fx_internal_position_set(FX_FILE* file, ULONG64 offset, ULONG cluster)
+{
+    FX_MEDIA* media_ptr = file->fx_file_media_ptr;
+    ULONG bytes_per_sector = media_ptr->fx_media_bytes_per_sector;
+    ULONG bytes_per_cluster = bytes_per_sector * media_ptr->fx_media_sectors_per_cluster;
+    ULONG remaining = (ULONG)(offset % bytes_per_cluster);
+
+    file->fx_file_current_relative_cluster = (ULONG)(offset / bytes_per_cluster);
+    file->fx_file_current_physical_cluster = cluster;
+    file->fx_file_current_logical_sector = media_ptr->fx_media_data_sector_start +
+                                           ((ULONG64)(cluster - FX_FAT_ENTRY_START) * media_ptr->fx_media_sectors_per_cluster) +
+                                           (remaining / bytes_per_sector);
+    file->fx_file_current_relative_sector = remaining / bytes_per_sector;
+    file->fx_file_current_file_offset = offset;
+    file->fx_file_current_logical_offset = remaining % bytes_per_sector;
+}
+
+/*
+ *   Extent maps
+ *
+ *   fx_file_extended_seek() finds a cluster directly only inside the file's leading run of consecutive
+ *   clusters, past that it follows the FAT chain from the current position or from the end of that
+ *   run, so random page access in a large fragmented file costs a chain walk that grows with the offset.
+ *   The map remembers the chain as extents, resolved lazily up to the furthest cluster asked for;
+ *   clusters appended later are picked up by resuming the walk at the last mapped one. Truncation
+ *   drops the map. Maps are taken and returned under openclose, used under the file mutex.
+ */
+struct sqlite3_azure_extents
+{
+    ULONG mapped;        // Relative clusters [0, mapped) are resolved
+    ULONG tail;          // Physical cluster of relative cluster mapped - 1
+    unsigned count;
+    struct
+    {
+        ULONG relative;
+        ULONG physical;
+        ULONG clusters;
+    } run[SQLITE3_AZURE_CONFIG_EXTENT_RUNS];
+};
+
+static struct sqlite3_azure_extents __attribute__((section(SQLITE3_AZURE_CONFIG_EXTENT_SECTION), aligned(32)))
+    extent_pool[SQLITE3_AZURE_CONFIG_EXTENT_MAPS];
+static unsigned char extent_pool_used[SQLITE3_AZURE_CONFIG_EXTENT_MAPS];
+
+static sqlite3_azure_ext_stats extent_stats;
+
+// NULL when all maps are taken, the file then seeks through FileX alone
+static struct sqlite3_azure_extents* extent_map_alloc(void)
+{
+    for(unsigned i = 0; i < SQLITE3_AZURE_CONFIG_EXTENT_MAPS; i++)
+        if(!extent_pool_used[i])
+        {
+            extent_pool_used[i] = 1;
+            extent_pool[i].mapped = extent_pool[i].count = 0;
+            return &extent_pool[i];
+        }
+    return NULL;
+}
+
+static void extent_map_free(struct sqlite3_azure_extents* map)
+{
+    if(map)
+        extent_pool_used[map - extent_pool] = 0;
+}
+
+// Walks the FAT chain on from the last mapped cluster until 'relative' is mapped, the chain ends
+// or the map is full
+static void extent_map_extend(FX_FILE* file, ULONG relative)
+{
+    struct sqlite3_azure_extents* map = file->extents;
+    FX_MEDIA* media_ptr = file->fx_file_media_ptr;
+    ULONG cluster, first, leading;
+
+    tx_mutex_get(&(media_ptr->fx_media_protect), TX_WAIT_FOREVER);
+
+    // The leading run is known from fx_file_open(), no need to read it from the FAT
+    fx_internal_leading_run(file, &first, &leading);
+    if((map->mapped == 0) && leading)
+    {
+        map->run[0].relative = 0;
+        map->run[0].physical = first;
+        map->run[0].clusters = leading;
+        map->count = 1;
+        map->mapped = leading;
+        map->tail = first + leading - 1;
+    }
+
+    if(map->mapped == 0)
+        cluster = first;
+    else if(fx_internal_fat_next(media_ptr, map->tail, &cluster) != FX_SUCCESS)
+        cluster = 0;
+    else
+        extent_stats.fat_reads++;
+
+    while((cluster >= FX_FAT_ENTRY_START) && (cluster < media_ptr->fx_media_fat_reserved))
+    {
+        if(map->count && (map->run[map->count - 1].physical + map->run[map->count - 1].clusters == cluster))
+            map->run[map->count - 1].clusters++;
+        else if(map->count < SQLITE3_AZURE_CONFIG_EXTENT_RUNS)
+        {
+            map->run[map->count].relative = map->mapped;
+            map->run[map->count].physical = cluster;
+            map->run[map->count].clusters = 1;
+            map->count++;
+        }
+        else
+            break;
+
+        map->mapped++;
+        map->tail = cluster;
+
+        if(map->mapped > relative)
+            break;
+        if(fx_internal_fat_next(media_ptr, cluster, &cluster) != FX_SUCCESS)
+            break;
+        extent_stats.fat_reads++;
+    }
+
+    tx_mutex_put(&(media_ptr->fx_media_protect));
+
+    if(map->count > extent_stats.max_extents)
+        extent_stats.max_extents = map->count;
+}
+
+// fx_file_extended_seek() with the cluster taken from the extent map, called with the file mutex held
+static UINT extent_seek(FX_FILE* file, ULONG64 offset)
+{
+    struct sqlite3_azure_extents* map = file->extents;
+    FX_MEDIA* media_ptr = file->fx_file_media_ptr;
+    ULONG bytes_per_cluster = media_ptr->fx_media_bytes_per_sector * media_ptr->fx_media_sectors_per_cluster;
+    ULONG first, leading;
+
+    // FileX resolves positions at or past the end and inside the leading run by itself
+    fx_internal_leading_run(file, &first, &leading);
+    if((map == NULL) || (bytes_per_cluster == 0) || (offset >= file->fx_file_current_file_size) ||
+       (offset == file->fx_file_current_file_offset) || (offset < (ULONG64)leading * bytes_per_cluster))
+        return fx_file_extended_seek(file, offset);
+
+    ULONG relative = (ULONG)(offset / bytes_per_cluster);
+    if(relative >= map->mapped)
+        extent_map_extend(file, relative);
+    if(relative >= map->mapped)
+    {
+        extent_stats.fallbacks++;
+        return fx_file_extended_seek(file, offset);
+    }
+
+    unsigned lo = 0, hi = map->count - 1;
+    while(lo < hi)
+    {
+        unsigned mid = (lo + hi + 1) / 2;
+        if(map->run[mid].relative <= relative)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+
+    fx_internal_position_set(file, offset, map->run[lo].physical + (relative - map->run[lo].relative));
+
+    extent_stats.seeks++;
+    return FX_SUCCESS;
+}
+
+// Allocates space up to 'end' in PREALLOCATE_CHUNK steps of consecutive clusters, with the file mutex held
+static void preallocate(FX_FILE* file, ULONG64 end)
+{
+    ULONG64 allocated = fx_internal_allocated(file);
+    if(end <= allocated)
+        return;
+
+    ULONG64 allocate = end - allocated;
+    allocate = (allocate + PREALLOCATE_CHUNK - 1) / PREALLOCATE_CHUNK * PREALLOCATE_CHUNK;
+
+    if(fx_file_extended_allocate(file, allocate) == FX_SUCCESS)
+        extent_stats.contiguous++;
+    else
+    {
+        // No free run that long: take the largest one there is
+        if(fx_file_extended_best_effort_allocate(file, allocate, &allocate) != FX_SUCCESS)
+            return;
+        extent_stats.best_effort++;
+    }
+    extent_stats.preallocated += allocate;
+}
+
+// Gives the clusters preallocated past the end of the file back to the card, when it is closed
+static void preallocate_release(FX_FILE* file)
+{
+    ULONG64 allocated = fx_internal_allocated(file);
+    ULONG64 size = file->fx_file_current_file_size;
+    ULONG bytes_per_cluster = file->fx_file_media_ptr->fx_media_bytes_per_sector *
+                              file->fx_file_media_ptr->fx_media_sectors_per_cluster;
+
+    if((bytes_per_cluster == 0) || (allocated < size + bytes_per_cluster))
+        return;
+
+    if(fx_file_extended_truncate_release(file, size) == FX_SUCCESS)
+        extent_stats.released += allocated - fx_internal_allocated(file);
+}
+
+void sqlite3_azure_extent_stats(sqlite3_azure_ext_stats* stats, int reset)
+{
+    assert(stats);
+
+    *stats = extent_stats;
+    if(reset)
+        memset(&extent_stats, 0, sizeof(extent_stats));
+}
+
+// Opens on the card, xOpen() below first offers temporary files to the PSRAM pool
+static int media_open(sqlite3_vfs* vfs, sqlite3_filename zName, sqlite3_file* fptr, int flags, int *pOutFlags)
 {
     assert(vfs == &azure_vfs);
     assert(fptr);
@@ -258,6 +573,9 @@ int xOpen(sqlite3_vfs* vfs, sqlite3_filename zName, sqlite3_file* fptr, int flag
     struct sqlite3_azure_file* azure_fptr = (struct sqlite3_azure_file*)fptr;
 
     fptr->pMethods = &azure_file_methods;
+    azure_fptr->shm_shared_mask = azure_fptr->shm_excl_mask = 0;
+    azure_fptr->shm_mapped = 0;
+    azure_fptr->temp = NULL;
 
     mutex_get(&openclose, TX_WAIT_FOREVER);
 
@@ -386,7 +704,8 @@ int xOpen(sqlite3_vfs* vfs, sqlite3_filename zName, sqlite3_file* fptr, int flag
     else
     {
         // Temporary files and journals must be used by the same process only, so locked immediately
-        // Not tested with WAL journals
+        // WAL journals are shared by all connections and never locked, writes to them are
+        // serialized by the wal-index WRITER lock (see xShmLock)
         if((flags & SQLITE_OPEN_MAIN_JOURNAL) || (NULL == zName))
         {
             fx_fptr->lock_type = SQLITE_LOCK_EXCLUSIVE;
@@ -399,6 +718,13 @@ int xOpen(sqlite3_vfs* vfs, sqlite3_filename zName, sqlite3_file* fptr, int flag
         }
         fx_fptr->shared_locks_count = 0;
         fx_fptr->open_count = 1;
+        fx_fptr->shm = NULL;
+        fx_fptr->wal_coordinated = (flags & SQLITE_OPEN_WAL) != 0;
+        fx_fptr->write_behind = SQLITE3_AZURE_CONFIG_WRITE_BEHIND && (flags & (SQLITE_OPEN_MAIN_DB | SQLITE_OPEN_WAL));
+        fx_fptr->wb_pending = 0;
+        fx_fptr->wb_size = 0;
+        fx_fptr->wb_error = SQLITE_OK;
+        fx_fptr->extents = (flags & (SQLITE_OPEN_MAIN_DB | SQLITE_OPEN_WAL)) ? extent_map_alloc() : NULL;
 
         mutex_create(&(fx_fptr->mutex), "Azure file mutex", TX_NO_INHERIT);
 
@@ -570,6 +896,9 @@ int xCurrentTimeInt64(sqlite3_vfs* vfs, sqlite3_int64* result)
     return SQLITE_OK;
 }
 
+// With the temporary files, past the file methods it falls back to
+int xOpen(sqlite3_vfs* vfs, sqlite3_filename zName, sqlite3_file* fptr, int flags, int *pOutFlags);
+
 sqlite3_vfs azure_vfs = {
           .iVersion      = 2,                                 /* Structure version number (currently 3) */
           .szOsFile      = sizeof(struct sqlite3_azure_file), /* Size of subclassed sqlite3_file */
@@ -608,6 +937,12 @@ sqlite3_vfs azure_vfs = {
           */
 };
 
+// Without WAL only the EXCLUSIVE lock holder writes. In WAL mode the WAL file is written under the
+// wal-index WRITER lock and the database file by checkpoints under the CHECKPOINT lock, both while
+// the file lock is only SHARED
+#define WRITE_ALLOWED(f) ((f)->wal_coordinated || \
+                          (((f)->lock_type == SQLITE_LOCK_EXCLUSIVE) && ((f)->lock_task == tx_thread_identify())))
+
 static inline FX_FILE* convert_fptr(sqlite3_file* fptr)
 {
 	assert(fptr);
@@ -619,6 +954,311 @@ static inline FX_FILE* convert_fptr(sqlite3_file* fptr)
     return azure_fptr;
 }
 
+// Writes at iOfst with the file mutex held, zero-filling a gap after the current end of file
+static int write_through(FX_FILE* azure_fptr, const void* buffer, ULONG iAmt, ULONG64 iOfst)
+{
+    static const char _Alignas(SQLITE3_AZURE_CONFIG_PAGE_POOL_ALIGNMENT) zero_buffer[512] = {0}; // May adjust size, it is guarded
+
+    int retval = SQLITE_OK;
+
+    if(azure_fptr->extents)
+        preallocate(azure_fptr, iOfst + iAmt);
+
+    // Azure does not check this condition
+    // Just sets to file size without error
+    if(azure_fptr->fx_file_current_file_size < iOfst)
+    {
+        if(fx_file_extended_seek(azure_fptr, azure_fptr->fx_file_current_file_size) != FX_SUCCESS)
+            retval = SQLITE_IOERR_SEEK;//SQLITE_IOERR_WRITE;
+        else
+        {
+            while(azure_fptr->fx_file_current_file_size < iOfst)
+            {
+                ULONG size = iOfst - azure_fptr->fx_file_current_file_size;
+                if(size > sizeof(zero_buffer))
+                    size = sizeof(zero_buffer);
+                if(fx_file_write(azure_fptr, (char*)zero_buffer, size) != FX_SUCCESS)
+                {
+                    retval = SQLITE_IOERR_WRITE;
+                    break;
+                }
+            }
+        }
+    }
+    else
+        if(extent_seek(azure_fptr, iOfst) != FX_SUCCESS)
+            retval = SQLITE_IOERR_SEEK; //SQLITE_IOERR_WRITE;
+
+    if(retval == SQLITE_OK)
+        retval = TranslateReturnValue(fx_file_write(azure_fptr, (void*)buffer, iAmt));
+
+    return retval;
+}
+
+#if SQLITE3_AZURE_CONFIG_WRITE_BEHIND
+
+/*
+ *   Write-behind queue
+ *
+ *   Slots and pool bytes are both FIFO rings indexed by free-running counters; the I/O thread always
+ *   takes the oldest slot, so writes reach the card in the order SQLite issued them, across files too.
+ *   A slot's data is placed so that its pool address and its file offset agree modulo 32: a write
+ *   that continues the previous one lands right after it, and a run starting on a sector boundary
+ *   is cache-line aligned, which lets the SD driver DMA straight from the pool instead of its
+ *   one-sector scratch buffer.
+ *
+ *   Lock order: a file mutex may be held while taking wb_mutex, never the other way round.
+ *   Nobody waits for the queue while holding a file mutex, the I/O thread needs it to make progress.
+ */
+struct wb_slot
+{
+    FX_FILE* file;
+    ULONG64 offset;  // File offset
+    ULONG64 pos;     // Pool position (free-running, modulo WB_POOL_SIZE)
+    ULONG size;
+};
+
+static char __attribute__((section(SQLITE3_AZURE_CONFIG_WB_POOL_SECTION), aligned(32)))
+    wb_pool[SQLITE3_AZURE_CONFIG_WB_POOL_SIZE];
+static struct wb_slot wb_slots[SQLITE3_AZURE_CONFIG_WB_SLOTS];
+static unsigned wb_head, wb_tail;           // Slots: next free, oldest
+static ULONG64 wb_pool_head, wb_pool_tail;  // Pool bytes: next free, end of the last written slot
+
+static TX_MUTEX wb_mutex;
+static TX_EVENT_FLAGS_GROUP wb_events;
+#define WB_EVENT_WORK    0x1  // Set on every staged write, cleared by the I/O thread
+#define WB_EVENT_WRITTEN 0x2  // Set after every run, cleared by the I/O thread before the next one
+
+static TX_THREAD wb_thread;
+static ULONG wb_stack[SQLITE3_AZURE_CONFIG_WB_STACK_SIZE / sizeof(ULONG)];
+
+static sqlite3_azure_wb_stats wb_stats;
+
+static void wb_thread_entry(ULONG)
+{
+    for(;;)
+    {
+        tx_mutex_get(&wb_mutex, TX_WAIT_FOREVER);
+
+        if(wb_head == wb_tail)
+        {
+            ULONG actual;
+            tx_mutex_put(&wb_mutex);
+            tx_event_flags_get(&wb_events, WB_EVENT_WORK, TX_OR_CLEAR, &actual, TX_WAIT_FOREVER);
+            continue;
+        }
+
+        // Oldest slot, extended by the following ones of the same file that continue it both in the
+        // file and in the pool
+        const struct wb_slot* first = &wb_slots[wb_tail % SQLITE3_AZURE_CONFIG_WB_SLOTS];
+        FX_FILE* file = first->file;
+        ULONG64 offset = first->offset;
+        ULONG64 pos = first->pos;
+        ULONG size = first->size;
+        unsigned count = 1;
+
+        while(wb_tail + count != wb_head)
+        {
+            const struct wb_slot* next = &wb_slots[(wb_tail + count) % SQLITE3_AZURE_CONFIG_WB_SLOTS];
+            if((next->file != file) || (next->offset != offset + size) || (next->pos != pos + size) ||
+               (size + next->size > SQLITE3_AZURE_CONFIG_WB_MAX_RUN) ||
+               ((pos % SQLITE3_AZURE_CONFIG_WB_POOL_SIZE) + size + next->size > SQLITE3_AZURE_CONFIG_WB_POOL_SIZE))
+                break;
+            size += next->size;
+            count++;
+        }
+
+        tx_event_flags_set(&wb_events, ~WB_EVENT_WRITTEN, TX_AND);
+        tx_mutex_put(&wb_mutex);
+
+        // The slots stay queued while the card is written, so xRead still finds them in the pool
+        mutex_get(&(file->mutex), TX_WAIT_FOREVER);
+        int retval = write_through(file, wb_pool + (pos % SQLITE3_AZURE_CONFIG_WB_POOL_SIZE), size, offset);
+        mutex_put(&(file->mutex));
+
+#if SQLITE3_AZURE_CONFIG_DEBUG > 0
+    printf("wb run %s %lu bytes at %lld from %u writes, %s%s", file->fx_file_name, size, offset, count,
+            retval == SQLITE_OK ? "SUCCESS" : "FAIL", newline);
+#endif
+
+        tx_mutex_get(&wb_mutex, TX_WAIT_FOREVER);
+        if((retval != SQLITE_OK) && (file->wb_error == SQLITE_OK))
+            file->wb_error = retval;  // Reported once, by the next xWrite / xSync / xTruncate on the file
+        file->wb_pending -= count;
+        if(file->wb_pending == 0)
+            file->wb_size = 0;
+        wb_tail += count;
+        wb_pool_tail = pos + size;
+        wb_stats.runs++;
+        wb_stats.bytes += size;
+        if(count > wb_stats.max_run_writes)
+            wb_stats.max_run_writes = count;
+        tx_mutex_put(&wb_mutex);
+
+        tx_event_flags_set(&wb_events, WB_EVENT_WRITTEN, TX_OR);
+    }
+}
+
+// Called with wb_mutex held, returns with it held
+static void wb_wait_written(void)
+{
+    ULONG actual;
+    tx_mutex_put(&wb_mutex);
+    tx_event_flags_get(&wb_events, WB_EVENT_WRITTEN, TX_OR, &actual, TX_WAIT_FOREVER);
+    tx_mutex_get(&wb_mutex, TX_WAIT_FOREVER);
+}
+
+// Queues a write, waiting for pool space if needed. Returns 0 if it is too large to stage
+static int wb_stage(FX_FILE* file, const void* buffer, ULONG size, ULONG64 offset)
+{
+    if((size == 0) || (size > SQLITE3_AZURE_CONFIG_WB_MAX_RUN))
+        return 0;
+
+    tx_mutex_get(&wb_mutex, TX_WAIT_FOREVER);
+
+    ULONG64 pos;
+    int stalled = 0;
+    for(;;)
+    {
+        pos = wb_pool_head + ((offset - wb_pool_head) & 31);
+        if((pos % SQLITE3_AZURE_CONFIG_WB_POOL_SIZE) + size > SQLITE3_AZURE_CONFIG_WB_POOL_SIZE)
+            pos = (pos / SQLITE3_AZURE_CONFIG_WB_POOL_SIZE + 1) * SQLITE3_AZURE_CONFIG_WB_POOL_SIZE + (offset & 31);
+
+        if((wb_head - wb_tail < SQLITE3_AZURE_CONFIG_WB_SLOTS) && (pos + size - wb_pool_tail <= SQLITE3_AZURE_CONFIG_WB_POOL_SIZE))
+            break;
+
+        if(!stalled)
+            wb_stats.stalls++;
+        stalled = 1;
+        wb_wait_written();
+    }
+
+    memcpy(wb_pool + (pos % SQLITE3_AZURE_CONFIG_WB_POOL_SIZE), buffer, size);
+
+    struct wb_slot* slot = &wb_slots[wb_head % SQLITE3_AZURE_CONFIG_WB_SLOTS];
+    slot->file = file;
+    slot->offset = offset;
+    slot->pos = pos;
+    slot->size = size;
+    wb_head++;
+    wb_pool_head = pos + size;
+
+    file->wb_pending++;
+    if(offset + size > file->wb_size)
+        file->wb_size = offset + size;
+
+    wb_stats.staged++;
+    ULONG queued = (ULONG)(wb_pool_head - wb_pool_tail);
+    if(queued > wb_stats.queued_max)
+        wb_stats.queued_max = queued;
+
+    tx_mutex_put(&wb_mutex);
+
+    tx_event_flags_set(&wb_events, WB_EVENT_WORK, TX_OR);
+
+    return 1;
+}
+
+// Serves a read from the newest staged write covering it
+// 1 - served, 0 - nothing staged is in the way, -1 - staged data only partly covers it
+static int wb_read(FX_FILE* file, void* buffer, ULONG size, ULONG64 offset)
+{
+    int retval = 0;
+
+    tx_mutex_get(&wb_mutex, TX_WAIT_FOREVER);
+
+    if(file->wb_pending)
+    {
+        for(unsigned i = wb_head; i != wb_tail; )
+        {
+            const struct wb_slot* slot = &wb_slots[--i % SQLITE3_AZURE_CONFIG_WB_SLOTS];
+            if((slot->file != file) || (slot->offset >= offset + size) || (slot->offset + slot->size <= offset))
+                continue;
+
+            if((slot->offset <= offset) && (slot->offset + slot->size >= offset + size))
+            {
+                memcpy(buffer, wb_pool + (slot->pos % SQLITE3_AZURE_CONFIG_WB_POOL_SIZE) + (offset - slot->offset), size);
+                wb_stats.read_hits++;
+                retval = 1;
+            }
+            else
+                retval = -1;
+            break;
+        }
+
+        // A hole before staged data is only zero-filled when the I/O thread gets there
+        if((retval == 0) && (offset + size > file->fx_file_current_file_size))
+            retval = -1;
+    }
+
+    tx_mutex_put(&wb_mutex);
+
+    return retval;
+}
+
+// Returns a deferred write error and clears it: SQLite handles it like the failed write it stands
+// for, and the file stays usable once the card is back
+static int wb_take_error(FX_FILE* file)
+{
+    tx_mutex_get(&wb_mutex, TX_WAIT_FOREVER);
+    int retval = file->wb_error;
+    file->wb_error = SQLITE_OK;
+    tx_mutex_put(&wb_mutex);
+
+    return retval;
+}
+
+// Waits until everything staged for the file is on the card, returns a deferred write error (kept)
+static int wb_drain(FX_FILE* file)
+{
+    tx_mutex_get(&wb_mutex, TX_WAIT_FOREVER);
+
+    if(file->wb_pending)
+        wb_stats.drains++;
+    while(file->wb_pending)
+        wb_wait_written();
+
+    int retval = file->wb_error;
+
+    tx_mutex_put(&wb_mutex);
+
+    return retval;
+}
+
+static void wb_start(void)
+{
+    tx_mutex_create(&wb_mutex, "SQLite Azure write-behind mutex", TX_NO_INHERIT);
+    tx_event_flags_create(&wb_events, "SQLite Azure write-behind events");
+    tx_thread_create(&wb_thread, "SQLite Azure write-behind", wb_thread_entry, 0,
+                     wb_stack, sizeof(wb_stack),
+                     SQLITE3_AZURE_CONFIG_WB_PRIORITY, SQLITE3_AZURE_CONFIG_WB_PRIORITY,
+                     TX_NO_TIME_SLICE, TX_AUTO_START);
+}
+
+void sqlite3_azure_write_behind_stats(sqlite3_azure_wb_stats* stats, int reset)
+{
+    assert(stats);
+
+    tx_mutex_get(&wb_mutex, TX_WAIT_FOREVER);
+    *stats = wb_stats;
+    stats->queued = (unsigned long)(wb_pool_head - wb_pool_tail);
+    if(reset)
+    {
+        memset(&wb_stats, 0, sizeof(wb_stats));
+    }
+    tx_mutex_put(&wb_mutex);
+}
+
+#else
+
+void sqlite3_azure_write_behind_stats(sqlite3_azure_wb_stats* stats, int reset)
+{
+    assert(stats);
+    memset(stats, 0, sizeof(*stats));
+}
+
+#endif
+
 int xClose(sqlite3_file* fptr)
 {
     FX_FILE* const azure_fptr = convert_fptr(fptr);
@@ -643,6 +1283,16 @@ int xClose(sqlite3_file* fptr)
     mutex_get(&openclose, TX_WAIT_FOREVER);
     mutex_put(&(azure_fptr->mutex));
 
+#if SQLITE3_AZURE_CONFIG_WRITE_BEHIND
+    // No connection is left to stage more, and openclose keeps xOpen from reusing the file meanwhile
+    if(azure_fptr->write_behind)
+        wb_drain(azure_fptr);
+#endif
+
+    // Only files with an extent map are preallocated; a file about to be deleted goes anyway
+    if(azure_fptr->extents && !azure_fptr->delete_on_close)
+        preallocate_release(azure_fptr);
+
     if(FX_SUCCESS == fx_file_close(azure_fptr))
     {
         if(((struct sqlite3_azure_file*)fptr)->fx_file->delete_on_close)
@@ -650,6 +1300,8 @@ int xClose(sqlite3_file* fptr)
 
         mutex_delete(&(azure_fptr->mutex));
 
+        extent_map_free(azure_fptr->extents);
+
         sqlite3_free(azure_fptr);
 
 #if SQLITE3_AZURE_CONFIG_DEBUG
@@ -691,11 +1343,30 @@ int xRead(sqlite3_file* fptr, void* buffer, int iAmt, sqlite3_int64 iOfst)
     //    or seek it at the same time
     mutex_get(&(azure_fptr->mutex), TX_WAIT_FOREVER);
 
+#if SQLITE3_AZURE_CONFIG_WRITE_BEHIND
+    // Under the file mutex: the I/O thread moves the file size while it holds it
+    if(azure_fptr->write_behind)
+    {
+        int staged = wb_read(azure_fptr, buffer, iAmt, iOfst);
+        if(staged > 0)
+        {
+            mutex_put(&(azure_fptr->mutex));
+            return SQLITE_OK;
+        }
+        if(staged < 0)
+        {   // Partly staged: let the I/O thread put it on the card first, it needs the file mutex for that
+            mutex_put(&(azure_fptr->mutex));
+            wb_drain(azure_fptr);
+            mutex_get(&(azure_fptr->mutex), TX_WAIT_FOREVER);
+        }
+    }
+#endif
+
     // TODO Trying to read behind the EOF is error, not short read?
     if(azure_fptr->fx_file_current_file_size < iOfst)
         retval = SQLITE_IOERR_SHORT_READ; //SQLITE_IOERR_READ;
     else
-       if(fx_file_extended_seek(azure_fptr, iOfst) != FX_SUCCESS)
+       if(extent_seek(azure_fptr, iOfst) != FX_SUCCESS)
            retval = SQLITE_IOERR_SEEK; //SQLITE_IOERR_READ;
 
     if(retval == SQLITE_OK)
@@ -720,50 +1391,31 @@ int xRead(sqlite3_file* fptr, void* buffer, int iAmt, sqlite3_int64 iOfst)
 
 int xWrite(sqlite3_file* fptr, const void* buffer, int iAmt, sqlite3_int64 iOfst)
 {
-    static const char _Alignas(SQLITE3_AZURE_CONFIG_PAGE_POOL_ALIGNMENT) zero_buffer[512] = {0}; // May adjust size, it is guarded
-
     FX_FILE* const azure_fptr = convert_fptr(fptr);
 
     assert(buffer);
 	assert(iAmt >= 0);
 	assert(iOfst >= 0);
-    assert(azure_fptr->lock_type == SQLITE_LOCK_EXCLUSIVE);
-    assert(azure_fptr->lock_task == tx_thread_identify());
+    assert(WRITE_ALLOWED(azure_fptr));
 
-    int retval = SQLITE_OK;
+#if SQLITE3_AZURE_CONFIG_WRITE_BEHIND
+    if(azure_fptr->write_behind)
+    {
+        int retval = wb_take_error(azure_fptr);
+        if(retval != SQLITE_OK)
+            return retval;
+        if(wb_stage(azure_fptr, buffer, iAmt, iOfst))
+            return SQLITE_OK;
+        wb_drain(azure_fptr); // Too large to stage, and it must not overtake what is queued
+    }
+#endif
 
     // Seems that SQLite may sometimes read read-only parts of the database file (like header)
     // without acquiring SHARED lock. It would be safe for normal OS, but here we need to
     // atomize seek and write. Because of this write is also isolated
     mutex_get(&(azure_fptr->mutex), TX_WAIT_FOREVER);
 
-    // Azure does not check this condition
-    // Just sets to file size without error
-    if(azure_fptr->fx_file_current_file_size < iOfst)
-    {
-        if(fx_file_extended_seek(azure_fptr, azure_fptr->fx_file_current_file_size) != FX_SUCCESS)
-            retval = SQLITE_IOERR_SEEK;//SQLITE_IOERR_WRITE;
-        else
-        {
-            while(azure_fptr->fx_file_current_file_size < iOfst)
-            {
-                ULONG size = iOfst - azure_fptr->fx_file_current_file_size;
-                if(size > sizeof(zero_buffer))
-                    size = sizeof(zero_buffer);
-                if(fx_file_write(azure_fptr, (char*)zero_buffer, size) != FX_SUCCESS)
-                {
-                    retval = SQLITE_IOERR_WRITE;
-                    break;
-                }
-            }
-        }
-    }
-    else
-        if(fx_file_extended_seek(azure_fptr, iOfst) != FX_SUCCESS)
-            retval = SQLITE_IOERR_SEEK; //SQLITE_IOERR_WRITE;
-
-    if(retval == SQLITE_OK)
-        retval = TranslateReturnValue(fx_file_write(azure_fptr, (void*)buffer, iAmt));
+    int retval = write_through(azure_fptr, buffer, iAmt, iOfst);
 
 #if SQLITE3_AZURE_CONFIG_DEBUG > 0
     printf("xWrite %s %i bytes at %lld process %li, memory used %i, %s%s", azure_fptr->fx_file_name, iAmt, iOfst,
@@ -783,16 +1435,29 @@ int xTruncate(sqlite3_file* fptr, sqlite3_int64 size)
     printf("xTruncate %s to %lli bytes\r\n", azure_fptr->fx_file_name, size);
 #endif
 
-    assert(azure_fptr->lock_type == SQLITE_LOCK_EXCLUSIVE);
-    assert(azure_fptr->lock_task == tx_thread_identify());
+    assert(WRITE_ALLOWED(azure_fptr));
 
     int retval = SQLITE_OK;
 
+#if SQLITE3_AZURE_CONFIG_WRITE_BEHIND
+    // Staged writes past the new end would otherwise grow the file again
+    if(azure_fptr->write_behind)
+    {
+        wb_drain(azure_fptr);
+        if((retval = wb_take_error(azure_fptr)) != SQLITE_OK)
+            return retval;
+    }
+#endif
+
     mutex_get(&(azure_fptr->mutex), TX_WAIT_FOREVER);
 
     if(fx_file_extended_truncate_release(azure_fptr, size) != FX_SUCCESS)
         retval = SQLITE_IOERR_TRUNCATE;
 
+    // Released clusters may be reused by any file, the map is rebuilt on demand
+    if(azure_fptr->extents)
+        azure_fptr->extents->mapped = azure_fptr->extents->count = 0;
+
     mutex_put(&(azure_fptr->mutex));
 
     return retval;
@@ -806,6 +1471,16 @@ int xSync(sqlite3_file* fptr, int flags)
     printf("xSync%s", newline);
 #endif
 
+#if SQLITE3_AZURE_CONFIG_WRITE_BEHIND
+    if(azure_fptr->write_behind)
+    {
+        wb_drain(azure_fptr);
+        int retval = wb_take_error(azure_fptr);
+        if(retval != SQLITE_OK)
+            return retval;
+    }
+#endif
+
     // In fact we does not need it while SQLite uses it to synchronize after writing.
     // As this RTOS does not have separate buffers for individual files all writes are immediately visible for all
     // But it is still good to flush for safety
@@ -818,8 +1493,25 @@ int xFileSize(sqlite3_file* fptr, sqlite3_int64 *pSize)
 
 	FX_FILE* const azure_fptr = convert_fptr(fptr);
 
+    // The I/O thread grows the file under its mutex and only then retires the staged size, so holding
+    // both locks sees one or the other
+    mutex_get(&(azure_fptr->mutex), TX_WAIT_FOREVER);
+
     *pSize = azure_fptr->fx_file_current_file_size;
 
+#if SQLITE3_AZURE_CONFIG_WRITE_BEHIND
+    // Staged writes past the end of the file already count
+    if(azure_fptr->write_behind)
+    {
+        tx_mutex_get(&wb_mutex, TX_WAIT_FOREVER);
+        if(azure_fptr->wb_pending && (azure_fptr->wb_size > *pSize))
+            *pSize = azure_fptr->wb_size;
+        tx_mutex_put(&wb_mutex);
+    }
+#endif
+
+    mutex_put(&(azure_fptr->mutex));
+
 #if SQLITE3_AZURE_CONFIG_DEBUG > 2
     printf("xFileSize %s, got %lld bytes%s", azure_fptr->fx_file_name, *pSize, newline);
 #endif
@@ -1096,13 +1788,11 @@ int xFileControl(sqlite3_file* fptr, int op, void *pArg)
            return SQLITE_OK;
        case SQLITE_FCNTL_SIZE_HINT:
     	   assert(pArg);
-    	   ULONG64 allocate = *((sqlite_int64*)pArg);
-    	   if(allocate < azure_fptr->fx_file_current_file_size)
-               return SQLITE_OK;
-    	   allocate -= azure_fptr->fx_file_current_file_size;
-    	   if(allocate < PREALLOCATE_MINIMUM)
-               return SQLITE_OK;
-           fx_file_extended_best_effort_allocate(azure_fptr, allocate, &allocate);
+           // Measured against the allocated space, not the file size: space taken by an earlier
+           // hint is not allocated again
+           mutex_get(&(azure_fptr->mutex), TX_WAIT_FOREVER); // The write-behind thread may be writing it
+           preallocate(azure_fptr, *((sqlite_int64*)pArg));
+           mutex_put(&(azure_fptr->mutex));
            return SQLITE_OK;
        case SQLITE_FCNTL_RESET_CACHE:
            return TranslateReturnValue(fx_media_cache_invalidate(azure_fptr->fx_file_media_ptr));
@@ -1127,258 +1817,2083 @@ int xDeviceCharacteristics(sqlite3_file*)
     return SQLITE_IOCAP_UNDELETABLE_WHEN_OPEN /*| SQLITE_IOCAP_SAFE_APPEND seems good but still need to test it*/;
 }
 
-const sqlite3_io_methods azure_file_methods = {
-        .iVersion               = 1,
-        .xClose                 = xClose,
-        .xRead                  = xRead,
-        .xWrite                 = xWrite,
-        .xTruncate              = xTruncate,
-        .xSync                  = xSync,
-        .xFileSize              = xFileSize,
-        .xLock                  = xLock,
-        .xUnlock                = xUnlock,
-        .xCheckReservedLock     = xCheckReservedLock,
-        .xFileControl           = xFileControl,
-        .xSectorSize            = xSectorSize,
-        .xDeviceCharacteristics = xDeviceCharacteristics,
-          /* Methods above are valid for version 1 */
-        /*.xShmMap = xShmMap,
-        .xShmLock = xShmLock,
-        .xShmBarrier = xShmBarrier,
-        .xShmUnmap = xShmUnmap,*/
-          /* Methods above are valid for version 2 */
-        /*.xFetch = xFetch,
-        .xUnfetch = xUnfetch*/
-};
-
-/* ---------------------------- Memory management ------------------------------------ */
-// Not tested, used static buffers instead
-#if !SQLITE3_AZURE_CONFIG_STATIC_POOL && SQLITE3_AZURE_CONFIG_DYNAMIC_POOL
-
-struct malloc_size{
-    void* address;
-    int   size;
-};
-
-struct malloc_size malloc_sizes[SQLITE3_AZURE_CONFIG_TRACKABLE_MALLOCS];
-
-void* xMalloc(int size)
+/*
+ *   Shared-memory wal-index
+ *
+ *   All connections live in this process, so the wal-index is plain memory shared through the FX_FILE
+ *   that xOpen already shares between connections opening the same database. Nothing is written to a
+ *   -shm file: after a reset the regions come up zeroed and SQLite rebuilds the index from the WAL.
+ *
+ *   SQLite never blocks in xShmLock, it retries through the busy handler, so the lock table is just a
+ *   set of counters guarded by a ThreadX mutex: >0 is the number of SHARED holders, -1 is EXCLUSIVE.
+ */
+struct sqlite3_azure_shm
 {
-    void* result;
-
-    if(tx_byte_allocate(SQLITE3_AZURE_CONFIG_DYNAMIC_POOL, &result, size, TX_WAIT_FOREVER) == TX_SUCCESS)
-    {
-        for(unsigned i = 0; i < SQLITE3_AZURE_CONFIG_TRACKABLE_MALLOCS; i++)
-            if(malloc_sizes[i].address == NULL)
-            {
-                malloc_sizes[i].address = result;
-                malloc_sizes[i].size = size;
-                break;
-            }
-        return result;
-    }
+    TX_MUTEX mutex;
+    unsigned references;                                          // Connections that mapped it
+    int locks[SQLITE_SHM_NLOCK];
+    unsigned regions_count;
+    volatile void* regions[SQLITE3_AZURE_CONFIG_SHM_POOL_REGIONS];
+};
 
-    return NULL;
-}
+static char __attribute__((section(SQLITE3_AZURE_CONFIG_SHM_POOL_SECTION), aligned(32)))
+    shm_pool[SQLITE3_AZURE_CONFIG_SHM_POOL_REGIONS][SQLITE3_AZURE_CONFIG_SHM_REGION_SIZE];
+static unsigned char shm_pool_used[SQLITE3_AZURE_CONFIG_SHM_POOL_REGIONS];
 
-void xFree(void* memptr)
+// Called with openclose held
+static void* shm_region_alloc(void)
 {
-	assert(memptr);
-
-    tx_byte_release(memptr);
-
-    for(unsigned i = 0; i < SQLITE3_AZURE_CONFIG_TRACKABLE_MALLOCS; i++)
-        if(malloc_sizes[i].address == memptr)
+    for(unsigned i = 0; i < SQLITE3_AZURE_CONFIG_SHM_POOL_REGIONS; i++)
+        if(!shm_pool_used[i])
         {
-            malloc_sizes[i].address = NULL;
-            return;
+            shm_pool_used[i] = 1;
+            memset(shm_pool[i], 0, SQLITE3_AZURE_CONFIG_SHM_REGION_SIZE);
+            return shm_pool[i];
         }
+
+    return NULL;
 }
 
-void* xRealloc(void* memptr, int size)
+// Called with openclose held
+static void shm_region_free(volatile void* region)
 {
-	assert(memptr);
+    const unsigned i = ((volatile char*)region - &shm_pool[0][0]) / SQLITE3_AZURE_CONFIG_SHM_REGION_SIZE;
 
-    void* newmem = xMalloc(size);
-    if(newmem == NULL)
-        return NULL;
-    memcpy(newmem, memptr, size);
-    xFree(memptr);
-    return newmem;
+    assert(i < SQLITE3_AZURE_CONFIG_SHM_POOL_REGIONS);
+    shm_pool_used[i] = 0;
 }
 
-int xSize(void* memptr)
+int xShmMap(sqlite3_file* fptr, int iRegion, int szRegion, int bExtend, void volatile** pp)
 {
-	assert(memptr);
-
-    for(unsigned i = 0; i < SQLITE3_AZURE_CONFIG_TRACKABLE_MALLOCS; i++)
-        if(malloc_sizes[i].address == memptr)
-            return malloc_sizes[i].size;
+    assert(pp);
+    assert(iRegion >= 0);
 
-    return 0;
-}
+    struct sqlite3_azure_file* const file = (struct sqlite3_azure_file*)fptr;
+    FX_FILE* const azure_fptr = convert_fptr(fptr);
 
-int xRoundup(int size)
-{
-    return size;
-}
+    if(szRegion != SQLITE3_AZURE_CONFIG_SHM_REGION_SIZE)
+        return SQLITE_IOERR_SHMMAP;
 
-int xInit(void*)
-{
-    for(unsigned i = 0; i < SQLITE3_AZURE_CONFIG_TRACKABLE_MALLOCS; i++)
-        malloc_sizes[i].address = NULL;
-    return SQLITE_OK;
-}
+    int retval = SQLITE_OK;
 
-void xShutdown(void*)
-{
-    for(unsigned i = 0; i < SQLITE3_AZURE_CONFIG_TRACKABLE_MALLOCS; i++)
-        if(malloc_sizes[i].address != NULL)
-            xFree(malloc_sizes[i].address);
-}
+    // Regions are allocated and freed under the same mutex as FX_FILE structures
+    mutex_get(&openclose, TX_WAIT_FOREVER);
 
-const sqlite3_mem_methods mem_methods = {
-          .xMalloc   = xMalloc,     /* Memory allocation function */
-          .xFree     = xFree,         /* Free a prior allocation */
-          .xRealloc  = xRealloc,   /* Resize an allocation */
-          .xSize     = xSize,         /* Return the size of an allocation */
-          .xRoundup  = xRoundup,   /* Round up request size to allocation size */
-          .xInit     = xInit,         /* Initialize the memory allocator */
-          .xShutdown = xShutdown,  /* Deinitialize the memory allocator */
-          .pAppData  = NULL        /* Argument to xInit() and xShutdown() */
-};
+    struct sqlite3_azure_shm* shm = azure_fptr->shm;
 
-#endif
+    if(NULL == shm)
+    {
+        shm = sqlite3_malloc(sizeof(struct sqlite3_azure_shm));
+        if(NULL == shm)
+        {
+            mutex_put(&openclose);
+            return SQLITE_NOMEM;
+        }
+        memset(shm, 0, sizeof(struct sqlite3_azure_shm));
+        mutex_create(&(shm->mutex), "Azure wal-index mutex", TX_NO_INHERIT);
+        azure_fptr->shm = shm;
+        azure_fptr->wal_coordinated = 1; // Checkpoints write the database under SHARED lock from now on
+    }
 
-/* ---------------------------- Mutexes ---------------------------------------------- */
+    if(!file->shm_mapped)
+    {
+        file->shm_mapped = 1;
+        shm->references++;
+    }
 
-#if SQLITE_THREADSAFE
+    while((shm->regions_count <= (unsigned)iRegion) && bExtend)
+    {
+        if(shm->regions_count == SQLITE3_AZURE_CONFIG_SHM_POOL_REGIONS)
+            break;
+        void* region = shm_region_alloc();
+        if(NULL == region)
+            break;
+        shm->regions[shm->regions_count++] = region;
+    }
 
-struct sqlite3_mutex { TX_MUTEX mutex; };
+    if((unsigned)iRegion < shm->regions_count)
+        *pp = shm->regions[iRegion];
+    else
+    {
+        *pp = NULL;
+        if(bExtend) // The pool is exhausted, the WAL must be checkpointed before it may grow further
+            retval = SQLITE_IOERR_SHMSIZE;
+    }
 
-sqlite3_mutex sqlite3_mutexes[SQLITE3_AZURE_CONFIG_STATIC_MUTEXES];
-#if 1
-const char* sqlite3_mutex_names[SQLITE3_AZURE_CONFIG_STATIC_MUTEXES] = {
-                  "SQLITE_MUTEX_STATIC_MAIN", "SQLITE_MUTEX_STATIC_MEM",
-                  "SQLITE_MUTEX_STATIC_OPEN", "SQLITE_MUTEX_STATIC_PRNG", "SQLITE_MUTEX_STATIC_LRU",
-				  "SQLITE_MUTEX_STATIC_PMEM", "SQLITE_MUTEX_STATIC_APP1",
-				  "SQLITE_MUTEX_STATIC_APP2", "SQLITE_MUTEX_STATIC_APP3", "SQLITE_MUTEX_STATIC_VFS1",
-				  "SQLITE_MUTEX_STATIC_VFS2", "SQLITE_MUTEX_STATIC_VFS3" };
-#else
-const char* const nullstr = "";
-const char* sqlite3_mutex_names[SQLITE3_AZURE_CONFIG_STATIC_MUTEXES] = {
-		nullstr, nullstr,
-		nullstr, nullstr, nullstr,
-		nullstr, nullstr,
-		nullstr, nullstr, nullstr,
-		nullstr, nullstr };
+#if SQLITE3_AZURE_CONFIG_DEBUG > 1
+    printf("xShmMap %s region %i, mapped %u, %s%s", azure_fptr->fx_file_name, iRegion, shm->regions_count,
+            retval == SQLITE_OK ? "SUCCESS" : "FAIL", newline);
 #endif
 
-int xMutexInit(void)
-{
-    for(unsigned i = 0; i < SQLITE3_AZURE_CONFIG_STATIC_MUTEXES; i++)
-        if(mutex_create(&(sqlite3_mutexes[i].mutex), (char*)sqlite3_mutex_names[i], TX_NO_INHERIT) != TX_SUCCESS)
-            ;//return SQLITE_ERROR; // Should not normally happen, use for debug
+    mutex_put(&openclose);
 
-    return SQLITE_OK;
+    return retval;
 }
 
-int xMutexEnd(void)
+int xShmLock(sqlite3_file* fptr, int offset, int n, int flags)
 {
-    for(unsigned i = 0; i < SQLITE3_AZURE_CONFIG_STATIC_MUTEXES; i++)
-        if(mutex_delete(&(sqlite3_mutexes[i].mutex)) != TX_SUCCESS)
-            ; // return SQLITE_ERROR; // Should not normally happen, just for debug
+    assert(offset >= 0);
+    assert(n >= 1);
+    assert(offset + n <= SQLITE_SHM_NLOCK);
+    assert((n == 1) || (flags & (SQLITE_SHM_EXCLUSIVE | SQLITE_SHM_UNLOCK))); // xShmUnmap releases all slots at once
 
-    return SQLITE_OK;
-}
+    struct sqlite3_azure_file* const file = (struct sqlite3_azure_file*)fptr;
+    struct sqlite3_azure_shm* const shm = convert_fptr(fptr)->shm;
 
-sqlite3_mutex* xMutexAlloc(int type)
-{
+    assert(shm);
+    assert(file->shm_mapped);
 
-    if(type < SQLITE_MUTEX_STATIC_MAIN)
-    {
-        sqlite3_mutex* mutex_ptr = sqlite3_malloc(sizeof(sqlite3_mutex));
+    const unsigned short mask = ((1U << n) - 1) << offset;
+    int retval = SQLITE_OK;
 
-        if(mutex_ptr == NULL)
-            return NULL;
+    mutex_get(&(shm->mutex), TX_WAIT_FOREVER);
 
-        if(mutex_create(&(mutex_ptr->mutex), "SQLIte Azure dynamic mutex", TX_NO_INHERIT) != TX_SUCCESS)
+    if(flags & SQLITE_SHM_UNLOCK)
+    {
+        for(int i = offset; i < offset + n; i++)
         {
-            sqlite3_free(mutex_ptr);
-            return NULL;
+            if(file->shm_excl_mask & (1U << i))
+                shm->locks[i] = 0;
+            else
+                if(file->shm_shared_mask & (1U << i))
+                {
+                    assert(shm->locks[i] > 0);
+                    shm->locks[i]--;
+                }
         }
-
-        return mutex_ptr;
+        file->shm_excl_mask &= ~mask;
+        file->shm_shared_mask &= ~mask;
     }
+    else
+        if(flags & SQLITE_SHM_SHARED)
+        {
+            if(!(file->shm_shared_mask & mask))
+            {
+                if(shm->locks[offset] < 0)
+                    retval = SQLITE_BUSY;
+                else
+                {
+                    shm->locks[offset]++;
+                    file->shm_shared_mask |= mask;
+                }
+            }
+        }
+        else
+        {   // EXCLUSIVE: nobody else may hold any of the slots
+            for(int i = offset; i < offset + n; i++)
+            {
+                if(file->shm_excl_mask & (1U << i))
+                    continue;
+                if(shm->locks[i] - ((file->shm_shared_mask & (1U << i)) ? 1 : 0) != 0)
+                {
+                    retval = SQLITE_BUSY;
+                    break;
+                }
+            }
+            if(retval == SQLITE_OK)
+            {
+                for(int i = offset; i < offset + n; i++)
+                    shm->locks[i] = -1;
+                file->shm_shared_mask &= ~mask;
+                file->shm_excl_mask |= mask;
+            }
+        }
 
-    type -= SQLITE_MUTEX_STATIC_MAIN;
+#if SQLITE3_AZURE_CONFIG_DEBUG > 1
+    printf("xShmLock %i+%i flags %i from process %u, %s%s", offset, n, flags, (unsigned)tx_thread_identify(),
+            retval == SQLITE_OK ? "SUCCESS" : "BUSY", newline);
+#endif
 
-    if(type < SQLITE3_AZURE_CONFIG_STATIC_MUTEXES)
-        return &sqlite3_mutexes[type];
+    mutex_put(&(shm->mutex));
 
-    return NULL;
+    return retval;
 }
 
-void xMutexFree(sqlite3_mutex* mutex)
+void xShmBarrier(sqlite3_file* fptr)
 {
-	assert(mutex);
+    struct sqlite3_azure_shm* const shm = convert_fptr(fptr)->shm;
 
-    if((mutex < sqlite3_mutexes) || (mutex > &sqlite3_mutexes[SQLITE3_AZURE_CONFIG_STATIC_MUTEXES - 1]))
+    // Orders the wal-index accesses of this core, the mutex round trip orders them against other threads
+    __sync_synchronize();
+    if(shm)
     {
-        if(FX_SUCCESS == mutex_delete(&(mutex->mutex))) // Prevents heap crash if the pointer is wrong
-            sqlite3_free(mutex);
+        mutex_get(&(shm->mutex), TX_WAIT_FOREVER);
+        mutex_put(&(shm->mutex));
     }
 }
 
-void xMutexEnter(sqlite3_mutex* mutex)
+int xShmUnmap(sqlite3_file* fptr, int deleteFlag)
 {
-	assert(mutex);
+    (void)deleteFlag; // There is no -shm file to delete
 
-    tx_mutex_get(&(mutex->mutex), TX_WAIT_FOREVER);
-}
+    struct sqlite3_azure_file* const file = (struct sqlite3_azure_file*)fptr;
+    FX_FILE* const azure_fptr = convert_fptr(fptr);
+    struct sqlite3_azure_shm* const shm = azure_fptr->shm;
 
-int xMutexTry(sqlite3_mutex* mutex)
-{
-	assert(mutex);
+    if((NULL == shm) || !file->shm_mapped)
+        return SQLITE_OK;
 
-    if(tx_mutex_get(&(mutex->mutex), TX_NO_WAIT) == TX_WAIT_ERROR)
-        return SQLITE_BUSY;
+    // Drop whatever this connection still holds
+    xShmLock(fptr, 0, SQLITE_SHM_NLOCK, SQLITE_SHM_UNLOCK);
 
-    return SQLITE_OK;
-}
+    mutex_get(&openclose, TX_WAIT_FOREVER);
 
-void xMutexLeave(sqlite3_mutex* mutex)
+    file->shm_mapped = 0;
+
+    if(--(shm->references) == 0)
+    {
+#if SQLITE3_AZURE_CONFIG_DEBUG > 1
+        printf("xShmUnmap %s releases %u regions%s", azure_fptr->fx_file_name, shm->regions_count, newline);
+#endif
+        for(unsigned i = 0; i < shm->regions_count; i++)
+            shm_region_free(shm->regions[i]);
+        mutex_delete(&(shm->mutex));
+        sqlite3_free(shm);
+        azure_fptr->shm = NULL;
+    }
+
+    mutex_put(&openclose);
+
+    return SQLITE_OK;
+}
+
+const sqlite3_io_methods azure_file_methods = {
+        .iVersion               = 2,
+        .xClose                 = xClose,
+        .xRead                  = xRead,
+        .xWrite                 = xWrite,
+        .xTruncate              = xTruncate,
+        .xSync                  = xSync,
+        .xFileSize              = xFileSize,
+        .xLock                  = xLock,
+        .xUnlock                = xUnlock,
+        .xCheckReservedLock     = xCheckReservedLock,
+        .xFileControl           = xFileControl,
+        .xSectorSize            = xSectorSize,
+        .xDeviceCharacteristics = xDeviceCharacteristics,
+          /* Methods above are valid for version 1 */
+        .xShmMap                = xShmMap,
+        .xShmLock               = xShmLock,
+        .xShmBarrier            = xShmBarrier,
+        .xShmUnmap              = xShmUnmap,
+          /* Methods above are valid for version 2 */
+        /*.xFetch = xFetch,
+        .xUnfetch = xUnfetch*/
+};
+
+/*
+ *   Temporary files in PSRAM
+ *
+ *   Files SQLite opens without a name are private to one connection and deleted on close, so they need
+ *   neither a directory entry nor locks. Their contents are kept in a table of blocks from a static PSRAM
+ *   pool, a block that was never written reads as zeros. When a write finds no free block the file is
+ *   spilled: created on the card under a temporary name as before, filled with what it held so far, and
+ *   from then on served by azure_file_methods (pMethods is switched, the way SQLite's own memory
+ *   journal hands over to a real file). The pool is a budget for all temporary files together.
+ *   Its top may be lent out (sqlite3_azure_temp_lend) while temporary files leave it unused, the budget
+ *   shrinks by as much until it is returned
+ */
+#if SQLITE3_AZURE_CONFIG_TEMP_POOL_SIZE
+
+#define TEMP_BLOCKS (SQLITE3_AZURE_CONFIG_TEMP_POOL_SIZE / SQLITE3_AZURE_CONFIG_TEMP_BLOCK_SIZE)
+
+struct temp_file
+{
+    int flags;                       // Open flags, for the spill
+    unsigned blocks_count;           // Entries in blocks, NULL ones are holes
+    unsigned char** blocks;
+    sqlite3_int64 size;
+};
+
+static unsigned char __attribute__((section(SQLITE3_AZURE_CONFIG_TEMP_POOL_SECTION), aligned(32)))
+    temp_pool[TEMP_BLOCKS][SQLITE3_AZURE_CONFIG_TEMP_BLOCK_SIZE];
+static void* temp_free;              // Linked through the first word of each block
+static unsigned temp_carved;         // Blocks handed out at least once
+static unsigned temp_limit = TEMP_BLOCKS; // Blocks below the part lent out
+static sqlite3_azure_tmp_stats temp_stats;
+
+const sqlite3_io_methods temp_file_methods;
+
+static unsigned char* temp_block_alloc(void)
+{
+    unsigned char* block = NULL;
+    UINT interrupts = tx_interrupt_control(TX_INT_DISABLE);
+
+    if(temp_free)
+    {
+        block = temp_free;
+        temp_free = *(void**)block;
+    }
+    else if(temp_carved < temp_limit)
+        block = temp_pool[temp_carved++];
+
+    if(block)
+    {
+        temp_stats.in_use += SQLITE3_AZURE_CONFIG_TEMP_BLOCK_SIZE;
+        if(temp_stats.in_use > temp_stats.in_use_max)
+            temp_stats.in_use_max = temp_stats.in_use;
+    }
+
+    tx_interrupt_control(interrupts);
+
+    return block;
+}
+
+// Frees the blocks from index first on
+static void temp_blocks_free(struct temp_file* temp, unsigned first)
+{
+    UINT interrupts = tx_interrupt_control(TX_INT_DISABLE);
+
+    for(unsigned i = first; i < temp->blocks_count; i++)
+        if(temp->blocks[i])
+        {
+            *(void**)temp->blocks[i] = temp_free;
+            temp_free = temp->blocks[i];
+            temp->blocks[i] = NULL;
+            temp_stats.in_use -= SQLITE3_AZURE_CONFIG_TEMP_BLOCK_SIZE;
+        }
+
+    tx_interrupt_control(interrupts);
+}
+
+static void temp_release(struct temp_file* temp)
+{
+    temp_blocks_free(temp, 0);
+    sqlite3_free(temp->blocks);
+    sqlite3_free(temp);
+
+    UINT interrupts = tx_interrupt_control(TX_INT_DISABLE);
+    temp_stats.open--;
+    tx_interrupt_control(interrupts);
+}
+
+static int temp_open(sqlite3_file* fptr, int flags, int *pOutFlags)
+{
+    struct sqlite3_azure_file* const file = (struct sqlite3_azure_file*)fptr;
+
+    struct temp_file* const temp = sqlite3_malloc(sizeof(struct temp_file));
+    if(NULL == temp)
+        return SQLITE_NOMEM;
+
+    temp->flags = flags;
+    temp->blocks_count = 0;
+    temp->blocks = NULL;
+    temp->size = 0;
+
+    fptr->pMethods = &temp_file_methods;
+    file->fx_file = NULL;
+    file->shm_shared_mask = file->shm_excl_mask = 0;
+    file->shm_mapped = 0;
+    file->temp = temp;
+
+    if(pOutFlags)
+        *pOutFlags = flags;
+
+    UINT interrupts = tx_interrupt_control(TX_INT_DISABLE);
+    temp_stats.files++;
+    temp_stats.open++;
+    tx_interrupt_control(interrupts);
+
+#if SQLITE3_AZURE_CONFIG_DEBUG > 0
+    printf("xOpen temporary file in PSRAM %p%s", (void*)temp, newline);
+#endif
+
+    return SQLITE_OK;
+}
+
+// Moves the file to the card, the PSRAM blocks go back to the pool
+static int temp_spill(sqlite3_file* fptr)
+{
+    struct temp_file* const temp = ((struct sqlite3_azure_file*)fptr)->temp;
+
+    // Sets pMethods and fx_file, and temp to NULL
+    int retval = media_open(&azure_vfs, NULL, fptr, temp->flags, NULL);
+
+    if(retval != SQLITE_OK)
+    {
+        fptr->pMethods = &temp_file_methods;
+        ((struct sqlite3_azure_file*)fptr)->temp = temp;
+        return retval;
+    }
+
+    for(unsigned i = 0; (retval == SQLITE_OK) && (i < temp->blocks_count); i++)
+    {
+        const sqlite3_int64 offset = (sqlite3_int64)i * SQLITE3_AZURE_CONFIG_TEMP_BLOCK_SIZE;
+        if(temp->blocks[i] && (offset < temp->size))
+        {
+            const sqlite3_int64 left = temp->size - offset;
+            retval = xWrite(fptr, temp->blocks[i],
+                            left < SQLITE3_AZURE_CONFIG_TEMP_BLOCK_SIZE ? (int)left : SQLITE3_AZURE_CONFIG_TEMP_BLOCK_SIZE,
+                            offset);
+        }
+    }
+
+    // Trailing holes still count in the size
+    if((retval == SQLITE_OK) && ((sqlite3_int64)convert_fptr(fptr)->fx_file_current_file_size < temp->size))
+    {
+        static const char zero = 0;
+        retval = xWrite(fptr, &zero, 1, temp->size - 1);
+    }
+
+#if SQLITE3_AZURE_CONFIG_DEBUG > 0
+    printf("Temporary file %p spilled %lld bytes to %s%s", (void*)temp, temp->size,
+           convert_fptr(fptr)->fx_file_name, newline);
+#endif
+
+    UINT interrupts = tx_interrupt_control(TX_INT_DISABLE);
+    temp_stats.spills++;
+    temp_stats.spilled += temp->size;
+    tx_interrupt_control(interrupts);
+
+    temp_release(temp);
+
+    return retval;
+}
+
+static int xTempClose(sqlite3_file* fptr)
+{
+    struct sqlite3_azure_file* const file = (struct sqlite3_azure_file*)fptr;
+
+    temp_release(file->temp);
+    file->temp = NULL;
+
+    return SQLITE_OK;
+}
+
+static int xTempRead(sqlite3_file* fptr, void* buffer, int iAmt, sqlite3_int64 iOfst)
+{
+    assert(buffer);
+    assert(iAmt >= 0);
+    assert(iOfst >= 0);
+
+    const struct temp_file* const temp = ((struct sqlite3_azure_file*)fptr)->temp;
+    unsigned char* out = buffer;
+    int retval = SQLITE_OK;
+
+    if(iOfst + iAmt > temp->size)
+    {
+        const sqlite3_int64 available = (iOfst < temp->size) ? temp->size - iOfst : 0;
+        memset(out + available, 0, iAmt - available);
+        iAmt = (int)available;
+        retval = SQLITE_IOERR_SHORT_READ;
+    }
+
+    UINT interrupts = tx_interrupt_control(TX_INT_DISABLE);
+    temp_stats.read += iAmt;
+    tx_interrupt_control(interrupts);
+
+    while(iAmt > 0)
+    {
+        const unsigned i = (unsigned)(iOfst / SQLITE3_AZURE_CONFIG_TEMP_BLOCK_SIZE);
+        const unsigned in_block = (unsigned)(iOfst % SQLITE3_AZURE_CONFIG_TEMP_BLOCK_SIZE);
+        unsigned amount = SQLITE3_AZURE_CONFIG_TEMP_BLOCK_SIZE - in_block;
+        if(amount > (unsigned)iAmt)
+            amount = iAmt;
+
+        if((i < temp->blocks_count) && temp->blocks[i])
+            memcpy(out, temp->blocks[i] + in_block, amount);
+        else
+            memset(out, 0, amount);
+
+        out += amount;
+        iOfst += amount;
+        iAmt -= amount;
+    }
+
+    return retval;
+}
+
+static int xTempWrite(sqlite3_file* fptr, const void* buffer, int iAmt, sqlite3_int64 iOfst)
+{
+    assert(buffer);
+    assert(iAmt >= 0);
+    assert(iOfst >= 0);
+
+    struct temp_file* const temp = ((struct sqlite3_azure_file*)fptr)->temp;
+
+    if(iAmt == 0)
+        return SQLITE_OK;
+
+    // Table first, so that running out of pool is the only reason to spill
+    const unsigned last = (unsigned)((iOfst + iAmt - 1) / SQLITE3_AZURE_CONFIG_TEMP_BLOCK_SIZE);
+    if(last >= temp->blocks_count)
+    {
+        unsigned count = temp->blocks_count ? temp->blocks_count : 8;
+        while(count <= last)
+            count *= 2;
+        unsigned char** const blocks = sqlite3_realloc(temp->blocks, count * sizeof(unsigned char*));
+        if(NULL == blocks)
+            return SQLITE_NOMEM;
+        memset(blocks + temp->blocks_count, 0, (count - temp->blocks_count) * sizeof(unsigned char*));
+        temp->blocks = blocks;
+        temp->blocks_count = count;
+    }
+
+    for(unsigned i = (unsigned)(iOfst / SQLITE3_AZURE_CONFIG_TEMP_BLOCK_SIZE); i <= last; i++)
+        if(NULL == temp->blocks[i])
+        {
+            temp->blocks[i] = temp_block_alloc();
+            if(NULL == temp->blocks[i])
+            {
+                // Blocks taken for this write so far lie past the end, the spill does not copy them
+                int retval = temp_spill(fptr);
+                if(retval != SQLITE_OK)
+                    return retval;
+                return fptr->pMethods->xWrite(fptr, buffer, iAmt, iOfst);
+            }
+            // Zeros before the data and for a hole, the rest is written over
+            memset(temp->blocks[i], 0, SQLITE3_AZURE_CONFIG_TEMP_BLOCK_SIZE);
+        }
+
+    UINT interrupts = tx_interrupt_control(TX_INT_DISABLE);
+    temp_stats.written += iAmt;
+    tx_interrupt_control(interrupts);
+
+    const unsigned char* in = buffer;
+    if(iOfst + iAmt > temp->size)
+        temp->size = iOfst + iAmt;
+
+    while(iAmt > 0)
+    {
+        const unsigned in_block = (unsigned)(iOfst % SQLITE3_AZURE_CONFIG_TEMP_BLOCK_SIZE);
+        unsigned amount = SQLITE3_AZURE_CONFIG_TEMP_BLOCK_SIZE - in_block;
+        if(amount > (unsigned)iAmt)
+            amount = iAmt;
+
+        memcpy(temp->blocks[iOfst / SQLITE3_AZURE_CONFIG_TEMP_BLOCK_SIZE] + in_block, in, amount);
+
+        in += amount;
+        iOfst += amount;
+        iAmt -= amount;
+    }
+
+    return SQLITE_OK;
+}
+
+static int xTempTruncate(sqlite3_file* fptr, sqlite3_int64 size)
+{
+    struct temp_file* const temp = ((struct sqlite3_azure_file*)fptr)->temp;
+
+    if(size < temp->size)
+    {
+        temp_blocks_free(temp, (unsigned)((size + SQLITE3_AZURE_CONFIG_TEMP_BLOCK_SIZE - 1) / SQLITE3_AZURE_CONFIG_TEMP_BLOCK_SIZE));
+
+        // The tail of the last block may be read back as a hole after growing again
+        const unsigned in_block = (unsigned)(size % SQLITE3_AZURE_CONFIG_TEMP_BLOCK_SIZE);
+        const unsigned i = (unsigned)(size / SQLITE3_AZURE_CONFIG_TEMP_BLOCK_SIZE);
+        if(in_block && (i < temp->blocks_count) && temp->blocks[i])
+            memset(temp->blocks[i] + in_block, 0, SQLITE3_AZURE_CONFIG_TEMP_BLOCK_SIZE - in_block);
+    }
+    temp->size = size;
+
+    return SQLITE_OK;
+}
+
+static int xTempSync(sqlite3_file*, int)
+{
+    return SQLITE_OK;
+}
+
+static int xTempFileSize(sqlite3_file* fptr, sqlite3_int64 *pSize)
+{
+    assert(pSize);
+
+    *pSize = ((struct sqlite3_azure_file*)fptr)->temp->size;
+
+    return SQLITE_OK;
+}
+
+// Nobody else sees the file
+static int xTempLock(sqlite3_file*, int)
+{
+    return SQLITE_OK;
+}
+
+static int xTempCheckReservedLock(sqlite3_file*, int *pResOut)
+{
+    assert(pResOut);
+
+    *pResOut = 0;
+
+    return SQLITE_OK;
+}
+
+static int xTempFileControl(sqlite3_file*, int op, void *pArg)
+{
+    switch(op)
+    {
+       case SQLITE_FCNTL_LOCKSTATE:
+           assert(pArg);
+           *((int*)pArg) = SQLITE_LOCK_EXCLUSIVE;
+           return SQLITE_OK;
+       case SQLITE_FCNTL_HAS_MOVED:
+           assert(pArg);
+           *((int*)pArg) = 0;
+           return SQLITE_OK;
+       default:
+           return SQLITE_NOTFOUND;
+    }
+}
+
+static int xTempSectorSize(sqlite3_file*)
+{
+    return sqlite3_media_ptr->fx_media_bytes_per_sector; // As it would be after a spill
+}
+
+static int xTempDeviceCharacteristics(sqlite3_file*)
+{
+    return SQLITE_IOCAP_UNDELETABLE_WHEN_OPEN;
+}
+
+const sqlite3_io_methods temp_file_methods = {
+        .iVersion               = 1,
+        .xClose                 = xTempClose,
+        .xRead                  = xTempRead,
+        .xWrite                 = xTempWrite,
+        .xTruncate              = xTempTruncate,
+        .xSync                  = xTempSync,
+        .xFileSize              = xTempFileSize,
+        .xLock                  = xTempLock,
+        .xUnlock                = xTempLock,
+        .xCheckReservedLock     = xTempCheckReservedLock,
+        .xFileControl           = xTempFileControl,
+        .xSectorSize            = xTempSectorSize,
+        .xDeviceCharacteristics = xTempDeviceCharacteristics,
+};
+
+#endif // SQLITE3_AZURE_CONFIG_TEMP_POOL_SIZE
+
+void sqlite3_azure_temp_stats(sqlite3_azure_tmp_stats* stats, int reset)
+{
+    assert(stats);
+
+#if SQLITE3_AZURE_CONFIG_TEMP_POOL_SIZE
+    UINT interrupts = tx_interrupt_control(TX_INT_DISABLE);
+
+    *stats = temp_stats;
+    stats->pool = SQLITE3_AZURE_CONFIG_TEMP_POOL_SIZE;
+    if(reset)
+    {
+        const unsigned long open = temp_stats.open, in_use = temp_stats.in_use, lent = temp_stats.lent;
+        memset(&temp_stats, 0, sizeof(temp_stats));
+        temp_stats.open = open;
+        temp_stats.in_use = temp_stats.in_use_max = in_use;
+        temp_stats.lent = lent;
+    }
+
+    tx_interrupt_control(interrupts);
+#else
+    memset(stats, 0, sizeof(*stats));
+#endif
+}
+
+void* sqlite3_azure_temp_lend(unsigned size)
+{
+    void* memory = NULL;
+
+#if SQLITE3_AZURE_CONFIG_TEMP_POOL_SIZE
+    const unsigned blocks = (size + SQLITE3_AZURE_CONFIG_TEMP_BLOCK_SIZE - 1) / SQLITE3_AZURE_CONFIG_TEMP_BLOCK_SIZE;
+    UINT interrupts = tx_interrupt_control(TX_INT_DISABLE);
+
+    // Once no block is in use the pool is carved again from the bottom, which frees its top
+    if(temp_stats.in_use == 0)
+    {
+        temp_free = NULL;
+        temp_carved = 0;
+    }
+
+    if(temp_limit >= temp_carved + blocks)
+    {
+        temp_limit -= blocks;
+        memory = temp_pool[temp_limit];
+        temp_stats.lent += blocks * SQLITE3_AZURE_CONFIG_TEMP_BLOCK_SIZE;
+    }
+
+    tx_interrupt_control(interrupts);
+#else
+    (void)size;
+#endif
+
+    return memory;
+}
+
+void sqlite3_azure_temp_return(void* memory, unsigned size)
+{
+#if SQLITE3_AZURE_CONFIG_TEMP_POOL_SIZE
+    const unsigned blocks = (size + SQLITE3_AZURE_CONFIG_TEMP_BLOCK_SIZE - 1) / SQLITE3_AZURE_CONFIG_TEMP_BLOCK_SIZE;
+
+    assert(memory == temp_pool[temp_limit]); // The latest lent comes back first
+    assert(temp_limit + blocks <= TEMP_BLOCKS);
+
+    UINT interrupts = tx_interrupt_control(TX_INT_DISABLE);
+    temp_limit += blocks;
+    temp_stats.lent -= blocks * SQLITE3_AZURE_CONFIG_TEMP_BLOCK_SIZE;
+    tx_interrupt_control(interrupts);
+#else
+    (void)memory;
+    (void)size;
+#endif
+}
+
+int xOpen(sqlite3_vfs* vfs, sqlite3_filename zName, sqlite3_file* fptr, int flags, int *pOutFlags)
+{
+#if SQLITE3_AZURE_CONFIG_TEMP_POOL_SIZE
+    // Only SQLite itself opens files without a name, and deletes them on close
+    if(NULL == zName)
+    {
+        assert(vfs == &azure_vfs);
+        return temp_open(fptr, flags, pOutFlags);
+    }
+#endif
+
+    return media_open(vfs, zName, fptr, flags, pOutFlags);
+}
+
+/* ---------------------------- Memory management ------------------------------------ */
+// Not tested, used static buffers instead
+#if !SQLITE3_AZURE_CONFIG_STATIC_POOL && SQLITE3_AZURE_CONFIG_DYNAMIC_POOL
+
+struct malloc_size{
+    void* address;
+    int   size;
+};
+
+struct malloc_size malloc_sizes[SQLITE3_AZURE_CONFIG_TRACKABLE_MALLOCS];
+
+void* xMalloc(int size)
+{
+    void* result;
+
+    if(tx_byte_allocate(SQLITE3_AZURE_CONFIG_DYNAMIC_POOL, &result, size, TX_WAIT_FOREVER) == TX_SUCCESS)
+    {
+        for(unsigned i = 0; i < SQLITE3_AZURE_CONFIG_TRACKABLE_MALLOCS; i++)
+            if(malloc_sizes[i].address == NULL)
+            {
+                malloc_sizes[i].address = result;
+                malloc_sizes[i].size = size;
+                break;
+            }
+        return result;
+    }
+
+    return NULL;
+}
+
+void xFree(void* memptr)
+{
+	assert(memptr);
+
+    tx_byte_release(memptr);
+
+    for(unsigned i = 0; i < SQLITE3_AZURE_CONFIG_TRACKABLE_MALLOCS; i++)
+        if(malloc_sizes[i].address == memptr)
+        {
+            malloc_sizes[i].address = NULL;
+            return;
+        }
+}
+
+void* xRealloc(void* memptr, int size)
+{
+	assert(memptr);
+
+    void* newmem = xMalloc(size);
+    if(newmem == NULL)
+        return NULL;
+    memcpy(newmem, memptr, size);
+    xFree(memptr);
+    return newmem;
+}
+
+int xSize(void* memptr)
+{
+	assert(memptr);
+
+    for(unsigned i = 0; i < SQLITE3_AZURE_CONFIG_TRACKABLE_MALLOCS; i++)
+        if(malloc_sizes[i].address == memptr)
+            return malloc_sizes[i].size;
+
+    return 0;
+}
+
+int xRoundup(int size)
+{
+    return size;
+}
+
+int xInit(void*)
+{
+    for(unsigned i = 0; i < SQLITE3_AZURE_CONFIG_TRACKABLE_MALLOCS; i++)
+        malloc_sizes[i].address = NULL;
+    return SQLITE_OK;
+}
+
+void xShutdown(void*)
+{
+    for(unsigned i = 0; i < SQLITE3_AZURE_CONFIG_TRACKABLE_MALLOCS; i++)
+        if(malloc_sizes[i].address != NULL)
+            xFree(malloc_sizes[i].address);
+}
+
+const sqlite3_mem_methods mem_methods = {
+          .xMalloc   = xMalloc,     /* Memory allocation function */
+          .xFree     = xFree,         /* Free a prior allocation */
+          .xRealloc  = xRealloc,   /* Resize an allocation */
+          .xSize     = xSize,         /* Return the size of an allocation */
+          .xRoundup  = xRoundup,   /* Round up request size to allocation size */
+          .xInit     = xInit,         /* Initialize the memory allocator */
+          .xShutdown = xShutdown,  /* Deinitialize the memory allocator */
+          .pAppData  = NULL        /* Argument to xInit() and xShutdown() */
+};
+
+#endif
+
+// Size-class allocator in front of memsys5 (SQLITE3_AZURE_CONFIG_SIZE_CLASSES)
+// Requests up to the largest class come off the free list of their class. A class takes a chunk
+// of the SRAM pool when its list is empty and carves blocks from it one at a time, so every call is
+// a few instructions with interrupts off and no headers: the chunk a block lies in names its class.
+// Larger requests, and classes that find the pool used up, go to memsys5 on the PSRAM heap.
+// Between sqlite3_azure_mem_arena(1) and (0) small requests of the thread that opened it are bumped
+// from the arena instead: blocks of ARENA_SIZE / ARENA_BLOCKS that count their live allocations and
+// start over once all of them are freed, which for a transaction's transient memory is at COMMIT.
+// The ingestor opens it once its statements are prepared; the page cache holds it off for its hash
+// tables and heap pages. Anything else that outlives the transaction only keeps its own block from
+// being reused (arena_pinned)
+#if SQLITE3_AZURE_CONFIG_SIZE_CLASSES
+
+#define MEM_CHUNK        6144       // Multiple of every class size
+#define MEM_CHUNKS       (SQLITE3_AZURE_CONFIG_CLASS_POOL_SIZE / MEM_CHUNK)
+#define MEM_MAX_CLASS    2048
+#define MEM_ARENA_BLOCK  (SQLITE3_AZURE_CONFIG_ARENA_SIZE / SQLITE3_AZURE_CONFIG_ARENA_BLOCKS)
+#define MEM_ARENA_HEADER 8          // Allocation size, keeps the 8-byte alignment
+
+static const unsigned short mem_class_size[SQLITE3_AZURE_MEM_CLASSES] = {
+    16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048 };
+
+__attribute__((section(SQLITE3_AZURE_CONFIG_CLASS_POOL_SECTION), aligned(32)))
+static unsigned char mem_pool[MEM_CHUNKS * MEM_CHUNK];
+__attribute__((section(SQLITE3_AZURE_CONFIG_CLASS_POOL_SECTION), aligned(32)))
+static unsigned char mem_arena[SQLITE3_AZURE_CONFIG_ARENA_BLOCKS * MEM_ARENA_BLOCK];
+
+static unsigned char mem_chunk_class[MEM_CHUNKS];
+static unsigned char mem_class_of[MEM_MAX_CLASS / 16 + 1]; // By (size + 15) / 16
+static unsigned mem_chunks_used;
+
+static struct
+{
+    void* free;                      // Linked through the first word of each block
+    unsigned char* next;             // Rest of the class's newest chunk
+    unsigned char* end;
+} mem_class[SQLITE3_AZURE_MEM_CLASSES];
+
+static struct
+{
+    unsigned used;
+    unsigned live;
+} mem_block[SQLITE3_AZURE_CONFIG_ARENA_BLOCKS];
+
+static unsigned mem_block_current;
+static TX_THREAD* mem_arena_owner;   // NULL while no transaction is open
+static volatile int mem_arena_hold;  // Set around allocations known to live on (page cache)
+static sqlite3_mem_methods mem_fallback;
+static sqlite3_azure_sc_stats mem_stats;
+
+#define IN_POOL(p)  ((unsigned char*)(p) >= mem_pool && (unsigned char*)(p) < mem_pool + sizeof(mem_pool))
+#define IN_ARENA(p) ((unsigned char*)(p) >= mem_arena && (unsigned char*)(p) < mem_arena + sizeof(mem_arena))
+
+// With interrupts off
+static void* mem_class_alloc(unsigned c)
+{
+    void* p = mem_class[c].free;
+
+    if(p)
+        mem_class[c].free = *(void**)p;
+    else
+    {
+        if(mem_class[c].next == mem_class[c].end)
+        {
+            if(mem_chunks_used == MEM_CHUNKS)
+                return NULL;
+            mem_class[c].next = mem_pool + mem_chunks_used * MEM_CHUNK;
+            mem_class[c].end = mem_class[c].next + MEM_CHUNK;
+            mem_chunk_class[mem_chunks_used++] = c;
+            mem_stats.carved[c] += MEM_CHUNK / mem_class_size[c];
+        }
+        p = mem_class[c].next;
+        mem_class[c].next += mem_class_size[c];
+    }
+    mem_stats.allocs[c]++;
+    mem_stats.in_use[c]++;
+    return p;
+}
+
+// With interrupts off
+static void* mem_arena_alloc(unsigned size)
+{
+    unsigned need = MEM_ARENA_HEADER + ((size + 7) & ~7u);
+
+    if(mem_block[mem_block_current].used + need > MEM_ARENA_BLOCK)
+    {
+        // Move on to a block with nothing live in it
+        unsigned i;
+        for(i = 1; i <= SQLITE3_AZURE_CONFIG_ARENA_BLOCKS; i++)
+            if(mem_block[(mem_block_current + i) % SQLITE3_AZURE_CONFIG_ARENA_BLOCKS].live == 0)
+                break;
+        if(i > SQLITE3_AZURE_CONFIG_ARENA_BLOCKS)
+            return NULL;
+        mem_block_current = (mem_block_current + i) % SQLITE3_AZURE_CONFIG_ARENA_BLOCKS;
+        mem_block[mem_block_current].used = 0;
+        mem_stats.arena_resets++;
+    }
+
+    unsigned char* p = mem_arena + mem_block_current * MEM_ARENA_BLOCK + mem_block[mem_block_current].used;
+    *(unsigned*)p = size;
+    mem_block[mem_block_current].used += need;
+    mem_block[mem_block_current].live++;
+    if(mem_block[mem_block_current].used > mem_stats.arena_high)
+        mem_stats.arena_high = mem_block[mem_block_current].used;
+    mem_stats.arena_allocs++;
+    return p + MEM_ARENA_HEADER;
+}
+
+static void* xClassMalloc(int size)
+{
+    void* p = NULL;
+    UINT interrupts = tx_interrupt_control(TX_INT_DISABLE);
+
+    if(mem_arena_owner && !mem_arena_hold && size <= MEM_ARENA_BLOCK - MEM_ARENA_HEADER
+       && tx_thread_identify() == mem_arena_owner)
+        p = mem_arena_alloc(size);
+    if(p == NULL && size <= MEM_MAX_CLASS)
+        p = mem_class_alloc(mem_class_of[(size + 15) / 16]);
+    if(p == NULL)
+        mem_stats.fallback_allocs++;
+
+    tx_interrupt_control(interrupts);
+
+    return p ? p : mem_fallback.xMalloc(size);
+}
+
+static void xClassFree(void* p)
+{
+    assert(p);
+
+    if(IN_ARENA(p))
+    {
+        unsigned block = ((unsigned char*)p - mem_arena) / MEM_ARENA_BLOCK;
+        UINT interrupts = tx_interrupt_control(TX_INT_DISABLE);
+        assert(mem_block[block].live);
+        if(--mem_block[block].live == 0 && block == mem_block_current)
+        {
+            mem_block[block].used = 0;
+            mem_stats.arena_resets++;
+        }
+        tx_interrupt_control(interrupts);
+    }
+    else if(IN_POOL(p))
+    {
+        unsigned c = mem_chunk_class[((unsigned char*)p - mem_pool) / MEM_CHUNK];
+        UINT interrupts = tx_interrupt_control(TX_INT_DISABLE);
+        *(void**)p = mem_class[c].free;
+        mem_class[c].free = p;
+        mem_stats.in_use[c]--;
+        tx_interrupt_control(interrupts);
+    }
+    else
+        mem_fallback.xFree(p);
+}
+
+static int xClassSize(void* p)
+{
+    assert(p);
+
+    if(IN_ARENA(p))
+        return *(unsigned*)((unsigned char*)p - MEM_ARENA_HEADER);
+    if(IN_POOL(p))
+        return mem_class_size[mem_chunk_class[((unsigned char*)p - mem_pool) / MEM_CHUNK]];
+    return mem_fallback.xSize(p);
+}
+
+static void* xClassRealloc(void* p, int size)
+{
+    assert(p);
+
+    if(!IN_ARENA(p) && !IN_POOL(p) && size > MEM_MAX_CLASS)
+        return mem_fallback.xRealloc(p, size);
+
+    int old_size = xClassSize(p);
+    if(size <= old_size && (IN_POOL(p) || IN_ARENA(p)))
+        return p;
+
+    void* q = xClassMalloc(size);
+    if(q == NULL)
+        return NULL;
+    memcpy(q, p, old_size < size ? old_size : size);
+    xClassFree(p);
+    return q;
+}
+
+static int xClassRoundup(int size)
+{
+    if(size <= 0 || size > MEM_MAX_CLASS)
+        return mem_fallback.xRoundup(size);
+    return mem_class_size[mem_class_of[(size + 15) / 16]];
+}
+
+static int xClassInit(void* arg)
+{
+    (void)arg;
+
+    for(unsigned i = 0, c = 0; i <= MEM_MAX_CLASS / 16; i++)
+    {
+        while(mem_class_size[c] < i * 16)
+            c++;
+        mem_class_of[i] = c;
+    }
+    memset(mem_class, 0, sizeof(mem_class));
+    memset(mem_block, 0, sizeof(mem_block));
+    memset(&mem_stats, 0, sizeof(mem_stats));
+    mem_chunks_used = 0;
+    mem_block_current = 0;
+    mem_arena_owner = NULL;
+
+    return mem_fallback.xInit(mem_fallback.pAppData);
+}
+
+static void xClassShutdown(void* arg)
+{
+    (void)arg;
+    mem_fallback.xShutdown(mem_fallback.pAppData);
+}
+
+static const sqlite3_mem_methods class_mem_methods = {
+    .xMalloc   = xClassMalloc,
+    .xFree     = xClassFree,
+    .xRealloc  = xClassRealloc,
+    .xSize     = xClassSize,
+    .xRoundup  = xClassRoundup,
+    .xInit     = xClassInit,
+    .xShutdown = xClassShutdown,
+    .pAppData  = NULL
+};
+
+int sqlite3_azure_mem_config(void)
+{
+    // The allocator configured so far (memsys5 after SQLITE_CONFIG_HEAP) takes what the classes do not
+    int rc = sqlite3_config(SQLITE_CONFIG_GETMALLOC, &mem_fallback);
+    if(rc == SQLITE_OK)
+        rc = sqlite3_config(SQLITE_CONFIG_MALLOC, &class_mem_methods);
+    return rc;
+}
+
+void sqlite3_azure_mem_arena(int open)
+{
+    UINT interrupts = tx_interrupt_control(TX_INT_DISABLE);
+
+    if(open)
+        mem_arena_owner = tx_thread_identify();
+    else
+    {
+        mem_arena_owner = NULL;
+        if(mem_block[mem_block_current].live)
+            mem_stats.arena_pinned++;
+        else if(mem_block[mem_block_current].used)
+        {
+            mem_block[mem_block_current].used = 0;
+            mem_stats.arena_resets++;
+        }
+    }
+
+    tx_interrupt_control(interrupts);
+}
+
+void sqlite3_azure_size_class_stats(sqlite3_azure_sc_stats* stats, int reset)
+{
+    assert(stats);
+
+    UINT interrupts = tx_interrupt_control(TX_INT_DISABLE);
+    *stats = mem_stats;
+    for(unsigned c = 0; c < SQLITE3_AZURE_MEM_CLASSES; c++)
+        stats->size[c] = mem_class_size[c];
+    stats->chunks = MEM_CHUNKS;
+    stats->chunks_used = mem_chunks_used;
+    stats->arena_blocks = SQLITE3_AZURE_CONFIG_ARENA_BLOCKS;
+    stats->arena_busy = 0;
+    for(unsigned b = 0; b < SQLITE3_AZURE_CONFIG_ARENA_BLOCKS; b++)
+        if(mem_block[b].live)
+            stats->arena_busy++;
+    if(reset)
+    {
+        memset(mem_stats.allocs, 0, sizeof(mem_stats.allocs));
+        mem_stats.arena_allocs = mem_stats.arena_resets = mem_stats.arena_pinned = 0;
+        mem_stats.arena_high = 0;
+        mem_stats.fallback_allocs = 0;
+    }
+    tx_interrupt_control(interrupts);
+}
+
+#else
+
+static volatile int mem_arena_hold;
+
+int sqlite3_azure_mem_config(void) { return SQLITE_OK; }
+
+void sqlite3_azure_mem_arena(int open) { (void)open; }
+
+void sqlite3_azure_size_class_stats(sqlite3_azure_sc_stats* stats, int reset)
+{
+    assert(stats);
+    (void)reset;
+    memset(stats, 0, sizeof(*stats));
+}
+
+#endif
+
+/* ---------------------------- Mutexes ---------------------------------------------- */
+
+#if SQLITE_THREADSAFE
+
+struct sqlite3_mutex { TX_MUTEX mutex; };
+
+sqlite3_mutex sqlite3_mutexes[SQLITE3_AZURE_CONFIG_STATIC_MUTEXES];
+#if 1
+const char* sqlite3_mutex_names[SQLITE3_AZURE_CONFIG_STATIC_MUTEXES] = {
+                  "SQLITE_MUTEX_STATIC_MAIN", "SQLITE_MUTEX_STATIC_MEM",
+                  "SQLITE_MUTEX_STATIC_OPEN", "SQLITE_MUTEX_STATIC_PRNG", "SQLITE_MUTEX_STATIC_LRU",
+				  "SQLITE_MUTEX_STATIC_PMEM", "SQLITE_MUTEX_STATIC_APP1",
+				  "SQLITE_MUTEX_STATIC_APP2", "SQLITE_MUTEX_STATIC_APP3", "SQLITE_MUTEX_STATIC_VFS1",
+				  "SQLITE_MUTEX_STATIC_VFS2", "SQLITE_MUTEX_STATIC_VFS3" };
+#else
+const char* const nullstr = "";
+const char* sqlite3_mutex_names[SQLITE3_AZURE_CONFIG_STATIC_MUTEXES] = {
+		nullstr, nullstr,
+		nullstr, nullstr, nullstr,
+		nullstr, nullstr,
+		nullstr, nullstr, nullstr,
+		nullstr, nullstr };
+#endif
+
+int xMutexInit(void)
+{
+    for(unsigned i = 0; i < SQLITE3_AZURE_CONFIG_STATIC_MUTEXES; i++)
+        if(mutex_create(&(sqlite3_mutexes[i].mutex), (char*)sqlite3_mutex_names[i], TX_NO_INHERIT) != TX_SUCCESS)
+            ;//return SQLITE_ERROR; // Should not normally happen, use for debug
+
+    return SQLITE_OK;
+}
+
+int xMutexEnd(void)
+{
+    for(unsigned i = 0; i < SQLITE3_AZURE_CONFIG_STATIC_MUTEXES; i++)
+        if(mutex_delete(&(sqlite3_mutexes[i].mutex)) != TX_SUCCESS)
+            ; // return SQLITE_ERROR; // Should not normally happen, just for debug
+
+    return SQLITE_OK;
+}
+
+sqlite3_mutex* xMutexAlloc(int type)
+{
+
+    if(type < SQLITE_MUTEX_STATIC_MAIN)
+    {
+        sqlite3_mutex* mutex_ptr = sqlite3_malloc(sizeof(sqlite3_mutex));
+
+        if(mutex_ptr == NULL)
+            return NULL;
+
+        if(mutex_create(&(mutex_ptr->mutex), "SQLIte Azure dynamic mutex", TX_NO_INHERIT) != TX_SUCCESS)
+        {
+            sqlite3_free(mutex_ptr);
+            return NULL;
+        }
+
+        return mutex_ptr;
+    }
+
+    type -= SQLITE_MUTEX_STATIC_MAIN;
+
+    if(type < SQLITE3_AZURE_CONFIG_STATIC_MUTEXES)
+        return &sqlite3_mutexes[type];
+
+    return NULL;
+}
+
+void xMutexFree(sqlite3_mutex* mutex)
+{
+	assert(mutex);
+
+    if((mutex < sqlite3_mutexes) || (mutex > &sqlite3_mutexes[SQLITE3_AZURE_CONFIG_STATIC_MUTEXES - 1]))
+    {
+        if(FX_SUCCESS == mutex_delete(&(mutex->mutex))) // Prevents heap crash if the pointer is wrong
+            sqlite3_free(mutex);
+    }
+}
+
+void xMutexEnter(sqlite3_mutex* mutex)
+{
+	assert(mutex);
+
+    tx_mutex_get(&(mutex->mutex), TX_WAIT_FOREVER);
+}
+
+int xMutexTry(sqlite3_mutex* mutex)
+{
+	assert(mutex);
+
+    if(tx_mutex_get(&(mutex->mutex), TX_NO_WAIT) != TX_SUCCESS) // TX_NOT_AVAILABLE when another thread owns it
+        return SQLITE_BUSY;
+
+    return SQLITE_OK;
+}
+
+void xMutexLeave(sqlite3_mutex* mutex)
+{
+	assert(mutex);
+
+    tx_mutex_put(&(mutex->mutex));
+}
+
+int xMutexHeld(sqlite3_mutex* mutex)
+{
+	assert(mutex);
+
+    return mutex->mutex.tx_mutex_ownership_count;
+}
+
+int xMutexNotheld(sqlite3_mutex* mutex) { return !xMutexHeld(mutex); }
+
+const sqlite3_mutex_methods azure_mutexes = {
+  .xMutexInit    = xMutexInit,
+  .xMutexEnd     = xMutexEnd,
+  .xMutexAlloc   = xMutexAlloc,
+  .xMutexFree    = xMutexFree,
+  .xMutexEnter   = xMutexEnter,
+  .xMutexTry     = xMutexTry,
+  .xMutexLeave   = xMutexLeave,
+  .xMutexHeld    = xMutexHeld,
+  .xMutexNotheld = xMutexNotheld
+};
+
+#endif
+
+/* ---------------------------- Page cache ------------------------------------------- */
+// Replaces pcache1 (SQLITE_CONFIG_PCACHE2) on a static pool of equal slots, one page each.
+// Every unpinned page goes to one of two LRU lists of its cache, by the b-tree page type read from the
+// page itself when SQLite unpins it: interior pages (the root included once the tree has levels) are
+// the protected segment, leaves and everything else (overflow, freelist) the probationary one.
+// Append-only inserts touch a leaf once and leave it, so recycling takes the oldest leaf first and the
+// interior pages that every insert walks stay cached, however large the table gets.
+// The protected segment is held to PCACHE_PROTECT_PCT of the cache, past that its oldest page goes
+// first, so a wide index cannot squeeze the leaves out completely.
+// A cache whose pages do not fit a slot (page size above what the pool was cut for) takes them from
+// the SQLite heap instead, with the same policy
+//
+// Slots also come from a second, smaller pool in on-chip SRAM (the SRAM tier). Pages the B-tree
+// appends to the file (the right-edge leaf and the pages a split creates) start there: the database
+// size in the header on page 1 is raised before such a page is fetched, so the last page is the
+// appended one. Reads of existing pages, the first ones of a new cache included, stay in PSRAM; an
+// interior page in the PSRAM pool moves up once it has been fetched PCACHE_PROMOTE_HITS times.
+// SQLite keeps pointers into a page while it is cached, so a page cannot be copied: a promotion
+// drops the PSRAM page and hands SQLite a new one in SRAM, which the pager reads again. Room in the
+// tier is made by dropping its oldest leaf (a demotion); interior pages are never displaced by a leaf
+//
+// Other pools may lend idle memory to the PSRAM side (sqlite3_azure_pcache_lend). It is cut into slots
+// like the pool, and while it is lent a cache whose cache_size covers the whole pool may hold that many
+// pages more. Taking it back evicts the pages in it, unless one of them is pinned
+
+#define PAGE_INTERIOR SQLITE3_AZURE_PAGE_INTERIOR
+#define PAGE_LEAF     SQLITE3_AZURE_PAGE_LEAF
+#define PAGE_OTHER    SQLITE3_AZURE_PAGE_OTHER
+
+#define PCACHE_PSRAM  0
+#define PCACHE_SRAM   1
+
+#define PCACHE_LOANS  64
+
+struct pcache_page
+{
+    sqlite3_pcache_page page;        // Must be first: SQLite hands it back in xUnpin and xRekey
+    struct pcache* cache;
+    unsigned key;
+    unsigned stamp;                  // Unpin order, for picking a victim across caches
+    struct pcache_page* hash_next;
+    struct pcache_page* lru_prev;
+    struct pcache_page* lru_next;
+    struct pcache_page* tier_prev;   // Unpinned pages of the SRAM tier, all caches
+    struct pcache_page* tier_next;
+    unsigned char pinned;
+    unsigned char type;              // PAGE_INTERIOR, PAGE_LEAF or PAGE_OTHER as of the last unpin
+    unsigned char fresh;             // Created by this fetch, the miss is counted on the first unpin
+    unsigned char heap;              // Allocated with sqlite3_malloc, not a pool slot
+    unsigned char tier;              // PCACHE_PSRAM or PCACHE_SRAM
+    unsigned char hits;              // Since the page was read in, saturates
+};
+
+struct pcache
+{
+    struct pcache* next;             // All caches, for eviction across them
+    int page_size;
+    int extra_size;
+    int purgeable;
+    int slotted;                     // Pages fit a pool slot
+    unsigned max;                    // xCachesize
+    unsigned pages;
+    unsigned pinned;
+    unsigned buckets;
+    struct pcache_page** hash;
+    struct pcache_page* lru_head[2]; // [0] protected (interior), [1] probationary, oldest first
+    struct pcache_page* lru_tail[2];
+    unsigned lru_count[2];
+};
+
+static struct
+{
+    sqlite3_mutex* mutex;
+    unsigned char* pool;
+    unsigned pool_size;
+    unsigned slot_size;
+    void* free_slots[2];             // Per tier, linked through the first word of each free slot
+    unsigned free_count[2];
+    unsigned slots[2];
+    struct pcache_page* tier_head[2];// Unpinned SRAM tier pages, [0] interior, [1] the rest, oldest first
+    struct pcache_page* tier_tail[2];
+    unsigned stamp;
+    struct pcache* caches;
+    struct
+    {
+        void* memory;                // As lent, the key for sqlite3_azure_pcache_reclaim()
+        unsigned char* base;         // Aligned start of its slots
+        unsigned slots;
+    } loans[PCACHE_LOANS];
+    unsigned loans_count;
+    unsigned loan_slots;             // Slots in lent memory, included in slots[PCACHE_PSRAM]
+    sqlite3_azure_pc_stats stats;
+} pc;
+
+#define PCACHE_PROTECT_PCT 60
+#define PCACHE_MIN_BUCKETS 64
+
+#if SQLITE3_AZURE_CONFIG_PCACHE_SRAM_SIZE
+__attribute__((section(SQLITE3_AZURE_CONFIG_PCACHE_SRAM_SECTION), aligned(SQLITE3_AZURE_CONFIG_PAGE_POOL_ALIGNMENT)))
+static unsigned char pcache_sram[SQLITE3_AZURE_CONFIG_PCACHE_SRAM_SIZE];
+#endif
+
+static int pcache_list(unsigned char type) { return type == PAGE_INTERIOR ? 0 : 1; }
+
+// Lent slots raise the limit of caches sized for the whole pool, a cache kept to a share stays there
+static unsigned pcache_limit(const struct pcache* cache)
 {
-	assert(mutex);
+    return cache->max >= pc.slots[PCACHE_PSRAM] - pc.loan_slots ? cache->max + pc.loan_slots : cache->max;
+}
 
-    tx_mutex_put(&(mutex->mutex));
+// Database size in pages from the header on page 1 (offset 28), or UINT_MAX while page 1 is not cached
+// or the size is not valid (change counter at 24 differs from version-valid-for at 92, as SQLite checks)
+static unsigned pcache_db_pages(const struct pcache* cache)
+{
+    const struct pcache_page* page;
+
+    for(page = cache->hash[1 % cache->buckets]; page && page->key != 1; page = page->hash_next);
+    if(page == NULL)
+        return UINT_MAX;
+
+    const unsigned char* header = page->page.pBuf;
+    if(memcmp(header + 24, header + 92, 4) != 0)
+        return UINT_MAX;
+    return ((unsigned)header[28] << 24) | ((unsigned)header[29] << 16) | ((unsigned)header[30] << 8) | header[31];
 }
 
-int xMutexHeld(sqlite3_mutex* mutex)
+// B-tree page type from the flag byte of the page header, which follows the file header on page 1
+static unsigned char pcache_type(const unsigned char* data, unsigned key)
 {
-	assert(mutex);
+    switch(data[key == 1 ? 100 : 0])
+    {
+        case 0x02: case 0x05: return PAGE_INTERIOR;
+        case 0x0A: case 0x0D: return PAGE_LEAF;
+        default: return PAGE_OTHER;
+    }
+}
 
-    return mutex->mutex.tx_mutex_ownership_count;
+static void lru_remove(struct pcache* cache, struct pcache_page* page)
+{
+    int list = pcache_list(page->type);
+
+    if(page->lru_prev) page->lru_prev->lru_next = page->lru_next;
+    else cache->lru_head[list] = page->lru_next;
+    if(page->lru_next) page->lru_next->lru_prev = page->lru_prev;
+    else cache->lru_tail[list] = page->lru_prev;
+    page->lru_prev = page->lru_next = NULL;
+    cache->lru_count[list]--;
+
+    if(page->tier == PCACHE_SRAM)
+    {
+        if(page->tier_prev) page->tier_prev->tier_next = page->tier_next;
+        else pc.tier_head[list] = page->tier_next;
+        if(page->tier_next) page->tier_next->tier_prev = page->tier_prev;
+        else pc.tier_tail[list] = page->tier_prev;
+        page->tier_prev = page->tier_next = NULL;
+    }
 }
 
-int xMutexNotheld(sqlite3_mutex* mutex) { return !xMutexHeld(mutex); }
+static void lru_append(struct pcache* cache, struct pcache_page* page)
+{
+    int list = pcache_list(page->type);
 
-const sqlite3_mutex_methods azure_mutexes = {
-  .xMutexInit    = xMutexInit,
-  .xMutexEnd     = xMutexEnd,
-  .xMutexAlloc   = xMutexAlloc,
-  .xMutexFree    = xMutexFree,
-  .xMutexEnter   = xMutexEnter,
-  .xMutexTry     = xMutexTry,
-  .xMutexLeave   = xMutexLeave,
-  .xMutexHeld    = xMutexHeld,
-  .xMutexNotheld = xMutexNotheld
-};
+    page->lru_next = NULL;
+    page->lru_prev = cache->lru_tail[list];
+    if(cache->lru_tail[list]) cache->lru_tail[list]->lru_next = page;
+    else cache->lru_head[list] = page;
+    cache->lru_tail[list] = page;
+    cache->lru_count[list]++;
+
+    if(page->tier == PCACHE_SRAM)
+    {
+        page->tier_next = NULL;
+        page->tier_prev = pc.tier_tail[list];
+        if(pc.tier_tail[list]) pc.tier_tail[list]->tier_next = page;
+        else pc.tier_head[list] = page;
+        pc.tier_tail[list] = page;
+    }
+}
+
+// Takes a page out of the cache and gives its memory back, with pc.mutex held
+static void pcache_free_page(struct pcache_page* page)
+{
+    struct pcache* cache = page->cache;
+    struct pcache_page** link = &cache->hash[page->key % cache->buckets];
+
+    while(*link != page)
+        link = &(*link)->hash_next;
+    *link = page->hash_next;
+
+    if(page->pinned)
+        cache->pinned--;
+    else if(cache->purgeable)
+        lru_remove(cache, page);
+    cache->pages--;
+    pc.stats.cached[page->type]--;
+
+    if(page->heap)
+    {
+        pc.stats.heap_pages--;
+        sqlite3_free(page->page.pBuf);
+    }
+    else
+    {
+        if(page->tier == PCACHE_SRAM)
+            pc.stats.sram_pages--;
+        *(void**)page->page.pBuf = pc.free_slots[page->tier];
+        pc.free_slots[page->tier] = page->page.pBuf;
+        pc.free_count[page->tier]++;
+    }
+}
+
+// Oldest unpinned page of a cache: a leaf, unless the protected segment has outgrown its share
+static struct pcache_page* pcache_victim(struct pcache* cache)
+{
+    if(!cache->purgeable)
+        return NULL;
+    if(cache->lru_head[0] && (!cache->lru_head[1] || cache->lru_count[0] * 100 > pcache_limit(cache) * PCACHE_PROTECT_PCT))
+        return cache->lru_head[0];
+    return cache->lru_head[1];
+}
+
+// The pool is out of slots: the oldest victim over all caches, leaves before interior pages
+static struct pcache_page* pcache_global_victim(void)
+{
+    struct pcache_page* victim = NULL;
+
+    for(struct pcache* cache = pc.caches; cache; cache = cache->next)
+    {
+        struct pcache_page* page = pcache_victim(cache);
+        if(page == NULL || !cache->slotted)
+            continue;
+        if(victim == NULL
+           || (page->type != PAGE_INTERIOR && victim->type == PAGE_INTERIOR)
+           || ((page->type == PAGE_INTERIOR) == (victim->type == PAGE_INTERIOR) && (int)(page->stamp - victim->stamp) < 0))
+            victim = page;
+    }
+    return victim;
+}
+
+static void pcache_evict(struct pcache_page* victim)
+{
+    pc.stats.evictions[victim->type]++;
+    pcache_free_page(victim);
+}
+
+static void pcache_enforce_max(struct pcache* cache)
+{
+    struct pcache_page* victim;
+
+    while(cache->pages > pcache_limit(cache) && (victim = pcache_victim(cache)) != NULL)
+        pcache_evict(victim);
+}
 
+static void* pcache_take_slot(int tier)
+{
+    void* slot = pc.free_slots[tier];
+
+    if(slot)
+    {
+        pc.free_slots[tier] = *(void**)slot;
+        pc.free_count[tier]--;
+    }
+    return slot;
+}
+
+// A slot in the SRAM tier, demoting its oldest leaf if it is full
+static void* pcache_sram_slot(void)
+{
+    void* slot = pcache_take_slot(PCACHE_SRAM);
+
+    if(slot == NULL && pc.tier_head[1])
+    {
+        pc.stats.demotions++;
+        pcache_free_page(pc.tier_head[1]);
+        slot = pcache_take_slot(PCACHE_SRAM);
+    }
+    return slot;
+}
+
+static void* pcache_slot(struct pcache* cache, int* tier)
+{
+    void* slot;
+
+    if(!cache->slotted)
+    {
+        *tier = PCACHE_PSRAM;
+        // Cached past the transaction that read it: keep it out of the arena too
+        mem_arena_hold++;
+        slot = sqlite3_malloc(cache->page_size + sizeof(struct pcache_page) + cache->extra_size);
+        mem_arena_hold--;
+        if(slot)
+            pc.stats.heap_pages++;
+        return slot;
+    }
+
+    if(*tier == PCACHE_SRAM && (slot = pcache_sram_slot()) != NULL)
+        return slot;
+
+    // Either pool will do, a free SRAM slot is better used than left empty
+    *tier = PCACHE_PSRAM;
+    slot = pcache_take_slot(PCACHE_PSRAM);
+    if(slot == NULL && (slot = pcache_take_slot(PCACHE_SRAM)) != NULL)
+        *tier = PCACHE_SRAM;
+    return slot;
+}
+
+// Memory for a new page of the cache, recycling an old page when the cache or the pool is full
+static void* pcache_new_slot(struct pcache* cache, int create_flag, int* tier)
+{
+    struct pcache_page* victim;
+    void* slot;
+
+    if(cache->purgeable && cache->pages >= pcache_limit(cache))
+    {
+        victim = pcache_victim(cache);
+        if(victim)
+            pcache_evict(victim);
+        else if(create_flag == 1)
+            return NULL;
+    }
+
+    slot = pcache_slot(cache, tier);
+    if(slot == NULL && cache->slotted && (victim = pcache_global_victim()) != NULL)
+    {
+        pcache_evict(victim);
+        slot = pcache_slot(cache, tier);
+    }
+    if(slot == NULL)
+        pc.stats.no_slot++;
+    return slot;
+}
+
+// Sets up a new pinned page in a slot and enters it in the cache, with pc.mutex held
+static struct pcache_page* pcache_init_page(struct pcache* cache, unsigned char* slot, int tier, unsigned key)
+{
+    // Page buffer at the start of the slot, so it keeps the pool's cache-line alignment for DMA
+    struct pcache_page* page = (struct pcache_page*)(slot + cache->page_size);
+
+    memset(page, 0, sizeof(*page));
+    page->page.pBuf = slot;
+    page->page.pExtra = page + 1;
+    *(void**)page->page.pExtra = NULL; // SQLite's PgHdr.pPage, tells it the page is new
+    page->cache = cache;
+    page->key = key;
+    page->type = PAGE_OTHER;
+    page->pinned = 1;
+    page->fresh = 1;
+    page->heap = !cache->slotted;
+    page->tier = tier;
+
+    page->hash_next = cache->hash[key % cache->buckets];
+    cache->hash[key % cache->buckets] = page;
+    cache->pages++;
+    cache->pinned++;
+    pc.stats.cached[PAGE_OTHER]++;
+    if(tier == PCACHE_SRAM && !page->heap)
+        pc.stats.sram_pages++;
+    return page;
+}
+
+static void pcache_grow_hash(struct pcache* cache)
+{
+    unsigned buckets = cache->buckets * 2;
+    struct pcache_page** hash;
+
+    // Lives as long as the cache: keep it out of the transaction arena
+    mem_arena_hold++;
+    hash = sqlite3_malloc(buckets * sizeof(*hash));
+    mem_arena_hold--;
+
+    if(hash == NULL)
+        return; // Longer chains, still correct
+
+    memset(hash, 0, buckets * sizeof(*hash));
+    for(unsigned i = 0; i < cache->buckets; i++)
+        for(struct pcache_page* page = cache->hash[i], *next; page; page = next)
+        {
+            next = page->hash_next;
+            page->hash_next = hash[page->key % buckets];
+            hash[page->key % buckets] = page;
+        }
+    sqlite3_free(cache->hash);
+    cache->hash = hash;
+    cache->buckets = buckets;
+}
+
+// Cuts a pool into slots, handed out in address order
+static void pcache_carve(int tier, unsigned char* pool, unsigned size)
+{
+    pc.free_slots[tier] = NULL;
+    pc.slots[tier] = pool ? size / pc.slot_size : 0;
+    for(unsigned i = pc.slots[tier]; i > 0; i--)
+    {
+        void* slot = pool + (i - 1) * pc.slot_size;
+        *(void**)slot = pc.free_slots[tier];
+        pc.free_slots[tier] = slot;
+    }
+    pc.free_count[tier] = pc.slots[tier];
+}
+
+static int xPcacheInit(void* arg)
+{
+    (void)arg;
+
+    pc.mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_LRU);
+    pc.caches = NULL;
+    pc.loans_count = pc.loan_slots = 0;
+    pc.tier_head[0] = pc.tier_head[1] = NULL;
+    pc.tier_tail[0] = pc.tier_tail[1] = NULL;
+    memset(&pc.stats, 0, sizeof(pc.stats));
+
+    pcache_carve(PCACHE_PSRAM, pc.pool, pc.pool_size);
+#if SQLITE3_AZURE_CONFIG_PCACHE_SRAM_SIZE
+    pcache_carve(PCACHE_SRAM, pcache_sram, sizeof(pcache_sram));
+#else
+    pcache_carve(PCACHE_SRAM, NULL, 0);
 #endif
+    return SQLITE_OK;
+}
+
+static void xPcacheShutdown(void* arg)
+{
+    (void)arg;
+    pc.mutex = NULL;
+}
+
+static sqlite3_pcache* xPcacheCreate(int page_size, int extra_size, int purgeable)
+{
+    struct pcache* cache = sqlite3_malloc(sizeof(struct pcache));
+
+    if(cache == NULL)
+        return NULL;
+    memset(cache, 0, sizeof(*cache));
+
+    cache->hash = sqlite3_malloc(PCACHE_MIN_BUCKETS * sizeof(*cache->hash));
+    if(cache->hash == NULL)
+    {
+        sqlite3_free(cache);
+        return NULL;
+    }
+    memset(cache->hash, 0, PCACHE_MIN_BUCKETS * sizeof(*cache->hash));
+    cache->buckets = PCACHE_MIN_BUCKETS;
+
+    cache->page_size = page_size;
+    cache->extra_size = (extra_size + 7) & ~7;
+    cache->purgeable = purgeable;
+    cache->slotted = page_size + sizeof(struct pcache_page) + cache->extra_size <= pc.slot_size;
+    cache->max = 100;
+
+    sqlite3_mutex_enter(pc.mutex);
+    cache->next = pc.caches;
+    pc.caches = cache;
+    sqlite3_mutex_leave(pc.mutex);
+
+    return (sqlite3_pcache*)cache;
+}
+
+static void xPcacheCachesize(sqlite3_pcache* p, int size)
+{
+    struct pcache* cache = (struct pcache*)p;
+
+    sqlite3_mutex_enter(pc.mutex);
+    cache->max = size > 0 ? (unsigned)size : 1;
+    pcache_enforce_max(cache);
+    sqlite3_mutex_leave(pc.mutex);
+}
+
+static int xPcachePagecount(sqlite3_pcache* p)
+{
+    return (int)((struct pcache*)p)->pages;
+}
+
+static sqlite3_pcache_page* xPcacheFetch(sqlite3_pcache* p, unsigned key, int create_flag)
+{
+    struct pcache* cache = (struct pcache*)p;
+    struct pcache_page* page;
+
+    sqlite3_mutex_enter(pc.mutex);
+
+    for(page = cache->hash[key % cache->buckets]; page && page->key != key; page = page->hash_next);
+
+    if(page)
+    {
+        pc.stats.hits[page->type]++;
+        pc.stats.tier_hits[page->tier]++;
+        if(page->hits < UCHAR_MAX)
+            page->hits++;
+
+        // Hot interior page in PSRAM: replace it by a new one in SRAM. Only on the pager's
+        // page fetch (create_flag set), which reads in a page SQLite has not seen yet
+        if(!page->pinned && create_flag && page->tier == PCACHE_PSRAM && page->type == PAGE_INTERIOR
+           && cache->purgeable && cache->slotted && page->hits >= SQLITE3_AZURE_CONFIG_PCACHE_PROMOTE_HITS)
+        {
+            unsigned char* slot = pcache_sram_slot();
+            if(slot)
+            {
+                pcache_free_page(page);
+                page = pcache_init_page(cache, slot, PCACHE_SRAM, key);
+                page->fresh = 0; // Counted as the hit above
+                page->type = PAGE_INTERIOR;
+                pc.stats.cached[PAGE_OTHER]--;
+                pc.stats.cached[PAGE_INTERIOR]++;
+                pc.stats.promotions++;
+            }
+        }
+
+        if(!page->pinned)
+        {
+            if(cache->purgeable)
+                lru_remove(cache, page);
+            page->pinned = 1;
+            cache->pinned++;
+        }
+    }
+    else if(create_flag)
+    {
+        // The B-tree counts a page it appends into the header first: the right edge of a tree, or a split
+        int tier = (cache->purgeable && key > 1 && key >= pcache_db_pages(cache)) ? PCACHE_SRAM : PCACHE_PSRAM;
+        unsigned char* slot = pcache_new_slot(cache, create_flag, &tier);
+        if(slot)
+        {
+            page = pcache_init_page(cache, slot, tier, key);
+            if(cache->pages > cache->buckets)
+                pcache_grow_hash(cache);
+        }
+    }
+
+    sqlite3_mutex_leave(pc.mutex);
+    return page ? &page->page : NULL;
+}
+
+static void xPcacheUnpin(sqlite3_pcache* p, sqlite3_pcache_page* pg, int discard)
+{
+    struct pcache* cache = (struct pcache*)p;
+    struct pcache_page* page = (struct pcache_page*)pg;
+
+    sqlite3_mutex_enter(pc.mutex);
+
+    if(discard)
+        pcache_free_page(page);
+    else
+    {
+        unsigned char type = pcache_type(page->page.pBuf, page->key);
+
+        pc.stats.cached[page->type]--;
+        pc.stats.cached[type]++;
+        page->type = type;
+        if(page->fresh)
+        {
+            pc.stats.misses[type]++;
+            page->fresh = 0;
+        }
+
+        page->pinned = 0;
+        cache->pinned--;
+        if(cache->purgeable)
+        {
+            page->stamp = ++pc.stamp;
+            lru_append(cache, page);
+            pcache_enforce_max(cache);
+        }
+    }
+
+    sqlite3_mutex_leave(pc.mutex);
+}
+
+static void xPcacheRekey(sqlite3_pcache* p, sqlite3_pcache_page* pg, unsigned old_key, unsigned new_key)
+{
+    struct pcache* cache = (struct pcache*)p;
+    struct pcache_page* page = (struct pcache_page*)pg;
+    struct pcache_page** link;
+
+    sqlite3_mutex_enter(pc.mutex);
+
+    assert(page->key == old_key);
+    for(link = &cache->hash[old_key % cache->buckets]; *link != page; link = &(*link)->hash_next);
+    *link = page->hash_next;
+
+    // A page already cached under the new key is stale, SQLite never asks for it again
+    struct pcache_page* stale;
+    for(stale = cache->hash[new_key % cache->buckets]; stale && stale->key != new_key; stale = stale->hash_next);
+    if(stale)
+        pcache_free_page(stale);
+
+    page->key = new_key;
+    page->hash_next = cache->hash[new_key % cache->buckets];
+    cache->hash[new_key % cache->buckets] = page;
+
+    sqlite3_mutex_leave(pc.mutex);
+}
+
+static void xPcacheTruncate(sqlite3_pcache* p, unsigned limit)
+{
+    struct pcache* cache = (struct pcache*)p;
+
+    sqlite3_mutex_enter(pc.mutex);
+    for(unsigned i = 0; i < cache->buckets; i++)
+        for(struct pcache_page* page = cache->hash[i], *next; page; page = next)
+        {
+            next = page->hash_next;
+            if(page->key >= limit)
+                pcache_free_page(page);
+        }
+    sqlite3_mutex_leave(pc.mutex);
+}
+
+static void xPcacheDestroy(sqlite3_pcache* p)
+{
+    struct pcache* cache = (struct pcache*)p;
+
+    sqlite3_mutex_enter(pc.mutex);
+    for(unsigned i = 0; i < cache->buckets; i++)
+        while(cache->hash[i])
+            pcache_free_page(cache->hash[i]);
+
+    for(struct pcache** link = &pc.caches; *link; link = &(*link)->next)
+        if(*link == cache)
+        {
+            *link = cache->next;
+            break;
+        }
+    sqlite3_mutex_leave(pc.mutex);
+
+    sqlite3_free(cache->hash);
+    sqlite3_free(cache);
+}
+
+static void xPcacheShrink(sqlite3_pcache* p)
+{
+    struct pcache* cache = (struct pcache*)p;
+
+    sqlite3_mutex_enter(pc.mutex);
+    if(cache->purgeable)
+        for(int list = 0; list < 2; list++)
+            while(cache->lru_head[list])
+                pcache_free_page(cache->lru_head[list]);
+    sqlite3_mutex_leave(pc.mutex);
+}
+
+static const sqlite3_pcache_methods2 azure_pcache = {
+    .iVersion   = 1,
+    .pArg       = NULL,
+    .xInit      = xPcacheInit,
+    .xShutdown  = xPcacheShutdown,
+    .xCreate    = xPcacheCreate,
+    .xCachesize = xPcacheCachesize,
+    .xPagecount = xPcachePagecount,
+    .xFetch     = xPcacheFetch,
+    .xUnpin     = xPcacheUnpin,
+    .xRekey     = xPcacheRekey,
+    .xTruncate  = xPcacheTruncate,
+    .xDestroy   = xPcacheDestroy,
+    .xShrink    = xPcacheShrink
+};
+
+int sqlite3_azure_pcache_config(void* pool, unsigned pool_size, unsigned slot_size)
+{
+    assert(pool);
+    assert(((uintptr_t)pool & (SQLITE3_AZURE_CONFIG_PAGE_POOL_ALIGNMENT - 1)) == 0);
+    assert((slot_size & (SQLITE3_AZURE_CONFIG_PAGE_POOL_ALIGNMENT - 1)) == 0);
+
+    pc.pool = pool;
+    pc.pool_size = pool_size;
+    pc.slot_size = slot_size;
+
+    // pcache1 must not carve the same memory for its own buffers
+    sqlite3_config(SQLITE_CONFIG_PAGECACHE, NULL, 0, 0);
+    return sqlite3_config(SQLITE_CONFIG_PCACHE2, &azure_pcache);
+}
+
+unsigned sqlite3_azure_pcache_slot_size(unsigned page_size)
+{
+    int header_size = 0;
+
+    // Counts pcache1's own page header as well, which this cache does not need: a little to spare
+    sqlite3_config(SQLITE_CONFIG_PCACHE_HDRSZ, &header_size);
+
+    return (page_size + header_size + sizeof(struct pcache_page) + SQLITE3_AZURE_CONFIG_PAGE_POOL_ALIGNMENT - 1)
+           & ~(SQLITE3_AZURE_CONFIG_PAGE_POOL_ALIGNMENT - 1);
+}
+
+int sqlite3_azure_pcache_lend(void* memory, unsigned size)
+{
+    assert(memory);
+
+    unsigned char* const base = (unsigned char*)(((uintptr_t)memory + SQLITE3_AZURE_CONFIG_PAGE_POOL_ALIGNMENT - 1)
+                                                 & ~(uintptr_t)(SQLITE3_AZURE_CONFIG_PAGE_POOL_ALIGNMENT - 1));
+    const unsigned skipped = base - (unsigned char*)memory;
+    const unsigned slots = size > skipped ? (size - skipped) / pc.slot_size : 0;
+
+    if(pc.mutex == NULL || slots == 0)
+        return SQLITE_MISUSE;
+
+    sqlite3_mutex_enter(pc.mutex);
+
+    if(pc.loans_count == PCACHE_LOANS)
+    {
+        sqlite3_mutex_leave(pc.mutex);
+        return SQLITE_FULL;
+    }
+
+    pc.loans[pc.loans_count].memory = memory;
+    pc.loans[pc.loans_count].base = base;
+    pc.loans[pc.loans_count].slots = slots;
+    pc.loans_count++;
+
+    for(unsigned i = slots; i > 0; i--)
+    {
+        void* slot = base + (i - 1) * pc.slot_size;
+        *(void**)slot = pc.free_slots[PCACHE_PSRAM];
+        pc.free_slots[PCACHE_PSRAM] = slot;
+    }
+    pc.slots[PCACHE_PSRAM] += slots;
+    pc.free_count[PCACHE_PSRAM] += slots;
+    pc.loan_slots += slots;
+
+    sqlite3_mutex_leave(pc.mutex);
+    return SQLITE_OK;
+}
+
+int sqlite3_azure_pcache_reclaim(void* memory)
+{
+    assert(memory);
+
+    if(pc.mutex == NULL)
+        return SQLITE_MISUSE;
+
+    sqlite3_mutex_enter(pc.mutex);
+
+    unsigned n;
+    for(n = 0; n < pc.loans_count && pc.loans[n].memory != memory; n++);
+    if(n == pc.loans_count)
+    {
+        sqlite3_mutex_leave(pc.mutex);
+        return SQLITE_NOTFOUND;
+    }
+
+    const unsigned char* const low = pc.loans[n].base;
+    const unsigned char* const high = low + pc.loans[n].slots * pc.slot_size;
+#define IN_LOAN(p) ((const unsigned char*)(p) >= low && (const unsigned char*)(p) < high)
+
+    // Nothing is changed while a page in it is pinned or cannot be dropped (an in-memory database),
+    // the owner asks again later
+    for(struct pcache* cache = pc.caches; cache; cache = cache->next)
+        for(unsigned i = 0; i < cache->buckets; i++)
+            for(struct pcache_page* page = cache->hash[i]; page; page = page->hash_next)
+                if((page->pinned || !cache->purgeable) && IN_LOAN(page->page.pBuf))
+                {
+                    sqlite3_mutex_leave(pc.mutex);
+                    return SQLITE_BUSY;
+                }
+
+    for(struct pcache* cache = pc.caches; cache; cache = cache->next)
+        for(unsigned i = 0; i < cache->buckets; i++)
+            for(struct pcache_page* page = cache->hash[i], *next; page; page = next)
+            {
+                next = page->hash_next;
+                if(IN_LOAN(page->page.pBuf))
+                    pcache_evict(page);
+            }
+
+    // All its slots are free now, take them off the list
+    for(void** link = &pc.free_slots[PCACHE_PSRAM]; *link; )
+        if(IN_LOAN(*link))
+            *link = *(void**)*link;
+        else
+            link = (void**)*link;
+#undef IN_LOAN
+
+    pc.slots[PCACHE_PSRAM] -= pc.loans[n].slots;
+    pc.free_count[PCACHE_PSRAM] -= pc.loans[n].slots;
+    pc.loan_slots -= pc.loans[n].slots;
+    pc.loans[n] = pc.loans[--pc.loans_count];
+
+    sqlite3_mutex_leave(pc.mutex);
+    return SQLITE_OK;
+}
+
+void sqlite3_azure_pcache_stats(sqlite3_azure_pc_stats* stats, int reset)
+{
+    assert(stats);
+
+    sqlite3_mutex_enter(pc.mutex);
+    *stats = pc.stats;
+    stats->slots = pc.slots[PCACHE_PSRAM];
+    stats->free_slots = pc.free_count[PCACHE_PSRAM];
+    stats->sram_slots = pc.slots[PCACHE_SRAM];
+    stats->lent_slots = pc.loan_slots;
+    if(reset)
+    {
+        memset(pc.stats.hits, 0, sizeof(pc.stats.hits));
+        memset(pc.stats.misses, 0, sizeof(pc.stats.misses));
+        memset(pc.stats.evictions, 0, sizeof(pc.stats.evictions));
+        memset(pc.stats.tier_hits, 0, sizeof(pc.stats.tier_hits));
+        pc.stats.promotions = pc.stats.demotions = 0;
+        pc.stats.no_slot = 0;
+    }
+    sqlite3_mutex_leave(pc.mutex);
+}
 
 /* ---------------------------- Initialization --------------------------------------- */
 
+// Memory plan (app_threadx.h): the pools of this file must fit what it sets aside for them.
+// SQLite's per-page extra is only known at run time (SQLITE_CONFIG_PCACHE_HDRSZ, checked at boot),
+// here it is taken as the size of MemPage and PgHdr of SQLite 3.51 on a 32-bit target, with room
+#define PLAN_SQLITE_PAGE_EXTRA 160
+
+_Static_assert((SQLITE3_AZURE_CONFIG_WRITE_BEHIND ? SQLITE3_AZURE_CONFIG_WB_POOL_SIZE : 0) + sizeof(shm_pool)
+               + sizeof(extent_pool) + SQLITE3_AZURE_CONFIG_TEMP_POOL_SIZE <= PLAN_VFS_PSRAM_BYTES,
+               "VFS pools in .psram_buffers exceed PLAN_VFS_PSRAM_BYTES");
+_Static_assert(SQLITE3_AZURE_CONFIG_PCACHE_SRAM_SIZE + (SQLITE3_AZURE_CONFIG_SIZE_CLASSES ?
+               SQLITE3_AZURE_CONFIG_CLASS_POOL_SIZE + SQLITE3_AZURE_CONFIG_ARENA_SIZE : 0) <= PLAN_SRAM_HOT_BYTES,
+               "Page cache tier and size classes exceed PLAN_SRAM_HOT_BYTES");
+_Static_assert((PLAN_PCACHE_SLOT & (SQLITE3_AZURE_CONFIG_PAGE_POOL_ALIGNMENT - 1)) == 0,
+               "PLAN_PCACHE_SLOT must keep the page buffers cache-line aligned");
+_Static_assert(PLAN_PCACHE_HEADER >= sizeof(struct pcache_page) + PLAN_SQLITE_PAGE_EXTRA,
+               "PLAN_PCACHE_HEADER leaves no room for SQLite's page extra, every page would go to the heap");
+
 void errorLogCallback(void *pArg, int iErrCode, const char *zMsg)
 {
 	// Here and in all debug output printf is used
@@ -1401,19 +3916,8 @@ void sqlite3_azure_init(FX_MEDIA* media_ptr, sqlite3_int64 (*datetime64)(void),
 #endif
 
     if(SQLITE3_AZURE_CONFIG_PAGE_POOL)
-    {
-        int header_size;
-        sqlite3_config(SQLITE_CONFIG_PCACHE_HDRSZ, &header_size);
-        if(header_size & (SQLITE3_AZURE_CONFIG_PAGE_POOL_ALIGNMENT - 1))
-        {
-            header_size += SQLITE3_AZURE_CONFIG_PAGE_POOL_ALIGNMENT;
-            header_size	&= ~(SQLITE3_AZURE_CONFIG_PAGE_POOL_ALIGNMENT - 1);
-        }
-        sqlite3_config(SQLITE_CONFIG_PAGECACHE,
-                       SQLITE3_AZURE_CONFIG_PAGE_POOL,
-                       SQLITE3_AZURE_CONFIG_MAX_PAGE_SIZE + header_size,
-                       SQLITE3_AZURE_CONFIG_PAGE_POOL_SIZE / (SQLITE3_AZURE_CONFIG_MAX_PAGE_SIZE + header_size));
-    }
+        sqlite3_azure_pcache_config(SQLITE3_AZURE_CONFIG_PAGE_POOL, SQLITE3_AZURE_CONFIG_PAGE_POOL_SIZE,
+                                    sqlite3_azure_pcache_slot_size(SQLITE3_AZURE_CONFIG_MAX_PAGE_SIZE));
 
     sqlite3_config(SQLITE_CONFIG_SMALL_MALLOC, SQLITE3_AZURE_CONFIG_SMALL_MALLOC);
 
@@ -1435,6 +3939,10 @@ void sqlite3_azure_init(FX_MEDIA* media_ptr, sqlite3_int64 (*datetime64)(void),
 
     mutex_create(&openclose, "SQLIte Azure file open/close mutex", TX_NO_INHERIT);
 
+#if SQLITE3_AZURE_CONFIG_WRITE_BEHIND
+    wb_start();
+#endif
+
     if(datetime64)
         sqlite3_time64 = datetime64;
 
@@ -7,3 +7,131 @@ void sqlite3_azure_init(FX_MEDIA* media_ptr   // pointer to already opened media
 		, sqlite3_int64 (*dattime64)(void)    // pointer to a function that returns Julian Day multiplied by 86400000, may be NULL
 		, int (*random_generator)(void)       // pointer to a random number generator, may be NULL
 		);
+
+// Write-behind counters (SQLITE3_AZURE_CONFIG_WRITE_BEHIND in sqlite3_azure.c), all zero when it is off
+typedef struct
+{
+    unsigned long staged;          // xWrite calls queued
+    unsigned long runs;            // fx_file_write calls of the I/O thread
+    unsigned long long bytes;      // Bytes those wrote
+    unsigned long max_run_writes;  // Most staged writes merged into one run
+    unsigned long read_hits;       // xRead served from the staging pool
+    unsigned long drains;          // Waits for a file's queue (xSync, xTruncate, xClose, partly staged reads)
+    unsigned long stalls;          // xWrite waits for pool space
+    unsigned long queued;          // Pool bytes in use now
+    unsigned long queued_max;
+} sqlite3_azure_wb_stats;
+
+// Copies the counters, and clears them (except the current queue) if reset is not 0
+void sqlite3_azure_write_behind_stats(sqlite3_azure_wb_stats* stats, int reset);
+
+// Extent map and preallocation counters (see extent_seek in sqlite3_azure.c)
+typedef struct
+{
+    unsigned long seeks;                // Seeks resolved through an extent map
+    unsigned long fallbacks;            // Past a full map, left to fx_file_extended_seek()
+    unsigned long fat_reads;            // FAT entries read to build the maps
+    unsigned long max_extents;          // Most extents in one map
+    unsigned long contiguous;           // Preallocations of consecutive clusters
+    unsigned long best_effort;          // Preallocations that had to take a shorter run
+    unsigned long long preallocated;    // Bytes those allocated
+    unsigned long long released;        // Unused preallocated bytes given back when files were closed
+} sqlite3_azure_ext_stats;
+
+// Copies the counters, and clears them if reset is not 0
+void sqlite3_azure_extent_stats(sqlite3_azure_ext_stats* stats, int reset);
+
+// Temporary files in PSRAM (SQLITE3_AZURE_CONFIG_TEMP_POOL_SIZE in sqlite3_azure.c), all zero when it is off
+typedef struct
+{
+    unsigned long files;           // Temporary files opened in PSRAM
+    unsigned long open;            // Open now
+    unsigned long spills;          // Moved to the card because the pool was used up
+    unsigned long long written;    // Bytes written to them while in PSRAM
+    unsigned long long read;       // Bytes read from them while in PSRAM
+    unsigned long long spilled;    // Bytes copied to the card by spills
+    unsigned long in_use;          // Pool bytes in use now
+    unsigned long in_use_max;
+    unsigned long pool;
+    unsigned long lent;            // Top of the pool lent out (sqlite3_azure_temp_lend), not available to files
+} sqlite3_azure_tmp_stats;
+
+// Copies the counters, and clears them (except the current use) if reset is not 0
+void sqlite3_azure_temp_stats(sqlite3_azure_tmp_stats* stats, int reset);
+
+// Lends size bytes from the top of the temporary file pool, NULL if temporary files use that part.
+// Returned with sqlite3_azure_temp_return(), the latest lent first
+void* sqlite3_azure_temp_lend(unsigned size);
+void sqlite3_azure_temp_return(void* memory, unsigned size);
+
+// Page cache (SQLITE_CONFIG_PCACHE2, see the page cache section of sqlite3_azure.c)
+// Pages are classed by their b-tree type when SQLite unpins them: interior pages are kept,
+// leaves and the rest are recycled first. The hottest pages live in an on-chip SRAM tier
+#define SQLITE3_AZURE_PAGE_INTERIOR 0
+#define SQLITE3_AZURE_PAGE_LEAF     1
+#define SQLITE3_AZURE_PAGE_OTHER    2   // Overflow, freelist, pages not yet classed
+
+typedef struct
+{
+    unsigned long hits[3];         // Fetches found in the cache, by SQLITE3_AZURE_PAGE_*
+    unsigned long misses[3];       // Pages read in (or created), by the type they turned out to be
+    unsigned long evictions[3];    // Pages recycled for another one
+    unsigned long cached[3];       // Pages cached now
+    unsigned long slots;           // Pool slots
+    unsigned long free_slots;      // Never used or freed
+    unsigned long heap_pages;      // Pages too large for a slot, on the SQLite heap
+    unsigned long no_slot;         // Fetches that found every page pinned
+    unsigned long tier_hits[2];    // Hits on pages in [0] the PSRAM pool, [1] the SRAM tier
+    unsigned long promotions;      // Interior pages moved up to the SRAM tier
+    unsigned long demotions;       // SRAM tier pages dropped to make room
+    unsigned long sram_slots;
+    unsigned long sram_pages;      // SRAM tier slots in use
+    unsigned long lent_slots;      // Of slots, those in memory lent by other pools
+} sqlite3_azure_pc_stats;
+
+// Installs the page cache on a static pool cut into slot_size slots (page, SQLite's extra, ~40 bytes),
+// both multiples of 32. Call between sqlite3_shutdown() and sqlite3_initialize()
+int sqlite3_azure_pcache_config(void* pool, unsigned pool_size, unsigned slot_size);
+
+// Smallest slot that holds a page of page_size with SQLite's extra (SQLITE_CONFIG_PCACHE_HDRSZ)
+unsigned sqlite3_azure_pcache_slot_size(unsigned page_size);
+
+// Adds memory another pool does not need now to the PSRAM slots. A cache whose cache_size covers the
+// whole pool may grow by as many pages, smaller ones keep their share.
+// sqlite3_azure_pcache_reclaim() gives it back: SQLITE_BUSY while a page in it is pinned (try later),
+// otherwise its pages are evicted. Only after sqlite3_initialize()
+int sqlite3_azure_pcache_lend(void* memory, unsigned size);
+int sqlite3_azure_pcache_reclaim(void* memory);
+
+// Copies the counters, and clears them (except the current occupancy) if reset is not 0
+void sqlite3_azure_pcache_stats(sqlite3_azure_pc_stats* stats, int reset);
+
+// Size-class allocator (SQLITE3_AZURE_CONFIG_SIZE_CLASSES in sqlite3_azure.c)
+#define SQLITE3_AZURE_MEM_CLASSES 14
+
+typedef struct
+{
+    unsigned short size[SQLITE3_AZURE_MEM_CLASSES];
+    unsigned long allocs[SQLITE3_AZURE_MEM_CLASSES];    // Served by each class
+    unsigned long in_use[SQLITE3_AZURE_MEM_CLASSES];    // Blocks allocated now
+    unsigned long carved[SQLITE3_AZURE_MEM_CLASSES];    // Blocks cut from the class's chunks so far
+    unsigned long chunks_used;     // Pool chunks handed to classes, they never go back
+    unsigned long chunks;
+    unsigned long arena_allocs;    // Served by the transaction arena
+    unsigned long arena_resets;    // Arena blocks started over
+    unsigned long arena_pinned;    // Transactions that ended with live arena allocations
+    unsigned long arena_high;      // Most bytes bumped in one block
+    unsigned long arena_busy;      // Blocks holding live allocations now
+    unsigned long arena_blocks;
+    unsigned long fallback_allocs; // Sent on to memsys5: too large, or the pool was used up
+} sqlite3_azure_sc_stats;
+
+// Puts the size classes in front of the allocator configured so far (memsys5 after SQLITE_CONFIG_HEAP).
+// Call between SQLITE_CONFIG_HEAP and sqlite3_initialize()
+int sqlite3_azure_mem_config(void);
+
+// Opens (1) the transaction arena for the calling thread or closes it (0), before the insert steps and after COMMIT/ROLLBACK
+void sqlite3_azure_mem_arena(int open);
+
+// Copies the counters, and clears them (except the current occupancy) if reset is not 0
+void sqlite3_azure_size_class_stats(sqlite3_azure_sc_stats* stats, int reset);
@@ -4,17 +4,36 @@
 
 #include "tx_api.h"
 
+// wal-index shared by all connections to a database in WAL mode, see xShmMap
+struct sqlite3_azure_shm;
+// Cluster extents of a main database or WAL file, see extent_seek
+struct sqlite3_azure_extents;
+
 #if SQLITE_THREADSAFE
 #define FX_FILE_MODULE_EXTENSION unsigned open_count;         \
                                  int delete_on_close;         \
 	                             unsigned shared_locks_count; \
  	                             int lock_type;               \
  	                             TX_THREAD* lock_task;        \
+ 	                             struct sqlite3_azure_shm* shm; \
+ 	                             int wal_coordinated;         \
+ 	                             int write_behind;            \
+ 	                             unsigned wb_pending;         \
+ 	                             ULONG64 wb_size;             \
+ 	                             int wb_error;                \
+ 	                             struct sqlite3_azure_extents* extents; \
 	                             TX_MUTEX mutex;
 #else
 #define FX_FILE_MODULE_EXTENSION unsigned open_count;         \
                                  int delete_on_close;         \
 	                             unsigned shared_locks_count; \
  	                             int lock_type;               \
- 	                             TX_THREAD* lock_task;
+ 	                             TX_THREAD* lock_task;        \
+ 	                             struct sqlite3_azure_shm* shm; \
+ 	                             int wal_coordinated;         \
+ 	                             int write_behind;            \
+ 	                             unsigned wb_pending;         \
+ 	                             ULONG64 wb_size;             \
+ 	                             int wb_error;                \
+ 	                             struct sqlite3_azure_extents* extents;
 #endif
@@ -0,0 +1,61 @@
+/*
+ *   FileX media driver over a RAM disk, the host replacement of fx_stm32_sd_driver.c.
+ *   fx_media_driver_info points to the disk image; fx_media_format() writes its boot sector.
+ */
+
+#include "fx_stm32_sd_driver.h"
+#include "fx_utility.h"
+
+#include <string.h>
+
+VOID fx_ram_driver(FX_MEDIA* media_ptr)
+{
+    UCHAR* disk = (UCHAR*)media_ptr->fx_media_driver_info;
+    ULONG sector_size = media_ptr->fx_media_bytes_per_sector;
+
+    switch(media_ptr->fx_media_driver_request)
+    {
+    case FX_DRIVER_READ:
+        memcpy(media_ptr->fx_media_driver_buffer,
+               disk + (media_ptr->fx_media_driver_logical_sector + media_ptr->fx_media_hidden_sectors) * sector_size,
+               media_ptr->fx_media_driver_sectors * sector_size);
+        media_ptr->fx_media_driver_status = FX_SUCCESS;
+        break;
+
+    case FX_DRIVER_WRITE:
+        memcpy(disk + (media_ptr->fx_media_driver_logical_sector + media_ptr->fx_media_hidden_sectors) * sector_size,
+               media_ptr->fx_media_driver_buffer,
+               media_ptr->fx_media_driver_sectors * sector_size);
+        media_ptr->fx_media_driver_status = FX_SUCCESS;
+        break;
+
+    case FX_DRIVER_BOOT_READ:
+        // Sector size is not known yet: take it from the boot record
+        sector_size = _fx_utility_16_unsigned_read(&disk[FX_BYTES_SECTOR]);
+        if(sector_size == 0 || sector_size > media_ptr->fx_media_memory_size)
+        {
+            media_ptr->fx_media_driver_status = FX_BUFFER_ERROR;
+            break;
+        }
+        memcpy(media_ptr->fx_media_driver_buffer, disk, sector_size);
+        media_ptr->fx_media_driver_status = FX_SUCCESS;
+        break;
+
+    case FX_DRIVER_BOOT_WRITE:
+        memcpy(disk, media_ptr->fx_media_driver_buffer, sector_size);
+        media_ptr->fx_media_driver_status = FX_SUCCESS;
+        break;
+
+    case FX_DRIVER_INIT:
+    case FX_DRIVER_UNINIT:
+    case FX_DRIVER_FLUSH:
+    case FX_DRIVER_ABORT:
+    case FX_DRIVER_RELEASE_SECTORS:
+        media_ptr->fx_media_driver_status = FX_SUCCESS;
+        break;
+
+    default:
+        media_ptr->fx_media_driver_status = FX_IO_ERROR;
+        break;
+    }
+}
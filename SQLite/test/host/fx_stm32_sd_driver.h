@@ -0,0 +1,21 @@
+/*
+ *   Host stand-in for Appli/FileX/Target/fx_stm32_sd_driver.h (app_filex.h includes it):
+ *   the media is the RAM disk of fx_ram_driver.c.
+ */
+
+#ifndef FX_STM32_SD_DRIVER_H
+#define FX_STM32_SD_DRIVER_H
+
+#include "fx_api.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+VOID fx_ram_driver(FX_MEDIA* media_ptr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FX_STM32_SD_DRIVER_H */
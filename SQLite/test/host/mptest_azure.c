@@ -0,0 +1,458 @@
+/*
+ *   Concurrent writer test of sqlite3_azure.c on the host: runs an mptest script
+ *   (SQLite's test/mptest.c format, e.g. ../multiwrite01.test) with every client task
+ *   on a thread and connection of its own, all on one database in WAL mode.
+ *
+ *   The wal-index of this VFS lives in a pool of this process (xShmMap), and the device
+ *   runs a single process, so the clients of mptest become threads here. Everything
+ *   below the SQLite API is the target code: the VFS, its page cache and mutexes, FileX
+ *   6.4 on a RAM disk (fx_ram_driver.c), ThreadX calls on pthreads (tx_host.c).
+ *
+ *   Script commands: --task N [name] ... --end, --wait all, --sleep MS, --match RESULT.
+ *   SQL results are the column texts of all rows joined by spaces, --match compares and
+ *   clears them.
+ *
+ *   Usage: mptest_azure SCRIPT [--journal MODE] [--repeat N] [--trace 1]
+ */
+
+#include "sqlite3_azure.h"
+#include "app_threadx.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#define TEST_TASKS          16
+#define TEST_DISK_BYTES     (128 * 1024 * 1024)
+#define TEST_SECTOR         512
+#define TEST_CLUSTER        2                   // Sectors, 1 KB clusters as on the card
+#define TEST_BUSY_TIMEOUT   10000               // ms, as mptest
+#define TEST_DB             "mptest.db"
+
+char sqlite_heap[PLAN_HEAP_BYTES];
+char sqlite_pcache[PLAN_PCACHE_BYTES];
+
+static FX_MEDIA test_media;
+static UCHAR test_media_memory[64 * 1024];
+static const char* test_journal = "WAL";
+static int test_errors;
+static int test_trace;
+static volatile int test_busy;      // Busy handler calls: the clients did contend for the locks
+static pthread_mutex_t test_print = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct test_block
+{
+    struct test_block* next;
+    int line;
+    char sql[];
+} test_block;
+
+typedef struct
+{
+    int id;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    test_block* head;
+    test_block* tail;
+    int busy;
+    int quit;
+} test_task;
+
+static test_task tasks[TEST_TASKS];
+
+#define FAIL(...) do { pthread_mutex_lock(&test_print); printf(__VA_ARGS__); printf("\n"); \
+                       test_errors++; pthread_mutex_unlock(&test_print); } while(0)
+
+/* ---------------------------- Script ----------------------------------------------- */
+
+typedef struct
+{
+    char* text;
+    size_t len;
+    size_t cap;
+} test_result;
+
+static void resultAppend(test_result* r, const char* s)
+{
+    size_t n = strlen(s);
+    if(r->len + n + 2 > r->cap)
+    {
+        r->cap = (r->len + n + 2) * 2;
+        r->text = realloc(r->text, r->cap);
+    }
+    if(r->len)
+        r->text[r->len++] = ' ';
+    memcpy(r->text + r->len, s, n);
+    r->len += n;
+    r->text[r->len] = 0;
+}
+
+static const char* skipSpace(const char* p, int* line)
+{
+    for(;;)
+    {
+        while(isspace((unsigned char)*p))
+        {
+            if(*p == '\n')
+                (*line)++;
+            p++;
+        }
+        if(p[0] == '/' && p[1] == '*')
+        {
+            const char* end = strstr(p + 2, "*/");
+            for(const char* q = p; q < (end ? end : p + strlen(p)); q++)
+                if(*q == '\n')
+                    (*line)++;
+            p = end ? end + 2 : p + strlen(p);
+            continue;
+        }
+        return p;
+    }
+}
+
+// Length of the command line at p, without the line end
+static size_t lineLength(const char* p)
+{
+    const char* end = strchr(p, '\n');
+    return end ? (size_t)(end - p) : strlen(p);
+}
+
+// Runs SQL and the --sleep/--match commands of one block on db
+static void runBlock(sqlite3* db, const char* who, const char* text, int line)
+{
+    test_result result = { 0 };
+    const char* p = text;
+
+    for(;;)
+    {
+        p = skipSpace(p, &line);
+        if(!*p)
+            break;
+
+        if(p[0] == '-' && p[1] == '-')
+        {
+            size_t n = lineLength(p);
+            char command[256];
+            snprintf(command, sizeof(command), "%.*s", (int)n, p);
+
+            if(!strncmp(command, "--sleep", 7))
+                tx_thread_sleep(atoi(command + 7) * TX_TIMER_TICKS_PER_SECOND / 1000);
+            else if(!strncmp(command, "--match", 7))
+            {
+                const char* expected = command + 7;
+                while(*expected == ' ')
+                    expected++;
+                if(strcmp(result.text ? result.text : "", expected))
+                    FAIL("%s line %d: expected [%s], got [%s]", who, line, expected, result.text ? result.text : "");
+                result.len = 0;
+                if(result.text)
+                    result.text[0] = 0;
+            }
+            else
+                FAIL("%s line %d: unknown command %s", who, line, command);
+            p += n;
+            continue;
+        }
+
+        // SQL runs up to the next command line, the last statement may lack its semicolon
+        const char* end = p;
+        for(;;)
+        {
+            end += lineLength(end);
+            if(!*end)
+                break;
+            const char* next = end + 1;
+            while(isspace((unsigned char)*next))
+                next++;
+            if(!*next || (next[0] == '-' && next[1] == '-'))
+                break;
+            end = next;
+        }
+        char* sql = strndup(p, end - p);
+        if(test_trace)
+            printf("%s line %d: %.*s\n", who, line, (int)lineLength(sql), sql);
+        const char* q = sql;
+
+        while(*q)
+        {
+            sqlite3_stmt* stmt = NULL;
+            const char* tail = NULL;
+            int rc = sqlite3_prepare_v2(db, q, -1, &stmt, &tail);
+            if(rc != SQLITE_OK)
+            {
+                FAIL("%s line %d: prepare: %s", who, line, sqlite3_errmsg(db));
+                break;
+            }
+            while(stmt && (rc = sqlite3_step(stmt)) == SQLITE_ROW)
+            {
+                for(int i = 0; i < sqlite3_column_count(stmt); i++)
+                {
+                    const char* v = (const char*)sqlite3_column_text(stmt, i);
+                    resultAppend(&result, v ? v : "nil");
+                }
+            }
+            if(stmt && rc != SQLITE_DONE)
+                FAIL("%s line %d: %s (%d)", who, line, sqlite3_errmsg(db), sqlite3_extended_errcode(db));
+            sqlite3_finalize(stmt);
+            q = tail;
+        }
+        free(sql);
+
+        for(const char* c = p; c < end; c++)
+            if(*c == '\n')
+                line++;
+        p = end;
+    }
+    free(result.text);
+}
+
+// sqlite3_busy_timeout() with a count, 1 ms per retry
+static int busyHandler(void* arg, int count)
+{
+    (void)arg;
+    __atomic_add_fetch(&test_busy, 1, __ATOMIC_RELAXED);
+    if(count >= TEST_BUSY_TIMEOUT)
+        return 0;
+    tx_thread_sleep(TX_TIMER_TICKS_PER_SECOND / 1000);
+    return 1;
+}
+
+static sqlite3* openConnection(void)
+{
+    sqlite3* db = NULL;
+    if(sqlite3_open_v2(TEST_DB, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX, NULL) != SQLITE_OK)
+    {
+        FAIL("open: %s", db ? sqlite3_errmsg(db) : "no memory");
+        return db;
+    }
+    sqlite3_busy_handler(db, busyHandler, NULL);
+
+    char pragma[64];
+    snprintf(pragma, sizeof(pragma), "PRAGMA journal_mode=%s;", test_journal);
+    sqlite3_exec(db, pragma, NULL, NULL, NULL);
+    return db;
+}
+
+/* ---------------------------- Clients ---------------------------------------------- */
+
+static void* taskThread(void* arg)
+{
+    test_task* task = arg;
+    sqlite3* db = openConnection();
+    char who[16];
+    snprintf(who, sizeof(who), "task %d", task->id);
+
+    pthread_mutex_lock(&task->lock);
+    for(;;)
+    {
+        while(!task->head && !task->quit)
+            pthread_cond_wait(&task->changed, &task->lock);
+        if(!task->head)
+            break;
+
+        test_block* block = task->head;
+        task->busy = 1;
+        pthread_mutex_unlock(&task->lock);
+
+        runBlock(db, who, block->sql, block->line);
+
+        pthread_mutex_lock(&task->lock);
+        task->head = block->next;
+        if(!task->head)
+            task->tail = NULL;
+        task->busy = 0;
+        free(block);
+        pthread_cond_broadcast(&task->changed);
+    }
+    pthread_mutex_unlock(&task->lock);
+
+    sqlite3_close(db);
+    return NULL;
+}
+
+static void taskQueue(int id, const char* sql, size_t len, int line)
+{
+    test_task* task = &tasks[id];
+    test_block* block = malloc(sizeof(test_block) + len + 1);
+    block->next = NULL;
+    block->line = line;
+    memcpy(block->sql, sql, len);
+    block->sql[len] = 0;
+
+    if(!task->id)
+    {
+        memset(task, 0, sizeof(*task));
+        task->id = id;
+        pthread_mutex_init(&task->lock, NULL);
+        pthread_cond_init(&task->changed, NULL);
+        pthread_create(&task->thread, NULL, taskThread, task);
+    }
+
+    pthread_mutex_lock(&task->lock);
+    if(task->tail)
+        task->tail->next = block;
+    else
+        task->head = block;
+    task->tail = block;
+    pthread_cond_broadcast(&task->changed);
+    pthread_mutex_unlock(&task->lock);
+}
+
+static void taskWaitAll(int quit)
+{
+    for(int id = 1; id < TEST_TASKS; id++)
+    {
+        test_task* task = &tasks[id];
+        if(!task->id)
+            continue;
+        pthread_mutex_lock(&task->lock);
+        task->quit = quit;
+        pthread_cond_broadcast(&task->changed);
+        while(task->head || task->busy)
+            pthread_cond_wait(&task->changed, &task->lock);
+        pthread_mutex_unlock(&task->lock);
+        if(quit)
+        {
+            pthread_join(task->thread, NULL);
+            task->id = 0;
+        }
+    }
+}
+
+/* ---------------------------- Main script ------------------------------------------ */
+
+// The main connection runs everything outside --task blocks, in order, up to the next --task or --wait
+static void runScript(sqlite3* db, const char* script)
+{
+    const char* p = script;
+    int line = 1;
+
+    while(*p)
+    {
+        const char* start = p;
+        int start_line = line;
+
+        // Main connection text: up to the next --task/--wait at a line start
+        for(;;)
+        {
+            const char* q = skipSpace(p, &line);
+            if(!*q || !strncmp(q, "--task", 6) || !strncmp(q, "--wait", 6))
+            {
+                p = q;
+                break;
+            }
+            size_t n = lineLength(q);
+            p = q + n;
+        }
+        if(p > start)
+        {
+            size_t len = p - start;
+            char* main_sql = malloc(len + 1);
+            memcpy(main_sql, start, len);
+            main_sql[len] = 0;
+            runBlock(db, "main", main_sql, start_line);
+            free(main_sql);
+        }
+        if(!*p)
+            break;
+
+        size_t n = lineLength(p);
+        if(!strncmp(p, "--wait", 6))
+        {
+            taskWaitAll(0);
+            p += n;
+            continue;
+        }
+
+        int id = atoi(p + 6);
+        if(id <= 0 || id >= TEST_TASKS)
+        {
+            FAIL("line %d: bad task id", line);
+            return;
+        }
+        p += n;
+        const char* body = p;
+        int body_line = line;
+        const char* end = strstr(p, "\n--end");
+        if(!end)
+        {
+            FAIL("line %d: --task without --end", line);
+            return;
+        }
+        for(const char* q = body; q < end; q++)
+            if(*q == '\n')
+                line++;
+        taskQueue(id, body, end - body, body_line);
+        p = end + 1 + lineLength(end + 1);
+    }
+    taskWaitAll(1);
+}
+
+int main(int argc, char** argv)
+{
+    int repeat = 1;
+
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    if(argc < 2)
+    {
+        printf("usage: %s SCRIPT [--journal MODE] [--repeat N] [--trace 1]\n", argv[0]);
+        return 2;
+    }
+    for(int i = 2; i + 1 < argc; i += 2)
+    {
+        if(!strcmp(argv[i], "--journal"))
+            test_journal = argv[i + 1];
+        else if(!strcmp(argv[i], "--repeat"))
+            repeat = atoi(argv[i + 1]);
+        else if(!strcmp(argv[i], "--trace"))
+            test_trace = atoi(argv[i + 1]);
+    }
+
+    FILE* f = fopen(argv[1], "rb");
+    if(!f)
+    {
+        printf("cannot open %s\n", argv[1]);
+        return 2;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char* script = malloc(size + 1);
+    script[fread(script, 1, size, f)] = 0;
+    fclose(f);
+
+    UCHAR* disk = calloc(1, TEST_DISK_BYTES);
+    fx_system_initialize();
+    if(fx_media_format(&test_media, fx_ram_driver, disk, test_media_memory, sizeof(test_media_memory), "HOST",
+                       1, 512, 0, TEST_DISK_BYTES / TEST_SECTOR, TEST_SECTOR, TEST_CLUSTER, 1, 1) != FX_SUCCESS
+       || fx_media_open(&test_media, "HOST", fx_ram_driver, disk, test_media_memory, sizeof(test_media_memory)) != FX_SUCCESS)
+    {
+        printf("cannot format the RAM disk\n");
+        return 2;
+    }
+
+    sqlite3_azure_init(&test_media, NULL, NULL);
+
+    for(int run = 0; run < repeat && !test_errors; run++)
+    {
+        sqlite3* db = openConnection();
+        runScript(db, script);
+
+        sqlite3_stmt* stmt;
+        const char* mode = "?";
+        if(sqlite3_prepare_v2(db, "PRAGMA journal_mode;", -1, &stmt, NULL) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW)
+            mode = strdup((const char*)sqlite3_column_text(stmt, 0));
+        sqlite3_finalize(stmt);
+        sqlite3_close(db);
+
+        printf("%s run %d (journal_mode %s): %d busy retries, %d errors\n", argv[1], run + 1, mode, test_busy, test_errors);
+        test_busy = 0;
+    }
+
+    fx_media_close(&test_media);
+    printf("%s\n", test_errors ? "FAILED" : "OK");
+    return test_errors ? 1 : 0;
+}
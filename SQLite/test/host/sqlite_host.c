@@ -0,0 +1,58 @@
+/*
+ *   The system SQLite initializes itself on first use, the target build has SQLITE_OMIT_AUTOINIT.
+ *   With the VFS mutexes that recurses: sqlite3_initialize() -> xMutexAlloc(SQLITE_MUTEX_RECURSIVE)
+ *   -> sqlite3_malloc() -> sqlite3_initialize() -> ... The VFS's calls are linked here (--wrap):
+ *   a nested one gets plain malloc() memory, which sqlite3_free() then recognizes and hands to free().
+ */
+
+#include "sqlite3.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#define HOST_RAW_BLOCKS 64
+
+void* __real_sqlite3_malloc(int n);
+void __real_sqlite3_free(void* p);
+
+static __thread int host_depth;
+static void* host_raw[HOST_RAW_BLOCKS];
+static pthread_mutex_t host_raw_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void* __wrap_sqlite3_malloc(int n)
+{
+    void* p = NULL;
+
+    if(host_depth)
+    {
+        pthread_mutex_lock(&host_raw_lock);
+        for(int i = 0; i < HOST_RAW_BLOCKS; i++)
+            if(!host_raw[i])
+            {
+                p = host_raw[i] = malloc(n);
+                break;
+            }
+        pthread_mutex_unlock(&host_raw_lock);
+        return p;
+    }
+
+    host_depth++;
+    p = __real_sqlite3_malloc(n);
+    host_depth--;
+    return p;
+}
+
+void __wrap_sqlite3_free(void* p)
+{
+    pthread_mutex_lock(&host_raw_lock);
+    for(int i = 0; p && i < HOST_RAW_BLOCKS; i++)
+        if(host_raw[i] == p)
+        {
+            host_raw[i] = NULL;
+            pthread_mutex_unlock(&host_raw_lock);
+            free(p);
+            return;
+        }
+    pthread_mutex_unlock(&host_raw_lock);
+    __real_sqlite3_free(p);
+}
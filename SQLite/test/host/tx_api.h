@@ -0,0 +1,134 @@
+/*
+ *   Host stand-in for the ThreadX API, just enough for FileX and sqlite3_azure.c
+ *   to run as a Linux process (see mptest_azure.c). Threads, mutexes and event
+ *   flags map to pthreads; tx_interrupt_control(TX_INT_DISABLE) takes one global
+ *   lock, so "interrupts off" sections stay mutually exclusive as on the single core.
+ *
+ *   Return codes follow ThreadX: tx_mutex_get(TX_NO_WAIT) on a mutex owned by
+ *   another thread gives TX_NOT_AVAILABLE, a timed out event flags wait TX_NO_EVENTS.
+ */
+
+#ifndef TX_API_H
+#define TX_API_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>     /* As the Cortex-M55 tx_port.h */
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define VOID                void
+typedef char                CHAR;
+typedef unsigned char       UCHAR;
+typedef int                 INT;
+typedef unsigned int        UINT;
+typedef long                LONG;
+typedef unsigned long       ULONG;
+typedef short               SHORT;
+typedef unsigned short      USHORT;
+typedef unsigned long long  ULONG64;
+#define ULONG64_DEFINED
+#define ALIGN_TYPE_DEFINED
+#define ALIGN_TYPE          ULONG
+
+#define TX_NULL             ((void*)0)
+#define TX_TIMER_TICKS_PER_SECOND 1000      /* Appli/Core/Inc/tx_user.h */
+
+#define TX_SUCCESS          0x00
+#define TX_DELETED          0x01
+#define TX_NO_MEMORY        0x10
+#define TX_WAIT_ERROR       0x04
+#define TX_NO_EVENTS        0x07
+#define TX_NOT_AVAILABLE    0x1D
+#define TX_NOT_OWNED        0x1E
+
+#define TX_NO_WAIT          0UL
+#define TX_WAIT_FOREVER     0xFFFFFFFFUL
+
+#define TX_OR               0
+#define TX_OR_CLEAR         1
+#define TX_AND              2
+#define TX_AND_CLEAR        3
+
+#define TX_INT_ENABLE       0
+#define TX_INT_DISABLE      1
+
+#define TX_NO_INHERIT       0
+#define TX_INHERIT          1
+#define TX_DONT_START       0
+#define TX_AUTO_START       1
+#define TX_NO_TIME_SLICE    0
+#define TX_NO_ACTIVATE      0
+#define TX_AUTO_ACTIVATE    1
+
+typedef struct TX_THREAD_STRUCT {
+    pthread_t           tx_host_thread;
+    VOID                (*tx_host_entry)(ULONG);
+    ULONG               tx_host_input;
+    const CHAR*         tx_thread_name;
+    VOID*               tx_thread_filex_ptr;
+} TX_THREAD;
+
+typedef struct TX_MUTEX_STRUCT {
+    pthread_mutex_t     tx_host_lock;
+    pthread_cond_t      tx_host_free;
+    TX_THREAD*          tx_mutex_owner;
+    UINT                tx_mutex_ownership_count;
+    UINT                tx_host_created;
+} TX_MUTEX;
+
+typedef struct TX_EVENT_FLAGS_GROUP_STRUCT {
+    pthread_mutex_t     tx_host_lock;
+    pthread_cond_t      tx_host_changed;
+    ULONG               tx_event_flags_group_current;
+} TX_EVENT_FLAGS_GROUP;
+
+typedef struct TX_TIMER_STRUCT {
+    ULONG               tx_host_unused;
+} TX_TIMER;
+
+typedef struct TX_BYTE_POOL_STRUCT {
+    ULONG               tx_host_unused;
+} TX_BYTE_POOL;
+
+UINT        tx_mutex_create(TX_MUTEX* mutex_ptr, CHAR* name_ptr, UINT inherit);
+UINT        tx_mutex_delete(TX_MUTEX* mutex_ptr);
+UINT        tx_mutex_get(TX_MUTEX* mutex_ptr, ULONG wait_option);
+UINT        tx_mutex_put(TX_MUTEX* mutex_ptr);
+
+UINT        tx_event_flags_create(TX_EVENT_FLAGS_GROUP* group_ptr, CHAR* name_ptr);
+UINT        tx_event_flags_get(TX_EVENT_FLAGS_GROUP* group_ptr, ULONG requested_flags, UINT get_option,
+                               ULONG* actual_flags_ptr, ULONG wait_option);
+UINT        tx_event_flags_set(TX_EVENT_FLAGS_GROUP* group_ptr, ULONG flags_to_set, UINT set_option);
+
+UINT        tx_thread_create(TX_THREAD* thread_ptr, CHAR* name_ptr, VOID (*entry_function)(ULONG), ULONG entry_input,
+                             VOID* stack_start, ULONG stack_size, UINT priority, UINT preempt_threshold,
+                             ULONG time_slice, UINT auto_start);
+TX_THREAD*  tx_thread_identify(VOID);
+UINT        tx_thread_sleep(ULONG timer_ticks);
+UINT        tx_thread_preemption_change(TX_THREAD* thread_ptr, UINT new_threshold, UINT* old_threshold);
+
+UINT        tx_interrupt_control(UINT new_posture);
+#define TX_INTERRUPT_SAVE_AREA  UINT interrupt_save;
+#define TX_DISABLE              interrupt_save = tx_interrupt_control(TX_INT_DISABLE);
+#define TX_RESTORE              tx_interrupt_control(interrupt_save);
+ULONG       tx_time_get(VOID);
+
+UINT        tx_timer_create(TX_TIMER* timer_ptr, CHAR* name_ptr, VOID (*expiration_function)(ULONG), ULONG expiration_input,
+                            ULONG initial_ticks, ULONG reschedule_ticks, UINT auto_activate);
+UINT        tx_timer_delete(TX_TIMER* timer_ptr);
+
+UINT        tx_byte_allocate(TX_BYTE_POOL* pool_ptr, VOID** memory_ptr, ULONG memory_size, ULONG wait_option);
+UINT        tx_byte_release(VOID* memory_ptr);
+
+/* FileX reads the current thread's default path through this */
+#define _tx_thread_current_ptr  (tx_thread_identify())
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TX_API_H */
@@ -0,0 +1,274 @@
+/*
+ *   pthread implementation of the ThreadX stand-in in tx_api.h.
+ *
+ *   Threads not started through tx_thread_create() (main, the mptest clients) get a TX_THREAD
+ *   of their own on first tx_thread_identify(), as FileX and the VFS key state on it.
+ */
+
+#include "tx_api.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+
+static pthread_mutex_t tx_host_interrupts = PTHREAD_MUTEX_INITIALIZER;
+static __thread UINT tx_host_posture = TX_INT_ENABLE;
+static __thread TX_THREAD* tx_host_self;
+static __thread TX_THREAD tx_host_adopted;
+
+static void deadline(struct timespec* ts, ULONG ticks)
+{
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += ticks / TX_TIMER_TICKS_PER_SECOND;
+    ts->tv_nsec += (long)(ticks % TX_TIMER_TICKS_PER_SECOND) * (1000000000L / TX_TIMER_TICKS_PER_SECOND);
+    if(ts->tv_nsec >= 1000000000L)
+    {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+/* ---------------------------- Threads ---------------------------------------------- */
+
+TX_THREAD* tx_thread_identify(VOID)
+{
+    if(!tx_host_self)
+    {
+        memset(&tx_host_adopted, 0, sizeof(tx_host_adopted));
+        tx_host_adopted.tx_host_thread = pthread_self();
+        tx_host_adopted.tx_thread_name = "host";
+        tx_host_self = &tx_host_adopted;
+    }
+    return tx_host_self;
+}
+
+static void* thread_trampoline(void* arg)
+{
+    TX_THREAD* thread_ptr = arg;
+    tx_host_self = thread_ptr;
+    thread_ptr->tx_host_entry(thread_ptr->tx_host_input);
+    return NULL;
+}
+
+UINT tx_thread_create(TX_THREAD* thread_ptr, CHAR* name_ptr, VOID (*entry_function)(ULONG), ULONG entry_input,
+                      VOID* stack_start, ULONG stack_size, UINT priority, UINT preempt_threshold,
+                      ULONG time_slice, UINT auto_start)
+{
+    (void)stack_start; (void)stack_size; (void)priority; (void)preempt_threshold; (void)time_slice; (void)auto_start;
+
+    memset(thread_ptr, 0, sizeof(*thread_ptr));
+    thread_ptr->tx_host_entry = entry_function;
+    thread_ptr->tx_host_input = entry_input;
+    thread_ptr->tx_thread_name = name_ptr;
+    if(pthread_create(&thread_ptr->tx_host_thread, NULL, thread_trampoline, thread_ptr) != 0)
+        return TX_NO_MEMORY;
+    pthread_detach(thread_ptr->tx_host_thread);
+    return TX_SUCCESS;
+}
+
+UINT tx_thread_sleep(ULONG timer_ticks)
+{
+    if(timer_ticks == 0)
+    {
+        sched_yield();
+        return TX_SUCCESS;
+    }
+
+    struct timespec ts = { timer_ticks / TX_TIMER_TICKS_PER_SECOND,
+                           (long)(timer_ticks % TX_TIMER_TICKS_PER_SECOND) * (1000000000L / TX_TIMER_TICKS_PER_SECOND) };
+    while(nanosleep(&ts, &ts) != 0 && errno == EINTR)
+        ;
+    return TX_SUCCESS;
+}
+
+UINT tx_thread_preemption_change(TX_THREAD* thread_ptr, UINT new_threshold, UINT* old_threshold)
+{
+    (void)thread_ptr;
+    *old_threshold = new_threshold;
+    return TX_SUCCESS;
+}
+
+/* ---------------------------- Interrupts and time ---------------------------------- */
+
+// Interrupts off = the one global lock; nested disables keep it, the outermost restore drops it
+UINT tx_interrupt_control(UINT new_posture)
+{
+    UINT old_posture = tx_host_posture;
+
+    if(new_posture == TX_INT_DISABLE && old_posture == TX_INT_ENABLE)
+        pthread_mutex_lock(&tx_host_interrupts);
+    else if(new_posture == TX_INT_ENABLE && old_posture == TX_INT_DISABLE)
+        pthread_mutex_unlock(&tx_host_interrupts);
+
+    tx_host_posture = new_posture;
+    return old_posture;
+}
+
+ULONG tx_time_get(VOID)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ULONG)(ts.tv_sec * TX_TIMER_TICKS_PER_SECOND + ts.tv_nsec / (1000000000L / TX_TIMER_TICKS_PER_SECOND));
+}
+
+// FileX's directory entry time update timer: the host run does not need it
+UINT tx_timer_create(TX_TIMER* timer_ptr, CHAR* name_ptr, VOID (*expiration_function)(ULONG), ULONG expiration_input,
+                     ULONG initial_ticks, ULONG reschedule_ticks, UINT auto_activate)
+{
+    (void)timer_ptr; (void)name_ptr; (void)expiration_function; (void)expiration_input;
+    (void)initial_ticks; (void)reschedule_ticks; (void)auto_activate;
+    return TX_SUCCESS;
+}
+
+UINT tx_timer_delete(TX_TIMER* timer_ptr)
+{
+    (void)timer_ptr;
+    return TX_SUCCESS;
+}
+
+/* ---------------------------- Mutexes ---------------------------------------------- */
+
+UINT tx_mutex_create(TX_MUTEX* mutex_ptr, CHAR* name_ptr, UINT inherit)
+{
+    (void)name_ptr; (void)inherit;
+
+    pthread_mutex_init(&mutex_ptr->tx_host_lock, NULL);
+    pthread_cond_init(&mutex_ptr->tx_host_free, NULL);
+    mutex_ptr->tx_mutex_owner = TX_NULL;
+    mutex_ptr->tx_mutex_ownership_count = 0;
+    mutex_ptr->tx_host_created = 1;
+    return TX_SUCCESS;
+}
+
+UINT tx_mutex_delete(TX_MUTEX* mutex_ptr)
+{
+    pthread_cond_destroy(&mutex_ptr->tx_host_free);
+    pthread_mutex_destroy(&mutex_ptr->tx_host_lock);
+    mutex_ptr->tx_host_created = 0;
+    return TX_SUCCESS;
+}
+
+UINT tx_mutex_get(TX_MUTEX* mutex_ptr, ULONG wait_option)
+{
+    TX_THREAD* self = tx_thread_identify();
+    struct timespec ts;
+    UINT status = TX_SUCCESS;
+
+    if(wait_option != TX_NO_WAIT && wait_option != TX_WAIT_FOREVER)
+        deadline(&ts, wait_option);
+
+    pthread_mutex_lock(&mutex_ptr->tx_host_lock);
+    while(mutex_ptr->tx_mutex_ownership_count && mutex_ptr->tx_mutex_owner != self)
+    {
+        if(wait_option == TX_NO_WAIT)
+            status = TX_NOT_AVAILABLE;
+        else if(wait_option == TX_WAIT_FOREVER)
+            pthread_cond_wait(&mutex_ptr->tx_host_free, &mutex_ptr->tx_host_lock);
+        else if(pthread_cond_timedwait(&mutex_ptr->tx_host_free, &mutex_ptr->tx_host_lock, &ts) == ETIMEDOUT)
+            status = TX_NOT_AVAILABLE;
+
+        if(status != TX_SUCCESS)
+            break;
+    }
+    if(status == TX_SUCCESS)
+    {
+        mutex_ptr->tx_mutex_owner = self;
+        mutex_ptr->tx_mutex_ownership_count++;
+    }
+    pthread_mutex_unlock(&mutex_ptr->tx_host_lock);
+    return status;
+}
+
+UINT tx_mutex_put(TX_MUTEX* mutex_ptr)
+{
+    UINT status = TX_SUCCESS;
+
+    pthread_mutex_lock(&mutex_ptr->tx_host_lock);
+    if(!mutex_ptr->tx_mutex_ownership_count || mutex_ptr->tx_mutex_owner != tx_thread_identify())
+        status = TX_NOT_OWNED;
+    else if(--mutex_ptr->tx_mutex_ownership_count == 0)
+    {
+        mutex_ptr->tx_mutex_owner = TX_NULL;
+        pthread_cond_signal(&mutex_ptr->tx_host_free);
+    }
+    pthread_mutex_unlock(&mutex_ptr->tx_host_lock);
+    return status;
+}
+
+/* ---------------------------- Event flags ------------------------------------------ */
+
+UINT tx_event_flags_create(TX_EVENT_FLAGS_GROUP* group_ptr, CHAR* name_ptr)
+{
+    (void)name_ptr;
+
+    pthread_mutex_init(&group_ptr->tx_host_lock, NULL);
+    pthread_cond_init(&group_ptr->tx_host_changed, NULL);
+    group_ptr->tx_event_flags_group_current = 0;
+    return TX_SUCCESS;
+}
+
+UINT tx_event_flags_get(TX_EVENT_FLAGS_GROUP* group_ptr, ULONG requested_flags, UINT get_option,
+                        ULONG* actual_flags_ptr, ULONG wait_option)
+{
+    struct timespec ts;
+    UINT status = TX_SUCCESS;
+    int all = get_option == TX_AND || get_option == TX_AND_CLEAR;
+
+    if(wait_option != TX_NO_WAIT && wait_option != TX_WAIT_FOREVER)
+        deadline(&ts, wait_option);
+
+    pthread_mutex_lock(&group_ptr->tx_host_lock);
+    for(;;)
+    {
+        ULONG current = group_ptr->tx_event_flags_group_current;
+        if(all ? (current & requested_flags) == requested_flags : (current & requested_flags) != 0)
+        {
+            *actual_flags_ptr = current;
+            if(get_option == TX_OR_CLEAR || get_option == TX_AND_CLEAR)
+                group_ptr->tx_event_flags_group_current &= ~requested_flags;
+            break;
+        }
+
+        if(wait_option == TX_NO_WAIT)
+            status = TX_NO_EVENTS;
+        else if(wait_option == TX_WAIT_FOREVER)
+            pthread_cond_wait(&group_ptr->tx_host_changed, &group_ptr->tx_host_lock);
+        else if(pthread_cond_timedwait(&group_ptr->tx_host_changed, &group_ptr->tx_host_lock, &ts) == ETIMEDOUT)
+            status = TX_NO_EVENTS;
+
+        if(status != TX_SUCCESS)
+            break;
+    }
+    pthread_mutex_unlock(&group_ptr->tx_host_lock);
+    return status;
+}
+
+UINT tx_event_flags_set(TX_EVENT_FLAGS_GROUP* group_ptr, ULONG flags_to_set, UINT set_option)
+{
+    pthread_mutex_lock(&group_ptr->tx_host_lock);
+    if(set_option == TX_AND)
+        group_ptr->tx_event_flags_group_current &= flags_to_set;
+    else
+        group_ptr->tx_event_flags_group_current |= flags_to_set;
+    pthread_cond_broadcast(&group_ptr->tx_host_changed);
+    pthread_mutex_unlock(&group_ptr->tx_host_lock);
+    return TX_SUCCESS;
+}
+
+/* ---------------------------- Byte pools ------------------------------------------- */
+
+UINT tx_byte_allocate(TX_BYTE_POOL* pool_ptr, VOID** memory_ptr, ULONG memory_size, ULONG wait_option)
+{
+    (void)pool_ptr; (void)wait_option;
+
+    *memory_ptr = malloc(memory_size);
+    return *memory_ptr ? TX_SUCCESS : TX_NO_MEMORY;
+}
+
+UINT tx_byte_release(VOID* memory_ptr)
+{
+    free(memory_ptr);
+    return TX_SUCCESS;
+}